@@ -0,0 +1,23 @@
+# ONNX Runtime's release tarballs don't ship a CMake config, so we look for the header and library ourselves.
+# Point OnnxRuntime_DIR (or CMAKE_PREFIX_PATH) at the unpacked tarball, e.g. onnxruntime-linux-x64-1.16.3.
+
+find_path(OnnxRuntime_INCLUDE_DIR
+        NAMES onnxruntime_cxx_api.h
+        PATH_SUFFIXES include include/onnxruntime include/onnxruntime/core/session
+        PATHS ${OnnxRuntime_DIR}
+        )
+
+find_library(OnnxRuntime_LIBRARY
+        NAMES onnxruntime
+        PATH_SUFFIXES lib lib64
+        PATHS ${OnnxRuntime_DIR}
+        )
+
+set(OnnxRuntime_INCLUDE_DIRS ${OnnxRuntime_INCLUDE_DIR})
+set(OnnxRuntime_LIBRARIES ${OnnxRuntime_LIBRARY})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(OnnxRuntime
+        FOUND_VAR OnnxRuntime_FOUND
+        REQUIRED_VARS OnnxRuntime_INCLUDE_DIR OnnxRuntime_LIBRARY
+        )
@@ -122,6 +122,9 @@ void wrapped_stationary_heat_eqn(double* T, double* f, int n) {
 
 int main() {
 
+    // Load the models of all surrogates now, in parallel, rather than on their first call
+    phasm::preload_all();
+
     double T[(N+2) * (N+2)];
     double f[N * N];
 
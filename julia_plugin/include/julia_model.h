@@ -5,14 +5,41 @@
 #pragma once
 #include <string>
 #include <model.h>
+#include <julia.h>
 
 
 namespace phasm {
 
 
+/// Runs a model written in Julia. The model file is included into a module of its own, and defines either
+///     infer!(outputs, inputs) -> Bool
+/// which writes into the preallocated `outputs` arrays in place, or
+///     infer(inputs) -> (outputs, is_confident)
+/// whose outputs are then copied over. Either way, the function is looked up once, in initialize(), and infer() is
+/// just a jl_call.
+///
+/// `inputs` and `outputs` are vectors of Julia arrays which wrap phasm tensors without copying, one per input and
+/// output model variable, in the order they were declared. The outputs wrap the ModelVariables' inference_output
+/// tensors directly. The inputs wrap buffers of our own, which each call's inputs are copied into, because the
+/// captured input tensors are reallocated on every call. Output arrays have the same eltype as the input for INOUT
+/// variables, and Float64 otherwise.
 class JuliaModel : public phasm::Model {
 
     std::string m_filepath;
+    jl_module_t* m_module = nullptr;
+    jl_function_t* m_infer = nullptr;       // infer!, or Phasm.phasm_infer! if the model only defines infer
+    jl_function_t* m_model_infer = nullptr; // The model's infer, if it doesn't define infer!
+    jl_function_t* m_wrap = nullptr;        // Phasm.phasm_wrap
+
+    // Both are globals in m_module, which roots them, and everything they contain, for as long as the model lives
+    jl_array_t* m_input_arrays = nullptr;
+    jl_array_t* m_output_arrays = nullptr;
+
+    std::vector<tensor> m_input_buffers;
+    std::vector<const void*> m_bound_outputs;
+
+    jl_value_t* wrap(tensor& t);
+    void bind_arrays();
 
 public:
     JuliaModel(std::string filepath) : m_filepath(filepath) {}
@@ -23,6 +50,12 @@ public:
 
     bool infer() override;
 
+    // Deprecated: these only back phasm_modelvars_getinputdata and phasm_modelvars_setoutputdata*, for models which
+    // still read and write their data one variable at a time. Both take the position among all model variables.
+    const tensor& get_input_data(size_t position);
+    void set_output_data(size_t position, DType dtype, const void* data, const std::vector<int64_t>& shape);
+
 };
 
 } // namespace phasm
+
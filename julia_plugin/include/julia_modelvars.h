@@ -3,15 +3,20 @@
 // Subject to the terms in the LICENSE file found in the top-level directory.
 
 #include <cstdint>
+#include <tensor.hpp>
 #pragma once
 
-/// These are meant to be called from Phasm.jl. They expose a subset of phasm's ModelVariable to Julia
+/// These are meant to be called from Phasm.jl. They expose a subset of phasm's ModelVariable to Julia. The data itself
+/// normally doesn't go through here; JuliaModel hands it to the model's infer function as arrays which wrap the tensors.
 extern "C" {
 
 int64_t phasm_modelvars_count(void* model);
 const char* phasm_modelvars_getname(void* model, int64_t index);
 bool phasm_modelvars_isinput(void* model, int64_t index);
 bool phasm_modelvars_isoutput(void* model, int64_t index);
+
+/// Deprecated: models get their data as the arguments of infer!/infer now. These are kept for model files which still
+/// fetch and store it one variable at a time, and go through the same buffers that those arguments wrap.
 void phasm_modelvars_getinputdata(void* model, int64_t index, phasm::DType* dtype, void** data, const int64_t** shape, size_t* ndims);
 void phasm_modelvars_setoutputdata(void* model, int64_t index, phasm::DType dtype, void* data, size_t length);
 void phasm_modelvars_setoutputdata2(void* model, int64_t index, phasm::DType dtype, void* data, int64_t* shape, size_t dims);
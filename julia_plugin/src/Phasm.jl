@@ -25,7 +25,24 @@ end
 phasm_modelvars_isinput(model::Model, index) = @ccall phasm_modelvars_isinput(model::Model,index::Int64)::Bool
 phasm_modelvars_isoutput(model::Model, index) = @ccall phasm_modelvars_isoutput(model::Model,index::Int64)::Bool
 
+# Called by JuliaModel whenever it (re)binds a tensor, not on every call
+function phasm_wrap(ptr::Ptr{Cvoid}, ::Type{T}, shape::Vector{Int64}) where T
+    return unsafe_wrap(Array, Ptr{T}(ptr), (shape...,); own=false)
+end
+
+# Adapts models which define infer(inputs) -> (outputs, is_confident) instead of infer!(outputs, inputs)
+function phasm_infer!(infer_fn, outputs, inputs)
+    results, is_confident = infer_fn(inputs)
+    for (output, result) in zip(outputs, results)
+        copyto!(output, result)
+    end
+    return is_confident
+end
+
+# Deprecated: models get their data as the arguments of infer! or infer now. These fetch and store it one variable
+# at a time instead, and are only kept so that existing model files which call them keep working.
 function phasm_modelvars_getinputdata(model::Model, index) 
+    Base.depwarn("phasm_modelvars_getinputdata is deprecated, use the inputs passed to infer! or infer instead", :phasm_modelvars_getinputdata)
     untyped_data_ptr::Vector{Ptr{Nothing}} = [0]
     shape_ptr::Vector{Ptr{Int64}} = [0]
     dtype::Vector{Int64} = [0]
@@ -60,6 +77,7 @@ function phasm_modelvars_getinputdata(model::Model, index)
 end
 
 function phasm_modelvars_setoutputdata(model::Model, index, array) 
+    Base.depwarn("phasm_modelvars_setoutputdata is deprecated, define infer! and write into its outputs instead", :phasm_modelvars_setoutputdata)
 
     # enum class DType { Undefined, UI8, I16, I32, I64, F32, F64 };
     if eltype(array) == UInt8
@@ -82,14 +100,15 @@ function phasm_modelvars_setoutputdata(model::Model, index, array)
     dims = Csize_t(ndims(array))
     if (dims == 1)
         len = Csize_t(length(array))
-        @ccall phasm_modelvars_setoutputdata(model::Model,index::Int64,dtype::Int32,ptr::Ptr{Float64},len::Csize_t)::Cvoid
+        @ccall phasm_modelvars_setoutputdata(model::Model,index::Int64,dtype::Int32,ptr::Ptr{Cvoid},len::Csize_t)::Cvoid
     else
         shape = [Int64(x) for x in size(array)]::Vector{Int64}
-        @ccall phasm_modelvars_setoutputdata2(model::Model,index::Int64,dtype::Int32,ptr::Ptr{Float64},pointer(shape)::Ptr{Int64}, dims::Csize_t)::Cvoid
+        @ccall phasm_modelvars_setoutputdata2(model::Model,index::Int64,dtype::Int32,ptr::Ptr{Cvoid},pointer(shape)::Ptr{Int64}, dims::Csize_t)::Cvoid
     end
 end
 
 function phasm_infer(model::Model, infer_fn)
+    Base.depwarn("phasm_infer is deprecated, JuliaModel calls infer! or infer directly", :phasm_infer)
     inputs = []
     var_count = phasm_modelvars_count(model)
     for i in 0:var_count-1
@@ -4,36 +4,179 @@
 
 #include <julia.h>
 #include <julia_model.h>
+#include <dtype_conversion.h>
+#include <cstring>
 #include <iostream>
 
 namespace phasm {
-void JuliaModel::initialize() {
-    std::string inc_str = "include(\"" + m_filepath + "\")";
-    jl_eval_string(inc_str.c_str());
-    if (jl_exception_occurred()) {
-        jl_static_show(jl_stdout_stream(), jl_exception_occurred());
+
+namespace {
+
+void throw_if_julia_exception(const std::string& context) {
+    jl_value_t* exception = jl_exception_occurred();
+    if (exception != nullptr) {
+        std::cout << "Julia exception in " << context << ": " << jl_typeof_str(exception) << std::endl;
+        jl_static_show(jl_stdout_stream(), exception);
         std::cout << std::endl;
+        jl_exception_clear();
+        throw std::runtime_error("Exception inside Julia model! (" + context + ")");
     }
-    jl_value_t* boxed_model = jl_box_voidpointer(this);
-    jl_set_global(jl_main_module, jl_symbol("model"), boxed_model);
-    if (jl_exception_occurred()) {
-        std::cout << "set_global: exception: " << jl_typeof_str(jl_exception_occurred()) << std::endl;
+}
+
+jl_value_t* to_julia_type(DType dtype) {
+    switch (dtype) {
+        case DType::UI8: return (jl_value_t*) jl_uint8_type;
+        case DType::I16: return (jl_value_t*) jl_int16_type;
+        case DType::I32: return (jl_value_t*) jl_int32_type;
+        case DType::I64: return (jl_value_t*) jl_int64_type;
+        case DType::F32: return (jl_value_t*) jl_float32_type;
+        case DType::F64: return (jl_value_t*) jl_float64_type;
+        default: throw std::runtime_error("JuliaModel: Invalid DType!");
     }
 }
 
+} // namespace
+
+
+void JuliaModel::initialize() {
+    // Every model file gets a module of its own. Otherwise each one would add its methods to the same Main.infer,
+    // and whichever model was included last would win.
+    static int s_module_count = 0;
+    std::string module_name = "PhasmModel" + std::to_string(s_module_count++);
+    std::string module_str = "const " + module_name + " = Module(:" + module_name + ")";
+    m_module = (jl_module_t*) jl_eval_string(module_str.c_str());
+    throw_if_julia_exception("creating a module for " + m_filepath);
+
+    jl_value_t* filepath = jl_cstr_to_string(m_filepath.c_str());
+    JL_GC_PUSH1(&filepath);
+    jl_call2(jl_get_function(jl_base_module, "include"), (jl_value_t*) m_module, filepath);
+    JL_GC_POP();
+    throw_if_julia_exception("including " + m_filepath);
+
+    jl_set_global(m_module, jl_symbol("model"), jl_box_voidpointer(this));
+
+    auto phasm_module = (jl_module_t*) jl_get_global(jl_main_module, jl_symbol("Phasm"));
+    if (phasm_module == nullptr) {
+        throw std::runtime_error("JuliaModel: Phasm.jl hasn't been loaded");
+    }
+    m_wrap = jl_get_function(phasm_module, "phasm_wrap");
+    m_infer = jl_get_function(m_module, "infer!");
+    if (m_infer == nullptr) {
+        m_model_infer = jl_get_function(m_module, "infer");
+        if (m_model_infer == nullptr) {
+            throw std::runtime_error("JuliaModel: " + m_filepath + " defines neither infer! nor infer");
+        }
+        m_infer = jl_get_function(phasm_module, "phasm_infer!");
+    }
+
+    jl_array_t* inputs = jl_alloc_vec_any(m_inputs.size());
+    JL_GC_PUSH1(&inputs);
+    jl_set_global(m_module, jl_symbol("phasm_inputs"), (jl_value_t*) inputs);
+    JL_GC_POP();
+    jl_array_t* outputs = jl_alloc_vec_any(m_outputs.size());
+    JL_GC_PUSH1(&outputs);
+    jl_set_global(m_module, jl_symbol("phasm_outputs"), (jl_value_t*) outputs);
+    JL_GC_POP();
+    m_input_arrays = inputs;
+    m_output_arrays = outputs;
+    m_input_buffers.resize(m_inputs.size());
+    m_bound_outputs.assign(m_outputs.size(), nullptr);
+}
+
+/// Wraps a tensor's buffer in a Julia array with the same eltype and shape, without copying. Setting up a binding is
+/// rare enough that going through Phasm.phasm_wrap, rather than assembling the dims tuple by hand, is fine.
+jl_value_t* JuliaModel::wrap(tensor& t) {
+    std::vector<int64_t> shape = t.get_shape();
+    jl_value_t* shape_array = nullptr;
+    jl_value_t* array = nullptr;
+    JL_GC_PUSH2(&shape_array, &array);
+    jl_value_t* shape_type = jl_apply_array_type((jl_value_t*) jl_int64_type, 1);
+    shape_array = (jl_value_t*) jl_ptr_to_array_1d(shape_type, shape.data(), shape.size(), 0);
+    array = jl_call3(m_wrap, jl_box_voidpointer(t.get_data<void>()), to_julia_type(t.get_dtype()), shape_array);
+    JL_GC_POP();
+    throw_if_julia_exception("wrapping a tensor for " + m_filepath);
+    return array;
+}
+
+/// Copies this call's inputs into the buffers the Julia input arrays wrap, and makes sure that the Julia output arrays
+/// wrap the current inference_output tensors. Bindings only change on the first call, when the input dtypes become
+/// known, or if somebody swaps out an output tensor, e.g. a PartitionedModel.
+void JuliaModel::bind_arrays() {
+    for (size_t i=0; i<m_inputs.size(); ++i) {
+        const tensor& input = m_inputs[i]->inference_input;
+        tensor& buffer = m_input_buffers[i];
+        if (buffer.get_dtype() != input.get_dtype() || buffer.get_shape() != input.get_shape()) {
+            buffer = tensor(input.get_dtype(), input.get_shape());
+            jl_arrayset(m_input_arrays, wrap(buffer), i);
+        }
+        std::memcpy(buffer.get_data<void>(), input.get_data<void>(), input.get_length() * get_dtype_size(input.get_dtype()));
+    }
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        auto& model_var = m_outputs[i];
+        tensor& output = model_var->inference_output;
+        if (output.get_data<void>() != m_bound_outputs[i]) {
+            DType dtype = model_var->is_input ? model_var->inference_input.get_dtype() : DType::F64;
+            if (output.get_dtype() != dtype || output.get_shape() != model_var->shape()) {
+                output = tensor(dtype, model_var->shape());
+            }
+            jl_arrayset(m_output_arrays, wrap(output), i);
+            m_bound_outputs[i] = output.get_data<void>();
+        }
+    }
+}
+
+/// Returns the buffer the Julia input array wraps, which holds the current call's input once bind_arrays has run.
+const tensor& JuliaModel::get_input_data(size_t position) {
+    auto model_var = get_model_var(position);
+    for (size_t i=0; i<m_inputs.size(); ++i) {
+        if (m_inputs[i] == model_var && i < m_input_buffers.size() && m_input_buffers[i].get_dtype() != DType::Undefined) {
+            return m_input_buffers[i];
+        }
+    }
+    return model_var->inference_input;
+}
+
+/// If a Julia output array wraps this variable's inference_output, the data is converted into it in place, because
+/// replacing the tensor would leave the array dangling. Otherwise the tensor is replaced, like it used to be.
+void JuliaModel::set_output_data(size_t position, DType dtype, const void* data, const std::vector<int64_t>& shape) {
+    if (dtype == DType::Undefined) {
+        throw std::runtime_error("JuliaModel: Invalid DType!");
+    }
+    auto model_var = get_model_var(position);
+    tensor& output = model_var->inference_output;
+    size_t length = 1;
+    for (int64_t dim : shape) {
+        length *= dim;
+    }
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        if (m_outputs[i] == model_var && i < m_bound_outputs.size() && m_bound_outputs[i] == output.get_data<void>()) {
+            if (output.get_length() != length) {
+                throw std::runtime_error("JuliaModel: Output '" + model_var->name + "' has length " +
+                                         std::to_string(output.get_length()) + ", not " + std::to_string(length));
+            }
+            convert(data, dtype, output.get_data<void>(), output.get_dtype(), length);
+            return;
+        }
+    }
+    tensor replacement(dtype, shape);
+    convert(data, dtype, replacement.get_data<void>(), dtype, length);
+    output = std::move(replacement);
+}
+
 void JuliaModel::train_from_captures() {
     std::cout << "PHASM: Calling JuliaModel::train_from_captures (currently a no-op)" << std::endl;
 }
 
 bool JuliaModel::infer() {
-    // TODO: Don't want to do the jl_eval_string on every call to infer()
-    auto ret = jl_eval_string("Phasm.phasm_infer(reinterpret(Phasm.Model,model), infer)");
-    if (jl_exception_occurred()) {
-        std::cout << "Julia exception in JuliaModel::infer(): " << jl_typeof_str(jl_exception_occurred()) << std::endl;
-        jl_static_show(jl_stdout_stream(), jl_exception_occurred());
-        std::cout << std::endl;
-        throw std::runtime_error("Exception inside Julia model!");
+    bind_arrays();
+    jl_value_t* ret;
+    if (m_model_infer != nullptr) {
+        ret = jl_call3(m_infer, m_model_infer, (jl_value_t*) m_output_arrays, (jl_value_t*) m_input_arrays);
+    }
+    else {
+        ret = jl_call2(m_infer, (jl_value_t*) m_output_arrays, (jl_value_t*) m_input_arrays);
     }
+    throw_if_julia_exception("JuliaModel::infer()");
     if (jl_typeis(ret, jl_bool_type)) {
         return jl_unbox_bool(ret);
     }
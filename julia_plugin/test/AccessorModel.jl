@@ -0,0 +1,17 @@
+
+println("PHASM: Julia: Loading AccessorModel.jl")
+
+# Ignores the arguments and goes through the deprecated per-variable accessors instead, the way models used to
+function infer(inputs)
+    m = reinterpret(Main.Phasm.Model, model)
+    mat = Main.Phasm.phasm_modelvars_getinputdata(m, 0)
+    println("From Julia callee: Input: $(mat)")
+
+    entries_squared = mat.^2
+    Main.Phasm.phasm_modelvars_setoutputdata(m, 0, entries_squared)
+    Main.Phasm.phasm_modelvars_setoutputdata(m, 1, [sum(entries_squared)])
+
+    # Nothing left for PHASM to copy over
+    return ([], true)
+
+end # function infer
@@ -0,0 +1,18 @@
+
+println("PHASM: Julia: Loading OddInPlaceModel.jl")
+
+function infer!(outputs, inputs)
+    for input in inputs
+        println("From Julia callee: Input: $(input)")
+    end
+
+    # Writes into the arrays PHASM preallocated, rather than returning new ones
+    outputs[1] .= inputs[1].^2
+    outputs[2][1] = sum(outputs[1])
+
+    println("From Julia callee: Output: $(outputs[1])")
+    println("From Julia callee: Output: $(outputs[2])")
+
+    return true
+
+end # function infer!
@@ -0,0 +1,18 @@
+
+println("PHASM: Julia: Loading TypedInPlaceModel.jl")
+
+function infer!(outputs, inputs)
+    for input in inputs
+        println("From Julia callee: Input: $(input)")
+    end
+
+    # outputs[1] is a Float32 array, like the INOUT input, and outputs[2] is a Float64 array
+    outputs[1] .= inputs[1].^2
+    outputs[2][1] = convert(Int16, trunc(sum(outputs[1])))
+
+    println("From Julia callee: Output: $(outputs[1])")
+    println("From Julia callee: Output: $(outputs[2])")
+
+    return true
+
+end # function infer!
@@ -114,4 +114,104 @@ TEST_CASE("Tensors of different dtypes") {
     REQUIRE(sum == 4 + 9 + 49 + 196 + 81 + 1);
 }
 
+TEST_CASE("Models which write into their outputs in place") {
+
+    auto model = std::make_shared<phasm::JuliaModel>("TypedInPlaceModel.jl");
+
+    phasm::Surrogate f_surrogate = phasm::SurrogateBuilder()
+        .set_model(model)
+        .local_primitive<float>("mat", phasm::INOUT, {2, 3})
+        .local_primitive<int16_t>("sum", phasm::OUT)
+        .finish();
+
+    float matrix[6] = { 2.0, 3.0, 7.0, 14.0, 9.0, 1.0};
+    int16_t sum = 0;
+
+    f_surrogate
+        .bind_original_function([&](){ sum = square2x3(matrix); })
+        .bind_all_callsite_vars(&matrix, &sum)
+        .call_model();
+
+    REQUIRE(matrix[0] == 4.0);
+    REQUIRE(matrix[1] == 9.0);
+    REQUIRE(matrix[2] == 49.0);
+    REQUIRE(matrix[3] == 196.0);
+    REQUIRE(matrix[4] == 81.0);
+    REQUIRE(matrix[5] == 1.0);
+    REQUIRE(sum == 4 + 9 + 49 + 196 + 81 + 1);
+}
+
+TEST_CASE("Models which still use the deprecated per-variable accessors") {
+
+    auto model = std::make_shared<phasm::JuliaModel>("AccessorModel.jl");
+
+    phasm::Surrogate f_surrogate = phasm::SurrogateBuilder()
+        .set_model(model)
+        .local_primitive<double>("mat", phasm::INOUT, {2, 3})
+        .local_primitive<double>("sum", phasm::OUT)
+        .finish();
+
+    double matrix[6] = { 2.0, 3.0, 7.0, 14.0, 9.0, 1.0};
+    double sum = 0.0;
+    f_surrogate
+        .bind_original_function([&](){ sum = square2x3(matrix); })
+        .bind_all_callsite_vars(&matrix, &sum);
+
+    f_surrogate.call_model();
+    REQUIRE(matrix[0] == 4.0);
+    REQUIRE(matrix[5] == 1.0);
+    REQUIRE(sum == 4.0 + 9.0 + 49.0 + 196.0 + 81.0 + 1.0);
+
+    // The outputs are written into the buffers the Julia arrays wrap, so a second call sees the first call's results
+    f_surrogate.call_model();
+    REQUIRE(matrix[0] == 16.0);
+    REQUIRE(matrix[3] == 38416.0);
+    REQUIRE(sum == 16.0 + 81.0 + 2401.0 + 38416.0 + 6561.0 + 1.0);
+}
+
+TEST_CASE("Models keep their own infer functions and reuse their buffers across calls") {
+
+    auto odd_model = std::make_shared<phasm::JuliaModel>("OddInPlaceModel.jl");
+    auto scalar_model = std::make_shared<phasm::JuliaModel>("ScalarModel.jl");
+
+    phasm::Surrogate odd_surrogate = phasm::SurrogateBuilder()
+        .set_model(odd_model)
+        .local_primitive<double>("mat", phasm::INOUT, {2, 3})
+        .local_primitive<double>("sum", phasm::OUT)
+        .finish();
+
+    phasm::Surrogate scalar_surrogate = phasm::SurrogateBuilder()
+        .set_model(scalar_model)
+        .local_primitive<double>("x", phasm::INOUT)
+        .local_primitive<double>("f", phasm::OUT)
+        .finish();
+
+    double matrix[6] = { 1.0, 2.0, 3.0, 4.0, 5.0, 6.0};
+    double sum = 0.0;
+    double x = 2.0;
+    double f = 0.0;
+    odd_surrogate
+        .bind_original_function([&](){ sum = square2x3(matrix); })
+        .bind_all_callsite_vars(&matrix, &sum);
+    scalar_surrogate
+        .bind_original_function([&](){ f = plusplus(x); })
+        .bind_all_callsite_vars(&x, &f);
+
+    // Both files define functions called infer or infer!, which mustn't replace each other
+    odd_surrogate.call_model();
+    const void* output_buffer = odd_model->get_model_var(0)->inference_output.get_data<void>();
+    scalar_surrogate.call_model();
+    odd_surrogate.call_model();
+
+    REQUIRE(x == 22.0);
+    REQUIRE(f == 33.0);
+    REQUIRE(matrix[0] == 1.0);
+    REQUIRE(matrix[1] == 16.0);
+    REQUIRE(matrix[5] == 1296.0);
+    REQUIRE(sum == 1.0 + 16.0 + 81.0 + 256.0 + 625.0 + 1296.0);
+
+    // The Julia arrays wrap the output tensors, so the second call wrote into the same buffer
+    REQUIRE(odd_model->get_model_var(0)->inference_output.get_data<void>() == output_buffer);
+}
+
 } // namespace phasm_julia_tests
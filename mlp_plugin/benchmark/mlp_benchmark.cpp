@@ -0,0 +1,113 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+// Compares MlpModel against TorchscriptModel on the same small network, shaped like the magnetic field map
+// surrogate (3 inputs -> 3 outputs). Usage: phasm-mlp-benchmark [hidden_width] [iterations] [batch_size]
+
+#include <torch/script.h>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include "surrogate_builder.h"
+#include "dtype_conversion.h"
+#include "mlp_model.h"
+#include "torchscript_model.h"
+
+using namespace phasm;
+
+template <typename F>
+double time_per_call_us(F&& f, size_t iterations) {
+    for (size_t i=0; i<iterations/10 + 1; ++i) f(); // Warm up
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<iterations; ++i) f();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    int64_t hidden = (argc > 1) ? std::atoll(argv[1]) : 32;
+    size_t iterations = (argc > 2) ? std::atoll(argv[2]) : 100000;
+    int64_t batch_size = (argc > 3) ? std::atoll(argv[3]) : 1024;
+
+    // Same weights for both: 3 -> hidden -> hidden -> 3, ReLU in between
+    torch::manual_seed(0);
+    std::vector<int64_t> dims = {3, hidden, hidden, 3};
+    std::vector<torch::Tensor> weights, biases;
+    std::vector<DenseLayer> layers;
+    for (size_t l=0; l+1<dims.size(); ++l) {
+        weights.push_back(torch::randn({dims[l+1], dims[l]}) / std::sqrt(double(dims[l])));
+        biases.push_back(torch::randn({dims[l+1]}) * 0.1);
+        Activation activation = (l+2 < dims.size()) ? Activation::ReLU : Activation::Identity;
+        layers.emplace_back(dims[l], dims[l+1], activation, weights[l].data_ptr<float>(), biases[l].data_ptr<float>());
+    }
+    MlpNetwork(std::move(layers)).save("mlp_benchmark.mlp");
+
+    torch::jit::Module module("MlpBenchmark");
+    for (size_t l=0; l<weights.size(); ++l) {
+        module.register_parameter("w" + std::to_string(l), weights[l], false);
+        module.register_parameter("b" + std::to_string(l), biases[l], false);
+    }
+    module.define(R"JIT(
+        def forward(self, x):
+            x = torch.relu(torch.matmul(x, self.w0.t()) + self.b0)
+            x = torch.relu(torch.matmul(x, self.w1.t()) + self.b1)
+            return torch.matmul(x, self.w2.t()) + self.b2
+    )JIT");
+    module.save("mlp_benchmark.pt");
+
+    // Single samples, through the full Surrogate machinery, which is how the field map actually calls it
+    auto run_surrogate = [&](std::shared_ptr<Model> model) {
+        double x, y, z, bx, by, bz;
+        auto s = SurrogateBuilder()
+                .set_model(model, true)
+                .set_callmode(CallMode::UseModel)
+                .local_primitive<double>("x", Direction::IN)
+                .local_primitive<double>("y", Direction::IN)
+                .local_primitive<double>("z", Direction::IN)
+                .local_primitive<double>("Bx", Direction::OUT)
+                .local_primitive<double>("By", Direction::OUT)
+                .local_primitive<double>("Bz", Direction::OUT)
+                .finish();
+        s.bind_all_callsite_vars(&x, &y, &z, &bx, &by, &bz);
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<double> dist(-1, 1);
+        x = dist(rng); y = dist(rng); z = dist(rng);
+        double us = time_per_call_us([&]() { s.call(); }, iterations);
+        return std::make_pair(us, std::array<double,3>{bx, by, bz});
+    };
+    auto [torch_us, torch_out] = run_surrogate(std::make_shared<TorchscriptModel>("mlp_benchmark.pt"));
+    auto [mlp_us, mlp_out] = run_surrogate(std::make_shared<MlpModel>("mlp_benchmark.mlp"));
+
+    // Batches, straight into the networks, to see the raw GEMM throughput
+    MlpNetwork network = MlpNetwork::load("mlp_benchmark.mlp");
+    torch::Tensor batch = torch::rand({batch_size, 3});
+    torch::Tensor mlp_batch_out = torch::empty({batch_size, 3});
+    std::vector<torch::jit::IValue> torch_inputs = {batch};
+    size_t batch_iterations = std::max<size_t>(1, iterations / batch_size);
+    double torch_batch_us, mlp_batch_us;
+    {
+        c10::InferenceMode guard;
+        torch_batch_us = time_per_call_us([&]() { module.forward(torch_inputs); }, batch_iterations);
+        mlp_batch_us = time_per_call_us([&]() {
+            network.forward(batch.data_ptr<float>(), mlp_batch_out.data_ptr<float>(), batch_size);
+        }, batch_iterations);
+    }
+    double max_difference = (module.forward(torch_inputs).toTensor() - mlp_batch_out).abs().max().item<double>();
+
+    const char* levels[] = {"scalar", "SSE4.1 (scalar kernels)", "AVX2", "AVX-512"};
+    std::cout << "PHASM: MLP benchmark, 3 -> " << hidden << " -> " << hidden << " -> 3, "
+              << levels[static_cast<int>(get_simd_level())] << std::endl;
+    std::cout << "  Surrogate::call(), single sample:" << std::endl;
+    std::cout << "    TorchscriptModel: " << torch_us << " us/call" << std::endl;
+    std::cout << "    MlpModel:         " << mlp_us << " us/call (" << torch_us / mlp_us << "x)" << std::endl;
+    std::cout << "  forward(), batches of " << batch_size << ":" << std::endl;
+    std::cout << "    TorchScript:      " << torch_batch_us * 1000 / batch_size << " ns/sample" << std::endl;
+    std::cout << "    MlpNetwork:       " << mlp_batch_us * 1000 / batch_size << " ns/sample (" << torch_batch_us / mlp_batch_us << "x)" << std::endl;
+    std::cout << "  Max difference between outputs: " << max_difference
+              << " (single sample: " << std::abs(torch_out[0] - mlp_out[0]) << ")" << std::endl;
+    return 0;
+}
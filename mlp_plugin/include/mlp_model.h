@@ -0,0 +1,43 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef MLP_PLUGIN_MLP_MODEL_H
+#define MLP_PLUGIN_MLP_MODEL_H
+
+#include "model.h"
+#include "mlp_network.h"
+
+namespace phasm {
+
+/// Runs a feed-forward network exported from PyTorch (see python/export_mlp.py) using MlpNetwork's kernels.
+/// This is meant for small networks, where the fixed per-call overhead of libtorch dominates the actual math.
+/// All model variables are combined into a single input vector and a single output vector, just like
+/// FeedForwardModel, and normalizations are loaded from "<filename>.norm" if it exists.
+class MlpModel : public Model {
+    std::string m_filename;
+    MlpNetwork m_network;
+
+    std::vector<const tensor*> m_input_tensors;
+    std::vector<const Normalization*> m_input_normalizations;
+    std::vector<std::vector<int64_t>> m_output_shapes;
+    std::vector<int64_t> m_output_lengths;
+    std::vector<float> m_input_buffer;
+    std::vector<float> m_output_buffer;
+
+public:
+    explicit MlpModel(std::string filename);
+
+    void initialize() override;
+
+    /// Training isn't supported; train in PyTorch and export the weights instead
+    void train_from_captures() override;
+
+    bool infer() override;
+
+    MlpNetwork& get_network() { return m_network; }
+};
+
+} // namespace phasm
+#endif //MLP_PLUGIN_MLP_MODEL_H
@@ -0,0 +1,81 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef MLP_PLUGIN_MLP_NETWORK_H
+#define MLP_PLUGIN_MLP_NETWORK_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace phasm {
+
+enum class Activation : uint32_t { Identity = 0, ReLU = 1, Tanh = 2, Sigmoid = 3 };
+
+/// A fully connected layer, y = activation(W x + b). The weights are stored transposed, as [in_features][padded_out],
+/// with each row zero-padded to a multiple of 16 floats. This way the kernels broadcast one input at a time and
+/// accumulate a whole vector of outputs with a single FMA, which works well even when in_features is tiny (e.g. 3).
+struct DenseLayer {
+    static constexpr int64_t PADDING = 16; // One AVX-512 vector, or two AVX2 vectors
+
+    int64_t in_features = 0;
+    int64_t out_features = 0;
+    int64_t padded_out = 0;
+    Activation activation = Activation::Identity;
+    std::vector<float> weights; ///< [in_features][padded_out]
+    std::vector<float> bias;    ///< [padded_out]
+
+    DenseLayer() = default;
+
+    /// `weights` is row-major [out_features][in_features], i.e. the layout of torch.nn.Linear.weight
+    DenseLayer(int64_t in_features, int64_t out_features, Activation activation, const float* weights, const float* bias);
+
+    /// Returns W as row-major [out_features][in_features] again
+    std::vector<float> get_weights() const;
+};
+
+/// Computes `rows` samples at once. `x` is [rows][in_features] and `y` is [rows][out_features], both contiguous.
+/// ReLU and Identity are applied in-register; Tanh and Sigmoid in a second pass over the output. Uses AVX-512 or
+/// AVX2 depending on phasm::get_simd_level(), and a scalar loop otherwise.
+void dense_forward(const DenseLayer& layer, const float* x, float* y, size_t rows);
+
+
+/// A feed-forward network evaluated by our own kernels, with no dependency on Torch. Networks are stored in a
+/// small binary format, which python/export_mlp.py writes from a PyTorch nn.Sequential or TorchScript module:
+///
+///     char[8]  magic "PHASMMLP"
+///     uint32   version (1)
+///     uint32   layer count
+///     per layer:
+///         uint32   in_features
+///         uint32   out_features
+///         uint32   activation (see Activation)
+///         float32  weights[out_features][in_features]
+///         float32  bias[out_features]
+///
+/// Everything is little-endian.
+class MlpNetwork {
+    std::vector<DenseLayer> m_layers;
+    std::vector<float> m_buffers[2]; // Ping-pong activations between layers
+
+public:
+    MlpNetwork() = default;
+    explicit MlpNetwork(std::vector<DenseLayer> layers);
+
+    /// Throws std::runtime_error if the file is missing, truncated, or not in the format above
+    static MlpNetwork load(const std::string& filename);
+    void save(const std::string& filename) const;
+
+    const std::vector<DenseLayer>& get_layers() const { return m_layers; }
+    int64_t get_input_dim() const { return m_layers.empty() ? 0 : m_layers.front().in_features; }
+    int64_t get_output_dim() const { return m_layers.empty() ? 0 : m_layers.back().out_features; }
+
+    /// Evaluates `rows` samples, [rows][input_dim] -> [rows][output_dim]. Not thread safe, since it reuses the
+    /// intermediate buffers; these only grow, so steady-state calls don't allocate.
+    void forward(const float* input, float* output, size_t rows = 1);
+};
+
+} // namespace phasm
+#endif //MLP_PLUGIN_MLP_NETWORK_H
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# Copyright 2022, Jefferson Science Associates, LLC.
+# Subject to the terms in the LICENSE file found in the top-level directory.
+
+"""Exports a feed-forward network into the binary format read by phasm-mlp-plugin (see mlp_network.h).
+
+The network has to be a chain of Linear layers, each optionally followed by a ReLU, Tanh, or Sigmoid, e.g. an
+nn.Sequential. Both TorchScript files and pickled nn.Modules are accepted:
+
+    python export_mlp.py model.pt model.mlp
+"""
+
+import struct
+import sys
+
+import torch
+import torch.nn as nn
+
+MAGIC = b"PHASMMLP"
+VERSION = 1
+ACTIVATIONS = {"Identity": 0, "ReLU": 1, "Tanh": 2, "Sigmoid": 3}
+
+
+def collect_layers(module):
+    """Returns [(weight, bias, activation)] by walking the leaf modules in registration order"""
+    layers = []
+    for name, child in module.named_modules():
+        if any(True for _ in child.children()):
+            continue  # Only leaves do any work
+        kind = getattr(child, "original_name", type(child).__name__)
+        if kind == "Linear":
+            bias = child.bias if child.bias is not None else torch.zeros(child.weight.shape[0])
+            layers.append([child.weight.detach().float(), bias.detach().float(), "Identity"])
+        elif kind in ACTIVATIONS and kind != "Identity":
+            if not layers or layers[-1][2] != "Identity":
+                raise ValueError(f"'{name}': activations have to follow a Linear layer")
+            layers[-1][2] = kind
+        elif kind in ("Dropout", "Identity", "Flatten"):
+            continue  # No-ops at inference time
+        else:
+            raise ValueError(f"'{name}': {kind} layers aren't supported by phasm-mlp-plugin")
+    if not layers:
+        raise ValueError("No Linear layers found")
+    return layers
+
+
+def export(module, filename):
+    layers = collect_layers(module)
+    with open(filename, "wb") as f:
+        f.write(MAGIC)
+        f.write(struct.pack("<II", VERSION, len(layers)))
+        for weight, bias, activation in layers:
+            out_features, in_features = weight.shape
+            f.write(struct.pack("<III", in_features, out_features, ACTIVATIONS[activation]))
+            f.write(weight.contiguous().numpy().astype("<f4").tobytes())
+            f.write(bias.contiguous().numpy().astype("<f4").tobytes())
+    print(f"Exported {len(layers)} layers to {filename}")
+
+
+def load(filename):
+    try:
+        return torch.jit.load(filename, map_location="cpu")
+    except RuntimeError:
+        return torch.load(filename, map_location="cpu")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    export(load(sys.argv[1]), sys.argv[2])
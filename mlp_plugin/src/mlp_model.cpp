@@ -0,0 +1,67 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "mlp_model.h"
+#include "normalization.h"
+
+#include <fstream>
+#include <iostream>
+
+namespace phasm {
+
+MlpModel::MlpModel(std::string filename) : m_filename(std::move(filename)) {
+    m_network = MlpNetwork::load(m_filename);
+    std::cerr << "PHASM: Loaded MLP '" << m_filename << "' (" << m_network.get_layers().size() << " layers)" << std::endl;
+}
+
+void MlpModel::initialize() {
+    int64_t all_inputs_dim = 0;
+    int64_t all_outputs_dim = 0;
+    for (const auto& input : m_inputs) {
+        int64_t length = 1;
+        for (int64_t dim : input->shape()) length *= dim;
+        all_inputs_dim += length;
+        m_input_tensors.push_back(&input->inference_input);
+        m_input_normalizations.push_back(&input->normalization);
+    }
+    for (const auto& output : m_outputs) {
+        std::vector<int64_t> shape = output->shape();
+        int64_t length = 1;
+        for (int64_t dim : shape) length *= dim;
+        m_output_shapes.push_back(shape);
+        m_output_lengths.push_back(length);
+        all_outputs_dim += length;
+        output->inference_output = tensor(DType::F32, shape);
+    }
+    if (all_inputs_dim != m_network.get_input_dim() || all_outputs_dim != m_network.get_output_dim()) {
+        throw std::runtime_error("MlpModel: '" + m_filename + "' maps " + std::to_string(m_network.get_input_dim()) +
+                                 " inputs to " + std::to_string(m_network.get_output_dim()) + " outputs, but the model variables have " +
+                                 std::to_string(all_inputs_dim) + " inputs and " + std::to_string(all_outputs_dim) + " outputs");
+    }
+    m_input_buffer.resize(all_inputs_dim);
+    m_output_buffer.resize(all_outputs_dim);
+
+    std::ifstream normalization_file(m_filename + ".norm");
+    if (normalization_file.good()) {
+        load_normalizations(normalization_file);
+        std::cerr << "PHASM: Loaded normalizations from '" << m_filename << ".norm'" << std::endl;
+    }
+}
+
+void MlpModel::train_from_captures() {
+    std::cerr << "PHASM: phasm-mlp-plugin can't train models. Train in PyTorch and export with export_mlp.py" << std::endl;
+}
+
+bool MlpModel::infer() {
+    flatten_and_join_into(m_input_tensors, m_input_normalizations, m_input_buffer.data(), m_input_buffer.size());
+    m_network.forward(m_input_buffer.data(), m_output_buffer.data());
+    const float* output = m_output_buffer.data();
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        unpack_output_into(output, m_output_shapes[i], m_outputs[i]->normalization, m_outputs[i]->inference_output);
+        output += m_output_lengths[i];
+    }
+    return true;
+}
+
+} // namespace phasm
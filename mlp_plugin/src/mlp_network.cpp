@@ -0,0 +1,336 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "mlp_network.h"
+#include "dtype_conversion.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PHASM_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define PHASM_X86_SIMD 0
+#endif
+
+namespace phasm {
+
+DenseLayer::DenseLayer(int64_t in_features, int64_t out_features, Activation activation, const float* w, const float* b)
+    : in_features(in_features), out_features(out_features), activation(activation) {
+
+    padded_out = (out_features + PADDING - 1) / PADDING * PADDING;
+    weights.assign(in_features * padded_out, 0.0f);
+    bias.assign(padded_out, 0.0f);
+    for (int64_t o=0; o<out_features; ++o) {
+        for (int64_t i=0; i<in_features; ++i) {
+            weights[i*padded_out + o] = w[o*in_features + i];
+        }
+        bias[o] = b[o];
+    }
+}
+
+std::vector<float> DenseLayer::get_weights() const {
+    std::vector<float> result(out_features * in_features);
+    for (int64_t o=0; o<out_features; ++o) {
+        for (int64_t i=0; i<in_features; ++i) {
+            result[o*in_features + i] = weights[i*padded_out + o];
+        }
+    }
+    return result;
+}
+
+
+// --------------------------------------------------------------------------
+// Kernels
+// --------------------------------------------------------------------------
+
+/// Tanh and Sigmoid don't have cheap vector forms, so the kernels leave them for this pass
+static void apply_slow_activation(Activation activation, float* y, size_t length) {
+    if (activation == Activation::Tanh) {
+        for (size_t i=0; i<length; ++i) y[i] = std::tanh(y[i]);
+    }
+    else if (activation == Activation::Sigmoid) {
+        for (size_t i=0; i<length; ++i) y[i] = 1.0f / (1.0f + std::exp(-y[i]));
+    }
+}
+
+static void dense_forward_scalar(const DenseLayer& layer, const float* x, float* y, size_t rows) {
+    const int64_t in = layer.in_features, out = layer.out_features, stride = layer.padded_out;
+    const bool relu = layer.activation == Activation::ReLU;
+    for (size_t r=0; r<rows; ++r) {
+        const float* xr = x + r*in;
+        float* yr = y + r*out;
+        std::copy(layer.bias.data(), layer.bias.data() + out, yr);
+        for (int64_t i=0; i<in; ++i) {
+            const float* w = layer.weights.data() + i*stride;
+            for (int64_t o=0; o<out; ++o) {
+                yr[o] += xr[i] * w[o];
+            }
+        }
+        if (relu) {
+            for (int64_t o=0; o<out; ++o) yr[o] = std::max(yr[o], 0.0f);
+        }
+    }
+}
+
+#if PHASM_X86_SIMD
+
+// Sliding window over this gives the store mask for the last, partial vector of outputs
+alignas(64) static const int32_t s_mask_table[16] = {-1,-1,-1,-1,-1,-1,-1,-1, 0,0,0,0,0,0,0,0};
+
+__attribute__((target("avx2,fma")))
+static inline __m256i avx2_mask(int64_t remaining) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s_mask_table + 8 - std::min<int64_t>(remaining, 8)));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 avx2_activate(__m256 v, bool relu) {
+    return relu ? _mm256_max_ps(v, _mm256_setzero_ps()) : v;
+}
+
+/// Two kinds of register blocking: For batches, 4 rows x 8 outputs, so that each weight vector we load is used
+/// 4 times. For single samples (and the leftover rows), 1 row x 32 outputs, so that there are 4 independent FMA
+/// chains to hide the FMA latency.
+__attribute__((target("avx2,fma")))
+static void dense_forward_avx2(const DenseLayer& layer, const float* x, float* y, size_t rows) {
+    const int64_t in = layer.in_features, out = layer.out_features, stride = layer.padded_out;
+    const bool relu = layer.activation == Activation::ReLU;
+    const float* W = layer.weights.data();
+    const float* B = layer.bias.data();
+
+    size_t r = 0;
+    for (; r+4 <= rows; r+=4) {
+        const float* x0 = x + r*in;
+        const float* x1 = x0 + in;
+        const float* x2 = x1 + in;
+        const float* x3 = x2 + in;
+        for (int64_t c=0; c<out; c+=8) {
+            __m256 bias = _mm256_loadu_ps(B + c);
+            __m256 acc0 = bias, acc1 = bias, acc2 = bias, acc3 = bias;
+            for (int64_t i=0; i<in; ++i) {
+                __m256 w = _mm256_loadu_ps(W + i*stride + c);
+                acc0 = _mm256_fmadd_ps(_mm256_broadcast_ss(x0+i), w, acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_broadcast_ss(x1+i), w, acc1);
+                acc2 = _mm256_fmadd_ps(_mm256_broadcast_ss(x2+i), w, acc2);
+                acc3 = _mm256_fmadd_ps(_mm256_broadcast_ss(x3+i), w, acc3);
+            }
+            __m256i mask = avx2_mask(out - c);
+            float* yr = y + r*out + c;
+            _mm256_maskstore_ps(yr, mask, avx2_activate(acc0, relu));
+            _mm256_maskstore_ps(yr + out, mask, avx2_activate(acc1, relu));
+            _mm256_maskstore_ps(yr + 2*out, mask, avx2_activate(acc2, relu));
+            _mm256_maskstore_ps(yr + 3*out, mask, avx2_activate(acc3, relu));
+        }
+    }
+    for (; r<rows; ++r) {
+        const float* xr = x + r*in;
+        float* yr = y + r*out;
+        int64_t c = 0;
+        for (; c+32 <= out; c+=32) {
+            __m256 acc0 = _mm256_loadu_ps(B+c), acc1 = _mm256_loadu_ps(B+c+8);
+            __m256 acc2 = _mm256_loadu_ps(B+c+16), acc3 = _mm256_loadu_ps(B+c+24);
+            for (int64_t i=0; i<in; ++i) {
+                __m256 xi = _mm256_broadcast_ss(xr+i);
+                const float* w = W + i*stride + c;
+                acc0 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(w), acc0);
+                acc1 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(w+8), acc1);
+                acc2 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(w+16), acc2);
+                acc3 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(w+24), acc3);
+            }
+            _mm256_storeu_ps(yr+c, avx2_activate(acc0, relu));
+            _mm256_storeu_ps(yr+c+8, avx2_activate(acc1, relu));
+            _mm256_storeu_ps(yr+c+16, avx2_activate(acc2, relu));
+            _mm256_storeu_ps(yr+c+24, avx2_activate(acc3, relu));
+        }
+        for (; c<out; c+=8) {
+            __m256 acc = _mm256_loadu_ps(B+c);
+            for (int64_t i=0; i<in; ++i) {
+                acc = _mm256_fmadd_ps(_mm256_broadcast_ss(xr+i), _mm256_loadu_ps(W + i*stride + c), acc);
+            }
+            _mm256_maskstore_ps(yr+c, avx2_mask(out-c), avx2_activate(acc, relu));
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline __mmask16 avx512_mask(int64_t remaining) {
+    return (remaining >= 16) ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << remaining) - 1);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 avx512_activate(__m512 v, bool relu) {
+    // The masked form computes the same thing, but avoids a spurious -Wmaybe-uninitialized from GCC's _mm512_max_ps
+    return relu ? _mm512_mask_max_ps(v, 0xFFFF, v, _mm512_setzero_ps()) : v;
+}
+
+/// Same blocking as the AVX2 kernel, with twice the width
+__attribute__((target("avx512f")))
+static void dense_forward_avx512(const DenseLayer& layer, const float* x, float* y, size_t rows) {
+    const int64_t in = layer.in_features, out = layer.out_features, stride = layer.padded_out;
+    const bool relu = layer.activation == Activation::ReLU;
+    const float* W = layer.weights.data();
+    const float* B = layer.bias.data();
+
+    size_t r = 0;
+    for (; r+4 <= rows; r+=4) {
+        const float* x0 = x + r*in;
+        const float* x1 = x0 + in;
+        const float* x2 = x1 + in;
+        const float* x3 = x2 + in;
+        for (int64_t c=0; c<out; c+=16) {
+            __m512 bias = _mm512_loadu_ps(B + c);
+            __m512 acc0 = bias, acc1 = bias, acc2 = bias, acc3 = bias;
+            for (int64_t i=0; i<in; ++i) {
+                __m512 w = _mm512_loadu_ps(W + i*stride + c);
+                acc0 = _mm512_fmadd_ps(_mm512_set1_ps(x0[i]), w, acc0);
+                acc1 = _mm512_fmadd_ps(_mm512_set1_ps(x1[i]), w, acc1);
+                acc2 = _mm512_fmadd_ps(_mm512_set1_ps(x2[i]), w, acc2);
+                acc3 = _mm512_fmadd_ps(_mm512_set1_ps(x3[i]), w, acc3);
+            }
+            __mmask16 mask = avx512_mask(out - c);
+            float* yr = y + r*out + c;
+            _mm512_mask_storeu_ps(yr, mask, avx512_activate(acc0, relu));
+            _mm512_mask_storeu_ps(yr + out, mask, avx512_activate(acc1, relu));
+            _mm512_mask_storeu_ps(yr + 2*out, mask, avx512_activate(acc2, relu));
+            _mm512_mask_storeu_ps(yr + 3*out, mask, avx512_activate(acc3, relu));
+        }
+    }
+    for (; r<rows; ++r) {
+        const float* xr = x + r*in;
+        float* yr = y + r*out;
+        int64_t c = 0;
+        for (; c+64 <= out; c+=64) {
+            __m512 acc0 = _mm512_loadu_ps(B+c), acc1 = _mm512_loadu_ps(B+c+16);
+            __m512 acc2 = _mm512_loadu_ps(B+c+32), acc3 = _mm512_loadu_ps(B+c+48);
+            for (int64_t i=0; i<in; ++i) {
+                __m512 xi = _mm512_set1_ps(xr[i]);
+                const float* w = W + i*stride + c;
+                acc0 = _mm512_fmadd_ps(xi, _mm512_loadu_ps(w), acc0);
+                acc1 = _mm512_fmadd_ps(xi, _mm512_loadu_ps(w+16), acc1);
+                acc2 = _mm512_fmadd_ps(xi, _mm512_loadu_ps(w+32), acc2);
+                acc3 = _mm512_fmadd_ps(xi, _mm512_loadu_ps(w+48), acc3);
+            }
+            _mm512_storeu_ps(yr+c, avx512_activate(acc0, relu));
+            _mm512_storeu_ps(yr+c+16, avx512_activate(acc1, relu));
+            _mm512_storeu_ps(yr+c+32, avx512_activate(acc2, relu));
+            _mm512_storeu_ps(yr+c+48, avx512_activate(acc3, relu));
+        }
+        for (; c<out; c+=16) {
+            __m512 acc = _mm512_loadu_ps(B+c);
+            for (int64_t i=0; i<in; ++i) {
+                acc = _mm512_fmadd_ps(_mm512_set1_ps(xr[i]), _mm512_loadu_ps(W + i*stride + c), acc);
+            }
+            _mm512_mask_storeu_ps(yr+c, avx512_mask(out-c), avx512_activate(acc, relu));
+        }
+    }
+}
+
+#endif // PHASM_X86_SIMD
+
+
+void dense_forward(const DenseLayer& layer, const float* x, float* y, size_t rows) {
+    switch (get_simd_level()) {
+#if PHASM_X86_SIMD
+        case SimdLevel::AVX512: dense_forward_avx512(layer, x, y, rows); break;
+        case SimdLevel::AVX2: dense_forward_avx2(layer, x, y, rows); break;
+#endif
+        default: dense_forward_scalar(layer, x, y, rows); break;
+    }
+    apply_slow_activation(layer.activation, y, rows * layer.out_features);
+}
+
+
+// --------------------------------------------------------------------------
+// MlpNetwork
+// --------------------------------------------------------------------------
+
+static const char s_magic[8] = {'P','H','A','S','M','M','L','P'};
+static const uint32_t s_version = 1;
+
+MlpNetwork::MlpNetwork(std::vector<DenseLayer> layers) : m_layers(std::move(layers)) {
+    for (size_t i=1; i<m_layers.size(); ++i) {
+        if (m_layers[i].in_features != m_layers[i-1].out_features) {
+            throw std::runtime_error("MlpNetwork: Layer " + std::to_string(i) + " expects " +
+                                     std::to_string(m_layers[i].in_features) + " inputs, but the previous layer has " +
+                                     std::to_string(m_layers[i-1].out_features) + " outputs");
+        }
+    }
+}
+
+MlpNetwork MlpNetwork::load(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.good()) {
+        throw std::runtime_error("MlpNetwork: Unable to open '" + filename + "'");
+    }
+    auto read = [&](void* dest, size_t bytes) {
+        file.read(static_cast<char*>(dest), bytes);
+        if (!file.good()) throw std::runtime_error("MlpNetwork: '" + filename + "' is truncated");
+    };
+    char magic[8];
+    uint32_t version, layer_count;
+    read(magic, sizeof(magic));
+    if (std::memcmp(magic, s_magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("MlpNetwork: '" + filename + "' is not a PHASM MLP file");
+    }
+    read(&version, sizeof(version));
+    if (version != s_version) {
+        throw std::runtime_error("MlpNetwork: '" + filename + "' has unsupported version " + std::to_string(version));
+    }
+    read(&layer_count, sizeof(layer_count));
+
+    std::vector<DenseLayer> layers;
+    for (uint32_t l=0; l<layer_count; ++l) {
+        uint32_t header[3];
+        read(header, sizeof(header));
+        if (header[2] > static_cast<uint32_t>(Activation::Sigmoid)) {
+            throw std::runtime_error("MlpNetwork: '" + filename + "' has unknown activation " + std::to_string(header[2]));
+        }
+        std::vector<float> weights(size_t(header[0]) * header[1]);
+        std::vector<float> bias(header[1]);
+        read(weights.data(), weights.size() * sizeof(float));
+        read(bias.data(), bias.size() * sizeof(float));
+        layers.emplace_back(header[0], header[1], static_cast<Activation>(header[2]), weights.data(), bias.data());
+    }
+    return MlpNetwork(std::move(layers));
+}
+
+void MlpNetwork::save(const std::string& filename) const {
+    std::ofstream file(filename, std::ios::binary);
+    uint32_t layer_count = m_layers.size();
+    file.write(s_magic, sizeof(s_magic));
+    file.write(reinterpret_cast<const char*>(&s_version), sizeof(s_version));
+    file.write(reinterpret_cast<const char*>(&layer_count), sizeof(layer_count));
+    for (const auto& layer : m_layers) {
+        uint32_t header[3] = {uint32_t(layer.in_features), uint32_t(layer.out_features), uint32_t(layer.activation)};
+        std::vector<float> weights = layer.get_weights();
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(weights.data()), weights.size() * sizeof(float));
+        file.write(reinterpret_cast<const char*>(layer.bias.data()), layer.out_features * sizeof(float));
+    }
+    if (!file.good()) {
+        throw std::runtime_error("MlpNetwork: Unable to write '" + filename + "'");
+    }
+}
+
+void MlpNetwork::forward(const float* input, float* output, size_t rows) {
+    const float* x = input;
+    for (size_t l=0; l<m_layers.size(); ++l) {
+        const DenseLayer& layer = m_layers[l];
+        float* y = output;
+        if (l+1 < m_layers.size()) {
+            std::vector<float>& buffer = m_buffers[l % 2];
+            size_t needed = rows * layer.out_features;
+            if (buffer.size() < needed) buffer.resize(needed);
+            y = buffer.data();
+        }
+        dense_forward(layer, x, y, rows);
+        x = y;
+    }
+}
+
+} // namespace phasm
@@ -0,0 +1,28 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "plugin.h"
+#include "mlp_model.h"
+
+struct MlpPlugin : public phasm::Plugin {
+
+    std::string get_name() override {
+        return "phasm-mlp-plugin";
+    }
+
+    std::shared_ptr<phasm::Model> make_model(std::string file_name) override {
+        if (file_name.empty()) {
+            throw std::runtime_error("phasm-mlp-plugin needs the filename of an exported network");
+        }
+        return std::make_shared<phasm::MlpModel>(file_name);
+    }
+};
+
+MlpPlugin g_mlp_plugin;
+
+extern "C" {
+    phasm::Plugin* get_plugin() {
+        return &g_mlp_plugin;
+    };
+}
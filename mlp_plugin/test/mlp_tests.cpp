@@ -0,0 +1,145 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+#include "surrogate_builder.h"
+#include "dtype_conversion.h"
+#include "mlp_model.h"
+
+using namespace phasm;
+namespace phasm::test::mlp_tests {
+
+DenseLayer make_random_layer(int64_t in, int64_t out, Activation activation, std::mt19937& rng) {
+    std::normal_distribution<float> dist;
+    std::vector<float> w(in*out), b(out);
+    for (auto& x : w) x = dist(rng);
+    for (auto& x : b) x = dist(rng);
+    return DenseLayer(in, out, activation, w.data(), b.data());
+}
+
+std::vector<float> reference_forward(const DenseLayer& layer, const std::vector<float>& x, size_t rows) {
+    std::vector<float> w = layer.get_weights();
+    std::vector<float> y(rows * layer.out_features);
+    for (size_t r=0; r<rows; ++r) {
+        for (int64_t o=0; o<layer.out_features; ++o) {
+            double acc = layer.bias[o];
+            for (int64_t i=0; i<layer.in_features; ++i) {
+                acc += double(w[o*layer.in_features + i]) * x[r*layer.in_features + i];
+            }
+            switch (layer.activation) {
+                case Activation::ReLU: acc = std::max(acc, 0.0); break;
+                case Activation::Tanh: acc = std::tanh(acc); break;
+                case Activation::Sigmoid: acc = 1.0 / (1.0 + std::exp(-acc)); break;
+                default: break;
+            }
+            y[r*layer.out_features + o] = acc;
+        }
+    }
+    return y;
+}
+
+TEST_CASE("Dense kernels agree with a naive reference at every SIMD level") {
+    std::mt19937 rng(7);
+    std::normal_distribution<float> dist;
+    SimdLevel original_level = get_simd_level();
+
+    // Odd sizes exercise the masked stores and the leftover rows
+    for (auto [in, out] : std::vector<std::pair<int64_t,int64_t>>{{3,3}, {3,64}, {17,33}, {64,70}, {5,1}}) {
+        for (Activation activation : {Activation::Identity, Activation::ReLU, Activation::Tanh, Activation::Sigmoid}) {
+            DenseLayer layer = make_random_layer(in, out, activation, rng);
+            for (size_t rows : {1, 4, 7}) {
+                std::vector<float> x(rows*in);
+                for (auto& v : x) v = dist(rng);
+                std::vector<float> expected = reference_forward(layer, x, rows);
+                for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::AVX2, SimdLevel::AVX512}) {
+                    set_simd_level(level);
+                    // One guard value past the end, to catch stores that don't respect the mask
+                    std::vector<float> y(rows*out + 1, 12345.0f);
+                    dense_forward(layer, x.data(), y.data(), rows);
+                    for (size_t k=0; k<rows*out; ++k) {
+                        REQUIRE(y[k] == Approx(expected[k]).margin(1e-4));
+                    }
+                    REQUIRE(y[rows*out] == 12345.0f);
+                }
+            }
+        }
+    }
+    set_simd_level(original_level);
+}
+
+TEST_CASE("MlpNetwork round-trips through its file format") {
+    std::mt19937 rng(11);
+    std::vector<DenseLayer> layers;
+    layers.push_back(make_random_layer(3, 16, Activation::ReLU, rng));
+    layers.push_back(make_random_layer(16, 2, Activation::Identity, rng));
+    MlpNetwork network(std::move(layers));
+    network.save("mlp_tests_roundtrip.mlp");
+
+    MlpNetwork loaded = MlpNetwork::load("mlp_tests_roundtrip.mlp");
+    REQUIRE(loaded.get_input_dim() == 3);
+    REQUIRE(loaded.get_output_dim() == 2);
+    REQUIRE(loaded.get_layers()[0].activation == Activation::ReLU);
+
+    float x[6] = {0.1f, -0.2f, 0.3f, 1, 2, 3};
+    float expected[4], actual[4];
+    network.forward(x, expected, 2);
+    loaded.forward(x, actual, 2);
+    for (int i=0; i<4; ++i) {
+        REQUIRE(actual[i] == expected[i]);
+    }
+    std::remove("mlp_tests_roundtrip.mlp");
+}
+
+TEST_CASE("MlpNetwork rejects bad files and mismatched layers") {
+    REQUIRE_THROWS(MlpNetwork::load("does_not_exist.mlp"));
+    std::ofstream("mlp_tests_garbage.mlp") << "not a network";
+    REQUIRE_THROWS(MlpNetwork::load("mlp_tests_garbage.mlp"));
+    std::remove("mlp_tests_garbage.mlp");
+
+    std::mt19937 rng(3);
+    std::vector<DenseLayer> layers;
+    layers.push_back(make_random_layer(3, 16, Activation::ReLU, rng));
+    layers.push_back(make_random_layer(8, 2, Activation::Identity, rng));
+    REQUIRE_THROWS(MlpNetwork(std::move(layers)));
+}
+
+TEST_CASE("MlpModel serves a Surrogate") {
+    // y = 2*x0 - x1 + 1, z = x0
+    float w[] = {2, -1, 1, 0};
+    float b[] = {1, 0};
+    std::vector<DenseLayer> layers;
+    layers.emplace_back(2, 2, Activation::Identity, w, b);
+    MlpNetwork(std::move(layers)).save("mlp_tests_model.mlp");
+
+    double x0, x1, y;
+    float z;
+    auto s = SurrogateBuilder()
+            .set_model(std::make_shared<MlpModel>("mlp_tests_model.mlp"))
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x0", Direction::IN)
+            .local_primitive<double>("x1", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .local_primitive<float>("z", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x0, &x1, &y, &z);
+    x0 = 3; x1 = 4;
+    s.call();
+    REQUIRE(y == Approx(3));
+    REQUIRE(z == Approx(3));
+
+    auto bad = std::make_shared<MlpModel>("mlp_tests_model.mlp");
+    auto builder = SurrogateBuilder()
+            .set_model(bad)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT);
+    REQUIRE_THROWS(builder.finish());
+    std::remove("mlp_tests_model.mlp");
+}
+
+} // namespace phasm::test::mlp_tests
@@ -0,0 +1,155 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+// Compares OnnxModel against TorchscriptModel on the same networks, shaped like the magnetic field map surrogate
+// (3 inputs -> 3 outputs) and the diffusion PDE solver surrogate (T: 9x9 and f: 7x7 in -> T: 9x9 out).
+// Usage: phasm-onnx-benchmark [hidden_width] [iterations] [batch_size] [intra_op_threads]
+
+#include <torch/script.h>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include "surrogate_builder.h"
+#include "onnx_model.h"
+#include "onnx_export.h"
+#include "torchscript_model.h"
+
+using namespace phasm;
+
+template <typename F>
+double time_per_call_us(F&& f, size_t iterations) {
+    for (size_t i=0; i<iterations/10 + 1; ++i) f(); // Warm up
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<iterations; ++i) f();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+/// Writes the same in -> hidden -> hidden -> out ReLU network as both TorchScript and ONNX, and returns the module
+torch::jit::Module write_networks(const std::string& name, int64_t in, int64_t hidden, int64_t out) {
+    std::vector<int64_t> dims = {in, hidden, hidden, out};
+    std::vector<OnnxDenseLayer> layers;
+    torch::jit::Module module(name);
+    for (size_t l=0; l+1<dims.size(); ++l) {
+        torch::Tensor weight = torch::randn({dims[l+1], dims[l]}) / std::sqrt(double(dims[l]));
+        torch::Tensor bias = torch::randn({dims[l+1]}) * 0.1;
+        module.register_parameter("w" + std::to_string(l), weight, false);
+        module.register_parameter("b" + std::to_string(l), bias, false);
+        layers.push_back({dims[l], dims[l+1],
+                          std::vector<float>(weight.data_ptr<float>(), weight.data_ptr<float>() + weight.numel()),
+                          std::vector<float>(bias.data_ptr<float>(), bias.data_ptr<float>() + bias.numel()),
+                          l+2 < dims.size()});
+    }
+    module.define(R"JIT(
+        def forward(self, x):
+            x = torch.relu(torch.matmul(x, self.w0.t()) + self.b0)
+            x = torch.relu(torch.matmul(x, self.w1.t()) + self.b1)
+            return torch.matmul(x, self.w2.t()) + self.b2
+    )JIT");
+    module.save(name + ".pt");
+    write_onnx_mlp(name + ".onnx", layers);
+    return module;
+}
+
+struct Result {
+    double torch_us, onnx_us;
+    double torch_batch_us, onnx_batch_us;
+    double max_difference;
+};
+
+template <typename MakeSurrogate>
+Result run(const std::string& name, int64_t in, int64_t hidden, int64_t out, MakeSurrogate&& make_surrogate,
+           size_t iterations, int64_t batch_size, const OnnxOptions& options) {
+    torch::jit::Module module = write_networks(name, in, hidden, out);
+    Result result {};
+
+    // Single samples, through the full Surrogate machinery, which is how the call sites actually use them
+    result.torch_us = time_per_call_us(make_surrogate(std::make_shared<TorchscriptModel>(name + ".pt")), iterations);
+    auto onnx_model = std::make_shared<OnnxModel>(name + ".onnx", options);
+    result.onnx_us = time_per_call_us(make_surrogate(onnx_model), iterations);
+
+    // Batches, straight into the networks, to see the raw throughput
+    torch::Tensor batch = torch::rand({batch_size, in});
+    torch::Tensor onnx_out = torch::empty({batch_size, out});
+    std::vector<torch::jit::IValue> torch_inputs = {batch};
+    size_t batch_iterations = std::max<size_t>(1, iterations / batch_size);
+    {
+        c10::InferenceMode guard;
+        result.torch_batch_us = time_per_call_us([&]() { module.forward(torch_inputs); }, batch_iterations);
+        result.onnx_batch_us = time_per_call_us([&]() {
+            onnx_model->infer_batch(batch.data_ptr<float>(), onnx_out.data_ptr<float>(), batch_size);
+        }, batch_iterations);
+    }
+    result.max_difference = (module.forward(torch_inputs).toTensor() - onnx_out).abs().max().item<double>();
+    return result;
+}
+
+void print(const std::string& title, const Result& r, int64_t batch_size) {
+    std::cout << "  " << title << std::endl;
+    std::cout << "    Surrogate::call(), single sample:" << std::endl;
+    std::cout << "      TorchscriptModel: " << r.torch_us << " us/call" << std::endl;
+    std::cout << "      OnnxModel:        " << r.onnx_us << " us/call (" << r.torch_us / r.onnx_us << "x)" << std::endl;
+    std::cout << "    Batches of " << batch_size << ":" << std::endl;
+    std::cout << "      TorchScript:      " << r.torch_batch_us * 1000 / batch_size << " ns/sample" << std::endl;
+    std::cout << "      ONNX Runtime:     " << r.onnx_batch_us * 1000 / batch_size << " ns/sample ("
+              << r.torch_batch_us / r.onnx_batch_us << "x)" << std::endl;
+    std::cout << "    Max difference between outputs: " << r.max_difference << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    int64_t hidden = (argc > 1) ? std::atoll(argv[1]) : 32;
+    size_t iterations = (argc > 2) ? std::atoll(argv[2]) : 100000;
+    int64_t batch_size = (argc > 3) ? std::atoll(argv[3]) : 1024;
+    OnnxOptions options = OnnxOptions::from_env();
+    if (argc > 4) options.intra_op_threads = std::atoi(argv[4]);
+    torch::manual_seed(0);
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> dist(-1, 1);
+
+    double x = dist(rng), y = dist(rng), z = dist(rng), bx, by, bz;
+    auto make_field_map = [&](std::shared_ptr<Model> model) {
+        auto s = std::make_shared<Surrogate>(SurrogateBuilder()
+                .set_model(model, true)
+                .set_callmode(CallMode::UseModel)
+                .local_primitive<double>("x", Direction::IN)
+                .local_primitive<double>("y", Direction::IN)
+                .local_primitive<double>("z", Direction::IN)
+                .local_primitive<double>("Bx", Direction::OUT)
+                .local_primitive<double>("By", Direction::OUT)
+                .local_primitive<double>("Bz", Direction::OUT)
+                .finish());
+        s->bind_all_callsite_vars(&x, &y, &z, &bx, &by, &bz);
+        return [s]() { s->call(); };
+    };
+    Result field_map = run("onnx_benchmark_field_map", 3, hidden, 3, make_field_map, iterations, batch_size, options);
+
+    // Same sizes as examples/pde_solver, with N=7
+    constexpr int64_t N = 7;
+    std::vector<double> T((N+2)*(N+2)), f(N*N);
+    for (auto& v : T) v = dist(rng);
+    for (auto& v : f) v = dist(rng);
+    auto make_pde = [&](std::shared_ptr<Model> model) {
+        auto s = std::make_shared<Surrogate>(SurrogateBuilder()
+                .set_model(model, true)
+                .set_callmode(CallMode::UseModel)
+                .local_primitive<double>("T", Direction::INOUT, {N+2, N+2})
+                .local_primitive<double>("f", Direction::IN, {N, N})
+                .finish());
+        s->bind_all_callsite_vars(T.data(), f.data());
+        return [s]() { s->call(); };
+    };
+    int64_t pde_in = (N+2)*(N+2) + N*N;
+    int64_t pde_out = (N+2)*(N+2);
+    Result pde = run("onnx_benchmark_pde", pde_in, hidden, pde_out, make_pde, iterations, batch_size, options);
+
+    std::cout << "PHASM: ONNX Runtime benchmark, hidden width " << hidden << ", optimization level "
+              << static_cast<int>(options.optimization_level) << ", " << options.intra_op_threads
+              << " intra-op threads (0 = default)" << std::endl;
+    print("Field map, 3 -> " + std::to_string(hidden) + " -> " + std::to_string(hidden) + " -> 3:", field_map, batch_size);
+    print("PDE solver, " + std::to_string(pde_in) + " -> " + std::to_string(hidden) + " -> " + std::to_string(hidden)
+          + " -> " + std::to_string(pde_out) + ":", pde, batch_size);
+    return 0;
+}
@@ -0,0 +1,31 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef ONNX_PLUGIN_ONNX_EXPORT_H
+#define ONNX_PLUGIN_ONNX_EXPORT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace phasm {
+
+/// One fully connected layer, y = relu?(W x + b), with W stored row-major as [out_features, in_features] like
+/// torch.nn.Linear
+struct OnnxDenseLayer {
+    int64_t in_features;
+    int64_t out_features;
+    std::vector<float> weights;
+    std::vector<float> biases;
+    bool relu;
+};
+
+/// Writes a dense network as an .onnx file (opset 13), with a single float input "input" of shape [batch, in_features]
+/// and a single float output "output" of shape [batch, out_features], where batch is dynamic. Networks trained in
+/// Python should be exported with torch.onnx.export instead; this lets the tests and benchmarks make networks without
+/// depending on Python or protobuf.
+void write_onnx_mlp(const std::string& filename, const std::vector<OnnxDenseLayer>& layers);
+
+} // namespace phasm
+#endif //ONNX_PLUGIN_ONNX_EXPORT_H
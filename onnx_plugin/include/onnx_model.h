@@ -0,0 +1,129 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef ONNX_PLUGIN_ONNX_MODEL_H
+#define ONNX_PLUGIN_ONNX_MODEL_H
+
+#include "model.h"
+
+#include <onnxruntime_cxx_api.h>
+#include <memory>
+
+namespace phasm {
+
+/// Which of ONNX Runtime's graph optimizations to apply when the session is created
+enum class OnnxOptimizationLevel {
+    Disabled, ///< Run the graph exactly as exported
+    Basic,    ///< Constant folding and redundant node elimination
+    Extended, ///< Plus operator fusions, e.g. Gemm+Relu
+    All       ///< Plus layout transformations specific to the CPU we're running on
+};
+
+/// Controls how an OnnxModel's session is set up. The defaults favor low latency for single samples.
+struct OnnxOptions {
+    OnnxOptimizationLevel optimization_level = OnnxOptimizationLevel::All;
+    /// Number of threads ONNX Runtime uses within an operator and across independent operators. 0 leaves the ONNX
+    /// Runtime default (one per physical core) alone. For single samples through a small network, 1 is usually
+    /// fastest, since waking up a thread pool costs more than the math.
+    int intra_op_threads = 0;
+    int inter_op_threads = 0;
+    /// Runs independent branches of the graph concurrently, on the inter-op threads
+    bool parallel_execution = false;
+    /// Lets idle pool threads spin before going to sleep, which trades CPU time for latency
+    bool allow_spinning = true;
+    /// Have all OnnxModels in the process share one pair of thread pools, sized by whichever OnnxModel is created
+    /// first, instead of every session starting its own. Worth it once there are many surrogates.
+    bool share_thread_pools = false;
+    /// Saves the optimized graph here, e.g. to inspect the fusions, or to load it later with optimization disabled
+    std::string optimized_model_path;
+    /// Number of runs in initialize(), so that the first real call doesn't pay for ONNX Runtime's lazy allocations
+    size_t warmup_iterations = 0;
+
+    /// Reads PHASM_ONNX_OPTIMIZATION_LEVEL (0-3, in the order above), PHASM_ONNX_INTRA_OP_THREADS,
+    /// PHASM_ONNX_INTER_OP_THREADS, PHASM_ONNX_PARALLEL_EXECUTION, PHASM_ONNX_ALLOW_SPINNING,
+    /// PHASM_ONNX_SHARE_THREAD_POOLS, PHASM_ONNX_OPTIMIZED_MODEL_PATH, and PHASM_ONNX_WARMUP_ITERATIONS,
+    /// falling back to the defaults above
+    static OnnxOptions from_env();
+};
+
+
+/// Runs an .onnx file on ONNX Runtime's CPU execution provider. This is much lighter than libtorch, both to start
+/// up and per call, which matters for the small MLPs we typically surrogate with.
+///
+/// Inputs and outputs go through an IoBinding over buffers that we own, so ONNX Runtime reads and writes them in
+/// place, and a call allocates nothing:
+/// - With tensor combining, the graph has one float input and one float output. The inputs are packed (and
+///   normalized) into a preallocated buffer, like every other plugin does. If there is a single output variable, which
+///   isn't normalized, the graph writes straight into its inference_output tensor; otherwise into a second buffer,
+///   which is then unpacked.
+/// - Without tensor combining, the graph has one input per input variable and one output per output variable, in the
+///   order they were declared, with matching dtypes. These are bound directly to the ModelVariables' tensors, and
+///   only rebound when a tensor's buffer moves. Normalizations aren't supported in this mode.
+///
+/// Graph dimensions which are dynamic (e.g. a batch dimension) are set to 1 for Surrogate::call(). infer_batch()
+/// runs whole batches through graphs whose leading dimension is dynamic. Normalizations are loaded from
+/// "<filename>.norm" if it exists, and training isn't supported.
+class OnnxModel : public Model {
+    std::string m_filename;
+    OnnxOptions m_options;
+    std::unique_ptr<Ort::Session> m_session;
+    std::unique_ptr<Ort::IoBinding> m_binding;
+    Ort::MemoryInfo m_memory_info {nullptr};
+    Ort::RunOptions m_run_options {nullptr};
+
+    std::vector<std::string> m_input_names;
+    std::vector<std::string> m_output_names;
+    std::vector<std::vector<int64_t>> m_input_graph_shapes;  // As declared in the graph, with -1 for dynamic dims
+    std::vector<std::vector<int64_t>> m_output_graph_shapes;
+    std::vector<ONNXTensorElementDataType> m_input_types;
+    std::vector<ONNXTensorElementDataType> m_output_types;
+    std::vector<std::vector<int64_t>> m_input_bound_shapes; // As bound for a single sample
+    std::vector<std::vector<int64_t>> m_output_bound_shapes;
+
+    // Bound values have to outlive the binding. We also remember which buffers they point at, to notice when a
+    // tensor has been reallocated (or swapped out, e.g. by a PartitionedModel) and needs rebinding.
+    std::vector<Ort::Value> m_input_values;
+    std::vector<Ort::Value> m_output_values;
+    std::vector<const void*> m_bound_inputs;
+    std::vector<const void*> m_bound_outputs;
+
+    std::vector<std::vector<int64_t>> m_output_shapes; // Of the output ModelVariables
+    std::vector<int64_t> m_output_lengths;
+
+    // Only used with tensor combining
+    std::vector<const tensor*> m_input_tensors;
+    std::vector<const Normalization*> m_input_normalizations;
+    tensor m_input_buffer;
+    tensor m_output_buffer;
+    int64_t m_input_dim = 0;
+    int64_t m_output_dim = 0;
+    bool m_write_output_directly = false;
+
+    void load_session();
+    void bind_input(size_t index, tensor& t);
+    void bind_output(size_t index, tensor& t);
+    void rebind_moved_tensors();
+
+public:
+    explicit OnnxModel(std::string filename, OnnxOptions options = OnnxOptions());
+
+    void initialize() override;
+
+    /// Training isn't supported; train in PyTorch and export with torch.onnx.export instead
+    void train_from_captures() override;
+
+    bool infer() override;
+
+    /// Runs `batch_size` samples at once, straight from `inputs` ([batch_size, input_dim], packed and normalized like
+    /// the combined input) into `outputs` ([batch_size, output_dim], still normalized), without copying either.
+    /// Requires tensor combining, and a graph whose leading dimension is dynamic. Returns false if the run fails.
+    bool infer_batch(float* inputs, float* outputs, size_t batch_size);
+
+    int64_t get_input_dim() const { return m_input_dim; }
+    int64_t get_output_dim() const { return m_output_dim; }
+    Ort::Session& get_session() { return *m_session; }
+};
+
+} // namespace phasm
+#endif //ONNX_PLUGIN_ONNX_MODEL_H
@@ -0,0 +1,133 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "onnx_export.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace phasm {
+
+namespace {
+
+/// Just enough of the protobuf wire format to write an ONNX ModelProto. Field numbers come from onnx.proto.
+class ProtoWriter {
+    std::string m_buffer;
+
+    void write_varint(uint64_t value) {
+        while (value >= 0x80) {
+            m_buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        m_buffer.push_back(static_cast<char>(value));
+    }
+    void write_tag(int field, int wire_type) {
+        write_varint((static_cast<uint64_t>(field) << 3) | wire_type);
+    }
+
+public:
+    ProtoWriter& varint(int field, int64_t value) {
+        write_tag(field, 0);
+        write_varint(static_cast<uint64_t>(value));
+        return *this;
+    }
+    ProtoWriter& bytes(int field, const std::string& value) {
+        write_tag(field, 2);
+        write_varint(value.size());
+        m_buffer += value;
+        return *this;
+    }
+    ProtoWriter& message(int field, const ProtoWriter& value) {
+        return bytes(field, value.m_buffer);
+    }
+    ProtoWriter& packed_floats(int field, const std::vector<float>& values) {
+        std::string packed(values.size() * sizeof(float), '\0');
+        std::memcpy(&packed[0], values.data(), packed.size()); // Little-endian, like the wire format
+        return bytes(field, packed);
+    }
+    const std::string& str() const { return m_buffer; }
+};
+
+constexpr int64_t FLOAT = 1; // TensorProto.DataType
+
+ProtoWriter make_initializer(const std::string& name, const std::vector<int64_t>& dims, const std::vector<float>& data) {
+    ProtoWriter tensor;
+    for (int64_t dim : dims) tensor.varint(1, dim);
+    tensor.varint(2, FLOAT).packed_floats(4, data).bytes(8, name);
+    return tensor;
+}
+
+ProtoWriter make_value_info(const std::string& name, int64_t features) {
+    ProtoWriter shape;
+    shape.message(1, ProtoWriter().bytes(2, "batch"));
+    shape.message(1, ProtoWriter().varint(1, features));
+    ProtoWriter tensor_type;
+    tensor_type.varint(1, FLOAT).message(2, shape);
+    ProtoWriter value_info;
+    value_info.bytes(1, name).message(2, ProtoWriter().message(1, tensor_type));
+    return value_info;
+}
+
+ProtoWriter make_node(const std::string& op_type, const std::string& name, const std::vector<std::string>& inputs,
+                      const std::string& output) {
+    ProtoWriter node;
+    for (const auto& input : inputs) node.bytes(1, input);
+    node.bytes(2, output).bytes(3, name).bytes(4, op_type);
+    return node;
+}
+
+} // namespace
+
+
+void write_onnx_mlp(const std::string& filename, const std::vector<OnnxDenseLayer>& layers) {
+    if (layers.empty()) {
+        throw std::runtime_error("write_onnx_mlp: Network needs at least one layer");
+    }
+    ProtoWriter graph;
+    std::string x = "input";
+    for (size_t l=0; l<layers.size(); ++l) {
+        const auto& layer = layers[l];
+        if (layer.weights.size() != static_cast<size_t>(layer.in_features * layer.out_features) ||
+            layer.biases.size() != static_cast<size_t>(layer.out_features) ||
+            (l > 0 && layer.in_features != layers[l-1].out_features)) {
+            throw std::runtime_error("write_onnx_mlp: Layer " + std::to_string(l) + " has inconsistent dimensions");
+        }
+        std::string suffix = std::to_string(l);
+        bool last = (l+1 == layers.size());
+        std::string gemm_output = (last && !layer.relu) ? "output" : "gemm" + suffix;
+
+        // Gemm computes x * W^T + b with transB=1, so the weights keep their torch.nn.Linear layout
+        ProtoWriter gemm = make_node("Gemm", "gemm" + suffix, {x, "w" + suffix, "b" + suffix}, gemm_output);
+        gemm.message(5, ProtoWriter().bytes(1, "transB").varint(3, 1).varint(20, 2));
+        graph.message(1, gemm);
+        x = gemm_output;
+        if (layer.relu) {
+            std::string relu_output = last ? "output" : "relu" + suffix;
+            graph.message(1, make_node("Relu", "relu" + suffix, {x}, relu_output));
+            x = relu_output;
+        }
+    }
+    graph.bytes(2, "phasm_mlp");
+    for (size_t l=0; l<layers.size(); ++l) {
+        const auto& layer = layers[l];
+        std::string suffix = std::to_string(l);
+        graph.message(5, make_initializer("w" + suffix, {layer.out_features, layer.in_features}, layer.weights));
+        graph.message(5, make_initializer("b" + suffix, {layer.out_features}, layer.biases));
+    }
+    graph.message(11, make_value_info("input", layers.front().in_features));
+    graph.message(12, make_value_info("output", layers.back().out_features));
+
+    ProtoWriter model;
+    model.varint(1, 7).bytes(2, "phasm");
+    model.message(7, graph);
+    model.message(8, ProtoWriter().bytes(1, "").varint(2, 13));
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.good()) {
+        throw std::runtime_error("write_onnx_mlp: Unable to open '" + filename + "' for writing");
+    }
+    file.write(model.str().data(), static_cast<std::streamsize>(model.str().size()));
+}
+
+} // namespace phasm
@@ -0,0 +1,394 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "onnx_model.h"
+#include "normalization.h"
+#include "dtype_conversion.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace phasm {
+
+namespace {
+
+struct OnnxEnvironment {
+    Ort::Env env;
+    bool has_global_thread_pools;
+};
+
+/// ONNX Runtime wants a single Env per process, which has to outlive every session. Our sessions belong to Surrogates,
+/// which are often static globals, so rather than get caught up in the static destruction order, we never destroy it.
+/// The first OnnxModel decides whether it has global thread pools.
+OnnxEnvironment& get_environment(const OnnxOptions& options) {
+    static OnnxEnvironment* environment = [&options]() {
+        if (options.share_thread_pools) {
+            Ort::ThreadingOptions threading;
+            if (options.intra_op_threads > 0) threading.SetGlobalIntraOpNumThreads(options.intra_op_threads);
+            if (options.inter_op_threads > 0) threading.SetGlobalInterOpNumThreads(options.inter_op_threads);
+            threading.SetGlobalSpinControl(options.allow_spinning);
+            return new OnnxEnvironment {Ort::Env(threading, ORT_LOGGING_LEVEL_WARNING, "phasm"), true};
+        }
+        return new OnnxEnvironment {Ort::Env(ORT_LOGGING_LEVEL_WARNING, "phasm"), false};
+    }();
+    return *environment;
+}
+
+DType to_dtype(ONNXTensorElementDataType type) {
+    switch (type) {
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8: return DType::UI8;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT16: return DType::I16;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32: return DType::I32;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64: return DType::I64;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT: return DType::F32;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_DOUBLE: return DType::F64;
+        default: return DType::Undefined;
+    }
+}
+
+std::string shape_to_string(const std::vector<int64_t>& shape) {
+    std::ostringstream oss;
+    oss << "[";
+    for (size_t i=0; i<shape.size(); ++i) {
+        if (i > 0) oss << ",";
+        oss << shape[i];
+    }
+    oss << "]";
+    return oss.str();
+}
+
+/// Fills in the dynamic dimensions of a graph input or output so that it holds exactly `length` elements. The first
+/// dynamic dimension gets whatever is left over once the fixed ones are accounted for, and any others get 1.
+std::vector<int64_t> resolve_shape(const std::vector<int64_t>& graph_shape, int64_t length, const std::string& name) {
+    std::vector<int64_t> shape = graph_shape;
+    int64_t fixed = 1;
+    int64_t* first_dynamic = nullptr;
+    for (auto& dim : shape) {
+        if (dim < 0) {
+            if (first_dynamic == nullptr) first_dynamic = &dim;
+            dim = 1;
+        }
+        else {
+            fixed *= dim;
+        }
+    }
+    if (first_dynamic != nullptr && fixed > 0 && length % fixed == 0) {
+        *first_dynamic = length / fixed;
+    }
+    int64_t total = 1;
+    for (int64_t dim : shape) total *= dim;
+    if (total != length) {
+        throw std::runtime_error("OnnxModel: Graph tensor '" + name + "' has shape " + shape_to_string(graph_shape) +
+                                 ", which can't hold " + std::to_string(length) + " elements");
+    }
+    return shape;
+}
+
+} // namespace
+
+
+OnnxOptions OnnxOptions::from_env() {
+    OnnxOptions options;
+    auto read_int = [](const char* name, long long default_value) {
+        const char* value = std::getenv(name);
+        return (value == nullptr) ? default_value : std::atoll(value);
+    };
+    long long level = read_int("PHASM_ONNX_OPTIMIZATION_LEVEL", static_cast<int>(options.optimization_level));
+    if (level < 0 || level > static_cast<int>(OnnxOptimizationLevel::All)) {
+        throw std::runtime_error("OnnxOptions: PHASM_ONNX_OPTIMIZATION_LEVEL has to be between 0 and 3");
+    }
+    options.optimization_level = static_cast<OnnxOptimizationLevel>(level);
+    options.intra_op_threads = static_cast<int>(read_int("PHASM_ONNX_INTRA_OP_THREADS", options.intra_op_threads));
+    options.inter_op_threads = static_cast<int>(read_int("PHASM_ONNX_INTER_OP_THREADS", options.inter_op_threads));
+    options.parallel_execution = read_int("PHASM_ONNX_PARALLEL_EXECUTION", options.parallel_execution) != 0;
+    options.allow_spinning = read_int("PHASM_ONNX_ALLOW_SPINNING", options.allow_spinning) != 0;
+    options.share_thread_pools = read_int("PHASM_ONNX_SHARE_THREAD_POOLS", options.share_thread_pools) != 0;
+    const char* optimized_model_path = std::getenv("PHASM_ONNX_OPTIMIZED_MODEL_PATH");
+    if (optimized_model_path != nullptr) options.optimized_model_path = optimized_model_path;
+    options.warmup_iterations = static_cast<size_t>(read_int("PHASM_ONNX_WARMUP_ITERATIONS", options.warmup_iterations));
+    return options;
+}
+
+
+OnnxModel::OnnxModel(std::string filename, OnnxOptions options)
+    : m_filename(std::move(filename)), m_options(std::move(options)) {
+    load_session();
+}
+
+
+void OnnxModel::load_session() {
+    OnnxEnvironment& environment = get_environment(m_options);
+
+    Ort::SessionOptions session_options;
+    static const GraphOptimizationLevel levels[] = {ORT_DISABLE_ALL, ORT_ENABLE_BASIC, ORT_ENABLE_EXTENDED, ORT_ENABLE_ALL};
+    session_options.SetGraphOptimizationLevel(levels[static_cast<int>(m_options.optimization_level)]);
+    session_options.SetExecutionMode(m_options.parallel_execution ? ORT_PARALLEL : ORT_SEQUENTIAL);
+    if (!m_options.optimized_model_path.empty()) {
+        session_options.SetOptimizedModelFilePath(m_options.optimized_model_path.c_str());
+    }
+    if (m_options.share_thread_pools && environment.has_global_thread_pools) {
+        session_options.DisablePerSessionThreads();
+    }
+    else {
+        if (m_options.share_thread_pools) {
+            std::cerr << "PHASM: WARNING: The first OnnxModel didn't ask for shared thread pools, so '" << m_filename
+                      << "' gets its own" << std::endl;
+        }
+        if (m_options.intra_op_threads > 0) session_options.SetIntraOpNumThreads(m_options.intra_op_threads);
+        if (m_options.inter_op_threads > 0) session_options.SetInterOpNumThreads(m_options.inter_op_threads);
+        const char* spinning = m_options.allow_spinning ? "1" : "0";
+        session_options.AddConfigEntry("session.intra_op.allow_spinning", spinning);
+        session_options.AddConfigEntry("session.inter_op.allow_spinning", spinning);
+    }
+
+    try {
+        m_session = std::make_unique<Ort::Session>(environment.env, m_filename.c_str(), session_options);
+    }
+    catch (const Ort::Exception& e) {
+        throw std::runtime_error("OnnxModel: Unable to load '" + m_filename + "': " + e.what());
+    }
+
+    Ort::AllocatorWithDefaultOptions allocator;
+    for (size_t i=0; i<m_session->GetInputCount(); ++i) {
+        m_input_names.emplace_back(m_session->GetInputNameAllocated(i, allocator).get());
+        Ort::TypeInfo type_info = m_session->GetInputTypeInfo(i);
+        auto tensor_info = type_info.GetTensorTypeAndShapeInfo();
+        m_input_graph_shapes.push_back(tensor_info.GetShape());
+        m_input_types.push_back(tensor_info.GetElementType());
+    }
+    for (size_t i=0; i<m_session->GetOutputCount(); ++i) {
+        m_output_names.emplace_back(m_session->GetOutputNameAllocated(i, allocator).get());
+        Ort::TypeInfo type_info = m_session->GetOutputTypeInfo(i);
+        auto tensor_info = type_info.GetTensorTypeAndShapeInfo();
+        m_output_graph_shapes.push_back(tensor_info.GetShape());
+        m_output_types.push_back(tensor_info.GetElementType());
+    }
+    m_memory_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+    m_run_options = Ort::RunOptions();
+    m_binding = std::make_unique<Ort::IoBinding>(*m_session);
+    std::cerr << "PHASM: Loaded ONNX model '" << m_filename << "' (" << m_input_names.size() << " inputs, "
+              << m_output_names.size() << " outputs)" << std::endl;
+}
+
+
+void OnnxModel::initialize() {
+    for (const auto& model_var : m_model_vars) {
+        if (model_var->isRagged()) {
+            throw std::runtime_error("OnnxModel: Ragged model variable '" + model_var->name + "' isn't supported");
+        }
+    }
+    std::ifstream normalization_file(m_filename + ".norm");
+    if (normalization_file.good()) {
+        load_normalizations(normalization_file);
+        std::cerr << "PHASM: Loaded normalizations from '" << m_filename << ".norm'" << std::endl;
+    }
+
+    for (const auto& input : m_inputs) {
+        int64_t length = 1;
+        for (int64_t dim : input->shape()) length *= dim;
+        m_input_dim += length;
+        m_input_tensors.push_back(&input->inference_input);
+        m_input_normalizations.push_back(&input->normalization);
+    }
+    for (const auto& output : m_outputs) {
+        std::vector<int64_t> shape = output->shape();
+        int64_t length = 1;
+        for (int64_t dim : shape) length *= dim;
+        m_output_shapes.push_back(shape);
+        m_output_lengths.push_back(length);
+        m_output_dim += length;
+    }
+
+    size_t expected_inputs = m_combine_tensors ? 1 : m_inputs.size();
+    size_t expected_outputs = m_combine_tensors ? 1 : m_outputs.size();
+    if (m_input_names.size() != expected_inputs || m_output_names.size() != expected_outputs) {
+        throw std::runtime_error("OnnxModel: '" + m_filename + "' has " + std::to_string(m_input_names.size()) +
+                                 " inputs and " + std::to_string(m_output_names.size()) + " outputs, but " +
+                                 std::to_string(expected_inputs) + " and " + std::to_string(expected_outputs) +
+                                 " are needed" + (m_combine_tensors ? " with tensor combining" : ""));
+    }
+    m_input_values.clear();
+    m_output_values.clear();
+    for (size_t i=0; i<expected_inputs; ++i) m_input_values.emplace_back(nullptr);
+    for (size_t i=0; i<expected_outputs; ++i) m_output_values.emplace_back(nullptr);
+    m_bound_inputs.assign(expected_inputs, nullptr);
+    m_bound_outputs.assign(expected_outputs, nullptr);
+    m_input_bound_shapes.resize(expected_inputs);
+    m_output_bound_shapes.resize(expected_outputs);
+
+    if (m_combine_tensors) {
+        if (m_input_types[0] != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || m_output_types[0] != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+            throw std::runtime_error("OnnxModel: With tensor combining, '" + m_filename + "' needs a float input and output");
+        }
+        for (size_t i=0; i<m_outputs.size(); ++i) {
+            m_outputs[i]->inference_output = tensor(DType::F32, m_output_shapes[i]);
+        }
+        m_input_buffer = tensor(DType::F32, {m_input_dim});
+        bind_input(0, m_input_buffer);
+        // Denormalizing needs a pass over the output anyway, so only skip the buffer if there's nothing to do
+        m_write_output_directly = (m_outputs.size() == 1 && !m_outputs[0]->normalization.is_enabled());
+        if (m_write_output_directly) {
+            bind_output(0, m_outputs[0]->inference_output);
+        }
+        else {
+            m_output_buffer = tensor(DType::F32, {m_output_dim});
+            bind_output(0, m_output_buffer);
+        }
+    }
+    else {
+        for (size_t i=0; i<m_inputs.size(); ++i) {
+            if (m_inputs[i]->normalization.is_enabled()) {
+                throw std::runtime_error("OnnxModel: Normalizing '" + m_inputs[i]->name + "' requires tensor combining");
+            }
+            DType dtype = to_dtype(m_input_types[i]);
+            if (dtype == DType::Undefined) {
+                throw std::runtime_error("OnnxModel: Graph input '" + m_input_names[i] + "' has an unsupported element type");
+            }
+            // A placeholder until the first call, so that the binding is complete for warming up
+            m_inputs[i]->inference_input = tensor(dtype, m_inputs[i]->shape());
+            bind_input(i, m_inputs[i]->inference_input);
+        }
+        for (size_t i=0; i<m_outputs.size(); ++i) {
+            if (m_outputs[i]->normalization.is_enabled()) {
+                throw std::runtime_error("OnnxModel: Normalizing '" + m_outputs[i]->name + "' requires tensor combining");
+            }
+            DType dtype = to_dtype(m_output_types[i]);
+            if (dtype == DType::Undefined) {
+                throw std::runtime_error("OnnxModel: Graph output '" + m_output_names[i] + "' has an unsupported element type");
+            }
+            m_outputs[i]->inference_output = tensor(dtype, m_output_shapes[i]);
+            bind_output(i, m_outputs[i]->inference_output);
+        }
+    }
+
+    for (size_t i=0; i<m_options.warmup_iterations; ++i) {
+        m_session->Run(m_run_options, *m_binding);
+    }
+}
+
+
+void OnnxModel::bind_input(size_t index, tensor& t) {
+    if (t.get_dtype() != to_dtype(m_input_types[index])) {
+        throw std::runtime_error("OnnxModel: The tensor for graph input '" + m_input_names[index] +
+                                 "' doesn't have the dtype the graph expects");
+    }
+    m_input_bound_shapes[index] = resolve_shape(m_input_graph_shapes[index], t.get_length(), m_input_names[index]);
+    const auto& shape = m_input_bound_shapes[index];
+    m_input_values[index] = Ort::Value::CreateTensor(m_memory_info, t.get_data<void>(),
+                                                     t.get_length() * get_dtype_size(t.get_dtype()),
+                                                     shape.data(), shape.size(), m_input_types[index]);
+    m_binding->BindInput(m_input_names[index].c_str(), m_input_values[index]);
+    m_bound_inputs[index] = t.get_data<void>();
+}
+
+
+void OnnxModel::bind_output(size_t index, tensor& t) {
+    m_output_bound_shapes[index] = resolve_shape(m_output_graph_shapes[index], t.get_length(), m_output_names[index]);
+    const auto& shape = m_output_bound_shapes[index];
+    m_output_values[index] = Ort::Value::CreateTensor(m_memory_info, t.get_data<void>(),
+                                                      t.get_length() * get_dtype_size(t.get_dtype()),
+                                                      shape.data(), shape.size(), m_output_types[index]);
+    m_binding->BindOutput(m_output_names[index].c_str(), m_output_values[index]);
+    m_bound_outputs[index] = t.get_data<void>();
+}
+
+
+/// The ModelVariables' tensors get replaced behind our back: inputs on every call (though usually at the same address),
+/// and outputs whenever someone swaps them out, e.g. a PartitionedModel lending its tensors to an expert. Comparing
+/// pointers is all it takes to notice, and rebinding doesn't copy anything either.
+void OnnxModel::rebind_moved_tensors() {
+    if (m_combine_tensors) {
+        if (m_write_output_directly) {
+            tensor& output = m_outputs[0]->inference_output;
+            if (output.get_data<void>() != m_bound_outputs[0]) {
+                if (output.get_dtype() != DType::F32 || output.get_length() != static_cast<size_t>(m_output_dim)) {
+                    output = tensor(DType::F32, m_output_shapes[0]);
+                }
+                bind_output(0, output);
+            }
+        }
+        return;
+    }
+    for (size_t i=0; i<m_inputs.size(); ++i) {
+        tensor& input = m_inputs[i]->inference_input;
+        if (input.get_data<void>() != m_bound_inputs[i]) bind_input(i, input);
+    }
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        tensor& output = m_outputs[i]->inference_output;
+        if (output.get_data<void>() != m_bound_outputs[i]) {
+            DType dtype = to_dtype(m_output_types[i]);
+            if (output.get_dtype() != dtype || output.get_length() != static_cast<size_t>(m_output_lengths[i])) {
+                output = tensor(dtype, m_output_shapes[i]);
+            }
+            bind_output(i, output);
+        }
+    }
+}
+
+
+void OnnxModel::train_from_captures() {
+    std::cerr << "PHASM: phasm-onnx-plugin can't train models. Train in PyTorch and export with torch.onnx.export" << std::endl;
+}
+
+
+bool OnnxModel::infer() {
+    if (m_combine_tensors) {
+        flatten_and_join_into(m_input_tensors, m_input_normalizations, m_input_buffer.get_data<float>(), m_input_dim);
+    }
+    rebind_moved_tensors();
+    try {
+        m_session->Run(m_run_options, *m_binding);
+    }
+    catch (const Ort::Exception& e) {
+        std::cerr << "PHASM: ONNX Runtime failed to run '" << m_filename << "': " << e.what() << std::endl;
+        return false;
+    }
+    if (m_combine_tensors && !m_write_output_directly) {
+        const float* output = m_output_buffer.get_data<float>();
+        for (size_t i=0; i<m_outputs.size(); ++i) {
+            unpack_output_into(output, m_output_shapes[i], m_outputs[i]->normalization, m_outputs[i]->inference_output);
+            output += m_output_lengths[i];
+        }
+    }
+    return true;
+}
+
+
+bool OnnxModel::infer_batch(float* inputs, float* outputs, size_t batch_size) {
+    if (!m_combine_tensors) {
+        throw std::runtime_error("OnnxModel: infer_batch requires tensor combining");
+    }
+    auto batch_shape = [&](const std::vector<int64_t>& graph_shape, const std::vector<int64_t>& sample_shape,
+                           const std::string& name) {
+        if (graph_shape.size() < 2 || graph_shape[0] >= 0 || sample_shape[0] != 1) {
+            throw std::runtime_error("OnnxModel: Graph tensor '" + name + "' has shape " + shape_to_string(graph_shape) +
+                                     ", which doesn't have a dynamic leading dimension to batch along");
+        }
+        std::vector<int64_t> shape = sample_shape;
+        shape[0] = static_cast<int64_t>(batch_size);
+        return shape;
+    };
+    std::vector<int64_t> input_shape = batch_shape(m_input_graph_shapes[0], m_input_bound_shapes[0], m_input_names[0]);
+    std::vector<int64_t> output_shape = batch_shape(m_output_graph_shapes[0], m_output_bound_shapes[0], m_output_names[0]);
+
+    // A binding of its own, so that the one infer() uses stays bound to the single-sample buffers
+    Ort::IoBinding binding(*m_session);
+    Ort::Value input = Ort::Value::CreateTensor<float>(m_memory_info, inputs, batch_size * m_input_dim,
+                                                       input_shape.data(), input_shape.size());
+    Ort::Value output = Ort::Value::CreateTensor<float>(m_memory_info, outputs, batch_size * m_output_dim,
+                                                        output_shape.data(), output_shape.size());
+    binding.BindInput(m_input_names[0].c_str(), input);
+    binding.BindOutput(m_output_names[0].c_str(), output);
+    try {
+        m_session->Run(m_run_options, binding);
+    }
+    catch (const Ort::Exception& e) {
+        std::cerr << "PHASM: ONNX Runtime failed to run a batch through '" << m_filename << "': " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+} // namespace phasm
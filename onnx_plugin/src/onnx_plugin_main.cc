@@ -0,0 +1,27 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "plugin.h"
+#include "onnx_model.h"
+
+struct OnnxPlugin : public phasm::Plugin {
+
+    std::string get_name() override {
+        return "phasm-onnx-plugin";
+    }
+
+    std::shared_ptr<phasm::Model> make_model(std::string file_name) override {
+        if (file_name.empty()) {
+            throw std::runtime_error("phasm-onnx-plugin needs the filename of an .onnx model");
+        }
+        return std::make_shared<phasm::OnnxModel>(file_name, phasm::OnnxOptions::from_env());
+    }
+};
+
+OnnxPlugin g_onnx_plugin;
+
+extern "C" {
+    phasm::Plugin* get_plugin() {
+        return &g_onnx_plugin;
+    };
+}
@@ -0,0 +1,215 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#define CATCH_CONFIG_MAIN
+#include <catch.hpp>
+#include <random>
+
+#include "surrogate_builder.h"
+#include "onnx_model.h"
+#include "onnx_export.h"
+
+using namespace phasm;
+namespace phasm::test::onnx_tests {
+
+OnnxDenseLayer make_random_layer(int64_t in, int64_t out, bool relu, std::mt19937& rng) {
+    std::normal_distribution<float> dist;
+    OnnxDenseLayer layer {in, out, std::vector<float>(in*out), std::vector<float>(out), relu};
+    for (auto& x : layer.weights) x = dist(rng);
+    for (auto& x : layer.biases) x = dist(rng);
+    return layer;
+}
+
+std::vector<OnnxDenseLayer> make_random_network(const std::vector<int64_t>& dims, std::mt19937& rng) {
+    std::vector<OnnxDenseLayer> layers;
+    for (size_t l=0; l+1<dims.size(); ++l) {
+        layers.push_back(make_random_layer(dims[l], dims[l+1], l+2 < dims.size(), rng));
+    }
+    return layers;
+}
+
+std::vector<float> reference_forward(const std::vector<OnnxDenseLayer>& layers, std::vector<float> x) {
+    for (const auto& layer : layers) {
+        std::vector<float> y(layer.out_features);
+        for (int64_t o=0; o<layer.out_features; ++o) {
+            double acc = layer.biases[o];
+            for (int64_t i=0; i<layer.in_features; ++i) {
+                acc += double(layer.weights[o*layer.in_features + i]) * x[i];
+            }
+            y[o] = layer.relu ? std::max(acc, 0.0) : acc;
+        }
+        x = std::move(y);
+    }
+    return x;
+}
+
+TEST_CASE("OnnxModel serves a Surrogate with combined tensors") {
+    std::mt19937 rng(7);
+    auto layers = make_random_network({3, 16, 16, 3}, rng);
+    write_onnx_mlp("onnx_tests_field_map.onnx", layers);
+
+    double x, y, z, bx, by, bz;
+    auto s = SurrogateBuilder()
+            .set_model(std::make_shared<OnnxModel>("onnx_tests_field_map.onnx"), true)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::IN)
+            .local_primitive<double>("z", Direction::IN)
+            .local_primitive<double>("Bx", Direction::OUT)
+            .local_primitive<double>("By", Direction::OUT)
+            .local_primitive<double>("Bz", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x, &y, &z, &bx, &by, &bz);
+
+    std::uniform_real_distribution<double> dist(-1, 1);
+    for (int trial=0; trial<5; ++trial) {
+        x = dist(rng); y = dist(rng); z = dist(rng);
+        s.call();
+        auto expected = reference_forward(layers, {float(x), float(y), float(z)});
+        REQUIRE(bx == Approx(expected[0]).margin(1e-4));
+        REQUIRE(by == Approx(expected[1]).margin(1e-4));
+        REQUIRE(bz == Approx(expected[2]).margin(1e-4));
+    }
+}
+
+TEST_CASE("A single output is written in place, without being copied or reallocated") {
+    std::mt19937 rng(8);
+    auto layers = make_random_network({5, 8, 4}, rng);
+    write_onnx_mlp("onnx_tests_single_output.onnx", layers);
+
+    auto model = std::make_shared<OnnxModel>("onnx_tests_single_output.onnx");
+    double x[5];
+    float y[4];
+    auto s = SurrogateBuilder()
+            .set_model(model, true)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN, {5})
+            .local_primitive<float>("y", Direction::OUT, {4})
+            .finish();
+    s.bind_all_callsite_vars(x, y);
+
+    std::normal_distribution<double> dist;
+    const void* output_buffer = nullptr;
+    for (int trial=0; trial<3; ++trial) {
+        for (double& v : x) v = dist(rng);
+        s.call();
+        auto expected = reference_forward(layers, std::vector<float>(x, x+5));
+        for (int i=0; i<4; ++i) {
+            REQUIRE(y[i] == Approx(expected[i]).margin(1e-4));
+        }
+        const void* current = model->get_model_var(1)->inference_output.get_data<void>();
+        if (trial > 0) REQUIRE(current == output_buffer);
+        output_buffer = current;
+    }
+}
+
+TEST_CASE("infer_batch runs whole batches") {
+    std::mt19937 rng(9);
+    auto layers = make_random_network({3, 16, 3}, rng);
+    write_onnx_mlp("onnx_tests_batch.onnx", layers);
+
+    auto model = std::make_shared<OnnxModel>("onnx_tests_batch.onnx");
+    auto s = SurrogateBuilder()
+            .set_model(model, true)
+            .local_primitive<double>("x", Direction::IN, {3})
+            .local_primitive<double>("y", Direction::OUT, {3})
+            .finish();
+    REQUIRE(model->get_input_dim() == 3);
+    REQUIRE(model->get_output_dim() == 3);
+
+    size_t batch_size = 37;
+    std::normal_distribution<float> dist;
+    std::vector<float> inputs(batch_size * 3), outputs(batch_size * 3);
+    for (auto& v : inputs) v = dist(rng);
+    REQUIRE(model->infer_batch(inputs.data(), outputs.data(), batch_size));
+    for (size_t b=0; b<batch_size; ++b) {
+        auto expected = reference_forward(layers, std::vector<float>(&inputs[3*b], &inputs[3*b+3]));
+        for (int i=0; i<3; ++i) {
+            REQUIRE(outputs[3*b+i] == Approx(expected[i]).margin(1e-4));
+        }
+    }
+}
+
+TEST_CASE("Without tensor combining, the ModelVariables' own tensors are bound") {
+    std::mt19937 rng(10);
+    auto layers = make_random_network({3, 8, 2}, rng);
+    write_onnx_mlp("onnx_tests_uncombined.onnx", layers);
+
+    auto model = std::make_shared<OnnxModel>("onnx_tests_uncombined.onnx");
+    float x[3], y[2];
+    auto s = SurrogateBuilder()
+            .set_model(model, false)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<float>("x", Direction::IN, {3})
+            .local_primitive<float>("y", Direction::OUT, {2})
+            .finish();
+    s.bind_all_callsite_vars(x, y);
+
+    std::normal_distribution<float> dist;
+    for (int trial=0; trial<3; ++trial) {
+        for (float& v : x) v = dist(rng);
+        s.call();
+        auto expected = reference_forward(layers, std::vector<float>(x, x+3));
+        REQUIRE(y[0] == Approx(expected[0]).margin(1e-4));
+        REQUIRE(y[1] == Approx(expected[1]).margin(1e-4));
+    }
+
+    // Swapping out the output tensor, like a PartitionedModel does, makes the model rebind it
+    tensor replacement(DType::F32, {2});
+    const void* replacement_data = replacement.get_data<void>();
+    model->get_model_var(1)->inference_output = std::move(replacement);
+    REQUIRE(model->infer());
+    REQUIRE(model->get_model_var(1)->inference_output.get_data<void>() == replacement_data);
+    auto expected = reference_forward(layers, std::vector<float>(x, x+3));
+    REQUIRE(model->get_model_var(1)->inference_output.get_data<float>()[0] == Approx(expected[0]).margin(1e-4));
+}
+
+TEST_CASE("Session options don't change the results") {
+    std::mt19937 rng(11);
+    auto layers = make_random_network({4, 32, 32, 2}, rng);
+    write_onnx_mlp("onnx_tests_options.onnx", layers);
+    std::vector<float> inputs = {0.5f, -1.0f, 2.0f, 0.25f};
+    auto expected = reference_forward(layers, inputs);
+
+    std::vector<OnnxOptions> all_options(4);
+    all_options[0].optimization_level = OnnxOptimizationLevel::Disabled;
+    all_options[1].optimization_level = OnnxOptimizationLevel::Basic;
+    all_options[1].intra_op_threads = 1;
+    all_options[1].inter_op_threads = 1;
+    all_options[2].optimization_level = OnnxOptimizationLevel::Extended;
+    all_options[2].allow_spinning = false;
+    all_options[2].warmup_iterations = 3;
+    all_options[3].parallel_execution = true;
+    all_options[3].optimized_model_path = "onnx_tests_options.optimized.onnx";
+
+    for (const auto& options : all_options) {
+        auto model = std::make_shared<OnnxModel>("onnx_tests_options.onnx", options);
+        auto s = SurrogateBuilder()
+                .set_model(model, true)
+                .local_primitive<float>("x", Direction::IN, {4})
+                .local_primitive<float>("y", Direction::OUT, {2})
+                .finish();
+        std::vector<float> outputs(2);
+        REQUIRE(model->infer_batch(inputs.data(), outputs.data(), 1));
+        REQUIRE(outputs[0] == Approx(expected[0]).margin(1e-4));
+        REQUIRE(outputs[1] == Approx(expected[1]).margin(1e-4));
+    }
+}
+
+TEST_CASE("Model variables that don't fit the graph are rejected") {
+    std::mt19937 rng(12);
+    write_onnx_mlp("onnx_tests_mismatch.onnx", make_random_network({3, 4, 3}, rng));
+    auto build = [](int64_t input_length) {
+        return SurrogateBuilder()
+                .set_model(std::make_shared<OnnxModel>("onnx_tests_mismatch.onnx"), true)
+                .local_primitive<double>("x", Direction::IN, {input_length})
+                .local_primitive<double>("y", Direction::OUT, {3})
+                .finish();
+    };
+    REQUIRE_NOTHROW(build(3));
+    REQUIRE_THROWS(build(2));
+    REQUIRE_THROWS(std::make_shared<OnnxModel>("onnx_tests_does_not_exist.onnx"));
+    REQUIRE_THROWS(write_onnx_mlp("onnx_tests_bad.onnx", {make_random_layer(3, 4, true, rng), make_random_layer(5, 3, false, rng)}));
+}
+
+} // namespace phasm::test::onnx_tests
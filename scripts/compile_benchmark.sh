@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Measures how long each of the given targets takes to compile from scratch, and appends the results
+# to compile_times.csv in the build directory. This is meant to be invoked via the `phasm-compile-benchmark`
+# target, which has already built everything once, so that only the target's own sources get recompiled.
+#
+# Usage: compile_benchmark.sh <build_dir> <use_pch> <target>...
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 <build_dir> <use_pch> <target>..."
+    exit 1
+fi
+
+BUILD_DIR=$(realpath $1)
+USE_PCH=$2
+shift 2
+
+PHASM_SOURCE=$(realpath $(dirname $0)/..)
+GIT_REV=$(git -C $PHASM_SOURCE rev-parse --short HEAD 2>/dev/null || echo "unknown")
+TIMESTAMP=$(date +%Y-%m-%dT%H:%M:%S)
+RESULTS=$BUILD_DIR/compile_times.csv
+
+if [ ! -f $RESULTS ]; then
+    echo "timestamp,git_rev,use_pch,target,seconds" > $RESULTS
+fi
+
+for TARGET in "$@"; do
+    # Throw away this target's object files (but not those of its dependencies) so that it recompiles from scratch
+    OBJECT_DIR=$(find $BUILD_DIR -type d -name "$TARGET.dir" | head -n 1)
+    if [ -z "$OBJECT_DIR" ]; then
+        echo "PHASM: Skipping '$TARGET' because its object directory couldn't be found"
+        continue
+    fi
+    find $OBJECT_DIR -name "*.o" -delete
+
+    START=$(date +%s.%N)
+    cmake --build $BUILD_DIR --target $TARGET > /dev/null || exit 1
+    END=$(date +%s.%N)
+
+    SECONDS_ELAPSED=$(awk "BEGIN { printf \"%.2f\", $END - $START }")
+    echo "PHASM: Compiled '$TARGET' in $SECONDS_ELAPSED seconds"
+    echo "$TIMESTAMP,$GIT_REV,$USE_PCH,$TARGET,$SECONDS_ELAPSED" >> $RESULTS
+done
+
+echo "PHASM: Appended results to $RESULTS"
@@ -0,0 +1,83 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_BOUNDED_QUEUE_H
+#define SURROGATE_TOOLKIT_BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace phasm {
+
+/// A fixed-capacity multi-producer, multi-consumer queue for handing captures from the host program to a
+/// background thread (e.g. for online training). Producers never block: if the consumer falls behind, new items
+/// are dropped and counted, because slowing down the host program is worse than training on fewer samples.
+template <typename T>
+class BoundedQueue {
+    std::deque<T> m_items;
+    size_t m_capacity;
+    bool m_closed = false;
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::atomic<size_t> m_dropped {0};
+
+public:
+    explicit BoundedQueue(size_t capacity) : m_capacity(capacity) {}
+
+    /// Returns false (and drops the item) if the queue is full or closed
+    bool try_push(T&& item) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_closed || m_items.size() >= m_capacity) {
+                m_dropped++;
+                return false;
+            }
+            m_items.push_back(std::move(item));
+        }
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    /// Waits up to timeout for an item. Returns false if none arrived, or if the queue was closed and drained.
+    template <typename Rep, typename Period>
+    bool pop_for(T& item, std::chrono::duration<Rep, Period> timeout) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_not_empty.wait_for(lock, timeout, [this]{ return !m_items.empty() || m_closed; })) {
+            return false;
+        }
+        if (m_items.empty()) return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        return true;
+    }
+
+    /// Wakes up all waiting consumers and rejects all further items
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_not_empty.notify_all();
+    }
+
+    bool is_closed() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_closed;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_items.size();
+    }
+
+    size_t get_capacity() const { return m_capacity; }
+    size_t get_dropped_count() const { return m_dropped; }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_BOUNDED_QUEUE_H
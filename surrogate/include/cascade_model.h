@@ -0,0 +1,110 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_CASCADE_MODEL_H
+#define SURROGATE_TOOLKIT_CASCADE_MODEL_H
+
+#include "model.h"
+#include <atomic>
+#include <chrono>
+
+namespace phasm {
+
+/// Counts durations in power-of-two buckets of nanoseconds: bucket i holds [2^i, 2^(i+1)) ns, with everything under
+/// 2 ns in bucket 0 and everything over ~2 s in the last one. Recording is lock-free and safe from any thread.
+class LatencyHistogram {
+public:
+    static constexpr size_t BUCKET_COUNT = 32;
+
+private:
+    std::atomic<uint64_t> m_counts[BUCKET_COUNT] = {};
+    std::atomic<uint64_t> m_total_ns {0};
+
+public:
+    void record(std::chrono::nanoseconds duration);
+
+    uint64_t get_count() const;
+    uint64_t get_bucket_count(size_t bucket) const { return m_counts[bucket].load(std::memory_order_relaxed); }
+    std::chrono::nanoseconds get_mean() const;
+
+    /// Upper bound of the bucket containing the q-th quantile, e.g. q=0.99 for the 99th percentile. Zero if empty.
+    std::chrono::nanoseconds get_quantile(double q) const;
+
+    void clear();
+};
+
+
+/// Per-stage counters. Every attempt ends up as exactly one of accepted, rejected (infer() succeeded, but with too
+/// little confidence), or failed (infer() returned false).
+struct CascadeStageStats {
+    std::string name;
+    float min_confidence = 0;
+    uint64_t attempts = 0;
+    uint64_t accepted = 0;
+    uint64_t rejected = 0;
+    uint64_t failed = 0;
+    const LatencyHistogram* latency = nullptr; ///< Of infer() itself, whatever its outcome
+};
+
+
+/// Trades accuracy for latency per call: tries a list of Models in order, cheapest first, and uses the outputs of the
+/// first one that succeeds with at least its stage's minimum confidence (see Model::infer_with_confidence). If no
+/// stage accepts, infer() returns false, and the Surrogate falls back to the original function, which acts as the
+/// implicit last stage. For example:
+///
+///     auto cascade = std::make_shared<CascadeModel>();
+///     cascade->add_stage(std::make_shared<InterpolationModel>("table.grid"), 1.0f, "table")
+///             .add_stage(std::make_shared<KnnModel>("captures.knn"), 0.5f, "knn");
+///     SurrogateBuilder().set_model(cascade) ...
+///
+/// Each stage has its own copies of the cascade's ModelVariables, so that it can load its own normalizations, and
+/// borrows the cascade's tensors around every call. All stages train on the cascade's captures, in order. During
+/// online training, each stage gets its own copy of every new capture.
+class CascadeModel : public Model {
+    struct Stage {
+        std::shared_ptr<Model> model;
+        float min_confidence;
+        std::string name;
+        std::atomic<uint64_t> accepted {0};
+        std::atomic<uint64_t> rejected {0};
+        std::atomic<uint64_t> failed {0};
+        LatencyHistogram latency;
+    };
+    std::vector<std::unique_ptr<Stage>> m_stages;
+    std::atomic<uint64_t> m_fallthroughs {0};
+
+public:
+    CascadeModel() = default;
+
+    /// Stages have to be added before the cascade is handed to a SurrogateBuilder. `name` defaults to "stage<i>".
+    CascadeModel& add_stage(std::shared_ptr<Model> model, float min_confidence = 0, std::string name = "");
+
+    void initialize() override;
+
+    void train_from_captures() override;
+
+    bool infer() override;
+
+    /// Reports the confidence of whichever stage accepted
+    bool infer_with_confidence(float& confidence) override;
+
+    void train_online() override;
+
+    /// True once any stage has converged, since the original function still backs up whatever that stage rejects
+    bool is_online_training_converged() override;
+
+    size_t get_stage_count() const { return m_stages.size(); }
+    std::shared_ptr<Model> get_stage(size_t index) const { return m_stages.at(index)->model; }
+    CascadeStageStats get_stats(size_t index) const;
+
+    /// Calls that no stage accepted, i.e. which went to the original function
+    uint64_t get_fallthrough_count() const { return m_fallthroughs.load(std::memory_order_relaxed); }
+
+    void clear_stats();
+    void print_stats(std::ostream& os) const;
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_CASCADE_MODEL_H
@@ -0,0 +1,51 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#ifndef SURROGATE_TOOLKIT_DTYPE_CONVERSION_H
+#define SURROGATE_TOOLKIT_DTYPE_CONVERSION_H
+
+#include "tensor.hpp"
+
+namespace phasm {
+
+/// These are the kernels we use to convert buffers of primitives from one DType to another, e.g. when TensorIso
+/// turns the user's doubles into the floats the model wants. The common conversions (F64<->F32, I32<->F32, UI8->F32)
+/// are vectorized using SSE4.1, AVX2, or AVX-512, whichever the CPU supports. This is detected once at runtime, so
+/// that the same binary runs on any x86-64 machine. Everything else (and everything on non-x86 CPUs) falls back to
+/// a plain scalar loop, which the compiler may or may not autovectorize.
+
+/// AVX2 implies FMA: kernels compiled for it may use fused multiply-adds, and CPUs without FMA get SSE4 instead
+enum class SimdLevel { Scalar, SSE4, AVX2, AVX512 };
+
+/// Returns the SIMD level the conversion kernels are currently using
+SimdLevel get_simd_level();
+
+/// Returns the best SIMD level the current CPU supports
+SimdLevel get_max_simd_level();
+
+/// Overrides the SIMD level, e.g. for testing or benchmarking. Levels the CPU doesn't support are clamped.
+void set_simd_level(SimdLevel level);
+
+size_t get_dtype_size(DType dtype);
+
+/// Converts `length` elements of type `source_dtype` into elements of type `dest_dtype`. Conversions follow the
+/// usual C++ rules, e.g. floats are truncated towards zero when converting to integers.
+void convert(const void* source, DType source_dtype, void* dest, DType dest_dtype, size_t length);
+
+/// Converts `length` elements of type `source_dtype` into floats, multiplying each by `scale`.
+/// For instance, converting UI8 pixels into the range [0,1] uses scale=1/255.
+void convert_scaled(const void* source, DType source_dtype, float* dest, size_t length, float scale);
+
+/// Converts `length` elements of type `source_dtype` into floats, computing x*scale + offset in the same pass.
+void convert_affine(const void* source, DType source_dtype, float* dest, size_t length, float scale, float offset);
+
+/// Converts `length` elements of type `source_dtype` into floats, computing (x - center) * scale in double precision.
+/// Unlike convert_affine(), a center much larger than the spread of x (e.g. the mean of 1e9+1, 1e9+2, 1e9+3) cancels
+/// exactly before anything is rounded to float. This is what applies a ModelVariable's Normalization while packing
+/// it into the model's input buffer.
+void convert_centered(const void* source, DType source_dtype, float* dest, size_t length, double center, double scale);
+
+} // namespace phasm
+
+#endif //SURROGATE_TOOLKIT_DTYPE_CONVERSION_H
@@ -0,0 +1,62 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_INTERPOLATION_MODEL_H
+#define SURROGATE_TOOLKIT_INTERPOLATION_MODEL_H
+
+#include "model.h"
+#include "interpolation_table.h"
+
+namespace phasm {
+
+/// Replaces a slow function of a few inputs with a lookup into an InterpolationTable, so that every call costs the
+/// same small, constant amount. infer() returns false for inputs outside the grid, rather than extrapolating.
+///
+/// train_from_captures() fills the grid given by `axes` from the captures and saves the table to `filename`; later
+/// runs mmap it from there in initialize(). The captures ideally come from Surrogate::capture_grid, in which case
+/// every grid point is captured exactly. Otherwise, each grid point is estimated from the nearest captures (see
+/// KnnIndex). Every tenth capture that doesn't lie on a grid point is held out from the table, and used for the error
+/// report printed afterwards, so capturing some extra points in between the grid points gives an honest estimate.
+///
+/// All inputs are combined into one point and all outputs into one vector, like FeedForwardModel. There has to be
+/// one GridAxis per input element.
+class InterpolationModel : public Model {
+    std::string m_filename;
+    std::vector<GridAxis> m_axes;
+    Interpolation m_interpolation;
+    InterpolationTable m_table;
+    InterpolationReport m_report;
+
+    size_t m_input_dim = 0;
+    size_t m_output_dim = 0;
+    std::vector<const tensor*> m_input_tensors;
+    std::vector<std::vector<int64_t>> m_output_shapes;
+    std::vector<int64_t> m_output_lengths;
+
+public:
+    /// Loads the table from `filename`; the grid and interpolation are whatever it was saved with
+    explicit InterpolationModel(std::string filename);
+
+    /// Builds the table on the given grid if `filename` doesn't exist yet
+    InterpolationModel(std::string filename, std::vector<GridAxis> axes, Interpolation interpolation = Interpolation::Linear);
+
+    void initialize() override;
+
+    void train_from_captures() override;
+
+    bool infer() override;
+
+    /// Many queries at once, [rows][input_dim] -> [rows][output_dim], bypassing the ModelVariables. Inputs outside the
+    /// grid are clamped rather than rejected.
+    void infer_batch(const float* x, float* y, size_t rows) const { m_table.interpolate(x, y, rows); }
+
+    const InterpolationTable& get_table() const { return m_table; }
+
+    /// Error against the held-out captures, from the last call to train_from_captures()
+    const InterpolationReport& get_report() const { return m_report; }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_INTERPOLATION_MODEL_H
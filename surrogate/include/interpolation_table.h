@@ -0,0 +1,123 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_INTERPOLATION_TABLE_H
+#define SURROGATE_TOOLKIT_INTERPOLATION_TABLE_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace phasm {
+
+class MappedFile;
+
+/// One input dimension of a regular grid: `count` evenly spaced points from `lower` to `upper`, inclusive
+struct GridAxis {
+    float lower = 0;
+    float upper = 1;
+    uint32_t count = 2;
+
+    float get_spacing() const { return (upper - lower) / float(count - 1); }
+    float get_point(uint32_t i) const { return lower + i * get_spacing(); }
+};
+
+enum class Interpolation : uint32_t {
+    Linear = 0, ///< Multilinear over the 2^N surrounding grid points
+    Cubic = 1   ///< Catmull-Rom over the 4^N surrounding grid points; C1-continuous, and exact for quadratics
+};
+
+/// How well a table reproduces held-out captures
+struct InterpolationReport {
+    size_t samples = 0;
+    std::vector<double> rms_error;     ///< Per output
+    std::vector<double> max_abs_error; ///< Per output
+};
+
+std::ostream& operator<<(std::ostream& os, const InterpolationReport& report);
+
+
+/// Tabulated values of a function on an N-D regular grid, interpolated in between. This is the generic version of
+/// what e.g. DMagneticFieldMapFineMesh does by hand: the function is evaluated once per grid point up front, and
+/// every query after that costs the same, no matter how expensive the original function was.
+///
+/// Values are stored SoA: one contiguous array per output, each starting on a 64-byte boundary, with grid points in
+/// row-major order (the last axis varies fastest). Batched queries are vectorized across rows with AVX2 gathers.
+/// Queries outside the grid are clamped to its boundary.
+///
+/// The on-disk format is the in-memory format, so that load() can mmap it:
+///
+///     char[8]  magic "PHASMGRD"
+///     uint32   version (1)
+///     uint32   input_dim
+///     uint32   output_dim
+///     uint32   interpolation (see Interpolation)
+///     per axis: float32 lower, float32 upper, uint32 count, uint32 (unused)
+///     zero padding up to the next multiple of 64 bytes
+///     per output: float32 values[stride]    where stride = point count rounded up to a multiple of 16
+///
+/// Everything is little-endian.
+class InterpolationTable {
+    std::vector<GridAxis> m_axes;
+    std::vector<uint32_t> m_strides; // Per axis, in grid points
+    size_t m_point_count = 0;
+    size_t m_value_stride = 0;       // Per output, in floats
+    uint32_t m_output_dim = 0;
+    Interpolation m_interpolation = Interpolation::Linear;
+
+    const float* m_values = nullptr; // Points into either m_storage or m_mapping
+    std::shared_ptr<float> m_storage;
+    std::shared_ptr<MappedFile> m_mapping;
+
+    void init_layout();
+
+public:
+    static constexpr size_t MAX_NEIGHBORS = 4096; // Grid points per query, i.e. 2^N or 4^N
+
+    InterpolationTable() = default;
+
+    /// Creates a table filled with zeros. Throws if the grid is degenerate, or needs too many points per query.
+    InterpolationTable(std::vector<GridAxis> axes, size_t output_dim, Interpolation interpolation = Interpolation::Linear);
+
+    /// Evaluates `f(x, y)` at every grid point, spread over `threads` threads (0 = one per hardware thread).
+    /// `f` has to be safe to call concurrently.
+    void fill(const std::function<void(const float* x, float* y)>& f, size_t threads = 0);
+
+    /// Throws std::runtime_error if the file is missing, truncated, or not a table
+    static InterpolationTable load(const std::string& filename);
+    void save(const std::string& filename) const;
+
+    /// Evaluates `rows` queries, [rows][input_dim] -> [rows][output_dim]. Thread safe.
+    void interpolate(const float* x, float* y, size_t rows = 1) const;
+
+    /// Returns true if `x` lies inside the grid (up to rounding), i.e. interpolate() won't have to clamp it
+    bool contains(const float* x) const;
+
+    /// Compares interpolated values against known ones, e.g. held-out captures
+    InterpolationReport evaluate(const float* x, const float* y, size_t rows) const;
+
+    const std::vector<GridAxis>& get_axes() const { return m_axes; }
+    size_t get_input_dim() const { return m_axes.size(); }
+    size_t get_output_dim() const { return m_output_dim; }
+    size_t get_point_count() const { return m_point_count; }
+    Interpolation get_interpolation() const { return m_interpolation; }
+    void set_interpolation(Interpolation interpolation);
+    bool is_mapped() const { return m_mapping != nullptr; }
+
+    /// Row-major coordinates of grid point `index`, written to `x` ([input_dim])
+    void get_point(size_t index, float* x) const;
+
+    /// The tabulated value of `output` at grid point `index`
+    float get_value(size_t output, size_t index) const { return m_values[output * m_value_stride + index]; }
+
+    /// Overwrites one tabulated value. Throws if the table is mmapped, since those are read-only.
+    void set_value(size_t output, size_t index, float value);
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_INTERPOLATION_TABLE_H
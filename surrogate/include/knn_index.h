@@ -0,0 +1,100 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_KNN_INDEX_H
+#define SURROGATE_TOOLKIT_KNN_INDEX_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace phasm {
+
+class MappedFile;
+
+/// A k-d tree over a fixed set of points, each carrying a vector of outputs. Used by KnnModel.
+///
+/// Inputs are standardized per dimension (using the mean and standard deviation of the points the index was built
+/// from) before anything else happens, so distances are measured in standard deviations and no single input dominates
+/// just because of its units.
+///
+/// The tree is complete and implicit: node i has children 2i+1 and 2i+2, every leaf sits at the same depth, and every
+/// split is at the median, so each node's range of points follows from its position alone. A node is then only a
+/// split value and a dimension (8 bytes), the top of the tree stays in cache, and the points of each leaf are stored
+/// next to each other. Construction splits the work by subtree across threads.
+///
+/// The on-disk format is just these arrays, so load() can mmap a saved index and start answering queries right away:
+///
+///     char[8]  magic "PHASMKNN"
+///     uint32   version (1)
+///     uint32   input_dim
+///     uint32   output_dim
+///     uint32   depth
+///     uint64   point_count
+///     float32  scale[input_dim], offset[input_dim]
+///     Node     nodes[2^depth - 1]
+///     float32  points[point_count][input_dim]     (standardized, in leaf order)
+///     float32  outputs[point_count][output_dim]
+///
+/// Everything is little-endian.
+class KnnIndex {
+public:
+    struct Node {
+        float split;
+        uint32_t dim;
+    };
+
+private:
+    uint32_t m_input_dim = 0;
+    uint32_t m_output_dim = 0;
+    uint32_t m_depth = 0;
+    uint64_t m_point_count = 0;
+
+    // Either point into m_storage (after build) or into m_mapping (after load)
+    const float* m_scale = nullptr;
+    const float* m_offset = nullptr;
+    const Node* m_nodes = nullptr;
+    const float* m_points = nullptr;
+    const float* m_outputs = nullptr;
+
+    std::vector<char> m_storage;
+    std::shared_ptr<MappedFile> m_mapping;
+
+    void set_pointers(const char* base);
+    void search(uint32_t node, uint32_t level, size_t begin, size_t end, const float* query,
+                size_t k, size_t& found, uint32_t* indices, float* distances) const;
+
+public:
+    KnnIndex() = default;
+    KnnIndex(KnnIndex&&) = default;
+    KnnIndex& operator=(KnnIndex&&) = default;
+    KnnIndex(const KnnIndex&) = delete;
+    KnnIndex& operator=(const KnnIndex&) = delete;
+
+    /// Builds an index over `count` rows of `inputs` ([count][input_dim]) and `outputs` ([count][output_dim]).
+    /// Leaves hold at most about `leaf_size` points. `threads` = 0 means one per hardware thread.
+    static KnnIndex build(const float* inputs, const float* outputs, size_t count, size_t input_dim, size_t output_dim,
+                          size_t leaf_size = 8, size_t threads = 0);
+
+    /// Maps a file written by save(). Throws std::runtime_error if it is missing, truncated, or not an index.
+    static KnnIndex load(const std::string& filename);
+    void save(const std::string& filename) const;
+
+    size_t get_input_dim() const { return m_input_dim; }
+    size_t get_output_dim() const { return m_output_dim; }
+    size_t get_point_count() const { return m_point_count; }
+    bool is_mapped() const { return m_mapping != nullptr; }
+
+    /// Finds the (up to) k points nearest to `query`, which is in the original units. Writes their indices and
+    /// *squared* standardized distances, nearest first, and returns how many were found. Thread safe.
+    size_t query(const float* query, size_t k, uint32_t* indices, float* squared_distances) const;
+
+    /// Outputs of the point returned by query() as `index`
+    const float* get_output(uint32_t index) const { return m_outputs + size_t(index) * m_output_dim; }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_KNN_INDEX_H
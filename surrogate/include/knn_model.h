@@ -0,0 +1,53 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_KNN_MODEL_H
+#define SURROGATE_TOOLKIT_KNN_MODEL_H
+
+#include "model.h"
+#include "knn_index.h"
+#include <limits>
+
+namespace phasm {
+
+/// A surrogate for low-dimensional functions which doesn't need any training beyond remembering the captures.
+/// infer() finds the k captured inputs nearest to the current input and returns an inverse-distance-weighted average
+/// of their outputs (or the outputs of an exact match). If even the nearest capture is farther away than
+/// `max_distance`, measured in standard deviations of the captured inputs, infer() returns false instead of
+/// extrapolating.
+///
+/// train_from_captures() builds a KnnIndex and saves it to `filename`; on later runs, initialize() mmaps it from
+/// there. All inputs are combined into one point and all outputs into one vector, like FeedForwardModel. Ragged
+/// model variables aren't supported.
+class KnnModel : public Model {
+    std::string m_filename;
+    size_t m_k;
+    float m_max_distance;
+    KnnIndex m_index;
+
+    size_t m_input_dim = 0;
+    size_t m_output_dim = 0;
+    std::vector<const tensor*> m_input_tensors;
+    std::vector<std::vector<int64_t>> m_output_shapes;
+    std::vector<int64_t> m_output_lengths;
+
+public:
+    explicit KnnModel(std::string filename, size_t k = 4,
+                      float max_distance = std::numeric_limits<float>::infinity());
+
+    void initialize() override;
+
+    void train_from_captures() override;
+
+    bool infer() override;
+
+    /// Confidence is 1 / (1 + d), where d is the distance to the nearest capture in standard deviations
+    bool infer_with_confidence(float& confidence) override;
+
+    const KnnIndex& get_index() const { return m_index; }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_KNN_MODEL_H
@@ -0,0 +1,33 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_MAPPED_FILE_H
+#define SURROGATE_TOOLKIT_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace phasm {
+
+/// A read-only memory mapping of an entire file, for models whose on-disk format is also their in-memory format.
+/// Pages are only read when first touched, and are shared between processes mapping the same file.
+class MappedFile {
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+
+public:
+    /// Throws std::runtime_error if the file can't be opened or mapped
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_MAPPED_FILE_H
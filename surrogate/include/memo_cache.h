@@ -0,0 +1,97 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_MEMO_CACHE_H
+#define SURROGATE_TOOLKIT_MEMO_CACHE_H
+
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tensor.hpp"
+
+namespace phasm {
+
+struct ModelVariable;
+
+/// A bounded, thread-safe cache from packed inputs to outputs, used for memoizing a Model (see MemoizingModel) or
+/// the original function (see SurrogateBuilder::set_original_memoization).
+///
+/// Keys are the exact bytes of the inputs, so two inputs only share an entry if they are bitwise identical. The cache
+/// is split into shards by key hash, each with its own lock and its own share of the memory budget. Lookups only take
+/// the shard's lock in shared mode and set the entry's reference bit; eviction uses the CLOCK algorithm, which gives
+/// roughly LRU behavior without having to reorder anything on a hit.
+class MemoCache {
+public:
+    /// Approximate bookkeeping cost of one entry on top of its key and output data
+    static constexpr size_t ENTRY_OVERHEAD = 128;
+
+private:
+    struct Entry {
+        std::vector<tensor> outputs;
+        size_t bytes = 0;
+        mutable std::atomic<bool> referenced {false};
+    };
+    using Node = std::pair<const std::string, Entry>;
+
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::vector<Node*> clock;      // Ring of entries for CLOCK eviction; evicted slots become nullptr
+        std::vector<size_t> free_slots;
+        size_t hand = 0;
+        size_t bytes = 0;
+        std::atomic<uint64_t> hits {0};
+        std::atomic<uint64_t> misses {0};
+        std::atomic<uint64_t> insertions {0};
+        std::atomic<uint64_t> evictions {0};
+    };
+
+    size_t m_max_bytes;
+    size_t m_shard_max_bytes;
+    std::unique_ptr<Shard[]> m_shards;
+    size_t m_shard_count;
+
+    Shard& get_shard(const std::string& key) const;
+    void evict_one(Shard& shard);
+
+public:
+    /// `max_bytes` bounds the total size of keys, outputs, and bookkeeping. It is divided evenly between the shards.
+    explicit MemoCache(size_t max_bytes, size_t shard_count = 16);
+
+    MemoCache(const MemoCache&) = delete;
+    MemoCache& operator=(const MemoCache&) = delete;
+
+    /// On a hit, copies the cached outputs into `outputs` and returns true
+    bool lookup(const std::string& key, std::vector<tensor>& outputs) const;
+
+    /// Evicts entries until `outputs` fits. Entries larger than a whole shard are silently not cached.
+    void insert(const std::string& key, std::vector<tensor> outputs);
+
+    void clear();
+
+    uint64_t get_hit_count() const;
+    uint64_t get_miss_count() const;
+    uint64_t get_insertion_count() const;
+    uint64_t get_eviction_count() const;
+    size_t get_entry_count() const;
+    size_t get_size_bytes() const;
+    size_t get_max_bytes() const { return m_max_bytes; }
+
+    void print_stats(std::ostream& os) const;
+};
+
+
+/// Appends the dtype, length, row offsets, and raw data of `t` to `key`
+void append_memo_key(std::string& key, const tensor& t);
+
+/// Builds the cache key from the inference inputs of `vars`, skipping those which aren't inputs
+void make_memo_key(std::string& key, const std::vector<std::shared_ptr<ModelVariable>>& vars);
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_MEMO_CACHE_H
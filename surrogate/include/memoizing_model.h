@@ -0,0 +1,44 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_MEMOIZING_MODEL_H
+#define SURROGATE_TOOLKIT_MEMOIZING_MODEL_H
+
+#include "model.h"
+#include "memo_cache.h"
+
+namespace phasm {
+
+/// Wraps any other Model, remembering its outputs for the most recently used inputs, so that repeated queries skip
+/// inference entirely. Inputs are compared bitwise. The cache is cleared whenever the wrapped model is (re)trained via
+/// train_from_captures(), and whenever a model which changes while in use, e.g. through online training, reports new
+/// weights via Model::weights_changed(). Use SurrogateBuilder::set_model_memoization to wrap a Surrogate's model.
+class MemoizingModel : public Model {
+    std::shared_ptr<Model> m_inner;
+    std::shared_ptr<MemoCache> m_cache;
+    std::atomic<uint64_t> m_cached_weights_version {0}; // The wrapped model's weights version the cache is valid for
+
+public:
+    MemoizingModel(std::shared_ptr<Model> inner, size_t max_bytes);
+    MemoizingModel(std::shared_ptr<Model> inner, std::shared_ptr<MemoCache> cache);
+
+    /// Hands our ModelVariables and settings to the wrapped model before initializing it
+    void initialize() override;
+
+    void train_from_captures() override;
+
+    /// Only calls the wrapped model's infer() on a cache miss. Failed inferences aren't cached.
+    bool infer() override;
+
+    void train_online() override;
+
+    bool is_online_training_converged() override;
+
+    std::shared_ptr<Model> get_inner() const { return m_inner; }
+    MemoCache& get_cache() const { return *m_cache; }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_MEMOIZING_MODEL_H
@@ -9,31 +9,79 @@
 #include "model_variable.h"
 #include "surrogate.h"
 
+#include <atomic>
+
 namespace phasm {
 
+/// How a Model should represent its weights for inference. Models which don't support a given kind ignore it.
+enum class Quantization {
+    None,       ///< Full precision
+    DynamicInt8 ///< Weights stored as int8 per output channel, activations quantized to int8 on the fly
+};
+
 
 /// There should be exactly one Model in your codebase for each unique function that you wish to surrogate.
 /// Contrast this with Surrogate. There should be one Surrogate for each call site of that function,
 /// and each of these Surrogates delegate to the same underlying model.
 class Model {
     friend class Surrogate;
+    friend class MemoizingModel;
+    friend class CascadeModel;
+    friend class PartitionedModel;
 
 protected:
     std::vector<std::shared_ptr<ModelVariable>> m_model_vars;
     size_t m_captured_rows = 0;
     bool m_combine_tensors = true;
+    Quantization m_quantization = Quantization::None;
+
+    // Set by models whose train_from_captures() trains their weights from scratch, and so needs normalizations fitted
+    // to the captures first. Pretrained models (e.g. TorchscriptModel) leave it unset, since the normalizations their
+    // network was trained with come from its .norm file, or there are none.
+    bool m_trains_from_scratch = false;
+
+    /// Models whose weights change while they are in use, e.g. when online training publishes a new network, call
+    /// this afterwards, so that wrappers which cache outputs (see MemoizingModel) know to drop them
+    void weights_changed() { m_weights_version.fetch_add(1, std::memory_order_release); }
 
     // The following are just for convenience
     std::vector<std::shared_ptr<ModelVariable>> m_inputs;
     std::vector<std::shared_ptr<ModelVariable>> m_outputs;
     std::map<std::string, std::shared_ptr<ModelVariable>> m_model_var_map;
 
+private:
+    // How many Surrogates currently use this model. Only the last one to go calls finalize().
+    std::atomic<size_t> m_surrogate_count {0};
+
+    // Set by load_normalizations(), so that finalize() doesn't refit normalizations the weights depend on
+    bool m_normalizations_loaded = false;
+
+    // Bumped by weights_changed()
+    std::atomic<uint64_t> m_weights_version {0};
+
+    // Models swapped in by Surrogate::swap_model, and the stages of a CascadeModel, are initialized on private copies
+    // of their owner's ModelVariables, so that each can have its own output buffers and normalizations. These are the
+    // owner's, in the same order as m_model_vars. Empty for every other model.
+    std::vector<std::shared_ptr<ModelVariable>> m_lender_vars;
+
+    /// Swaps the tensors and captures of the lender's ModelVariables with those of our private copies, for as long as
+    /// it lives. The owner holds one around every infer(), train_online(), finalize() or training, so that the model
+    /// works on the owner's data as if it were its own. Does nothing for models without private copies.
+    struct Loan;
+    void swap_lender_vars();
+    bool infer_on_loan();
+    void train_online_on_loan();
+
 public:
     Model() = default;
     virtual ~Model() = default; // We want to be able to inherit from this
 
     void enable_tensor_combining(bool enabled) { m_combine_tensors = enabled; }
 
+    /// Has to be set before initialize(), since that's where models decide how to lay out their weights
+    void set_quantization(Quantization quantization) { m_quantization = quantization; }
+    Quantization get_quantization() const { return m_quantization; }
+
 
     /// Surrogate calls set_model_vars() for us before calling initialize(). This way,
     /// the model can configure itself to adjust to the input and output sizes.
@@ -47,8 +95,15 @@ public:
     }
 
     // Performs tasks such as training or writing to CSV, right before the model gets destroyed.
+    // Surrogate calls this exactly once, when the last Surrogate using this model is destroyed.
     void finalize(CallMode callmode);
 
+    /// Increases every time weights_changed() is called
+    uint64_t get_weights_version() const { return m_weights_version.load(std::memory_order_acquire); }
+
+    /// How many Surrogates currently use this model
+    size_t get_surrogate_count() const { return m_surrogate_count.load(std::memory_order_acquire); }
+
     // The total number of training samples we have accumulated so far
     size_t get_capture_count() const;
 
@@ -62,6 +117,21 @@ public:
 
     void dump_ranges(std::ostream &);
 
+    /// Computes each ModelVariable's Normalization from its captured training data. finalize() calls this right
+    /// before train_from_captures() when should_fit_normalizations(), so models only need to apply the
+    /// normalizations, not fit them.
+    void fit_normalizations();
+
+    /// True for models which train from scratch and weren't loaded with normalizations. Refitting anything else would
+    /// change the inputs and outputs a pretrained network sees, and the .norm file saved with it.
+    bool should_fit_normalizations() const { return m_trains_from_scratch && !m_normalizations_loaded; }
+
+    /// Normalizations are persisted alongside the model, one line per ModelVariable, of the form "<name> <kind> <scale> <offset>"
+    void save_normalizations(std::ostream &);
+
+    /// Also marks the normalizations as loaded, so that should_fit_normalizations() is false from now on
+    void load_normalizations(std::istream &);
+
 
     // Initialize the underlying neural net once all the inputs and outputs are known
     virtual void initialize() {};
@@ -69,6 +139,30 @@ public:
     virtual void train_from_captures() {};
 
     virtual bool infer() { return false; };
+
+    /// Like infer(), but also reports how far to trust the outputs, from 0 (not at all) to 1. CascadeModel uses this
+    /// to decide whether to escalate to its next stage. By default, a successful infer() is fully trusted.
+    virtual bool infer_with_confidence(float& confidence) { confidence = 1; return infer(); };
+
+    /// Called by Surrogate after every capture in CallMode::TrainOnline. Models which support online training consume
+    /// the newest capture (e.g. by queueing it for a background thread) and then discard_captures(). By default the
+    /// captures are kept, so that they can still be used by train_from_captures() when the program exits.
+    virtual void train_online() {};
+
+    /// Returns true once online training has produced a model accurate enough to replace the original function
+    virtual bool is_online_training_converged() { return false; };
+
+    /// Forgets all captured training data
+    void discard_captures();
+};
+
+
+struct Model::Loan {
+    Model& model;
+    explicit Loan(Model& model) : model(model) { model.swap_lender_vars(); }
+    ~Loan() { model.swap_lender_vars(); }
+    Loan(const Loan&) = delete;
+    Loan& operator=(const Loan&) = delete;
 };
 
 
@@ -0,0 +1,55 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_MODEL_FILE_WATCHER_H
+#define SURROGATE_TOOLKIT_MODEL_FILE_WATCHER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace phasm {
+
+/// Polls a model file on a background thread and calls `on_change` whenever it has been replaced. A change is only
+/// reported once the file's size and modification time have stayed the same for a whole poll interval, so that we
+/// don't load a file that is still being written. (Deploying via write-to-temp-then-rename avoids the issue entirely.)
+/// Polling is deliberately used instead of inotify so that this works the same on every platform and filesystem,
+/// including NFS. If on_change throws, the error is printed and the watcher keeps going.
+class ModelFileWatcher {
+    std::string m_path;
+    std::function<void(const std::string&)> m_on_change;
+    std::chrono::milliseconds m_poll_interval;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_stop_requested;
+    std::condition_variable m_started_signal;
+    bool m_stop = false;
+    bool m_started = false;
+    std::atomic<size_t> m_change_count {0};
+
+    void run();
+
+public:
+    ModelFileWatcher(std::string path, std::function<void(const std::string&)> on_change,
+                     std::chrono::milliseconds poll_interval = std::chrono::seconds(1));
+
+    /// Stops and joins the polling thread. If on_change is running, this waits for it to finish.
+    ~ModelFileWatcher();
+
+    ModelFileWatcher(const ModelFileWatcher&) = delete;
+    ModelFileWatcher& operator=(const ModelFileWatcher&) = delete;
+
+    const std::string& get_path() const { return m_path; }
+
+    /// Counts how many times on_change has completed successfully
+    size_t get_change_count() const { return m_change_count.load(); }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_MODEL_FILE_WATCHER_H
@@ -0,0 +1,101 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_MODEL_HANDLE_H
+#define SURROGATE_TOOLKIT_MODEL_HANDLE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace phasm {
+
+class Model;
+
+/// ModelHandle is what a Surrogate holds instead of a plain shared_ptr<Model>, so that the model can be replaced
+/// (e.g. after retraining, or when a new .pt file is deployed) while other threads are in the middle of infer().
+///
+/// It works like RCU with hazard pointers: Readers pin() the current model by publishing a pointer to it in one of a
+/// fixed number of hazard slots. This costs a couple of atomic operations and never takes a lock. Writers publish() a
+/// new, fully initialized model, which readers see from their next pin() onwards. The previous model is retired, and
+/// only released once no hazard slot points to it any more. Retired models are reclaimed whenever a writer publishes
+/// or calls reclaim(); readers never do any reclamation work.
+class ModelHandle {
+public:
+    /// Maximum number of threads that can hold a Pin at the same time. Further readers spin until a slot frees up.
+    static constexpr size_t MAX_READERS = 64;
+
+private:
+    struct Version {
+        std::shared_ptr<Model> model;
+    };
+
+    // One cache line per slot, so that readers on different threads don't contend
+    struct alignas(64) HazardSlot {
+        std::atomic<Version*> hazard {nullptr};
+        std::atomic<bool> in_use {false};
+    };
+
+    std::atomic<Version*> m_current {nullptr};
+    HazardSlot m_slots[MAX_READERS];
+    std::mutex m_writer_mutex; // Serializes writers. Readers never touch it.
+    std::vector<Version*> m_retired;
+    std::atomic<size_t> m_version_number {0};
+
+    size_t reclaim_locked();
+
+public:
+    /// Keeps a model alive (and unchanged, from the reader's point of view) until it is destroyed
+    class Pin {
+        friend class ModelHandle;
+        HazardSlot* m_slot = nullptr;
+        Version* m_version = nullptr;
+        Pin(HazardSlot* slot, Version* version) : m_slot(slot), m_version(version) {}
+
+    public:
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+        Pin(Pin&& other) noexcept : m_slot(other.m_slot), m_version(other.m_version) { other.m_slot = nullptr; }
+        ~Pin() {
+            if (m_slot != nullptr) {
+                m_slot->hazard.store(nullptr, std::memory_order_release);
+                m_slot->in_use.store(false, std::memory_order_release);
+            }
+        }
+        Model* get() const { return m_version == nullptr ? nullptr : m_version->model.get(); }
+        Model* operator->() const { return get(); }
+        explicit operator bool() const { return get() != nullptr; }
+    };
+
+    explicit ModelHandle(std::shared_ptr<Model> model = nullptr);
+
+    /// All Pins must have been released by now
+    ~ModelHandle();
+
+    ModelHandle(const ModelHandle&) = delete;
+    ModelHandle& operator=(const ModelHandle&) = delete;
+
+    /// Pins the current model for the duration of a call. This is the only thing the hot path does.
+    Pin pin();
+
+    /// Returns an owning reference to the current model, for code that isn't performance critical
+    std::shared_ptr<Model> get();
+
+    /// Makes `model` the current model and returns the previous one. The caller is responsible for having initialized
+    /// it already; readers may start calling infer() on it as soon as this returns.
+    std::shared_ptr<Model> publish(std::shared_ptr<Model> model);
+
+    /// Releases the retired models which no reader is using any more. Returns how many are still waiting.
+    size_t reclaim();
+
+    /// Counts how many times publish() has been called, so that callers can tell whether a swap happened
+    size_t get_version_number() const { return m_version_number.load(std::memory_order_acquire); }
+
+    size_t get_retired_count();
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_MODEL_HANDLE_H
@@ -10,6 +10,7 @@
 #include "optics.h"
 #include "any_ptr.hpp"
 #include "tensor.hpp"
+#include "normalization.h"
 
 
 namespace phasm {
@@ -21,17 +22,34 @@ struct ModelVariable {
     bool is_input = false;
     bool is_output = false;
     OpticBase *accessor = nullptr;
+    // One tensor per capture, each exactly as long as that capture, so ragged variables aren't padded. They are only
+    // packed back-to-back with row offsets on demand (see getPackedTrainingInputs), because models, partitioning
+    // and online training all pick out, move and discard individual captures.
     std::vector<tensor> training_inputs;
     std::vector<tensor> training_outputs;
     tensor inference_input;
     tensor inference_output;
     Range range;
+    Normalization normalization;
 
     ModelVariable() = default;
     ~ModelVariable() {
         delete accessor;
     }
 
+    /// A fresh ModelVariable with the same name, direction, accessor and range, but none of the tensors or captures.
+    /// The normalization keeps its kind but not its fitted parameters, which belong to whichever model fitted them.
+    std::shared_ptr<ModelVariable> clone_declaration() const {
+        auto copy = std::make_shared<ModelVariable>();
+        copy->name = name;
+        copy->is_input = is_input;
+        copy->is_output = is_output;
+        copy->accessor = (accessor == nullptr) ? nullptr : accessor->clone();
+        copy->range = range;
+        copy->normalization.kind = normalization.kind;
+        return copy;
+    }
+
     std::vector<int64_t> shape() const {
         if (accessor == nullptr) {
             std::ostringstream oss;
@@ -51,6 +69,23 @@ struct ModelVariable {
         training_outputs.push_back(data);
     }
 
+    /// Packs all captured training inputs into a single tensor with one row per capture. This works for
+    /// variable-length (ragged) variables as well, in which case the rows are stored back-to-back without padding.
+    tensor getPackedTrainingInputs() const {
+        return stack_ragged(training_inputs);
+    }
+
+    tensor getPackedTrainingOutputs() const {
+        return stack_ragged(training_outputs);
+    }
+
+    bool isRagged() const {
+        for (int64_t dim : shape()) {
+            if (dim < 0) return true;
+        }
+        return false;
+    }
+
     void captureInferenceInput(const phasm::any_ptr &binding) {
         inference_input = accessor->unsafe_to(binding);
     }
@@ -0,0 +1,66 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_NORMALIZATION_H
+#define SURROGATE_TOOLKIT_NORMALIZATION_H
+
+#include "tensor.hpp"
+#include <istream>
+#include <ostream>
+
+namespace phasm {
+
+enum class NormalizationKind { None, Standardize, MinMax, Log };
+
+/// Feature scaling for a single ModelVariable. Every element x of the variable is mapped to
+///     normalized = (f(x) - center) * scale
+/// where f is the identity, except for NormalizationKind::Log, where it is the natural log. The center and scale
+/// are shared by all elements of the variable, and are computed from the captured training data by fit():
+/// - Standardize: normalized values have mean 0 and standard deviation 1
+/// - MinMax:      normalized values lie in [0, 1]
+/// - Log:         log(x) is standardized, for strictly positive variables spanning many orders of magnitude
+///
+/// The transform is applied while packing the model's input buffer, inside the dtype conversion kernel, so it costs
+/// little beyond the copy we were already doing. It is computed in double and only rounded to float at the end, since
+/// data with a large offset (e.g. timestamps) loses all of its spread if the center is subtracted in float.
+struct Normalization {
+    NormalizationKind kind = NormalizationKind::None;
+    double center = 0.0;
+    double scale = 1.0;
+
+    bool is_enabled() const { return kind != NormalizationKind::None; }
+
+    /// Computes center and scale from every element of every captured tensor. Does nothing if kind is None. If kind is
+    /// Log and a capture isn't strictly positive, this warns and sets kind to None rather than throwing.
+    void fit(const std::vector<tensor>& captures);
+
+    /// Converts source into floats and normalizes them, writing source.get_length() floats to dest
+    void normalize(const tensor& source, float* dest) const;
+
+    /// Maps a buffer of normalized floats (e.g. the model's output) back into a tensor of the original scale
+    tensor denormalize(const float* source, const std::vector<int64_t>& shape) const;
+
+    /// Same as above, but writes into an existing buffer so that steady-state inference doesn't allocate
+    void denormalize(const float* source, float* dest, size_t length) const;
+
+    /// Writes and reads the form "<kind> <scale> <offset>", where offset = -center * scale, so that the fitted
+    /// parameters can be saved with the model
+    void write(std::ostream& os) const;
+    void read(std::istream& is);
+};
+
+/// Packs the inputs into an existing buffer of `capacity` floats, applying each input's normalization (if provided)
+/// on the way. This is how every plugin fills its model's input buffer.
+void flatten_and_join_into(const std::vector<const tensor*>& inputs,
+                           const std::vector<const Normalization*>& normalizations,
+                           float* dest, size_t capacity);
+
+/// Writes `source` into `dest` as a float tensor with the given shape, denormalizing on the way. `dest` is reused
+/// in place if it already has the right dtype and length, so that steady-state inference doesn't allocate.
+void unpack_output_into(const float* source, const std::vector<int64_t>& shape,
+                        const Normalization& normalization, tensor& dest);
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_NORMALIZATION_H
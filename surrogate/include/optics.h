@@ -9,8 +9,10 @@
 #include "typename.hpp"
 #include "any_ptr.hpp"
 #include "tensor.hpp"
+#include "dtype_conversion.h"
 #include <numeric>
 #include <functional>
+#include <type_traits>
 // #include <concepts>
 
 // These aren't really optics yet (will they ever be?), but they are operational at least
@@ -41,6 +43,9 @@ struct OpticBase {
 
     virtual std::vector<int64_t> shape() {return {};}; // Torch uses int64_t instead of size_t for its indices and offsets
 
+    /// The dtype of the tensors this optic produces, i.e. that of the TensorIso (or StructArrayIso) at its end
+    virtual DType dtype() { return DType::Undefined; }
+
     void unsafe_attach(OpticBase* optic) {
         if (optic->consumes != produces) {
             std::ostringstream ss;
@@ -115,12 +120,30 @@ public:
     TensorIso(const TensorIso& other) = default;
 
     std::vector<int64_t> shape() override { return m_shape; }
+    DType dtype() override { return m_dtype_to_write; }
 
-    tensor to(T* source) override {
+    tensor to(T* source) override;
+    void from(tensor source, T* dest) override;
+
+    TensorIso* clone() override {
+        return new TensorIso<T>(*this);
+    }
+};
+
+
+template <typename T>
+tensor TensorIso<T>::to(T* source) {
+    if constexpr (default_dtype<T>() != DType::Undefined) {
+        // T is a primitive, so we can use the vectorized conversion kernels directly
+        tensor result(m_dtype_to_write, m_shape);
+        convert(source, default_dtype<T>(), result.get_data<void>(), m_dtype_to_write, m_length);
+        return result;
+    }
+    else {
         switch (m_dtype_to_write) {
-            // We could easily templatize this, but I'm concerned about how many levels of templates the Optics
-            // and SurrogateBuilder already have, and we already have trouble with compile times. Maybe revisit
-            // this when we do the compilation performance analysis.
+            // Only types the conversion kernels don't cover, such as bool or char, get here. This stays a
+            // hand-written switch rather than another layer of templates, because the Optics and SurrogateBuilder
+            // are already deeply nested.
             case DType::UI8: {
                 auto *ui8ptr = new uint8_t[m_length];
                 for (size_t i = 0; i < m_length; ++i) {
@@ -167,18 +190,20 @@ public:
                 throw std::runtime_error("TensorIso::to: Invalid dtype");
         };
     }
+}
 
-
-    void from(tensor source, T* dest) override {
-        if (source.get_length() != m_length) {
-            std::string msg = "TensorIso::from: Tensor has wrong length. Destination fits " + std::to_string(m_length)
-                    + " but provided a tensor with length " + std::to_string(source.get_length());
-            throw std::runtime_error(msg);
-        }
+template <typename T>
+void TensorIso<T>::from(tensor source, T* dest) {
+    if (source.get_length() != m_length) {
+        std::string msg = "TensorIso::from: Tensor has wrong length. Destination fits " + std::to_string(m_length)
+                + " but provided a tensor with length " + std::to_string(source.get_length());
+        throw std::runtime_error(msg);
+    }
+    if constexpr (default_dtype<T>() != DType::Undefined) {
+        convert(source.get_data<void>(), source.get_dtype(), dest, default_dtype<T>(), m_length);
+    }
+    else {
         switch (source.get_dtype()) {
-            // We could easily templatize this, but I'm concerned about how many levels of templates the Optics
-            // and SurrogateBuilder already have, and we already have trouble with compile times. Maybe revisit
-            // this when we do the compilation performance analysis.
             case DType::UI8: {
                 auto *ui8ptr = source.get_data<uint8_t>();
                 for (size_t i = 0; i < m_length; ++i) {
@@ -219,10 +244,7 @@ public:
                 throw std::runtime_error("tensor is undefined");
         };
     }
-    TensorIso* clone() override {
-        return new TensorIso<T>(*this);
-    }
-};
+}
 
 
 // Field is an Optic that accepts a struct of type StructT, knows how to extract a field of type FieldT from the StructT,
@@ -240,6 +262,7 @@ public:
     Lens(const Lens& other) = default;
 
     std::vector<int64_t> shape() override { return m_optic->shape(); }
+    DType dtype() override { return m_optic->dtype(); }
     tensor to(StructT* source) override {
         return m_optic->to(m_accessor(source));
     }
@@ -281,6 +304,7 @@ public:
     ValueLens(const ValueLens& other) = default;
 
     std::vector<int64_t> shape() override { return m_optic->shape(); }
+    DType dtype() override { return m_optic->dtype(); }
     tensor to(ClassT* source) override {
         FieldT val = m_getter(source); 
         return m_optic->to(&val);
@@ -324,6 +348,7 @@ public:
     RefLens(const RefLens &other) = default;
 
     std::vector<int64_t> shape() override { return m_optic->shape(); }
+    DType dtype() override { return m_optic->dtype(); }
 
     tensor to(StructT *source) override {
         return m_optic->to(&(source->*m_field));
@@ -357,6 +382,7 @@ public:
     }
     ArrayTraversal(const ArrayTraversal& other) = default;
 
+    DType dtype() override { return m_optic->dtype(); }
     std::vector<int64_t> shape() override {
         std::vector<int64_t> result {m_length};
         auto inner_shape = m_optic->shape();
@@ -393,6 +419,151 @@ public:
 };
 
 
+/// Obtains a raw pointer from either a raw pointer or a smart pointer, without dereferencing it
+template <typename T>
+inline T* raw_pointer(T* p) { return p; }
+
+template <typename PtrT>
+inline auto raw_pointer(const PtrT& p) -> decltype(p.get()) { return p.get(); }
+
+
+/// PointerLens follows a pointer (raw, std::unique_ptr, or std::shared_ptr) to its pointee and forwards it to
+/// an inner optic. This is how we reach objects such as a G4Track's G4DynamicParticle.
+/// If the pointer is null, we can't follow it, so instead we feed a default-constructed PointeeT to the inner optic.
+/// This gives the model a consistent "masked" default value (usually zeros) for missing objects. Writing back through
+/// a null pointer is silently skipped.
+template <typename PtrT, typename PointeeT>
+class PointerLens : public Optic<PtrT> {
+    Optic<PointeeT>* m_optic;
+
+public:
+    explicit PointerLens(Optic<PointeeT>* optic) : m_optic(optic) {
+        OpticBase::consumes = demangle<PtrT>();
+        OpticBase::produces = demangle<PointeeT>();
+    }
+    PointerLens(const PointerLens& other) = default;
+
+    std::vector<int64_t> shape() override { return m_optic->shape(); }
+    DType dtype() override { return m_optic->dtype(); }
+
+    tensor to(PtrT* source) override {
+        PointeeT* pointee = raw_pointer(*source);
+        if (pointee == nullptr) return to_masked_default();
+        return m_optic->to(pointee);
+    }
+    void from(tensor source, PtrT* dest) override {
+        PointeeT* pointee = raw_pointer(*dest);
+        if (pointee == nullptr) return;
+        m_optic->from(source, pointee);
+    }
+    tensor to_masked_default() {
+        if constexpr (std::is_default_constructible_v<PointeeT>) {
+            PointeeT default_value {};
+            return m_optic->to(&default_value);
+        }
+        else {
+            throw std::runtime_error("PointerLens: Encountered a null pointer to a non-default-constructible " + demangle<PointeeT>());
+        }
+    }
+    void attach(Optic<PointeeT>* optic) {
+        OpticBase::unsafe_attach(optic);
+        m_optic = optic;
+    }
+    void unsafe_use(OpticBase* optic) override {
+        auto downcasted = dynamic_cast<Optic<PointeeT>*>(optic);
+        if (downcasted == nullptr) {
+            throw std::runtime_error("Incompatible optic!");
+        }
+        m_optic = downcasted;
+    }
+    PointerLens* clone() override {
+        return new PointerLens(*this);
+    }
+};
+
+
+/// PointerArrayTraversal is the pointer-chasing equivalent of ArrayTraversal: It accepts a contiguous array of
+/// (raw or smart) pointers, follows each one, and stacks the results. Since the pointees are typically scattered
+/// across the heap, we issue software prefetches for the pointee m_prefetch_distance elements ahead, so that the
+/// cache miss overlaps with the inner optic's work on the current element. Null pointers produce the same masked
+/// default as PointerLens.
+template <typename PtrT, typename PointeeT>
+class PointerArrayTraversal : public Optic<PtrT> {
+    Optic<PointeeT>* m_optic;
+    int64_t m_length;
+    int64_t m_prefetch_distance;
+
+public:
+    PointerArrayTraversal(Optic<PointeeT>* optic, size_t length, size_t prefetch_distance=4)
+    : m_optic(optic), m_length(length), m_prefetch_distance(prefetch_distance) {
+        OpticBase::consumes = demangle<PtrT>();
+        OpticBase::produces = demangle<PointeeT>();
+    }
+    PointerArrayTraversal(const PointerArrayTraversal& other) = default;
+
+    DType dtype() override { return m_optic->dtype(); }
+    std::vector<int64_t> shape() override {
+        std::vector<int64_t> result {m_length};
+        auto inner_shape = m_optic->shape();
+        result.insert(result.end(), inner_shape.begin(), inner_shape.end());
+        return result;
+    }
+    tensor to(PtrT* source) override {
+        std::vector<tensor> tensors;
+        tensors.reserve(m_length);
+        for (int64_t i=0; i<m_prefetch_distance && i<m_length; ++i) {
+            prefetch(source[i]);
+        }
+        for (int64_t i=0; i<m_length; ++i) {
+            if (i + m_prefetch_distance < m_length) {
+                prefetch(source[i + m_prefetch_distance]);
+            }
+            PointeeT* pointee = raw_pointer(source[i]);
+            if (pointee == nullptr) {
+                PointerLens<PtrT, PointeeT> lens(m_optic);
+                tensors.push_back(lens.to_masked_default());
+            }
+            else {
+                tensors.push_back(m_optic->to(pointee));
+            }
+        }
+        return stack(tensors);
+    }
+    void from(tensor source, PtrT* dest) override {
+        auto unstacked = unstack(source);
+        for (int64_t i=0; i<m_length; ++i) {
+            if (i + m_prefetch_distance < m_length) {
+                prefetch(dest[i + m_prefetch_distance]);
+            }
+            PointeeT* pointee = raw_pointer(dest[i]);
+            if (pointee != nullptr) {
+                m_optic->from(unstacked[i], pointee);
+            }
+        }
+    }
+    void attach(Optic<PointeeT>* optic) {
+        OpticBase::unsafe_attach(optic);
+        m_optic = optic;
+    }
+    void unsafe_use(OpticBase* optic) override {
+        auto downcasted = dynamic_cast<Optic<PointeeT>*>(optic);
+        if (downcasted == nullptr) {
+            throw std::runtime_error("Incompatible optic!");
+        }
+        m_optic = downcasted;
+    }
+    PointerArrayTraversal* clone() override {
+        return new PointerArrayTraversal(*this);
+    }
+
+private:
+    static inline void prefetch(const PtrT& p) {
+        // Prefetching never faults, so we don't need to check for nullptr
+        __builtin_prefetch(raw_pointer(p), 0 /* read */, 3 /* keep in all cache levels */);
+    }
+};
+
+
 // For now assume the traversable contains exactly as many elements as expected
 template <typename OuterT, typename InnerT, typename IteratorT>
 class Traversal : public Optic<OuterT> {
@@ -405,6 +576,7 @@ public:
         OpticBase::produces = demangle<InnerT>();
     }
     Traversal(const Traversal& other) = default;
+    DType dtype() override { return m_optic->dtype(); }
     std::vector<int64_t> shape() override {
         std::vector<int64_t> result {m_length};
         auto inner_shape = m_optic->shape();
@@ -445,6 +617,163 @@ public:
     }
 };
 
+/// RaggedTraversal is like Traversal, except that the container may hold any number of elements, and that number
+/// may change from call to call (e.g. the hits or tracks in an event). The resulting tensor has shape
+/// [n, inner...] where n is the actual number of elements, so nothing gets padded out to some worst-case maximum.
+/// Consequently, shape() reports the leading dimension as -1. An empty container produces an undefined tensor.
+/// When writing back, the container is resized to match the tensor, so ContainerT needs to support resize().
+template <typename ContainerT, typename InnerT>
+class RaggedTraversal : public Optic<ContainerT> {
+    Optic<InnerT>* m_optic;
+
+public:
+    explicit RaggedTraversal(Optic<InnerT>* optic) : m_optic(optic) {
+        OpticBase::consumes = demangle<ContainerT>();
+        OpticBase::produces = demangle<InnerT>();
+    }
+    RaggedTraversal(const RaggedTraversal& other) = default;
+
+    DType dtype() override { return m_optic->dtype(); }
+    std::vector<int64_t> shape() override {
+        std::vector<int64_t> result {-1};
+        auto inner_shape = m_optic->shape();
+        result.insert(result.end(), inner_shape.begin(), inner_shape.end());
+        return result;
+    }
+    tensor to(ContainerT* source) override {
+        if (source->empty()) return tensor();
+        std::vector<tensor> tensors;
+        tensors.reserve(source->size());
+        for (InnerT& item : *source) {
+            tensors.push_back(m_optic->to(&item));
+        }
+        return stack(tensors);
+    }
+    void from(tensor source, ContainerT* dest) override {
+        if (source.get_dtype() == DType::Undefined) {
+            dest->clear();
+            return;
+        }
+        auto unstacked = unstack(source);
+        dest->resize(unstacked.size());
+        size_t i = 0;
+        for (InnerT& item : *dest) {
+            m_optic->from(unstacked[i++], &item);
+        }
+    }
+    void attach(Optic<InnerT>* optic) {
+        OpticBase::unsafe_attach(optic);
+        m_optic = optic;
+    }
+    void unsafe_use(OpticBase* optic) override {
+        auto downcasted = dynamic_cast<Optic<InnerT>*>(optic);
+        if (downcasted == nullptr) {
+            throw std::runtime_error("Incompatible optic!");
+        }
+        m_optic = downcasted;
+    }
+    RaggedTraversal* clone() override {
+        return new RaggedTraversal(*this);
+    }
+};
+
+
+/// StructArrayIso converts a container of structs (e.g. a std::vector<Hit>) into a single [n, fields] tensor, by
+/// reading the given data members out of each element. Compared to a Traversal over a Lens over a TensorIso, this
+/// walks the container exactly once and writes each field directly into its final position in the output buffer,
+/// instead of building one tensor per element and per field and then stack()ing them all together.
+/// All of the fields must have the same type FieldT, and (like Traversal) the container must contain exactly
+/// m_length elements.
+template <typename ContainerT, typename StructT, typename FieldT>
+class StructArrayIso : public Optic<ContainerT> {
+    std::vector<FieldT StructT::*> m_fields;
+    int64_t m_length;
+    DType m_dtype_to_write;
+
+public:
+    StructArrayIso(std::vector<FieldT StructT::*> fields, size_t length, DType dtype_to_write=phasm::default_dtype<FieldT>())
+    : m_fields(std::move(fields)), m_length(length), m_dtype_to_write(dtype_to_write) {
+        OpticBase::consumes = demangle<ContainerT>();
+        OpticBase::produces = "tensor";
+    }
+    StructArrayIso(const StructArrayIso& other) = default;
+
+    std::vector<int64_t> shape() override { return {m_length, static_cast<int64_t>(m_fields.size())}; }
+    DType dtype() override { return m_dtype_to_write; }
+
+    tensor to(ContainerT* source) override {
+        check_length(source);
+        switch (m_dtype_to_write) {
+            case DType::UI8: return to_typed<uint8_t>(source);
+            case DType::I16: return to_typed<int16_t>(source);
+            case DType::I32: return to_typed<int32_t>(source);
+            case DType::I64: return to_typed<int64_t>(source);
+            case DType::F32: return to_typed<float>(source);
+            case DType::F64: return to_typed<double>(source);
+            default: throw std::runtime_error("StructArrayIso::to: Invalid dtype");
+        }
+    }
+
+    void from(tensor source, ContainerT* dest) override {
+        check_length(dest);
+        if (source.get_length() != m_length * m_fields.size()) {
+            std::string msg = "StructArrayIso::from: Tensor has wrong length. Destination fits " +
+                              std::to_string(m_length * m_fields.size()) + " but provided a tensor with length " +
+                              std::to_string(source.get_length());
+            throw std::runtime_error(msg);
+        }
+        switch (source.get_dtype()) {
+            case DType::UI8: from_typed<uint8_t>(source, dest); break;
+            case DType::I16: from_typed<int16_t>(source, dest); break;
+            case DType::I32: from_typed<int32_t>(source, dest); break;
+            case DType::I64: from_typed<int64_t>(source, dest); break;
+            case DType::F32: from_typed<float>(source, dest); break;
+            case DType::F64: from_typed<double>(source, dest); break;
+            default: throw std::runtime_error("tensor is undefined");
+        }
+    }
+
+    StructArrayIso* clone() override {
+        return new StructArrayIso(*this);
+    }
+
+private:
+    void check_length(ContainerT* container) {
+        if (static_cast<int64_t>(container->size()) != m_length) {
+            std::string msg = "StructArrayIso: Container has " + std::to_string(container->size()) +
+                              " elements but expected " + std::to_string(m_length);
+            throw std::runtime_error(msg);
+        }
+    }
+
+    template <typename DestT>
+    tensor to_typed(ContainerT* source) {
+        size_t field_count = m_fields.size();
+        auto* buffer = new DestT[m_length * field_count];
+        DestT* row = buffer;
+        for (StructT& item : *source) {
+            for (size_t col = 0; col < field_count; ++col) {
+                row[col] = item.*(m_fields[col]);
+            }
+            row += field_count;
+        }
+        return tensor(std::unique_ptr<DestT[]>(buffer), shape());
+    }
+
+    template <typename SourceT>
+    void from_typed(const tensor& source, ContainerT* dest) {
+        size_t field_count = m_fields.size();
+        const SourceT* row = source.get_data<SourceT>();
+        for (StructT& item : *dest) {
+            for (size_t col = 0; col < field_count; ++col) {
+                item.*(m_fields[col]) = row[col];
+            }
+            row += field_count;
+        }
+    }
+};
+
+
 template<typename OuterT, typename InnerT>
 class STLIterator {
     OuterT* underlying;
@@ -468,6 +797,23 @@ public:
 };
 
 
+// Every translation unit that includes surrogate_builder.h would otherwise re-instantiate these optics (along with their
+// vtables and the big dtype switches above) for each primitive type. Instead, we instantiate them exactly once, inside
+// phasm-surrogate (see src/optics.cpp), and tell everyone else not to bother.
+extern template class TensorIso<uint8_t>;
+extern template class TensorIso<int16_t>;
+extern template class TensorIso<int32_t>;
+extern template class TensorIso<int64_t>;
+extern template class TensorIso<float>;
+extern template class TensorIso<double>;
+
+extern template class ArrayTraversal<uint8_t>;
+extern template class ArrayTraversal<int16_t>;
+extern template class ArrayTraversal<int32_t>;
+extern template class ArrayTraversal<int64_t>;
+extern template class ArrayTraversal<float>;
+extern template class ArrayTraversal<double>;
+
 } // namespace phasm
 
 
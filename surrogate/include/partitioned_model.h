@@ -0,0 +1,93 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef SURROGATE_TOOLKIT_PARTITIONED_MODEL_H
+#define SURROGATE_TOOLKIT_PARTITIONED_MODEL_H
+
+#include "model.h"
+
+namespace phasm {
+
+/// One node of a PartitionedModel's decision tree: inputs with x[input] < threshold go left, the rest go right
+struct PartitionSplit {
+    float threshold = 0;
+    uint32_t input = 0; ///< Index into the flattened, joined inputs
+};
+
+
+/// A mixture of experts: splits the input domain into axis-aligned regions with a decision tree, and hands each
+/// call to a small Model specialized on its region, rather than making one big Model cover everything. This pays off
+/// when the error of a single model concentrates in a few places, e.g. at the edges of a magnet.
+///
+/// The tree is complete, with 2^depth leaves and one expert per leaf, stored level-order in an array (the children
+/// of node i are 2i+1 and 2i+2). Routing is one compare per level, with no data-dependent branches, so it costs a
+/// few nanoseconds.
+///
+/// The tree is either given up front, or learned in train_from_captures() as a regression tree: each node picks the
+/// split that minimizes the squared error of the outputs (standardized per element) around their means on either
+/// side, keeping at least `min_captures` on each side. Nodes which can't be split that way send everything left.
+/// Each expert then gets its own copy of the ModelVariables holding only its region's captures, fits its own
+/// normalizations on them, and trains, with the experts spread across all cores.
+///
+/// The tree is saved to `filename` and loaded from there in initialize(), if present. Experts come from
+/// `make_expert(leaf)`, and are responsible for persisting themselves, e.g. KnnModels with one filename per leaf.
+/// All inputs are combined into one point for routing, like FeedForwardModel. Ragged model variables aren't supported.
+class PartitionedModel : public Model {
+public:
+    using ExpertFactory = std::function<std::shared_ptr<Model>(size_t leaf)>;
+
+private:
+    std::string m_filename;
+    ExpertFactory m_make_expert;
+    size_t m_depth;
+    size_t m_min_captures;
+    bool m_learn_splits;
+    std::vector<PartitionSplit> m_splits;
+    std::vector<std::shared_ptr<Model>> m_experts;
+    std::vector<std::vector<std::shared_ptr<ModelVariable>>> m_expert_vars;
+
+    size_t m_input_dim = 0;
+    size_t m_output_dim = 0;
+    std::vector<const tensor*> m_input_tensors;
+
+    void learn_splits(const std::vector<float>& x, const std::vector<float>& y, size_t rows);
+    void load_splits();
+    void save_splits() const;
+
+public:
+    /// Learns a tree of the given depth from the captures
+    PartitionedModel(std::string filename, ExpertFactory make_expert, size_t depth = 3, size_t min_captures = 32);
+
+    /// Uses the given tree, in level order. Its size has to be 2^depth - 1.
+    PartitionedModel(std::string filename, ExpertFactory make_expert, std::vector<PartitionSplit> splits);
+
+    /// Creates and initializes one expert per leaf
+    void initialize() override;
+
+    void train_from_captures() override;
+
+    bool infer() override;
+
+    /// Reports the confidence of the expert it was routed to
+    bool infer_with_confidence(float& confidence) override;
+
+    /// Which leaf `x` ([input_dim], flattened and joined like the inputs) belongs to
+    size_t route(const float* x) const {
+        size_t node = 0;
+        for (size_t level=0; level<m_depth; ++level) {
+            const PartitionSplit& split = m_splits[node];
+            node = 2*node + 1 + size_t(x[split.input] >= split.threshold);
+        }
+        return node - m_splits.size();
+    }
+
+    size_t get_depth() const { return m_depth; }
+    const std::vector<PartitionSplit>& get_splits() const { return m_splits; }
+    size_t get_expert_count() const { return m_experts.size(); }
+    std::shared_ptr<Model> get_expert(size_t leaf) const { return m_experts.at(leaf); }
+};
+
+} // namespace phasm
+#endif //SURROGATE_TOOLKIT_PARTITIONED_MODEL_H
@@ -3,7 +3,11 @@
 // Subject to the terms in the LICENSE file found in the top-level directory.
 
 #pragma once
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <tuple>
 #include <vector>
 #include <map>
 
@@ -19,14 +23,36 @@ public:
     void add_plugin_path(std::string path);
     Plugin* get_or_load_plugin(const std::string& plugin_name);
 
+    /// Registers a plugin which is linked into the executable rather than loaded from a shared library
+    void add_plugin(Plugin* plugin);
+
+    /// Returns the one Model for (plugin_name, model_name, config), so that every Surrogate of the same function shares
+    /// it instead of loading its own copy. `config` identifies everything else that goes into the Model, and
+    /// `make_model` builds it from the plugin if nobody is holding on to it at the moment.
+    std::shared_ptr<Model> get_or_make_model(const std::string& plugin_name, const std::string& model_name,
+                                             const std::string& config,
+                                             const std::function<std::shared_ptr<Model>(Plugin*)>& make_model);
+
+    /// How many of the models handed out by get_or_make_model are still alive
+    size_t get_shared_model_count();
+
     static PluginLoader& get_singleton();
 
 private:
+    struct SharedModel {
+        std::mutex mutex; // Held while making the model, so that the same model is never made twice
+        std::weak_ptr<Model> model;
+    };
+    using SharedModelKey = std::tuple<std::string, std::string, std::string>;
+
     std::string find_plugin(const std::string& short_plugin_name);
     Plugin* load_plugin(const std::string& exact_plugin_name);
 
     std::vector<std::string> m_plugin_paths;
     std::map<std::string, Plugin*> m_loaded_plugins;
+    std::mutex m_plugins_mutex;
+    std::map<SharedModelKey, std::shared_ptr<SharedModel>> m_shared_models;
+    std::mutex m_shared_models_mutex;
 };
 
 
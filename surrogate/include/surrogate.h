@@ -7,13 +7,18 @@
 #define SURROGATE_TOOLKIT_SURROGATE_H
 
 #include <vector>
+#include <chrono>
 #include "call_site_variable.h"
+#include "model_handle.h"
 
 namespace phasm {
 
 class Model;
+class ModelFileWatcher;
+class MemoCache;
+struct GridAxis;
 enum class CallMode {
-    NotSet, UseOriginal, UseModel, DumpTrainingData, DumpValidationData, TrainModel, DumpInputSummary
+    NotSet, UseOriginal, UseModel, DumpTrainingData, DumpValidationData, TrainModel, DumpInputSummary, TrainOnline
 };
 
 inline std::ostream& operator<<(std::ostream& os, CallMode cm) {
@@ -25,6 +30,7 @@ inline std::ostream& operator<<(std::ostream& os, CallMode cm) {
         case CallMode::DumpValidationData: os << "DumpValidationData"; break;
         case CallMode::TrainModel: os << "TrainModel"; break;
         case CallMode::DumpInputSummary: os << "DumpInputSummary"; break;
+        case CallMode::TrainOnline: os << "TrainOnline"; break;
     }
     return os;
 }
@@ -32,13 +38,20 @@ inline std::ostream& operator<<(std::ostream& os, CallMode cm) {
 class Surrogate {
 public:
     friend class Model;
+    friend void preload_all(size_t max_threads);
+    friend void preload(const std::vector<Surrogate*>& surrogates, size_t max_threads);
 
 private:
+    struct DeferredModel;
+    struct PendingModels;
     CallMode m_callmode = CallMode::NotSet;
     std::function<void(void)> m_original_function;
-    std::shared_ptr<Model> m_model;
+    std::shared_ptr<ModelHandle> m_model = std::make_shared<ModelHandle>();
+    std::shared_ptr<ModelFileWatcher> m_model_file_watcher;
+    std::shared_ptr<MemoCache> m_original_cache;
     std::vector<std::shared_ptr<CallSiteVariable>> m_callsite_vars;
     std::map<std::string, std::shared_ptr<CallSiteVariable>> m_callsite_var_map;
+    std::shared_ptr<DeferredModel> m_deferred_model;
 
 public:
 
@@ -56,26 +69,67 @@ public:
 
     inline Surrogate& bind_original_function(std::function<void(void)> f) { m_original_function = std::move(f); return *this;};
 
+    /// Makes the model now, if it was deferred and hasn't been made yet. Every call_* that needs the model does this
+    /// for you. Thread safe. Rethrows whatever went wrong while making the model.
+    inline void load_model() { if (m_deferred_model != nullptr && m_model->get_version_number() == 0) load_deferred_model(); }
+
+    /// In CallMode::UseModel, falls back to call_original() whenever the model's infer() fails, provided that an
+    /// original function is bound
     void call();
-    void call_model();
+
+    /// Returns false, leaving the outputs alone, if the model's infer() fails
+    bool call_model();
     void call_original();
     void call_original_and_capture();
     void call_model_and_capture();
     void capture_input_range();
+    void call_original_and_train_online();
+
+    /// Sets the inputs to every point of a regular grid in turn (row-major, one GridAxis per input element, in the
+    /// order the inputs were declared) and calls call_original_and_capture() at each. This is how to sample a function
+    /// for an InterpolationModel, though any model can train on the resulting captures.
+    void capture_grid(const std::vector<GridAxis>& axes);
 
     // ------------------------------------------------------------------------
     // Configuration: These are meant to be called by the SurrogateBuilder
     // ------------------------------------------------------------------------
 
     inline Surrogate& set_callmode(CallMode callmode) { m_callmode = callmode; return *this; };
-    inline Surrogate& set_model(const std::shared_ptr<Model>& model) { m_model = model; return *this; };
+    /// The model may be shared with other Surrogates, in which case the last of them to be destroyed finalizes it
+    Surrogate& set_model(const std::shared_ptr<Model>& model);
+
+    /// Makes the model on first use instead: `make_model` runs exactly once, in whichever comes first of load_model()
+    /// and preload(). It is responsible for initializing the model.
+    Surrogate& defer_model(std::function<std::shared_ptr<Model>()> make_model);
     Surrogate& add_callsite_vars(const std::vector<std::shared_ptr<CallSiteVariable>> &vars);
 
+    /// Makes call_original() look up its outputs in `cache` first, only calling the original function on a miss.
+    /// This is only correct if the original function is pure, i.e. its outputs depend on nothing but its inputs.
+    inline Surrogate& set_original_memoization(std::shared_ptr<MemoCache> cache) { m_original_cache = std::move(cache); return *this; }
+
+    // ------------------------------------------------------------------------
+    // Hot swapping: Replace the model while the program is running. Safe to
+    // call from any thread, including while another thread is inside call().
+    // ------------------------------------------------------------------------
+
+    /// Gives `model` copies of this Surrogate's ModelVariables, initializes it on those, and then atomically makes it
+    /// the model used by all subsequent calls. Calls already in progress finish using the old model, which is released
+    /// afterwards. The new model doesn't inherit the old one's normalizations, only their kinds.
+    void swap_model(std::shared_ptr<Model> model);
+
+    /// Calls swap_model(make_model(path)) whenever the file at `path` is replaced, polling every `poll_interval`.
+    /// The watcher stops when this Surrogate is destroyed, or when watch_model_file is called again.
+    void watch_model_file(std::string path, std::function<std::shared_ptr<Model>(const std::string&)> make_model,
+                          std::chrono::milliseconds poll_interval = std::chrono::seconds(1));
+
     // ------------------------------------------------------------------------
     // Inspection: These are meant to be used for debugging and testing
     // ------------------------------------------------------------------------
 
-    inline std::shared_ptr<Model> get_model() { return m_model; }
+    inline std::shared_ptr<Model> get_model() { load_model(); return m_model->get(); }
+    inline std::shared_ptr<ModelHandle> get_model_handle() { return m_model; }
+    inline CallMode get_callmode() const { return m_callmode; }
+    inline std::shared_ptr<MemoCache> get_original_cache() { return m_original_cache; }
     std::shared_ptr<CallSiteVariable> get_callsite_var(size_t index);
     std::shared_ptr<CallSiteVariable> get_callsite_var(std::string name);
 
@@ -89,6 +143,14 @@ public:
         return results;
     }
 
+private:
+    void call_original_memoized();
+    void load_deferred_model();
+    static PendingModels& get_pending_models();
+    static void load_deferred_models(const std::vector<std::shared_ptr<DeferredModel>>& models, size_t max_threads);
+    static void install_model(ModelHandle& handle, const std::vector<std::shared_ptr<ModelVariable>>& model_vars,
+                              std::shared_ptr<Model> model);
+    static void publish_model(ModelHandle& handle, std::shared_ptr<Model> model);
 };
 
 
@@ -99,6 +161,16 @@ public:
 CallMode get_call_mode_from_envvar();
 void print_help_screen();
 
+/// Makes the models of all Surrogates whose models are still deferred (see SurrogateBuilder::set_lazy_init), in parallel
+/// on up to `max_threads` threads (by default, one per core), and waits until they are done. Calling this at the top
+/// of main() takes the model loading off the critical path of the first call() to each Surrogate. Rethrows the first
+/// exception, after all models have been attempted.
+void preload_all(size_t max_threads = 0);
+
+/// Like preload_all(), but only for the given Surrogates, e.g. the ones a particular component owns. Surrogates
+/// whose models aren't deferred, or have already been made, are skipped.
+void preload(const std::vector<Surrogate*>& surrogates, size_t max_threads = 0);
+
 
 // --------------------
 // Template definitions
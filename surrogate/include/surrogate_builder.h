@@ -9,12 +9,16 @@
 #include <model.h>
 #include <surrogate.h>
 
+#include <optional>
+
 namespace phasm {
 
 
 template <typename HeadT, typename ...RestTs>
 struct Cursor;
 
+struct Plugin;
+
 /// OpticBuilder gives us a type-safe and intuitive way to represent the tree of accessors
 /// There are two representations that make sense:
 /// 1. A tree, where the root is a CallSiteVariable, the branches are Optics, and the leaves are ModelVariables.
@@ -30,13 +34,46 @@ class SurrogateBuilder {
     std::vector<std::shared_ptr<CallSiteVariable>> m_csvs;
     std::shared_ptr<Model> m_model;
     CallMode m_callmode = CallMode::NotSet;
+    std::string m_plugin_name;
+    std::string m_model_name;
+    bool m_enable_tensor_combining = false;
+    Quantization m_quantization = Quantization::None;
+    std::optional<bool> m_lazy_init;
+    std::chrono::milliseconds m_hot_reload_interval {0};
+    size_t m_model_memoization_bytes = 0;
+    size_t m_original_memoization_bytes = 0;
 
 public:
-    inline SurrogateBuilder& set_model(std::shared_ptr<Model> model, bool enable_tensor_combining=false) { m_model = model; m_model->enable_tensor_combining(enable_tensor_combining); return *this; }
+    inline SurrogateBuilder& set_model(std::shared_ptr<Model> model, bool enable_tensor_combining=false) { m_model = model; m_model->enable_tensor_combining(enable_tensor_combining); m_plugin_name.clear(); return *this; }
     inline SurrogateBuilder& set_callmode(CallMode callmode) { m_callmode = callmode; return *this; }
 
+    /// Every builder asking for the same plugin, model name and configuration gets the same Model, which is loaded and
+    /// initialized only once. Its Surrogates then share its ModelVariables, so they have to declare the same ones.
+    /// The configuration includes each variable's C++ type, dtype and normalization, so call sites which differ in
+    /// those get separate Models.
     SurrogateBuilder& set_model(std::string plugin_name, std::string model_name, bool enable_tensor_combining=false);
 
+    /// Asks the model to quantize its weights for inference, e.g. Quantization::DynamicInt8. This is applied in finish(),
+    /// so it doesn't matter whether it is called before or after set_model.
+    inline SurrogateBuilder& set_quantization(Quantization quantization) { m_quantization = quantization; return *this; }
+
+    /// Wraps the model in a MemoizingModel with a cache of at most `max_bytes`, so that repeated inputs skip inference
+    inline SurrogateBuilder& set_model_memoization(size_t max_bytes) { m_model_memoization_bytes = max_bytes; return *this; }
+
+    /// Caches the outputs of the original function for up to `max_bytes` worth of distinct inputs. Only use this if
+    /// the original function is pure. See Surrogate::set_original_memoization.
+    inline SurrogateBuilder& set_original_memoization(size_t max_bytes) { m_original_memoization_bytes = max_bytes; return *this; }
+
+    /// Whether to make the model on the first call() that needs it (or in preload_all()) rather than in finish().
+    /// Surrogates are often static globals, so this keeps model loading out of static initialization, and skips it
+    /// entirely for surrogates that a run never calls. By default, models loaded via a plugin are made lazily, and
+    /// models passed in directly are initialized in finish().
+    inline SurrogateBuilder& set_lazy_init(bool enabled) { m_lazy_init = enabled; return *this; }
+
+    /// Reloads the model whenever its file changes, without interrupting calls in progress. See Surrogate::watch_model_file.
+    /// This requires the model to have been loaded from a file via set_model(plugin_name, model_name).
+    inline SurrogateBuilder& enable_hot_reload(std::chrono::milliseconds poll_interval = std::chrono::seconds(1)) { m_hot_reload_interval = poll_interval; return *this; }
+
     template <typename T>
     Cursor<T> local(std::string name);
 
@@ -49,6 +86,10 @@ public:
     template <typename T>
     SurrogateBuilder& global_primitive(std::string name, T* binding, Direction dir, std::vector<int64_t>&& shape = {1});
 
+    /// Enables feature scaling for a model variable that has already been declared. The scale and offset are
+    /// fitted from the captures when training, and applied whenever the model's inputs and outputs are packed.
+    SurrogateBuilder& set_normalization(std::string model_var_name, NormalizationKind kind);
+
     std::vector<std::shared_ptr<CallSiteVariable>> get_callsite_vars() const;
     std::vector<std::shared_ptr<ModelVariable>> get_model_vars() const;
 
@@ -58,6 +99,8 @@ public:
 
 private:
     void printOptic(OpticBase* optic, int level);
+    std::shared_ptr<Model> make_model() const;
+    void share_model_vars(Model& model) const;
 };
 
 
@@ -72,6 +115,18 @@ struct Cursor<HeadT> {
     Cursor<HeadT> array(size_t size);
     SurrogateBuilder& end();
 
+    template <typename InnerT>
+    Cursor<InnerT, HeadT> ragged();
+
+    template <typename PointeeT>
+    Cursor<PointeeT, HeadT> deref();
+
+    template <typename PointeeT>
+    Cursor<PointeeT, HeadT> deref_array(size_t size, size_t prefetch_distance=4);
+
+    template <typename FieldT, typename StructT>
+    Cursor<HeadT> gather(std::string name, std::initializer_list<FieldT StructT::*> fields, size_t length, Direction dir=Direction::IN, DType dtype=default_dtype<FieldT>());
+
     template <typename T>
     Cursor<T, HeadT> accessor(std::function<T*(HeadT*)> lambda);
 
@@ -95,6 +150,18 @@ struct Cursor {
     Cursor<HeadT, RestTs...> array(size_t size);
     Cursor<RestTs...> end();
 
+    template <typename InnerT>
+    Cursor<InnerT, HeadT, RestTs...> ragged();
+
+    template <typename PointeeT>
+    Cursor<PointeeT, HeadT, RestTs...> deref();
+
+    template <typename PointeeT>
+    Cursor<PointeeT, HeadT, RestTs...> deref_array(size_t size, size_t prefetch_distance=4);
+
+    template <typename FieldT, typename StructT>
+    Cursor<HeadT, RestTs...> gather(std::string name, std::initializer_list<FieldT StructT::*> fields, size_t length, Direction dir=Direction::IN, DType dtype=default_dtype<FieldT>());
+
     template <typename T>
     Cursor<T, HeadT, RestTs...> accessor(std::function<T*(HeadT*)> lambda);
 
@@ -197,11 +264,52 @@ Cursor<HeadT> Cursor<HeadT>::array(size_t size) {
     return Cursor<HeadT>(child, current_callsite_var, builder);
 }
 
+template<typename HeadT>
+template<typename InnerT>
+Cursor<InnerT, HeadT> Cursor<HeadT>::ragged() {
+    auto child = new RaggedTraversal<HeadT, InnerT>(nullptr);
+    current_callsite_var->optics_tree.push_back(child);
+    return Cursor<InnerT, HeadT>(child, current_callsite_var, builder);
+}
+
+template<typename HeadT>
+template<typename PointeeT>
+Cursor<PointeeT, HeadT> Cursor<HeadT>::deref() {
+    auto child = new PointerLens<HeadT, PointeeT>(nullptr);
+    current_callsite_var->optics_tree.push_back(child);
+    return Cursor<PointeeT, HeadT>(child, current_callsite_var, builder);
+}
+
+template<typename HeadT>
+template<typename PointeeT>
+Cursor<PointeeT, HeadT> Cursor<HeadT>::deref_array(size_t size, size_t prefetch_distance) {
+    auto child = new PointerArrayTraversal<HeadT, PointeeT>(nullptr, size, prefetch_distance);
+    current_callsite_var->optics_tree.push_back(child);
+    return Cursor<PointeeT, HeadT>(child, current_callsite_var, builder);
+}
+
 template<typename HeadT>
 SurrogateBuilder &Cursor<HeadT>::end() {
     return *builder;
 }
 
+template<typename HeadT>
+template<typename FieldT, typename StructT>
+Cursor<HeadT> Cursor<HeadT>::gather(std::string name, std::initializer_list<FieldT StructT::*> fields, size_t length, Direction dir, DType dtype) {
+    auto child = new StructArrayIso<HeadT, StructT, FieldT>(fields, length, dtype);
+    child->name = name;
+    child->is_leaf = true;
+    current_callsite_var->optics_tree.push_back(child->clone());
+
+    auto mv = std::make_shared<ModelVariable>();
+    mv->name = name;
+    mv->accessor = child;
+    mv->is_input = (dir == Direction::IN) || (dir == Direction::INOUT);
+    mv->is_output = (dir == Direction::OUT) || (dir == Direction::INOUT);
+    current_callsite_var->model_vars.push_back(mv);
+    return *this;
+}
+
 
 // -----------------------------------------------------------------
 // Template member function definitions for Cursor<HeadT, RestTs...>
@@ -264,11 +372,62 @@ Cursor<HeadT, RestTs...> Cursor<HeadT, RestTs...>::array(size_t size) {
     return Cursor<HeadT, RestTs...>(child, current_callsite_var, builder);
 }
 
+template <typename HeadT, typename... RestTs>
+template <typename InnerT>
+Cursor<InnerT, HeadT, RestTs...> Cursor<HeadT, RestTs...>::ragged() {
+    auto child = new RaggedTraversal<HeadT, InnerT>(nullptr);
+    focus->unsafe_attach(child);
+    return Cursor<InnerT, HeadT, RestTs...>(child, current_callsite_var, builder);
+}
+
+template <typename HeadT, typename... RestTs>
+template <typename PointeeT>
+Cursor<PointeeT, HeadT, RestTs...> Cursor<HeadT, RestTs...>::deref() {
+    auto child = new PointerLens<HeadT, PointeeT>(nullptr);
+    focus->unsafe_attach(child);
+    return Cursor<PointeeT, HeadT, RestTs...>(child, current_callsite_var, builder);
+}
+
+template <typename HeadT, typename... RestTs>
+template <typename PointeeT>
+Cursor<PointeeT, HeadT, RestTs...> Cursor<HeadT, RestTs...>::deref_array(size_t size, size_t prefetch_distance) {
+    auto child = new PointerArrayTraversal<HeadT, PointeeT>(nullptr, size, prefetch_distance);
+    focus->unsafe_attach(child);
+    return Cursor<PointeeT, HeadT, RestTs...>(child, current_callsite_var, builder);
+}
+
 template <typename HeadT, typename... RestTs>
 Cursor<RestTs...> Cursor<HeadT, RestTs...>::end() {
     return Cursor<RestTs...>(focus->parent, current_callsite_var, builder);
 };
 
+template <typename HeadT, typename... RestTs>
+template <typename FieldT, typename StructT>
+Cursor<HeadT, RestTs...> Cursor<HeadT, RestTs...>::gather(std::string name, std::initializer_list<FieldT StructT::*> fields, size_t length, Direction dir, DType dtype) {
+    auto child = new StructArrayIso<HeadT, StructT, FieldT>(fields, length, dtype);
+    child->name = name;
+    child->is_leaf = true;
+    focus->unsafe_attach(child);
+
+    auto mv = std::make_shared<ModelVariable>();
+    mv->name = name;
+    mv->accessor = cloneOpticsFromLeafToRoot(child);
+    mv->is_input = (dir == Direction::IN) || (dir == Direction::INOUT);
+    mv->is_output = (dir == Direction::OUT) || (dir == Direction::INOUT);
+    current_callsite_var->model_vars.push_back(mv);
+    return *this;
+}
+
+
+
+// Cursors over primitives are what every call to local_primitive() and global_primitive() produces, so we instantiate
+// them once in src/surrogate_builder.cpp instead of in every translation unit. See the matching comment in optics.h.
+extern template struct Cursor<uint8_t>;
+extern template struct Cursor<int16_t>;
+extern template struct Cursor<int32_t>;
+extern template struct Cursor<int64_t>;
+extern template struct Cursor<float>;
+extern template struct Cursor<double>;
 
 } // namespace phasm
 
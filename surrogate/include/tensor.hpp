@@ -12,6 +12,7 @@
 #include <cassert>
 #include <ostream>
 #include <memory>
+#include <functional>
 
 namespace phasm {
 
@@ -23,7 +24,7 @@ enum class DType { Undefined, UI8, I16, I32, I64, F32, F64 };
 // https://pytorch.org/docs/stable/tensor_attributes.html
 
 template <typename T>
-phasm::DType default_dtype() {
+constexpr phasm::DType default_dtype() {
     if (std::is_same<T, uint8_t>()) return phasm::DType::UI8;
     if (std::is_same<T, int16_t>()) return phasm::DType::I16;
     if (std::is_same<T, int32_t>()) return phasm::DType::I32;
@@ -58,7 +59,11 @@ void print_dtype(std::ostream& os, phasm::DType dtype);
 ///    types to dtypes and back again (also note that dtypes include
 ///    some floating point representations that the CPU doesn't understand)
 ///    The way we are currently handling dtypes is pretty bad
-/// 4. Eventually we probably want to support variable length tensors as well
+/// 4. Variable-length ("ragged") tensors are supported in a limited way: A ragged tensor is laid out exactly like a
+///    dense tensor whose rows have all been concatenated along dimension 0, plus a vector of row offsets into
+///    dimension 0. Row r spans [row_offsets[r], row_offsets[r+1]). Thus everything which only cares about the flat
+///    buffer (hashing, equality, copying, dumping) keeps working, and only code which cares about rows needs to
+///    check is_ragged(). Use stack_ragged() and unstack_ragged() to go to and from ragged tensors.
 ///
 class tensor {
 
@@ -66,6 +71,10 @@ class tensor {
     size_t m_length;
     std::vector<int64_t> m_shape;
     DType m_dtype;
+    std::vector<int64_t> m_row_offsets; // Empty unless this tensor is ragged
+    std::function<void(void*)> m_deleter; // Empty unless the buffer is owned by someone else, e.g. a torch::Tensor
+
+    void free_data();
 
 public:
 
@@ -123,6 +132,20 @@ public:
         m_dtype = default_dtype<T>();
     }
 
+    // Construct ragged tensor from buffer, taking ownership. Shape is the shape of all rows concatenated along dimension 0
+    template <typename T> explicit tensor(std::unique_ptr<T[]>&& consecutive_buffer, const std::vector<int64_t>& shape, std::vector<int64_t> row_offsets)
+    : tensor(std::move(consecutive_buffer), shape) {
+        assert(!row_offsets.empty() && row_offsets.back() == (shape.empty() ? 1 : shape[0]));
+        m_row_offsets = std::move(row_offsets);
+    }
+
+    // Construct tensor over a buffer owned by someone else, e.g. a torch::Tensor. This does NOT perform a copy.
+    // Instead of delete[], the deleter is called once this tensor is done with the buffer, so it can release the owner.
+    explicit tensor(void* data, DType dtype, const std::vector<int64_t>& shape, std::function<void(void*)> deleter);
+
+    // Construct tensor with an uninitialized buffer of the given dtype, e.g. for filling via phasm::convert()
+    explicit tensor(DType dtype, const std::vector<int64_t>& shape);
+
     ~tensor();
 
     tensor(const tensor& other) noexcept;
@@ -135,6 +158,10 @@ public:
     inline size_t get_length() const { return m_length; }
     inline DType get_dtype() const { return m_dtype; }
     inline const std::vector<int64_t>& get_shape() const { return m_shape; }
+    inline bool is_ragged() const { return !m_row_offsets.empty(); }
+    inline const std::vector<int64_t>& get_row_offsets() const { return m_row_offsets; }
+    inline size_t get_row_count() const { return m_row_offsets.empty() ? 0 : m_row_offsets.size() - 1; }
+    inline bool is_borrowed() const { return static_cast<bool>(m_deleter); }
 
     bool operator==(const tensor& rhs) const;
 
@@ -156,6 +183,11 @@ public:
 phasm::tensor stack(const std::vector<phasm::tensor>&);
 std::vector<tensor> unstack(const phasm::tensor&);
 
+/// Packs tensors whose leading dimension varies (e.g. one per captured event) into a single ragged tensor,
+/// without padding. All other dimensions must agree. Undefined (empty) tensors become zero-length rows.
+phasm::tensor stack_ragged(const std::vector<phasm::tensor>&);
+std::vector<tensor> unstack_ragged(const phasm::tensor&);
+
 
 inline size_t combineHashes(size_t hash1, size_t hash2) {
     // Not clear why this isn't part of the standard library.
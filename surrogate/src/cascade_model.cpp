@@ -0,0 +1,209 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "cascade_model.h"
+
+#include <iostream>
+
+namespace phasm {
+
+
+void LatencyHistogram::record(std::chrono::nanoseconds duration) {
+    uint64_t ns = duration.count() > 0 ? uint64_t(duration.count()) : 0;
+    size_t bucket = 0;
+    while (bucket + 1 < BUCKET_COUNT && (ns >> (bucket + 1)) != 0) bucket++;
+    m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_total_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+
+uint64_t LatencyHistogram::get_count() const {
+    uint64_t count = 0;
+    for (const auto& c : m_counts) count += c.load(std::memory_order_relaxed);
+    return count;
+}
+
+
+std::chrono::nanoseconds LatencyHistogram::get_mean() const {
+    uint64_t count = get_count();
+    if (count == 0) return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds(m_total_ns.load(std::memory_order_relaxed) / count);
+}
+
+
+std::chrono::nanoseconds LatencyHistogram::get_quantile(double q) const {
+    uint64_t count = get_count();
+    if (count == 0) return std::chrono::nanoseconds(0);
+    auto rank = uint64_t(q * double(count - 1));
+    uint64_t seen = 0;
+    for (size_t bucket=0; bucket<BUCKET_COUNT; ++bucket) {
+        seen += get_bucket_count(bucket);
+        if (seen > rank) return std::chrono::nanoseconds(int64_t(1) << (bucket + 1));
+    }
+    return std::chrono::nanoseconds(int64_t(1) << BUCKET_COUNT);
+}
+
+
+void LatencyHistogram::clear() {
+    for (auto& c : m_counts) c.store(0, std::memory_order_relaxed);
+    m_total_ns.store(0, std::memory_order_relaxed);
+}
+
+
+CascadeModel& CascadeModel::add_stage(std::shared_ptr<Model> model, float min_confidence, std::string name) {
+    if (model == nullptr) {
+        throw std::runtime_error("CascadeModel: Stage model is null");
+    }
+    if (!m_model_vars.empty()) {
+        throw std::runtime_error("CascadeModel: Stages have to be added before the cascade is initialized");
+    }
+    auto stage = std::make_unique<Stage>();
+    stage->model = std::move(model);
+    stage->min_confidence = min_confidence;
+    stage->name = name.empty() ? "stage" + std::to_string(m_stages.size()) : std::move(name);
+    m_stages.push_back(std::move(stage));
+    return *this;
+}
+
+
+void CascadeModel::initialize() {
+    if (m_stages.empty()) {
+        throw std::runtime_error("CascadeModel: No stages");
+    }
+    for (auto& stage : m_stages) {
+        // Each stage gets its own ModelVariables, since it has its own output buffers and normalizations (e.g. from
+        // its own .norm file). It borrows our inputs, outputs and captures around every call; see Model::Loan.
+        std::vector<std::shared_ptr<ModelVariable>> vars;
+        for (const auto& mv : m_model_vars) {
+            vars.push_back(mv->clone_declaration());
+        }
+        stage->model->enable_tensor_combining(m_combine_tensors);
+        stage->model->set_quantization(m_quantization);
+        stage->model->add_model_vars(vars);
+        stage->model->initialize();
+        stage->model->m_lender_vars = m_model_vars;
+    }
+}
+
+
+void CascadeModel::train_from_captures() {
+    // Every stage trains on our captures, in turn, and fits its own normalizations to them unless it came with some
+    for (auto& stage : m_stages) {
+        std::cout << "PHASM: Training cascade stage '" << stage->name << "'" << std::endl;
+        Loan loan(*stage->model);
+        stage->model->m_captured_rows = m_captured_rows;
+        if (stage->model->should_fit_normalizations()) stage->model->fit_normalizations();
+        stage->model->train_from_captures();
+        stage->model->m_captured_rows = 0;
+    }
+    clear_stats();
+}
+
+
+bool CascadeModel::infer() {
+    float confidence;
+    return infer_with_confidence(confidence);
+}
+
+
+bool CascadeModel::infer_with_confidence(float& confidence) {
+    for (auto& stage : m_stages) {
+        auto start = std::chrono::steady_clock::now();
+        bool success;
+        {
+            Loan loan(*stage->model);
+            success = stage->model->infer_with_confidence(confidence);
+        }
+        stage->latency.record(std::chrono::steady_clock::now() - start);
+        if (!success) {
+            stage->failed.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (confidence < stage->min_confidence) {
+            stage->rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            stage->accepted.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    m_fallthroughs.fetch_add(1, std::memory_order_relaxed);
+    confidence = 0;
+    return false;
+}
+
+
+void CascadeModel::train_online() {
+    if (m_captured_rows == 0) return;
+    // Every stage gets its own copy of the newest capture, so that a stage which consumes it doesn't starve the ones
+    // after it. We keep our captures for train_from_captures(), unless every stage consumed its copy.
+    bool all_consumed = true;
+    for (auto& stage : m_stages) {
+        Model& model = *stage->model;
+        for (size_t i=0; i<m_model_vars.size(); ++i) {
+            const ModelVariable& ours = *m_model_vars[i];
+            ModelVariable& theirs = *model.m_model_vars[i];
+            if (ours.is_input) theirs.training_inputs.push_back(ours.training_inputs.back());
+            if (ours.is_output) theirs.training_outputs.push_back(ours.training_outputs.back());
+        }
+        model.m_captured_rows = 1;
+        model.train_online();
+        if (model.get_capture_count() != 0) {
+            // This stage doesn't train online. It gets all of our captures in train_from_captures() instead.
+            all_consumed = false;
+            model.discard_captures();
+        }
+    }
+    if (all_consumed) {
+        discard_captures();
+    }
+}
+
+
+bool CascadeModel::is_online_training_converged() {
+    for (auto& stage : m_stages) {
+        if (stage->model->is_online_training_converged()) return true;
+    }
+    return false;
+}
+
+
+CascadeStageStats CascadeModel::get_stats(size_t index) const {
+    const Stage& stage = *m_stages.at(index);
+    CascadeStageStats stats;
+    stats.name = stage.name;
+    stats.min_confidence = stage.min_confidence;
+    stats.accepted = stage.accepted.load(std::memory_order_relaxed);
+    stats.rejected = stage.rejected.load(std::memory_order_relaxed);
+    stats.failed = stage.failed.load(std::memory_order_relaxed);
+    stats.attempts = stats.accepted + stats.rejected + stats.failed;
+    stats.latency = &stage.latency;
+    return stats;
+}
+
+
+void CascadeModel::clear_stats() {
+    for (auto& stage : m_stages) {
+        stage->accepted.store(0, std::memory_order_relaxed);
+        stage->rejected.store(0, std::memory_order_relaxed);
+        stage->failed.store(0, std::memory_order_relaxed);
+        stage->latency.clear();
+    }
+    m_fallthroughs.store(0, std::memory_order_relaxed);
+}
+
+
+void CascadeModel::print_stats(std::ostream& os) const {
+    os << "PHASM: Model cascade:" << std::endl;
+    for (size_t i=0; i<m_stages.size(); ++i) {
+        CascadeStageStats stats = get_stats(i);
+        os << "  " << stats.name << " (min confidence " << stats.min_confidence << "): "
+           << stats.attempts << " attempts, " << stats.accepted << " accepted, "
+           << stats.rejected << " rejected, " << stats.failed << " failed; latency mean "
+           << stats.latency->get_mean().count() << " ns, p50 < " << stats.latency->get_quantile(0.5).count()
+           << " ns, p99 < " << stats.latency->get_quantile(0.99).count() << " ns" << std::endl;
+    }
+    os << "  original function: " << get_fallthrough_count() << " calls" << std::endl;
+}
+
+} // namespace phasm
@@ -0,0 +1,492 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "dtype_conversion.h"
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PHASM_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define PHASM_X86_SIMD 0
+#endif
+
+namespace phasm {
+
+
+// --------------------------------------------------------------------------
+// Runtime CPU detection
+// --------------------------------------------------------------------------
+
+SimdLevel get_max_simd_level() {
+#if PHASM_X86_SIMD
+    static SimdLevel s_max_level = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+        // Every AVX2 kernel, here and in the plugins, is also compiled for FMA, which a few AVX2 CPUs lack
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::AVX2;
+        if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE4;
+        return SimdLevel::Scalar;
+    }();
+    return s_max_level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+// Conversions on other threads may read this while set_simd_level() writes it. Either level is correct for them.
+static std::atomic<SimdLevel> s_simd_level {get_max_simd_level()};
+
+SimdLevel get_simd_level() {
+    return s_simd_level.load(std::memory_order_relaxed);
+}
+
+void set_simd_level(SimdLevel level) {
+    SimdLevel max_level = get_max_simd_level();
+    s_simd_level.store((static_cast<int>(level) > static_cast<int>(max_level)) ? max_level : level, std::memory_order_relaxed);
+}
+
+size_t get_dtype_size(DType dtype) {
+    switch (dtype) {
+        case DType::UI8: return sizeof(uint8_t);
+        case DType::I16: return sizeof(int16_t);
+        case DType::I32: return sizeof(int32_t);
+        case DType::I64: return sizeof(int64_t);
+        case DType::F32: return sizeof(float);
+        case DType::F64: return sizeof(double);
+        default: return 0;
+    }
+}
+
+
+// --------------------------------------------------------------------------
+// Scalar kernels. These handle every conversion, plus the tails of the SIMD kernels
+// --------------------------------------------------------------------------
+
+template <typename SourceT, typename DestT>
+inline void convert_scalar(const SourceT* source, DestT* dest, size_t length) {
+    for (size_t i=0; i<length; ++i) {
+        dest[i] = static_cast<DestT>(source[i]);
+    }
+}
+
+template <typename SourceT>
+inline void convert_affine_scalar(const SourceT* source, float* dest, size_t length, float scale, float offset) {
+    for (size_t i=0; i<length; ++i) {
+        dest[i] = static_cast<float>(source[i]) * scale + offset;
+    }
+}
+
+template <typename SourceT>
+inline void convert_centered_scalar(const SourceT* source, float* dest, size_t length, double center, double scale) {
+    for (size_t i=0; i<length; ++i) {
+        dest[i] = static_cast<float>((static_cast<double>(source[i]) - center) * scale);
+    }
+}
+
+
+// --------------------------------------------------------------------------
+// SIMD kernels. Each one processes as many full vectors as it can, then hands the
+// remainder to the scalar kernel.
+// --------------------------------------------------------------------------
+
+#if PHASM_X86_SIMD
+
+__attribute__((target("sse4.1")))
+static void f64_to_f32_sse4(const double* source, float* dest, size_t length) {
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(source+i));
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(source+i+2));
+        _mm_storeu_ps(dest+i, _mm_movelh_ps(lo, hi));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx2")))
+static void f64_to_f32_avx2(const double* source, float* dest, size_t length) {
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        _mm_storeu_ps(dest+i, _mm256_cvtpd_ps(_mm256_loadu_pd(source+i)));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx512f")))
+static void f64_to_f32_avx512(const double* source, float* dest, size_t length) {
+    size_t i = 0;
+    for (; i+8 <= length; i+=8) {
+        _mm256_storeu_ps(dest+i, _mm512_cvtpd_ps(_mm512_loadu_pd(source+i)));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("sse4.1")))
+static void f32_to_f64_sse4(const float* source, double* dest, size_t length) {
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        __m128 v = _mm_loadu_ps(source+i);
+        _mm_storeu_pd(dest+i, _mm_cvtps_pd(v));
+        _mm_storeu_pd(dest+i+2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx2")))
+static void f32_to_f64_avx2(const float* source, double* dest, size_t length) {
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        _mm256_storeu_pd(dest+i, _mm256_cvtps_pd(_mm_loadu_ps(source+i)));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx512f")))
+static void f32_to_f64_avx512(const float* source, double* dest, size_t length) {
+    size_t i = 0;
+    for (; i+8 <= length; i+=8) {
+        _mm512_storeu_pd(dest+i, _mm512_cvtps_pd(_mm256_loadu_ps(source+i)));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("sse4.1")))
+static void i32_to_f32_sse4(const int32_t* source, float* dest, size_t length) {
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source+i));
+        _mm_storeu_ps(dest+i, _mm_cvtepi32_ps(v));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx2")))
+static void i32_to_f32_avx2(const int32_t* source, float* dest, size_t length) {
+    size_t i = 0;
+    for (; i+8 <= length; i+=8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source+i));
+        _mm256_storeu_ps(dest+i, _mm256_cvtepi32_ps(v));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx512f")))
+static void i32_to_f32_avx512(const int32_t* source, float* dest, size_t length) {
+    size_t i = 0;
+    for (; i+16 <= length; i+=16) {
+        __m512i v = _mm512_loadu_si512(source+i);
+        _mm512_storeu_ps(dest+i, _mm512_cvtepi32_ps(v));
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+// The cvtt variants truncate towards zero, which matches static_cast<int32_t>
+__attribute__((target("sse4.1")))
+static void f32_to_i32_sse4(const float* source, int32_t* dest, size_t length) {
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        __m128i v = _mm_cvttps_epi32(_mm_loadu_ps(source+i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest+i), v);
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx2")))
+static void f32_to_i32_avx2(const float* source, int32_t* dest, size_t length) {
+    size_t i = 0;
+    for (; i+8 <= length; i+=8) {
+        __m256i v = _mm256_cvttps_epi32(_mm256_loadu_ps(source+i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest+i), v);
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+__attribute__((target("avx512f")))
+static void f32_to_i32_avx512(const float* source, int32_t* dest, size_t length) {
+    size_t i = 0;
+    for (; i+16 <= length; i+=16) {
+        __m512i v = _mm512_cvttps_epi32(_mm512_loadu_ps(source+i));
+        _mm512_storeu_si512(dest+i, v);
+    }
+    convert_scalar(source+i, dest+i, length-i);
+}
+
+// The affine kernels convert to float and apply scale and offset in the same pass, using a fused multiply-add
+// where the CPU has one. They are templated over the source type, with one loader per source type and SIMD level.
+
+__attribute__((target("sse4.1")))
+inline __m128 load_f32x4(const float* p) { return _mm_loadu_ps(p); }
+
+__attribute__((target("sse4.1")))
+inline __m128 load_f32x4(const double* p) { return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)), _mm_cvtpd_ps(_mm_loadu_pd(p+2))); }
+
+__attribute__((target("sse4.1")))
+inline __m128 load_f32x4(const int32_t* p) { return _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+
+__attribute__((target("sse4.1")))
+inline __m128 load_f32x4(const uint8_t* p) {
+    int32_t packed;
+    std::memcpy(&packed, p, sizeof(packed));
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+}
+
+template <typename SourceT>
+__attribute__((target("sse4.1")))
+static void affine_sse4(const SourceT* source, float* dest, size_t length, float scale, float offset) {
+    __m128 scale_v = _mm_set1_ps(scale);
+    __m128 offset_v = _mm_set1_ps(offset);
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        // SSE4 has no FMA, so this may differ from the other levels in the last bit
+        _mm_storeu_ps(dest+i, _mm_add_ps(_mm_mul_ps(load_f32x4(source+i), scale_v), offset_v));
+    }
+    convert_affine_scalar(source+i, dest+i, length-i, scale, offset);
+}
+
+__attribute__((target("avx2,fma")))
+inline __m256 load_f32x8(const float* p) { return _mm256_loadu_ps(p); }
+
+__attribute__((target("avx2,fma")))
+inline __m256 load_f32x8(const double* p) { return _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(p+4)), _mm256_cvtpd_ps(_mm256_loadu_pd(p))); }
+
+__attribute__((target("avx2,fma")))
+inline __m256 load_f32x8(const int32_t* p) { return _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))); }
+
+__attribute__((target("avx2,fma")))
+inline __m256 load_f32x8(const uint8_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))); }
+
+template <typename SourceT>
+__attribute__((target("avx2,fma")))
+static void affine_avx2(const SourceT* source, float* dest, size_t length, float scale, float offset) {
+    __m256 scale_v = _mm256_set1_ps(scale);
+    __m256 offset_v = _mm256_set1_ps(offset);
+    size_t i = 0;
+    for (; i+8 <= length; i+=8) {
+        _mm256_storeu_ps(dest+i, _mm256_fmadd_ps(load_f32x8(source+i), scale_v, offset_v));
+    }
+    convert_affine_scalar(source+i, dest+i, length-i, scale, offset);
+}
+
+__attribute__((target("avx512f")))
+inline __m512 load_f32x16(const float* p) { return _mm512_loadu_ps(p); }
+
+__attribute__((target("avx512f")))
+inline __m512 load_f32x16(const double* p) {
+    __m256 lo = _mm512_cvtpd_ps(_mm512_loadu_pd(p));
+    __m256 hi = _mm512_cvtpd_ps(_mm512_loadu_pd(p+8));
+    return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(lo)), _mm256_castps_pd(hi), 1));
+}
+
+__attribute__((target("avx512f")))
+inline __m512 load_f32x16(const int32_t* p) { return _mm512_cvtepi32_ps(_mm512_loadu_si512(p)); }
+
+__attribute__((target("avx512f")))
+inline __m512 load_f32x16(const uint8_t* p) { return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)))); }
+
+template <typename SourceT>
+__attribute__((target("avx512f")))
+static void affine_avx512(const SourceT* source, float* dest, size_t length, float scale, float offset) {
+    __m512 scale_v = _mm512_set1_ps(scale);
+    __m512 offset_v = _mm512_set1_ps(offset);
+    size_t i = 0;
+    for (; i+16 <= length; i+=16) {
+        _mm512_storeu_ps(dest+i, _mm512_fmadd_ps(load_f32x16(source+i), scale_v, offset_v));
+    }
+    convert_affine_scalar(source+i, dest+i, length-i, scale, offset);
+}
+
+// The centered kernels widen to double, subtract the center and scale, and only then narrow to float
+
+__attribute__((target("sse4.1")))
+inline __m128d load_f64x2(const double* p) { return _mm_loadu_pd(p); }
+
+__attribute__((target("sse4.1")))
+inline __m128d load_f64x2(const float* p) { return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))); }
+
+__attribute__((target("sse4.1")))
+inline __m128d load_f64x2(const int32_t* p) { return _mm_cvtepi32_pd(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))); }
+
+template <typename SourceT>
+__attribute__((target("sse4.1")))
+static void centered_sse4(const SourceT* source, float* dest, size_t length, double center, double scale) {
+    __m128d center_v = _mm_set1_pd(center);
+    __m128d scale_v = _mm_set1_pd(scale);
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_sub_pd(load_f64x2(source+i), center_v), scale_v));
+        __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_sub_pd(load_f64x2(source+i+2), center_v), scale_v));
+        _mm_storeu_ps(dest+i, _mm_movelh_ps(lo, hi));
+    }
+    convert_centered_scalar(source+i, dest+i, length-i, center, scale);
+}
+
+__attribute__((target("avx2")))
+inline __m256d load_f64x4(const double* p) { return _mm256_loadu_pd(p); }
+
+__attribute__((target("avx2")))
+inline __m256d load_f64x4(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+
+__attribute__((target("avx2")))
+inline __m256d load_f64x4(const int32_t* p) { return _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+
+template <typename SourceT>
+__attribute__((target("avx2")))
+static void centered_avx2(const SourceT* source, float* dest, size_t length, double center, double scale) {
+    __m256d center_v = _mm256_set1_pd(center);
+    __m256d scale_v = _mm256_set1_pd(scale);
+    size_t i = 0;
+    for (; i+4 <= length; i+=4) {
+        _mm_storeu_ps(dest+i, _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_sub_pd(load_f64x4(source+i), center_v), scale_v)));
+    }
+    convert_centered_scalar(source+i, dest+i, length-i, center, scale);
+}
+
+__attribute__((target("avx512f")))
+inline __m512d load_f64x8(const double* p) { return _mm512_loadu_pd(p); }
+
+__attribute__((target("avx512f")))
+inline __m512d load_f64x8(const float* p) { return _mm512_cvtps_pd(_mm256_loadu_ps(p)); }
+
+__attribute__((target("avx512f")))
+inline __m512d load_f64x8(const int32_t* p) { return _mm512_cvtepi32_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))); }
+
+template <typename SourceT>
+__attribute__((target("avx512f")))
+static void centered_avx512(const SourceT* source, float* dest, size_t length, double center, double scale) {
+    __m512d center_v = _mm512_set1_pd(center);
+    __m512d scale_v = _mm512_set1_pd(scale);
+    size_t i = 0;
+    for (; i+8 <= length; i+=8) {
+        _mm256_storeu_ps(dest+i, _mm512_cvtpd_ps(_mm512_mul_pd(_mm512_sub_pd(load_f64x8(source+i), center_v), scale_v)));
+    }
+    convert_centered_scalar(source+i, dest+i, length-i, center, scale);
+}
+
+#endif // PHASM_X86_SIMD
+
+
+// --------------------------------------------------------------------------
+// Dispatch
+// --------------------------------------------------------------------------
+
+#if PHASM_X86_SIMD
+#define PHASM_DISPATCH_SIMD(KERNEL, ...)                                    \
+    switch (s_simd_level.load(std::memory_order_relaxed)) {                 \
+        case SimdLevel::AVX512: KERNEL##_avx512(__VA_ARGS__); return true;  \
+        case SimdLevel::AVX2: KERNEL##_avx2(__VA_ARGS__); return true;      \
+        case SimdLevel::SSE4: KERNEL##_sse4(__VA_ARGS__); return true;      \
+        default: return false;                                              \
+    }
+#else
+#define PHASM_DISPATCH_SIMD(KERNEL, ...) return false;
+#endif
+
+/// Returns false if there is no SIMD kernel for this conversion, or if SIMD is disabled
+static bool convert_simd(const void* source, DType source_dtype, void* dest, DType dest_dtype, size_t length) {
+    if (source_dtype == DType::F64 && dest_dtype == DType::F32) {
+        PHASM_DISPATCH_SIMD(f64_to_f32, static_cast<const double*>(source), static_cast<float*>(dest), length)
+    }
+    if (source_dtype == DType::F32 && dest_dtype == DType::F64) {
+        PHASM_DISPATCH_SIMD(f32_to_f64, static_cast<const float*>(source), static_cast<double*>(dest), length)
+    }
+    if (source_dtype == DType::I32 && dest_dtype == DType::F32) {
+        PHASM_DISPATCH_SIMD(i32_to_f32, static_cast<const int32_t*>(source), static_cast<float*>(dest), length)
+    }
+    if (source_dtype == DType::F32 && dest_dtype == DType::I32) {
+        PHASM_DISPATCH_SIMD(f32_to_i32, static_cast<const float*>(source), static_cast<int32_t*>(dest), length)
+    }
+    return false;
+}
+
+template <typename SourceT>
+static void convert_from(const SourceT* source, void* dest, DType dest_dtype, size_t length) {
+    switch (dest_dtype) {
+        case DType::UI8: convert_scalar(source, static_cast<uint8_t*>(dest), length); break;
+        case DType::I16: convert_scalar(source, static_cast<int16_t*>(dest), length); break;
+        case DType::I32: convert_scalar(source, static_cast<int32_t*>(dest), length); break;
+        case DType::I64: convert_scalar(source, static_cast<int64_t*>(dest), length); break;
+        case DType::F32: convert_scalar(source, static_cast<float*>(dest), length); break;
+        case DType::F64: convert_scalar(source, static_cast<double*>(dest), length); break;
+        default: throw std::runtime_error("convert: Invalid destination dtype");
+    }
+}
+
+void convert(const void* source, DType source_dtype, void* dest, DType dest_dtype, size_t length) {
+    if (source_dtype == dest_dtype && source_dtype != DType::Undefined) {
+        std::memcpy(dest, source, length * get_dtype_size(source_dtype));
+        return;
+    }
+    if (convert_simd(source, source_dtype, dest, dest_dtype, length)) {
+        return;
+    }
+    switch (source_dtype) {
+        case DType::UI8: convert_from(static_cast<const uint8_t*>(source), dest, dest_dtype, length); break;
+        case DType::I16: convert_from(static_cast<const int16_t*>(source), dest, dest_dtype, length); break;
+        case DType::I32: convert_from(static_cast<const int32_t*>(source), dest, dest_dtype, length); break;
+        case DType::I64: convert_from(static_cast<const int64_t*>(source), dest, dest_dtype, length); break;
+        case DType::F32: convert_from(static_cast<const float*>(source), dest, dest_dtype, length); break;
+        case DType::F64: convert_from(static_cast<const double*>(source), dest, dest_dtype, length); break;
+        default: throw std::runtime_error("convert: Invalid source dtype");
+    }
+}
+
+static bool convert_affine_simd(const void* source, DType source_dtype, float* dest, size_t length, float scale, float offset) {
+    switch (source_dtype) {
+        case DType::UI8: { PHASM_DISPATCH_SIMD(affine, static_cast<const uint8_t*>(source), dest, length, scale, offset) }
+        case DType::I32: { PHASM_DISPATCH_SIMD(affine, static_cast<const int32_t*>(source), dest, length, scale, offset) }
+        case DType::F32: { PHASM_DISPATCH_SIMD(affine, static_cast<const float*>(source), dest, length, scale, offset) }
+        case DType::F64: { PHASM_DISPATCH_SIMD(affine, static_cast<const double*>(source), dest, length, scale, offset) }
+        default: return false;
+    }
+}
+
+void convert_affine(const void* source, DType source_dtype, float* dest, size_t length, float scale, float offset) {
+    if (convert_affine_simd(source, source_dtype, dest, length, scale, offset)) {
+        return;
+    }
+    switch (source_dtype) {
+        case DType::UI8: convert_affine_scalar(static_cast<const uint8_t*>(source), dest, length, scale, offset); break;
+        case DType::I16: convert_affine_scalar(static_cast<const int16_t*>(source), dest, length, scale, offset); break;
+        case DType::I32: convert_affine_scalar(static_cast<const int32_t*>(source), dest, length, scale, offset); break;
+        case DType::I64: convert_affine_scalar(static_cast<const int64_t*>(source), dest, length, scale, offset); break;
+        case DType::F32: convert_affine_scalar(static_cast<const float*>(source), dest, length, scale, offset); break;
+        case DType::F64: convert_affine_scalar(static_cast<const double*>(source), dest, length, scale, offset); break;
+        default: throw std::runtime_error("convert_affine: Invalid source dtype");
+    }
+}
+
+static bool convert_centered_simd(const void* source, DType source_dtype, float* dest, size_t length, double center, double scale) {
+    switch (source_dtype) {
+        case DType::I32: { PHASM_DISPATCH_SIMD(centered, static_cast<const int32_t*>(source), dest, length, center, scale) }
+        case DType::F32: { PHASM_DISPATCH_SIMD(centered, static_cast<const float*>(source), dest, length, center, scale) }
+        case DType::F64: { PHASM_DISPATCH_SIMD(centered, static_cast<const double*>(source), dest, length, center, scale) }
+        default: return false;
+    }
+}
+
+void convert_centered(const void* source, DType source_dtype, float* dest, size_t length, double center, double scale) {
+    if (convert_centered_simd(source, source_dtype, dest, length, center, scale)) {
+        return;
+    }
+    switch (source_dtype) {
+        case DType::UI8: convert_centered_scalar(static_cast<const uint8_t*>(source), dest, length, center, scale); break;
+        case DType::I16: convert_centered_scalar(static_cast<const int16_t*>(source), dest, length, center, scale); break;
+        case DType::I32: convert_centered_scalar(static_cast<const int32_t*>(source), dest, length, center, scale); break;
+        case DType::I64: convert_centered_scalar(static_cast<const int64_t*>(source), dest, length, center, scale); break;
+        case DType::F32: convert_centered_scalar(static_cast<const float*>(source), dest, length, center, scale); break;
+        case DType::F64: convert_centered_scalar(static_cast<const double*>(source), dest, length, center, scale); break;
+        default: throw std::runtime_error("convert_centered: Invalid source dtype");
+    }
+}
+
+void convert_scaled(const void* source, DType source_dtype, float* dest, size_t length, float scale) {
+    // x*scale + 0 rounds exactly like x*scale, with or without FMA
+    convert_affine(source, source_dtype, dest, length, scale, 0.0f);
+}
+
+#undef PHASM_DISPATCH_SIMD
+
+} // namespace phasm
@@ -0,0 +1,159 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "interpolation_model.h"
+#include "knn_index.h"
+#include "normalization.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+namespace phasm {
+
+InterpolationModel::InterpolationModel(std::string filename)
+    : m_filename(std::move(filename)), m_interpolation(Interpolation::Linear) {}
+
+
+InterpolationModel::InterpolationModel(std::string filename, std::vector<GridAxis> axes, Interpolation interpolation)
+    : m_filename(std::move(filename)), m_axes(std::move(axes)), m_interpolation(interpolation) {}
+
+
+void InterpolationModel::initialize() {
+    for (const auto& input : m_inputs) {
+        if (input->isRagged()) {
+            throw std::runtime_error("InterpolationModel: Ragged input '" + input->name + "' isn't supported");
+        }
+        int64_t length = 1;
+        for (int64_t dim : input->shape()) length *= dim;
+        m_input_dim += length;
+        m_input_tensors.push_back(&input->inference_input);
+    }
+    for (const auto& output : m_outputs) {
+        if (output->isRagged()) {
+            throw std::runtime_error("InterpolationModel: Ragged output '" + output->name + "' isn't supported");
+        }
+        std::vector<int64_t> shape = output->shape();
+        int64_t length = 1;
+        for (int64_t dim : shape) length *= dim;
+        m_output_shapes.push_back(shape);
+        m_output_lengths.push_back(length);
+        m_output_dim += length;
+    }
+    if (!m_axes.empty() && m_axes.size() != m_input_dim) {
+        throw std::runtime_error("InterpolationModel: Got " + std::to_string(m_axes.size()) + " axes for " +
+                                 std::to_string(m_input_dim) + " input elements");
+    }
+
+    if (!std::ifstream(m_filename).good()) {
+        if (m_axes.empty()) {
+            throw std::runtime_error("InterpolationModel: '" + m_filename + "' doesn't exist, and no grid was given to build it on");
+        }
+        std::cerr << "PHASM: No interpolation table at '" << m_filename << "' yet; it will be built from the captures" << std::endl;
+        return;
+    }
+    m_table = InterpolationTable::load(m_filename);
+    if (m_table.get_input_dim() != m_input_dim || m_table.get_output_dim() != m_output_dim) {
+        throw std::runtime_error("InterpolationModel: '" + m_filename + "' maps " + std::to_string(m_table.get_input_dim()) +
+                                 " inputs to " + std::to_string(m_table.get_output_dim()) + " outputs, but the model variables have " +
+                                 std::to_string(m_input_dim) + " inputs and " + std::to_string(m_output_dim) + " outputs");
+    }
+    std::cerr << "PHASM: Mapped interpolation table '" << m_filename << "' (" << m_table.get_point_count() << " grid points)" << std::endl;
+}
+
+
+void InterpolationModel::train_from_captures() {
+    if (m_axes.empty()) {
+        m_axes = m_table.get_axes(); // Rebuilding a table we loaded
+        m_interpolation = m_table.get_interpolation();
+    }
+    size_t rows = get_capture_count();
+    if (rows == 0) {
+        std::cerr << "PHASM: No captures to build an interpolation table from" << std::endl;
+        return;
+    }
+    std::vector<float> train_x, train_y, holdout_x, holdout_y;
+    std::vector<float> x(m_input_dim), y(m_output_dim);
+    std::vector<const tensor*> row_inputs(m_inputs.size()), row_outputs(m_outputs.size());
+    size_t off_grid_rows = 0;
+    auto is_on_grid = [this](const float* point) {
+        for (size_t d=0; d<m_axes.size(); ++d) {
+            float u = (point[d] - m_axes[d].lower) / m_axes[d].get_spacing();
+            if (u < -1e-4f || u > m_axes[d].count - 1 + 1e-4f || std::abs(u - std::round(u)) > 1e-4f) return false;
+        }
+        return true;
+    };
+    for (size_t r=0; r<rows; ++r) {
+        for (size_t i=0; i<m_inputs.size(); ++i) row_inputs[i] = &m_inputs[i]->training_inputs[r];
+        for (size_t i=0; i<m_outputs.size(); ++i) row_outputs[i] = &m_outputs[i]->training_outputs[r];
+        flatten_and_join_into(row_inputs, {}, x.data(), m_input_dim);
+        flatten_and_join_into(row_outputs, {}, y.data(), m_output_dim);
+        bool holdout = !is_on_grid(x.data()) && (off_grid_rows++ % 10 == 9);
+        auto& dest_x = holdout ? holdout_x : train_x;
+        auto& dest_y = holdout ? holdout_y : train_y;
+        dest_x.insert(dest_x.end(), x.begin(), x.end());
+        dest_y.insert(dest_y.end(), y.begin(), y.end());
+    }
+    size_t train_rows = train_x.size() / m_input_dim;
+    if (train_rows == 0) {
+        std::cerr << "PHASM: No captures left to build an interpolation table from after holding some out" << std::endl;
+        return;
+    }
+
+    // Grid points which were captured exactly come out of the index at distance 0, and are copied as-is
+    auto start = std::chrono::steady_clock::now();
+    KnnIndex index = KnnIndex::build(train_x.data(), train_y.data(), train_rows, m_input_dim, m_output_dim);
+    InterpolationTable table(m_axes, m_output_dim, m_interpolation);
+    size_t output_dim = m_output_dim;
+    table.fill([&index, output_dim](const float* point, float* values) {
+        constexpr size_t k = 4;
+        uint32_t neighbors[k];
+        float distances[k];
+        size_t found = index.query(point, k, neighbors, distances);
+        if (distances[0] == 0.0f) found = 1;
+        float total_weight = 0;
+        for (size_t m=0; m<output_dim; ++m) values[m] = 0;
+        for (size_t n=0; n<found; ++n) {
+            float weight = (found == 1) ? 1.0f : 1.0f / distances[n];
+            const float* y = index.get_output(neighbors[n]);
+            for (size_t m=0; m<output_dim; ++m) values[m] += weight * y[m];
+            total_weight += weight;
+        }
+        for (size_t m=0; m<output_dim; ++m) values[m] /= total_weight;
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "PHASM: Filled " << table.get_point_count() << " grid points from " << train_rows
+              << " captures in " << seconds << " s" << std::endl;
+
+    m_table = std::move(table);
+    m_table.save(m_filename);
+    std::cerr << "PHASM: Saved interpolation table to '" << m_filename << "'" << std::endl;
+
+    m_report = m_table.evaluate(holdout_x.data(), holdout_y.data(), holdout_x.size() / m_input_dim);
+    std::cerr << "PHASM: " << m_report;
+}
+
+
+bool InterpolationModel::infer() {
+    if (m_table.get_point_count() == 0) return false;
+    static thread_local std::vector<float> x, y;
+    x.resize(m_input_dim);
+    y.resize(m_output_dim);
+    flatten_and_join_into(m_input_tensors, {}, x.data(), m_input_dim);
+    if (!m_table.contains(x.data())) {
+        return false;
+    }
+    m_table.interpolate(x.data(), y.data());
+
+    static const Normalization identity;
+    const float* output = y.data();
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        unpack_output_into(output, m_output_shapes[i], identity, m_outputs[i]->inference_output);
+        output += m_output_lengths[i];
+    }
+    return true;
+}
+
+} // namespace phasm
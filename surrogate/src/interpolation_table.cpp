@@ -0,0 +1,438 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "interpolation_table.h"
+#include "mapped_file.h"
+#include "dtype_conversion.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define PHASM_INTERPOLATION_X86
+#endif
+
+namespace phasm {
+
+static const char s_magic[8] = {'P','H','A','S','M','G','R','D'};
+static const uint32_t s_version = 1;
+
+struct GridHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t input_dim;
+    uint32_t output_dim;
+    uint32_t interpolation;
+};
+struct GridAxisRecord {
+    float lower;
+    float upper;
+    uint32_t count;
+    uint32_t unused;
+};
+static_assert(sizeof(GridHeader) == 24, "GridHeader has to match the file format");
+static_assert(sizeof(GridAxisRecord) == 16, "GridAxisRecord has to match the file format");
+
+static size_t get_values_offset(size_t input_dim) {
+    size_t header_bytes = sizeof(GridHeader) + input_dim * sizeof(GridAxisRecord);
+    return (header_bytes + 63) / 64 * 64;
+}
+
+static size_t get_tap_count(Interpolation interpolation) {
+    return (interpolation == Interpolation::Cubic) ? 4 : 2;
+}
+
+
+// --------------------------------------------------------------------------
+// Kernels. Both compute, per axis, which grid points ("taps") surround the
+// query and how much each contributes, and then sum over every combination
+// of taps across axes. Offsets are in grid points, i.e. into each output's
+// array of values.
+// --------------------------------------------------------------------------
+
+struct TableView {
+    const GridAxis* axes;
+    const uint32_t* strides;
+    size_t input_dim;
+    size_t output_dim;
+    size_t value_stride;
+    const float* values;
+    size_t taps;
+};
+
+/// Catmull-Rom weights for the points at -1, 0, 1, 2 relative to the cell, at fraction t into it
+static inline void cubic_weights(float t, float* w) {
+    float t2 = t * t, t3 = t2 * t;
+    w[0] = 0.5f * (-t3 + 2*t2 - t);
+    w[1] = 0.5f * (3*t3 - 5*t2 + 2);
+    w[2] = 0.5f * (-3*t3 + 4*t2 + t);
+    w[3] = 0.5f * (t3 - t2);
+}
+
+static void interpolate_scalar(const TableView& v, const float* x, float* y, size_t rows) {
+    constexpr size_t MAX_DIMS = 12;
+    uint32_t tap_offsets[MAX_DIMS][4];
+    float tap_weights[MAX_DIMS][4];
+    size_t tap[MAX_DIMS];
+
+    for (size_t r=0; r<rows; ++r) {
+        const float* xr = x + r * v.input_dim;
+        float* yr = y + r * v.output_dim;
+        for (size_t d=0; d<v.input_dim; ++d) {
+            const GridAxis& axis = v.axes[d];
+            int64_t last = axis.count - 1;
+            float u = (xr[d] - axis.lower) / axis.get_spacing();
+            u = std::min(std::max(u, 0.0f), float(last));
+            int64_t cell = std::min<int64_t>(int64_t(std::floor(u)), last - 1);
+            float t = u - cell;
+            if (v.taps == 2) {
+                tap_offsets[d][0] = cell * v.strides[d];
+                tap_offsets[d][1] = (cell + 1) * v.strides[d];
+                tap_weights[d][0] = 1 - t;
+                tap_weights[d][1] = t;
+            }
+            else {
+                for (int k=0; k<4; ++k) {
+                    int64_t i = std::min(std::max<int64_t>(cell + k - 1, 0), last);
+                    tap_offsets[d][k] = i * v.strides[d];
+                }
+                cubic_weights(t, tap_weights[d]);
+            }
+            tap[d] = 0;
+        }
+        for (size_t m=0; m<v.output_dim; ++m) yr[m] = 0;
+
+        // Odometer over all combinations of taps, last axis fastest
+        while (true) {
+            size_t offset = 0;
+            float weight = 1;
+            for (size_t d=0; d<v.input_dim; ++d) {
+                offset += tap_offsets[d][tap[d]];
+                weight *= tap_weights[d][tap[d]];
+            }
+            for (size_t m=0; m<v.output_dim; ++m) {
+                yr[m] += weight * v.values[m * v.value_stride + offset];
+            }
+            size_t d = v.input_dim;
+            while (d > 0 && ++tap[d-1] == v.taps) {
+                tap[d-1] = 0;
+                d--;
+            }
+            if (d == 0) break;
+        }
+    }
+}
+
+#ifdef PHASM_INTERPOLATION_X86
+
+/// 0.5 * (a*t^3 + b*t^2 + c*t + e), i.e. one of the Catmull-Rom weights in cubic_weights()
+__attribute__((target("avx2,fma")))
+static inline __m256 avx2_cubic_weight(__m256 t, __m256 t2, __m256 t3, float a, float b, float c, float e) {
+    __m256 p = _mm256_fmadd_ps(_mm256_set1_ps(a), t3, _mm256_set1_ps(e));
+    p = _mm256_fmadd_ps(_mm256_set1_ps(b), t2, p);
+    p = _mm256_fmadd_ps(_mm256_set1_ps(c), t, p);
+    return _mm256_mul_ps(_mm256_set1_ps(0.5f), p);
+}
+
+/// Eight rows at a time. The tap offsets and weights are computed once per block, and then every output is a chain
+/// of gathers and FMAs over the same offsets, one per combination of taps.
+__attribute__((target("avx2,fma")))
+static void interpolate_avx2(const TableView& v, const float* x, float* y, size_t rows) {
+    size_t combos = 1;
+    for (size_t d=0; d<v.input_dim; ++d) combos *= v.taps;
+    static thread_local std::vector<int32_t> tap_offsets, offsets;
+    static thread_local std::vector<float> tap_weights, weights;
+    tap_offsets.resize(v.input_dim * 4 * 8);
+    tap_weights.resize(v.input_dim * 4 * 8);
+    offsets.resize(combos * 8);
+    weights.resize(combos * 8);
+    size_t tap[12];
+
+    size_t r = 0;
+    for (; r + 8 <= rows; r += 8) {
+        for (size_t d=0; d<v.input_dim; ++d) {
+            const GridAxis& axis = v.axes[d];
+            float lane[8];
+            for (int l=0; l<8; ++l) lane[l] = x[(r + l) * v.input_dim + d];
+            __m256 last = _mm256_set1_ps(float(axis.count - 1));
+            __m256 u = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(lane), _mm256_set1_ps(axis.lower)),
+                                     _mm256_set1_ps(1.0f / axis.get_spacing()));
+            u = _mm256_min_ps(_mm256_max_ps(u, _mm256_setzero_ps()), last);
+            __m256 cell = _mm256_min_ps(_mm256_floor_ps(u), _mm256_sub_ps(last, _mm256_set1_ps(1.0f)));
+            __m256 t = _mm256_sub_ps(u, cell);
+            __m256i cell_i = _mm256_cvttps_epi32(cell);
+            __m256i stride = _mm256_set1_epi32(int32_t(v.strides[d]));
+            int32_t* to = tap_offsets.data() + d * 32;
+            float* tw = tap_weights.data() + d * 32;
+            if (v.taps == 2) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(to), _mm256_mullo_epi32(cell_i, stride));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(to + 8),
+                                    _mm256_mullo_epi32(_mm256_add_epi32(cell_i, _mm256_set1_epi32(1)), stride));
+                _mm256_storeu_ps(tw, _mm256_sub_ps(_mm256_set1_ps(1.0f), t));
+                _mm256_storeu_ps(tw + 8, t);
+            }
+            else {
+                __m256i last_i = _mm256_set1_epi32(int32_t(axis.count - 1));
+                for (int k=0; k<4; ++k) {
+                    __m256i i = _mm256_add_epi32(cell_i, _mm256_set1_epi32(k - 1));
+                    i = _mm256_min_epi32(_mm256_max_epi32(i, _mm256_setzero_si256()), last_i);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(to + k*8), _mm256_mullo_epi32(i, stride));
+                }
+                __m256 t2 = _mm256_mul_ps(t, t), t3 = _mm256_mul_ps(t2, t);
+                _mm256_storeu_ps(tw, avx2_cubic_weight(t, t2, t3, -1, 2, -1, 0));
+                _mm256_storeu_ps(tw + 8, avx2_cubic_weight(t, t2, t3, 3, -5, 0, 2));
+                _mm256_storeu_ps(tw + 16, avx2_cubic_weight(t, t2, t3, -3, 4, 1, 0));
+                _mm256_storeu_ps(tw + 24, avx2_cubic_weight(t, t2, t3, 1, -1, 0, 0));
+            }
+            tap[d] = 0;
+        }
+
+        for (size_t c=0; c<combos; ++c) {
+            __m256i offset = _mm256_setzero_si256();
+            __m256 weight = _mm256_set1_ps(1.0f);
+            for (size_t d=0; d<v.input_dim; ++d) {
+                size_t k = d * 32 + tap[d] * 8;
+                offset = _mm256_add_epi32(offset, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tap_offsets.data() + k)));
+                weight = _mm256_mul_ps(weight, _mm256_loadu_ps(tap_weights.data() + k));
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(offsets.data() + c*8), offset);
+            _mm256_storeu_ps(weights.data() + c*8, weight);
+            for (size_t d=v.input_dim; d>0; --d) {
+                if (++tap[d-1] < v.taps) break;
+                tap[d-1] = 0;
+            }
+        }
+
+        for (size_t m=0; m<v.output_dim; ++m) {
+            const float* values = v.values + m * v.value_stride;
+            __m256 acc = _mm256_setzero_ps();
+            for (size_t c=0; c<combos; ++c) {
+                __m256i offset = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(offsets.data() + c*8));
+                acc = _mm256_fmadd_ps(_mm256_loadu_ps(weights.data() + c*8), _mm256_i32gather_ps(values, offset, 4), acc);
+            }
+            float result[8];
+            _mm256_storeu_ps(result, acc);
+            for (int l=0; l<8; ++l) y[(r + l) * v.output_dim + m] = result[l];
+        }
+    }
+    if (r < rows) {
+        interpolate_scalar(v, x + r * v.input_dim, y + r * v.output_dim, rows - r);
+    }
+}
+
+#endif
+
+
+// --------------------------------------------------------------------------
+// InterpolationTable
+// --------------------------------------------------------------------------
+
+void InterpolationTable::init_layout() {
+    if (m_axes.empty() || m_axes.size() > 12) {
+        throw std::runtime_error("InterpolationTable: Need between 1 and 12 input dimensions");
+    }
+    size_t neighbors = 1;
+    for (const auto& axis : m_axes) {
+        if (axis.count < 2 || !(axis.upper > axis.lower)) {
+            throw std::runtime_error("InterpolationTable: Every axis needs at least 2 points and upper > lower");
+        }
+        neighbors *= get_tap_count(m_interpolation);
+    }
+    if (neighbors > MAX_NEIGHBORS) {
+        throw std::runtime_error("InterpolationTable: Too many dimensions for this kind of interpolation");
+    }
+    m_strides.assign(m_axes.size(), 0);
+    m_point_count = 1;
+    for (size_t d=m_axes.size(); d>0; --d) {
+        m_strides[d-1] = m_point_count;
+        m_point_count *= m_axes[d-1].count;
+        if (m_point_count > size_t(std::numeric_limits<int32_t>::max())) {
+            throw std::runtime_error("InterpolationTable: Grid has too many points");
+        }
+    }
+    m_value_stride = (m_point_count + 15) / 16 * 16;
+}
+
+
+InterpolationTable::InterpolationTable(std::vector<GridAxis> axes, size_t output_dim, Interpolation interpolation)
+    : m_axes(std::move(axes)), m_output_dim(output_dim), m_interpolation(interpolation) {
+    init_layout();
+    size_t count = m_value_stride * m_output_dim;
+    auto* values = static_cast<float*>(::operator new[](std::max<size_t>(count, 1) * sizeof(float), std::align_val_t(64)));
+    std::fill(values, values + count, 0.0f);
+    m_storage = std::shared_ptr<float>(values, [](float* p) { ::operator delete[](p, std::align_val_t(64)); });
+    m_values = values;
+}
+
+
+void InterpolationTable::set_interpolation(Interpolation interpolation) {
+    Interpolation previous = m_interpolation;
+    m_interpolation = interpolation;
+    try {
+        init_layout();
+    }
+    catch (...) {
+        m_interpolation = previous;
+        throw;
+    }
+}
+
+
+void InterpolationTable::get_point(size_t index, float* x) const {
+    for (size_t d=0; d<m_axes.size(); ++d) {
+        x[d] = m_axes[d].get_point((index / m_strides[d]) % m_axes[d].count);
+    }
+}
+
+
+void InterpolationTable::set_value(size_t output, size_t index, float value) {
+    if (m_storage == nullptr) {
+        throw std::runtime_error("InterpolationTable: Mapped tables are read-only");
+    }
+    m_storage.get()[output * m_value_stride + index] = value;
+}
+
+
+void InterpolationTable::fill(const std::function<void(const float* x, float* y)>& f, size_t threads) {
+    if (m_storage == nullptr) {
+        throw std::runtime_error("InterpolationTable: Mapped tables are read-only");
+    }
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, m_point_count);
+    float* values = m_storage.get();
+    auto fill_range = [&](size_t begin, size_t end) {
+        std::vector<float> x(m_axes.size()), y(m_output_dim);
+        for (size_t i=begin; i<end; ++i) {
+            get_point(i, x.data());
+            f(x.data(), y.data());
+            for (size_t m=0; m<m_output_dim; ++m) values[m * m_value_stride + i] = y[m];
+        }
+    };
+    std::vector<std::thread> workers;
+    size_t chunk = (m_point_count + threads - 1) / threads;
+    for (size_t t=1; t<threads; ++t) {
+        workers.emplace_back(fill_range, std::min(t * chunk, m_point_count), std::min((t+1) * chunk, m_point_count));
+    }
+    fill_range(0, std::min(chunk, m_point_count));
+    for (auto& worker : workers) worker.join();
+}
+
+
+void InterpolationTable::interpolate(const float* x, float* y, size_t rows) const {
+    TableView view {m_axes.data(), m_strides.data(), m_axes.size(), m_output_dim, m_value_stride, m_values,
+                    get_tap_count(m_interpolation)};
+#ifdef PHASM_INTERPOLATION_X86
+    if (rows >= 8 && get_simd_level() >= SimdLevel::AVX2) {
+        interpolate_avx2(view, x, y, rows);
+        return;
+    }
+#endif
+    interpolate_scalar(view, x, y, rows);
+}
+
+
+bool InterpolationTable::contains(const float* x) const {
+    for (size_t d=0; d<m_axes.size(); ++d) {
+        float tolerance = 1e-4f * m_axes[d].get_spacing();
+        if (!(x[d] >= m_axes[d].lower - tolerance && x[d] <= m_axes[d].upper + tolerance)) return false;
+    }
+    return true;
+}
+
+
+InterpolationReport InterpolationTable::evaluate(const float* x, const float* y, size_t rows) const {
+    InterpolationReport report;
+    report.samples = rows;
+    report.rms_error.assign(m_output_dim, 0.0);
+    report.max_abs_error.assign(m_output_dim, 0.0);
+    std::vector<float> predicted(rows * m_output_dim);
+    interpolate(x, predicted.data(), rows);
+    for (size_t r=0; r<rows; ++r) {
+        for (size_t m=0; m<m_output_dim; ++m) {
+            double error = double(predicted[r * m_output_dim + m]) - y[r * m_output_dim + m];
+            report.rms_error[m] += error * error;
+            report.max_abs_error[m] = std::max(report.max_abs_error[m], std::abs(error));
+        }
+    }
+    for (auto& e : report.rms_error) e = (rows == 0) ? 0.0 : std::sqrt(e / rows);
+    return report;
+}
+
+
+std::ostream& operator<<(std::ostream& os, const InterpolationReport& report) {
+    os << "Interpolation error over " << report.samples << " held-out samples:" << std::endl;
+    for (size_t m=0; m<report.rms_error.size(); ++m) {
+        os << "  output " << m << ": rms " << report.rms_error[m] << ", max " << report.max_abs_error[m] << std::endl;
+    }
+    return os;
+}
+
+
+InterpolationTable InterpolationTable::load(const std::string& filename) {
+    auto mapping = std::make_shared<MappedFile>(filename);
+    GridHeader header;
+    if (mapping->size() < sizeof(header)) {
+        throw std::runtime_error("InterpolationTable: '" + filename + "' is truncated");
+    }
+    std::memcpy(&header, mapping->data(), sizeof(header));
+    if (std::memcmp(header.magic, s_magic, sizeof(s_magic)) != 0) {
+        throw std::runtime_error("InterpolationTable: '" + filename + "' is not a PHASM interpolation table");
+    }
+    if (header.version != s_version) {
+        throw std::runtime_error("InterpolationTable: '" + filename + "' has unsupported version " + std::to_string(header.version));
+    }
+    if (header.interpolation > uint32_t(Interpolation::Cubic) || header.input_dim > 12 ||
+        mapping->size() < get_values_offset(header.input_dim)) {
+        throw std::runtime_error("InterpolationTable: '" + filename + "' is corrupted");
+    }
+    InterpolationTable table;
+    table.m_output_dim = header.output_dim;
+    table.m_interpolation = static_cast<Interpolation>(header.interpolation);
+    for (size_t d=0; d<header.input_dim; ++d) {
+        GridAxisRecord record;
+        std::memcpy(&record, mapping->data() + sizeof(header) + d * sizeof(record), sizeof(record));
+        table.m_axes.push_back({record.lower, record.upper, record.count});
+    }
+    table.init_layout();
+    size_t offset = get_values_offset(header.input_dim);
+    if (mapping->size() != offset + table.m_value_stride * table.m_output_dim * sizeof(float)) {
+        throw std::runtime_error("InterpolationTable: '" + filename + "' is truncated");
+    }
+    table.m_values = reinterpret_cast<const float*>(mapping->data() + offset);
+    table.m_mapping = std::move(mapping);
+    return table;
+}
+
+
+void InterpolationTable::save(const std::string& filename) const {
+    GridHeader header;
+    std::memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.input_dim = m_axes.size();
+    header.output_dim = m_output_dim;
+    header.interpolation = static_cast<uint32_t>(m_interpolation);
+
+    std::ofstream file(filename, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto& axis : m_axes) {
+        GridAxisRecord record {axis.lower, axis.upper, axis.count, 0};
+        file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+    size_t written = sizeof(header) + m_axes.size() * sizeof(GridAxisRecord);
+    std::vector<char> padding(get_values_offset(m_axes.size()) - written, 0);
+    file.write(padding.data(), padding.size());
+    file.write(reinterpret_cast<const char*>(m_values), m_value_stride * m_output_dim * sizeof(float));
+    if (!file.good()) {
+        throw std::runtime_error("InterpolationTable: Unable to write '" + filename + "'");
+    }
+}
+
+} // namespace phasm
@@ -0,0 +1,268 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "knn_index.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+
+namespace phasm {
+
+static const char s_magic[8] = {'P','H','A','S','M','K','N','N'};
+static const uint32_t s_version = 1;
+
+struct KnnHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t input_dim;
+    uint32_t output_dim;
+    uint32_t depth;
+    uint64_t point_count;
+};
+static_assert(sizeof(KnnHeader) == 32, "KnnHeader has to match the file format");
+static_assert(sizeof(KnnIndex::Node) == 8, "KnnIndex::Node has to match the file format");
+
+static size_t get_body_size(size_t input_dim, size_t output_dim, uint32_t depth, size_t point_count) {
+    return 2 * input_dim * sizeof(float)
+         + ((size_t(1) << depth) - 1) * sizeof(KnnIndex::Node)
+         + point_count * input_dim * sizeof(float)
+         + point_count * output_dim * sizeof(float);
+}
+
+
+void KnnIndex::set_pointers(const char* base) {
+    m_scale = reinterpret_cast<const float*>(base);
+    m_offset = m_scale + m_input_dim;
+    m_nodes = reinterpret_cast<const Node*>(m_offset + m_input_dim);
+    m_points = reinterpret_cast<const float*>(m_nodes + ((size_t(1) << m_depth) - 1));
+    m_outputs = m_points + m_point_count * m_input_dim;
+}
+
+
+/// Builds the subtree below one node by partitioning its range of the permutation around the median of the
+/// dimension with the largest spread. The two halves are disjoint, so near the root they are built on separate threads.
+struct KnnBuilder {
+    const float* points; // Standardized, in the original order
+    size_t dims;
+    uint32_t depth;
+    uint32_t parallel_levels;
+    KnnIndex::Node* nodes;
+    std::vector<uint32_t>& permutation;
+
+    void build(uint32_t node, uint32_t level, size_t begin, size_t end) {
+        if (level == depth) return;
+        size_t mid = begin + (end - begin) / 2;
+
+        uint32_t best_dim = 0;
+        float best_spread = -1;
+        for (size_t d=0; d<dims; ++d) {
+            float lo = std::numeric_limits<float>::max();
+            float hi = std::numeric_limits<float>::lowest();
+            for (size_t i=begin; i<end; ++i) {
+                float x = points[permutation[i] * dims + d];
+                lo = std::min(lo, x);
+                hi = std::max(hi, x);
+            }
+            if (hi - lo > best_spread) {
+                best_spread = hi - lo;
+                best_dim = d;
+            }
+        }
+        auto first = permutation.begin();
+        std::nth_element(first + begin, first + mid, first + end, [this, best_dim](uint32_t a, uint32_t b) {
+            return points[a * dims + best_dim] < points[b * dims + best_dim];
+        });
+        nodes[node].dim = best_dim;
+        nodes[node].split = (mid < end) ? points[permutation[mid] * dims + best_dim] : 0.0f;
+
+        if (level < parallel_levels) {
+            std::thread left([=]() { build(2*node + 1, level + 1, begin, mid); });
+            build(2*node + 2, level + 1, mid, end);
+            left.join();
+        }
+        else {
+            build(2*node + 1, level + 1, begin, mid);
+            build(2*node + 2, level + 1, mid, end);
+        }
+    }
+};
+
+
+KnnIndex KnnIndex::build(const float* inputs, const float* outputs, size_t count, size_t input_dim, size_t output_dim,
+                         size_t leaf_size, size_t threads) {
+    if (input_dim == 0) {
+        throw std::runtime_error("KnnIndex: Need at least one input dimension");
+    }
+    if (count > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("KnnIndex: Too many points");
+    }
+    KnnIndex index;
+    index.m_input_dim = input_dim;
+    index.m_output_dim = output_dim;
+    index.m_point_count = count;
+    leaf_size = std::max<size_t>(leaf_size, 1);
+    while ((count >> index.m_depth) > leaf_size && index.m_depth < 30) {
+        index.m_depth++;
+    }
+    index.m_storage.resize(get_body_size(input_dim, output_dim, index.m_depth, count));
+    index.set_pointers(index.m_storage.data());
+    auto* scale = const_cast<float*>(index.m_scale);
+    auto* offset = const_cast<float*>(index.m_offset);
+    auto* nodes = const_cast<Node*>(index.m_nodes);
+    auto* points = const_cast<float*>(index.m_points);
+    auto* sorted_outputs = const_cast<float*>(index.m_outputs);
+
+    for (size_t d=0; d<input_dim; ++d) {
+        double sum = 0, sum_sq = 0;
+        for (size_t i=0; i<count; ++i) {
+            double x = inputs[i * input_dim + d];
+            sum += x;
+            sum_sq += x * x;
+        }
+        double mean = (count == 0) ? 0 : sum / count;
+        double variance = (count == 0) ? 0 : sum_sq / count - mean * mean;
+        double stddev = std::sqrt(std::max(variance, 0.0));
+        scale[d] = (stddev > 1e-12) ? float(1.0 / stddev) : 1.0f;
+        offset[d] = float(-mean * scale[d]);
+    }
+    std::vector<float> standardized(count * input_dim);
+    for (size_t i=0; i<count; ++i) {
+        for (size_t d=0; d<input_dim; ++d) {
+            standardized[i * input_dim + d] = inputs[i * input_dim + d] * scale[d] + offset[d];
+        }
+    }
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    uint32_t parallel_levels = 0;
+    while ((size_t(2) << parallel_levels) <= threads) parallel_levels++;
+
+    std::vector<uint32_t> permutation(count);
+    std::iota(permutation.begin(), permutation.end(), 0);
+    KnnBuilder builder {standardized.data(), input_dim, index.m_depth, parallel_levels, nodes, permutation};
+    builder.build(0, 0, 0, count);
+
+    // Store the points in leaf order, so that each leaf is one contiguous block
+    for (size_t i=0; i<count; ++i) {
+        std::memcpy(points + i * input_dim, standardized.data() + size_t(permutation[i]) * input_dim, input_dim * sizeof(float));
+        std::memcpy(sorted_outputs + i * output_dim, outputs + size_t(permutation[i]) * output_dim, output_dim * sizeof(float));
+    }
+    return index;
+}
+
+
+KnnIndex KnnIndex::load(const std::string& filename) {
+    auto mapping = std::make_shared<MappedFile>(filename);
+    KnnHeader header;
+    if (mapping->size() < sizeof(header)) {
+        throw std::runtime_error("KnnIndex: '" + filename + "' is truncated");
+    }
+    std::memcpy(&header, mapping->data(), sizeof(header));
+    if (std::memcmp(header.magic, s_magic, sizeof(s_magic)) != 0) {
+        throw std::runtime_error("KnnIndex: '" + filename + "' is not a PHASM k-NN index");
+    }
+    if (header.version != s_version) {
+        throw std::runtime_error("KnnIndex: '" + filename + "' has unsupported version " + std::to_string(header.version));
+    }
+    if (header.depth > 30 || header.input_dim == 0 ||
+        mapping->size() != sizeof(header) + get_body_size(header.input_dim, header.output_dim, header.depth, header.point_count)) {
+        throw std::runtime_error("KnnIndex: '" + filename + "' is truncated or corrupted");
+    }
+    KnnIndex index;
+    index.m_input_dim = header.input_dim;
+    index.m_output_dim = header.output_dim;
+    index.m_depth = header.depth;
+    index.m_point_count = header.point_count;
+    index.set_pointers(mapping->data() + sizeof(header));
+    index.m_mapping = std::move(mapping);
+    return index;
+}
+
+
+void KnnIndex::save(const std::string& filename) const {
+    KnnHeader header;
+    std::memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.input_dim = m_input_dim;
+    header.output_dim = m_output_dim;
+    header.depth = m_depth;
+    header.point_count = m_point_count;
+
+    // Written via m_scale rather than m_storage, so that this also works for a mapped index
+    std::ofstream file(filename, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(m_scale), get_body_size(m_input_dim, m_output_dim, m_depth, m_point_count));
+    if (!file.good()) {
+        throw std::runtime_error("KnnIndex: Unable to write '" + filename + "'");
+    }
+}
+
+
+size_t KnnIndex::query(const float* query, size_t k, uint32_t* indices, float* squared_distances) const {
+    if (k == 0 || m_point_count == 0) return 0;
+    static thread_local std::vector<float> standardized;
+    standardized.resize(m_input_dim);
+    for (size_t d=0; d<m_input_dim; ++d) {
+        standardized[d] = query[d] * m_scale[d] + m_offset[d];
+    }
+    size_t found = 0;
+    search(0, 0, 0, m_point_count, standardized.data(), k, found, indices, squared_distances);
+    return found;
+}
+
+
+/// Descends into the child containing the query first, and only visits the other child if the splitting plane is
+/// closer than the k-th nearest point found so far.
+void KnnIndex::search(uint32_t node, uint32_t level, size_t begin, size_t end, const float* query,
+                      size_t k, size_t& found, uint32_t* indices, float* distances) const {
+    if (level == m_depth) {
+        for (size_t i=begin; i<end; ++i) {
+            const float* point = m_points + i * m_input_dim;
+            float d2 = 0;
+            for (size_t d=0; d<m_input_dim; ++d) {
+                float diff = point[d] - query[d];
+                d2 += diff * diff;
+            }
+            // Insertion into the sorted list of the k best so far; k is small
+            size_t pos;
+            if (found < k) {
+                pos = found++;
+            }
+            else if (d2 < distances[k-1]) {
+                pos = k-1;
+            }
+            else {
+                continue;
+            }
+            while (pos > 0 && distances[pos-1] > d2) {
+                distances[pos] = distances[pos-1];
+                indices[pos] = indices[pos-1];
+                pos--;
+            }
+            distances[pos] = d2;
+            indices[pos] = i;
+        }
+        return;
+    }
+    size_t mid = begin + (end - begin) / 2;
+    const Node& n = m_nodes[node];
+    float diff = query[n.dim] - n.split;
+    uint32_t near = (diff < 0) ? 2*node + 1 : 2*node + 2;
+    uint32_t far = (diff < 0) ? 2*node + 2 : 2*node + 1;
+    size_t near_begin = (diff < 0) ? begin : mid, near_end = (diff < 0) ? mid : end;
+    size_t far_begin = (diff < 0) ? mid : begin, far_end = (diff < 0) ? end : mid;
+
+    search(near, level + 1, near_begin, near_end, query, k, found, indices, distances);
+    if (found < k || diff * diff < distances[k-1]) {
+        search(far, level + 1, far_begin, far_end, query, k, found, indices, distances);
+    }
+}
+
+} // namespace phasm
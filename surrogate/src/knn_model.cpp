@@ -0,0 +1,129 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "knn_model.h"
+#include "normalization.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+namespace phasm {
+
+KnnModel::KnnModel(std::string filename, size_t k, float max_distance)
+    : m_filename(std::move(filename)), m_k(std::max<size_t>(k, 1)), m_max_distance(max_distance) {}
+
+
+void KnnModel::initialize() {
+    for (const auto& input : m_inputs) {
+        if (input->isRagged()) {
+            throw std::runtime_error("KnnModel: Ragged input '" + input->name + "' isn't supported");
+        }
+        int64_t length = 1;
+        for (int64_t dim : input->shape()) length *= dim;
+        m_input_dim += length;
+        m_input_tensors.push_back(&input->inference_input);
+    }
+    for (const auto& output : m_outputs) {
+        if (output->isRagged()) {
+            throw std::runtime_error("KnnModel: Ragged output '" + output->name + "' isn't supported");
+        }
+        std::vector<int64_t> shape = output->shape();
+        int64_t length = 1;
+        for (int64_t dim : shape) length *= dim;
+        m_output_shapes.push_back(shape);
+        m_output_lengths.push_back(length);
+        m_output_dim += length;
+    }
+
+    if (!std::ifstream(m_filename).good()) {
+        std::cerr << "PHASM: No k-NN index at '" << m_filename << "' yet; it will be built from the captures" << std::endl;
+        return;
+    }
+    m_index = KnnIndex::load(m_filename);
+    if (m_index.get_input_dim() != m_input_dim || m_index.get_output_dim() != m_output_dim) {
+        throw std::runtime_error("KnnModel: '" + m_filename + "' maps " + std::to_string(m_index.get_input_dim()) +
+                                 " inputs to " + std::to_string(m_index.get_output_dim()) + " outputs, but the model variables have " +
+                                 std::to_string(m_input_dim) + " inputs and " + std::to_string(m_output_dim) + " outputs");
+    }
+    std::cerr << "PHASM: Mapped k-NN index '" << m_filename << "' (" << m_index.get_point_count() << " points)" << std::endl;
+}
+
+
+void KnnModel::train_from_captures() {
+    size_t rows = get_capture_count();
+    std::vector<float> inputs(rows * m_input_dim);
+    std::vector<float> outputs(rows * m_output_dim);
+    std::vector<const tensor*> row_inputs(m_inputs.size());
+    std::vector<const tensor*> row_outputs(m_outputs.size());
+    for (size_t r=0; r<rows; ++r) {
+        for (size_t i=0; i<m_inputs.size(); ++i) row_inputs[i] = &m_inputs[i]->training_inputs[r];
+        for (size_t i=0; i<m_outputs.size(); ++i) row_outputs[i] = &m_outputs[i]->training_outputs[r];
+        flatten_and_join_into(row_inputs, {}, inputs.data() + r * m_input_dim, m_input_dim);
+        flatten_and_join_into(row_outputs, {}, outputs.data() + r * m_output_dim, m_output_dim);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    m_index = KnnIndex::build(inputs.data(), outputs.data(), rows, m_input_dim, m_output_dim);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "PHASM: Built k-NN index over " << rows << " captures in " << seconds << " s" << std::endl;
+
+    m_index.save(m_filename);
+    std::cerr << "PHASM: Saved k-NN index to '" << m_filename << "'" << std::endl;
+}
+
+
+bool KnnModel::infer() {
+    float confidence;
+    return infer_with_confidence(confidence);
+}
+
+
+bool KnnModel::infer_with_confidence(float& confidence) {
+    confidence = 0;
+    if (m_index.get_point_count() == 0) return false;
+
+    static thread_local std::vector<float> query, result, distances;
+    static thread_local std::vector<uint32_t> neighbors;
+    query.resize(m_input_dim);
+    result.assign(m_output_dim, 0.0f);
+    distances.resize(m_k);
+    neighbors.resize(m_k);
+
+    flatten_and_join_into(m_input_tensors, {}, query.data(), m_input_dim);
+    size_t found = m_index.query(query.data(), m_k, neighbors.data(), distances.data());
+    float nearest = std::sqrt(distances[0]);
+    if (nearest > m_max_distance) {
+        return false;
+    }
+    confidence = 1.0f / (1.0f + nearest);
+
+    if (distances[0] == 0.0f) {
+        // Exact match: Weighting by 1/d would blow up, and the capture is the right answer anyway
+        const float* y = m_index.get_output(neighbors[0]);
+        std::copy(y, y + m_output_dim, result.begin());
+    }
+    else {
+        float total_weight = 0;
+        for (size_t n=0; n<found; ++n) {
+            float weight = 1.0f / distances[n]; // Inverse squared distance
+            const float* y = m_index.get_output(neighbors[n]);
+            for (size_t j=0; j<m_output_dim; ++j) result[j] += weight * y[j];
+            total_weight += weight;
+        }
+        for (size_t j=0; j<m_output_dim; ++j) result[j] /= total_weight;
+    }
+
+    static const Normalization identity;
+    const float* output = result.data();
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        unpack_output_into(output, m_output_shapes[i], identity, m_outputs[i]->inference_output);
+        output += m_output_lengths[i];
+    }
+    return true;
+}
+
+} // namespace phasm
@@ -0,0 +1,190 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "memo_cache.h"
+#include "model_variable.h"
+#include "dtype_conversion.h"
+
+#include <mutex>
+#include <ostream>
+
+namespace phasm {
+
+
+MemoCache::MemoCache(size_t max_bytes, size_t shard_count) {
+    if (shard_count == 0) {
+        throw std::runtime_error("MemoCache: shard_count has to be at least 1");
+    }
+    m_max_bytes = max_bytes;
+    m_shard_count = shard_count;
+    m_shard_max_bytes = max_bytes / shard_count;
+    m_shards = std::make_unique<Shard[]>(shard_count);
+}
+
+
+MemoCache::Shard& MemoCache::get_shard(const std::string& key) const {
+    return m_shards[std::hash<std::string>()(key) % m_shard_count];
+}
+
+
+bool MemoCache::lookup(const std::string& key, std::vector<tensor>& outputs) const {
+    Shard& shard = get_shard(key);
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            it->second.referenced.store(true, std::memory_order_relaxed);
+            outputs = it->second.outputs;
+            shard.hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    shard.misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+
+/// Advances the clock hand until it finds an entry that hasn't been used since the hand last passed it, giving
+/// every referenced entry a second chance along the way. Requires the shard's exclusive lock.
+void MemoCache::evict_one(Shard& shard) {
+    while (true) {
+        if (shard.hand >= shard.clock.size()) shard.hand = 0;
+        Node* node = shard.clock[shard.hand];
+        if (node != nullptr) {
+            if (node->second.referenced.exchange(false, std::memory_order_relaxed)) {
+                shard.hand++;
+                continue;
+            }
+            shard.bytes -= node->second.bytes;
+            shard.clock[shard.hand] = nullptr;
+            shard.free_slots.push_back(shard.hand);
+            shard.entries.erase(shard.entries.find(node->first));
+            shard.evictions.fetch_add(1, std::memory_order_relaxed);
+            shard.hand++;
+            return;
+        }
+        shard.hand++;
+    }
+}
+
+
+void MemoCache::insert(const std::string& key, std::vector<tensor> outputs) {
+    size_t bytes = key.size() + ENTRY_OVERHEAD;
+    for (const auto& t : outputs) {
+        bytes += t.get_length() * get_dtype_size(t.get_dtype());
+    }
+    if (bytes > m_shard_max_bytes) return;
+
+    Shard& shard = get_shard(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (shard.entries.count(key) != 0) return; // Another thread got here first
+    while (shard.bytes + bytes > m_shard_max_bytes) {
+        evict_one(shard);
+    }
+    auto it = shard.entries.try_emplace(key).first;
+    Entry& entry = it->second;
+    entry.outputs = std::move(outputs);
+    entry.bytes = bytes;
+    if (shard.free_slots.empty()) {
+        shard.clock.push_back(&*it);
+    }
+    else {
+        shard.clock[shard.free_slots.back()] = &*it;
+        shard.free_slots.pop_back();
+    }
+    shard.bytes += bytes;
+    shard.insertions.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void MemoCache::clear() {
+    for (size_t i=0; i<m_shard_count; ++i) {
+        Shard& shard = m_shards[i];
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.entries.clear();
+        shard.clock.clear();
+        shard.free_slots.clear();
+        shard.hand = 0;
+        shard.bytes = 0;
+    }
+}
+
+
+uint64_t MemoCache::get_hit_count() const {
+    uint64_t total = 0;
+    for (size_t i=0; i<m_shard_count; ++i) total += m_shards[i].hits.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t MemoCache::get_miss_count() const {
+    uint64_t total = 0;
+    for (size_t i=0; i<m_shard_count; ++i) total += m_shards[i].misses.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t MemoCache::get_insertion_count() const {
+    uint64_t total = 0;
+    for (size_t i=0; i<m_shard_count; ++i) total += m_shards[i].insertions.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t MemoCache::get_eviction_count() const {
+    uint64_t total = 0;
+    for (size_t i=0; i<m_shard_count; ++i) total += m_shards[i].evictions.load(std::memory_order_relaxed);
+    return total;
+}
+
+size_t MemoCache::get_entry_count() const {
+    size_t total = 0;
+    for (size_t i=0; i<m_shard_count; ++i) {
+        std::shared_lock<std::shared_mutex> lock(m_shards[i].mutex);
+        total += m_shards[i].entries.size();
+    }
+    return total;
+}
+
+size_t MemoCache::get_size_bytes() const {
+    size_t total = 0;
+    for (size_t i=0; i<m_shard_count; ++i) {
+        std::shared_lock<std::shared_mutex> lock(m_shards[i].mutex);
+        total += m_shards[i].bytes;
+    }
+    return total;
+}
+
+
+void MemoCache::print_stats(std::ostream& os) const {
+    uint64_t hits = get_hit_count();
+    uint64_t misses = get_miss_count();
+    double hit_rate = (hits + misses == 0) ? 0.0 : 100.0 * hits / (hits + misses);
+    os << "PHASM: Memoization cache: " << hits << " hits, " << misses << " misses (" << hit_rate << "% hit rate), "
+       << get_eviction_count() << " evictions, " << get_entry_count() << " entries, "
+       << get_size_bytes() << "/" << m_max_bytes << " bytes" << std::endl;
+}
+
+
+void append_memo_key(std::string& key, const tensor& t) {
+    // The length and offsets keep e.g. the ragged inputs {1,2},{3} and {1},{2,3} from colliding
+    auto dtype = static_cast<uint8_t>(t.get_dtype());
+    uint64_t length = t.get_length();
+    key.append(reinterpret_cast<const char*>(&dtype), sizeof(dtype));
+    key.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    const auto& offsets = t.get_row_offsets();
+    if (!offsets.empty()) {
+        key.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(int64_t));
+    }
+    if (length != 0) {
+        key.append(t.get_data<char>(), length * get_dtype_size(t.get_dtype()));
+    }
+}
+
+
+void make_memo_key(std::string& key, const std::vector<std::shared_ptr<ModelVariable>>& vars) {
+    key.clear();
+    for (const auto& var : vars) {
+        if (var->is_input) append_memo_key(key, var->inference_input);
+    }
+}
+
+} // namespace phasm
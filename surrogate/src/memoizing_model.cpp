@@ -0,0 +1,87 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "memoizing_model.h"
+
+namespace phasm {
+
+
+MemoizingModel::MemoizingModel(std::shared_ptr<Model> inner, size_t max_bytes)
+    : MemoizingModel(std::move(inner), std::make_shared<MemoCache>(max_bytes)) {}
+
+
+MemoizingModel::MemoizingModel(std::shared_ptr<Model> inner, std::shared_ptr<MemoCache> cache)
+    : m_inner(std::move(inner)), m_cache(std::move(cache)) {
+    if (m_inner == nullptr || m_cache == nullptr) {
+        throw std::runtime_error("MemoizingModel needs a model to wrap and a cache");
+    }
+    m_combine_tensors = m_inner->m_combine_tensors;
+    m_quantization = m_inner->m_quantization;
+    m_trains_from_scratch = m_inner->m_trains_from_scratch;
+}
+
+
+void MemoizingModel::initialize() {
+    m_inner->enable_tensor_combining(m_combine_tensors);
+    m_inner->set_quantization(m_quantization);
+    m_inner->add_model_vars(m_model_vars);
+    m_inner->initialize();
+    // We share the wrapped model's ModelVariables, so whatever it loaded is ours too
+    m_normalizations_loaded = m_inner->m_normalizations_loaded;
+    m_cache->clear();
+}
+
+
+void MemoizingModel::train_from_captures() {
+    // The captures live in the ModelVariables we share with the wrapped model; only the count has to be passed along
+    m_inner->m_captured_rows = m_captured_rows;
+    m_inner->train_from_captures();
+    m_cache->clear();
+}
+
+
+bool MemoizingModel::infer() {
+    static thread_local std::string key;
+    static thread_local std::vector<tensor> outputs;
+    make_memo_key(key, m_inputs);
+
+    uint64_t version = m_inner->get_weights_version();
+    if (version != m_cached_weights_version.load(std::memory_order_acquire)) {
+        m_cache->clear();
+        m_cached_weights_version.store(version, std::memory_order_release);
+    }
+    if (m_cache->lookup(key, outputs)) {
+        for (size_t i=0; i<m_outputs.size(); ++i) {
+            m_outputs[i]->inference_output = std::move(outputs[i]);
+        }
+        return true;
+    }
+    if (!m_inner->infer()) {
+        return false;
+    }
+    if (m_inner->get_weights_version() != version) {
+        // New weights were published while we were inferring, so these outputs may already be stale
+        return true;
+    }
+    outputs.clear();
+    for (const auto& output : m_outputs) {
+        outputs.push_back(output->inference_output);
+    }
+    m_cache->insert(key, std::move(outputs));
+    return true;
+}
+
+
+void MemoizingModel::train_online() {
+    m_inner->m_captured_rows = m_captured_rows;
+    m_inner->train_online();
+    m_captured_rows = m_inner->m_captured_rows; // In case it discarded the captures
+}
+
+
+bool MemoizingModel::is_online_training_converged() {
+    return m_inner->is_online_training_converged();
+}
+
+} // namespace phasm
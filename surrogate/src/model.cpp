@@ -12,6 +12,38 @@ namespace phasm {
 
 size_t Model::get_capture_count() const { return m_captured_rows; }
 
+void Model::swap_lender_vars() {
+    for (size_t i=0; i<m_lender_vars.size(); ++i) {
+        ModelVariable& ours = *m_model_vars[i];
+        ModelVariable& theirs = *m_lender_vars[i];
+        // Swapping rather than copying means that a model which reuses its output buffer keeps getting the same one
+        std::swap(ours.inference_input, theirs.inference_input);
+        std::swap(ours.inference_output, theirs.inference_output);
+        std::swap(ours.training_inputs, theirs.training_inputs);
+        std::swap(ours.training_outputs, theirs.training_outputs);
+    }
+}
+
+bool Model::infer_on_loan() {
+    if (m_lender_vars.empty()) return infer();
+    Loan loan(*this);
+    return infer();
+}
+
+void Model::train_online_on_loan() {
+    if (m_lender_vars.empty()) return train_online();
+    Loan loan(*this);
+    train_online();
+}
+
+void Model::discard_captures() {
+    for (const auto& mv : m_model_vars) {
+        mv->training_inputs.clear();
+        mv->training_outputs.clear();
+    }
+    m_captured_rows = 0;
+}
+
 std::shared_ptr<ModelVariable> Model::get_model_var(size_t position) {
     if (position >= m_model_vars.size()) { throw std::runtime_error("Parameter index out of bounds"); }
     return m_model_vars[position];
@@ -30,13 +62,20 @@ std::shared_ptr<ModelVariable> Model::get_model_var(std::string param_name) {
 /// finalize() as the first statement in their destructor, as otherwise Surrogate::call will be broken for that Model.
 /// We cannot call this from ~Model because it won't get called until the child destructor has already been called
 /// and the virtual call to train_from_captures is no longer valid.
-/// TODO: All this moves to Surrogate. Model keeps a reference count. Last surrogate turns out the lights.
+/// Models may be shared by several Surrogates (e.g. via PluginLoader::get_or_make_model), so each Model counts the
+/// Surrogates using it, and only the last Surrogate to be destroyed calls finalize(), with its own CallMode.
 void Model::finalize(CallMode callmode) {
 
     std::cout << "PHASM: Starting model shutdown" << std::endl;
+    Loan loan(*this);
     switch (callmode) {
+        case CallMode::TrainOnline:
+            if (get_capture_count() == 0) break;
+            // Otherwise the model doesn't support online training, so we fall back to training at exit
+            [[fallthrough]];
         case CallMode::TrainModel:
             std::cout << "PHASM: Training model from captures" << std::endl;
+            if (should_fit_normalizations()) fit_normalizations();
             train_from_captures();
             break;
         case CallMode::DumpTrainingData: {
@@ -60,67 +99,54 @@ void Model::finalize(CallMode callmode) {
 }
 
 
-void Model::dump_captures_to_csv(std::ostream &os) {
-    // print column header
-    for (auto input: m_inputs) {
-        int length = 1;
-        for (int dim: input->shape()) length *= dim;
-        if (length == 1) {
-            os << input->name << ", ";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                os << input->name << "[" << i << "], ";
-            }
+/// Writes every element of t to os, separated by separator. Ragged model variables are written into a single
+/// CSV column with their elements separated by spaces, since each row has a different number of elements.
+static void write_tensor_elements(std::ostream &os, const tensor& t, const char* separator) {
+    for (size_t k = 0; k < t.get_length(); ++k) {
+        switch (t.get_dtype()) {
+            case DType::UI8: os << *(t.get_data<uint8_t>() + k); break;
+            case DType::I16: os << *(t.get_data<int16_t>() + k); break;
+            case DType::I32: os << *(t.get_data<int32_t>() + k); break;
+            case DType::I64: os << *(t.get_data<int64_t>() + k); break;
+            case DType::F32: os << *(t.get_data<float>() + k); break;
+            case DType::F64: os << *(t.get_data<double>() + k); break;
+            default: os << "?"; break;
         }
+        if (k < t.get_length() - 1) os << separator;
     }
-    for (size_t i = 0; i < m_outputs.size(); ++i) {
+}
+
+void Model::dump_captures_to_csv(std::ostream &os) {
+    // print column header
+    std::vector<std::shared_ptr<ModelVariable>> columns = m_inputs;
+    columns.insert(columns.end(), m_outputs.begin(), m_outputs.end());
+    std::vector<bool> is_ragged;
+    for (const auto& column : columns) is_ragged.push_back(column->isRagged());
+
+    for (size_t i = 0; i < columns.size(); ++i) {
         int length = 1;
-        for (int dim: m_outputs[i]->shape()) length *= dim;
-        if (length == 1) {
-            os << m_outputs[i]->name;
-            if (i < (m_outputs.size() - 1)) os << ", ";
+        for (int dim: columns[i]->shape()) length *= dim;
+        if (is_ragged[i]) {
+            os << columns[i]->name << "[]";
+        } else if (length == 1) {
+            os << columns[i]->name;
         } else {
             for (int j = 0; j < length; ++j) {
-                os << m_outputs[i]->name << "[" << j << "]";
-                bool last_col = (i == m_outputs.size() - 1) && (j == length - 1);
-                if (!last_col) os << ", ";
+                os << columns[i]->name << "[" << j << "]";
+                if (j < length - 1) os << ", ";
             }
         }
+        if (i < columns.size() - 1) os << ", ";
     }
     os << std::endl;
 
     // print body
     for (size_t i = 0; i < m_captured_rows; ++i) {
-        for (size_t j = 0; j < m_inputs.size(); ++j) {
-            auto t = m_inputs[j]->training_inputs[i];
-            for (size_t k = 0; k < t.get_length(); ++k) {
-                switch (t.get_dtype()) {
-                    case DType::UI8: os << *(t.get_data<uint8_t>() + k); break;
-                    case DType::I16: os << *(t.get_data<int16_t>() + k); break;
-                    case DType::I32: os << *(t.get_data<int32_t>() + k); break;
-                    case DType::I64: os << *(t.get_data<int64_t>() + k); break;
-                    case DType::F32: os << *(t.get_data<float>() + k); break;
-                    case DType::F64: os << *(t.get_data<double>() + k); break;
-                    default: os << "?, "; break;
-                }
-                os << ", ";
-            }
-        }
-        for (size_t j = 0; j < m_outputs.size(); ++j) {
-            auto t = m_outputs[j]->training_outputs[i];
-            for (size_t k = 0; k < t.get_length(); ++k) {
-                switch (t.get_dtype()) {
-                    case DType::UI8: os << *(t.get_data<uint8_t>() + k); break;
-                    case DType::I16: os << *(t.get_data<int16_t>() + k); break;
-                    case DType::I32: os << *(t.get_data<int32_t>() + k); break;
-                    case DType::I64: os << *(t.get_data<int64_t>() + k); break;
-                    case DType::F32: os << *(t.get_data<float>() + k); break;
-                    case DType::F64: os << *(t.get_data<double>() + k); break;
-                    default: os << "?"; break;
-                }
-                bool last_col = (j == m_outputs.size() - 1) && (k == t.get_length() - 1);
-                if (!last_col) os << ", ";
-            }
+        for (size_t j = 0; j < columns.size(); ++j) {
+            bool is_input = (j < m_inputs.size());
+            const tensor& t = is_input ? columns[j]->training_inputs[i] : columns[j]->training_outputs[i];
+            write_tensor_elements(os, t, is_ragged[j] ? " " : ", ");
+            if (j < columns.size() - 1) os << ", ";
         }
         os << std::endl;
     }
@@ -132,4 +158,31 @@ void Model::dump_ranges(std::ostream &) {
 }
 
 
-} // namespace phasm
\ No newline at end of file
+void Model::fit_normalizations() {
+    for (const auto& input : m_inputs) {
+        input->normalization.fit(input->training_inputs);
+    }
+    for (const auto& output : m_outputs) {
+        if (output->is_input) continue; // INOUT variables share a single normalization, fitted on the inputs
+        output->normalization.fit(output->training_outputs);
+    }
+}
+
+void Model::save_normalizations(std::ostream &os) {
+    for (const auto& mv : m_model_vars) {
+        if (!mv->normalization.is_enabled()) continue;
+        os << mv->name << " ";
+        mv->normalization.write(os);
+        os << std::endl;
+    }
+}
+
+void Model::load_normalizations(std::istream &is) {
+    std::string name;
+    while (is >> name) {
+        get_model_var(name)->normalization.read(is);
+    }
+    m_normalizations_loaded = true;
+}
+
+} // namespace phasm
@@ -0,0 +1,96 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "model_file_watcher.h"
+
+#include <filesystem>
+#include <iostream>
+
+namespace phasm {
+
+namespace {
+
+/// What we compare between polls. Missing files compare equal to each other, so deleting a file isn't a change,
+/// but putting it back is.
+struct FileState {
+    bool exists = false;
+    std::filesystem::file_time_type write_time;
+    std::uintmax_t size = 0;
+
+    bool operator==(const FileState& other) const {
+        return exists == other.exists && (!exists || (write_time == other.write_time && size == other.size));
+    }
+    bool operator!=(const FileState& other) const { return !(*this == other); }
+};
+
+FileState get_file_state(const std::string& path) {
+    FileState state;
+    std::error_code ec;
+    state.write_time = std::filesystem::last_write_time(path, ec);
+    if (ec) return state;
+    state.size = std::filesystem::file_size(path, ec);
+    if (ec) return state;
+    state.exists = true;
+    return state;
+}
+
+} // namespace
+
+
+ModelFileWatcher::ModelFileWatcher(std::string path, std::function<void(const std::string&)> on_change,
+                                   std::chrono::milliseconds poll_interval)
+    : m_path(std::move(path)), m_on_change(std::move(on_change)), m_poll_interval(poll_interval) {
+
+    m_thread = std::thread(&ModelFileWatcher::run, this);
+    // Don't return before the thread has looked at the file, or a change made right after we return could be
+    // mistaken for the state that was already loaded
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_started_signal.wait(lock, [this]{ return m_started; });
+}
+
+
+ModelFileWatcher::~ModelFileWatcher() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_stop_requested.notify_all();
+    m_thread.join();
+}
+
+
+void ModelFileWatcher::run() {
+    FileState loaded = get_file_state(m_path);  // Whatever is there now has already been loaded by our owner
+    FileState pending = loaded;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_started = true;
+    m_started_signal.notify_all();
+    while (!m_stop_requested.wait_for(lock, m_poll_interval, [this]{ return m_stop; })) {
+        FileState current = get_file_state(m_path);
+        if (current == loaded || !current.exists) {
+            pending = current;
+            continue;
+        }
+        if (current != pending) {
+            // Changed since the last poll, so it might still be being written. Check again next time.
+            pending = current;
+            continue;
+        }
+        loaded = current;
+        lock.unlock();
+        try {
+            std::cout << "PHASM: Model file '" << m_path << "' changed; reloading" << std::endl;
+            m_on_change(m_path);
+            m_change_count++;
+        }
+        catch (std::exception& e) {
+            std::cerr << "PHASM: Failed to reload model from '" << m_path << "': " << e.what() << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+
+} // namespace phasm
@@ -0,0 +1,103 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "model_handle.h"
+#include "model.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace phasm {
+
+
+ModelHandle::ModelHandle(std::shared_ptr<Model> model) {
+    if (model != nullptr) {
+        m_current.store(new Version {std::move(model)}, std::memory_order_release);
+    }
+}
+
+
+ModelHandle::~ModelHandle() {
+    delete m_current.load(std::memory_order_acquire);
+    for (Version* v : m_retired) {
+        delete v;
+    }
+}
+
+
+ModelHandle::Pin ModelHandle::pin() {
+    // Each thread starts looking at a different slot, so that uncontended readers claim one on the first try
+    static thread_local size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    HazardSlot* slot = nullptr;
+    for (size_t i=start; slot == nullptr; ++i) {
+        HazardSlot& candidate = m_slots[i % MAX_READERS];
+        bool expected = false;
+        if (!candidate.in_use.load(std::memory_order_relaxed) &&
+            candidate.in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            slot = &candidate;
+        }
+    }
+
+    // Announce which version we are about to use, then make sure it is still current. If a writer swapped it in
+    // between, it may already have scanned the slots without seeing us, so we have to try again.
+    Version* version = m_current.load(std::memory_order_seq_cst);
+    while (true) {
+        slot->hazard.store(version, std::memory_order_seq_cst);
+        Version* current = m_current.load(std::memory_order_seq_cst);
+        if (current == version) break;
+        version = current;
+    }
+    return Pin(slot, version);
+}
+
+
+std::shared_ptr<Model> ModelHandle::get() {
+    Pin p = pin();
+    return p.m_version == nullptr ? nullptr : p.m_version->model;
+}
+
+
+std::shared_ptr<Model> ModelHandle::publish(std::shared_ptr<Model> model) {
+    std::lock_guard<std::mutex> lock(m_writer_mutex);
+    Version* previous = m_current.exchange(new Version {std::move(model)}, std::memory_order_seq_cst);
+    m_version_number.fetch_add(1, std::memory_order_release);
+    std::shared_ptr<Model> result;
+    if (previous != nullptr) {
+        result = previous->model;
+        m_retired.push_back(previous);
+    }
+    reclaim_locked();
+    return result;
+}
+
+
+size_t ModelHandle::reclaim() {
+    std::lock_guard<std::mutex> lock(m_writer_mutex);
+    return reclaim_locked();
+}
+
+
+size_t ModelHandle::reclaim_locked() {
+    std::vector<Version*> hazards;
+    for (HazardSlot& slot : m_slots) {
+        Version* v = slot.hazard.load(std::memory_order_seq_cst);
+        if (v != nullptr) hazards.push_back(v);
+    }
+    auto still_in_use = [&](Version* v) { return std::find(hazards.begin(), hazards.end(), v) != hazards.end(); };
+    auto it = std::partition(m_retired.begin(), m_retired.end(), still_in_use);
+    for (auto unused = it; unused != m_retired.end(); ++unused) {
+        delete *unused;
+    }
+    m_retired.erase(it, m_retired.end());
+    return m_retired.size();
+}
+
+
+size_t ModelHandle::get_retired_count() {
+    std::lock_guard<std::mutex> lock(m_writer_mutex);
+    return m_retired.size();
+}
+
+
+} // namespace phasm
@@ -0,0 +1,167 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "normalization.h"
+#include "dtype_conversion.h"
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+namespace phasm {
+
+
+/// Returns element i of t as a double, regardless of t's dtype
+static double get_element(const tensor& t, size_t i) {
+    switch (t.get_dtype()) {
+        case DType::UI8: return t.get_data<uint8_t>()[i];
+        case DType::I16: return t.get_data<int16_t>()[i];
+        case DType::I32: return t.get_data<int32_t>()[i];
+        case DType::I64: return static_cast<double>(t.get_data<int64_t>()[i]);
+        case DType::F32: return t.get_data<float>()[i];
+        case DType::F64: return t.get_data<double>()[i];
+        default: throw std::runtime_error("Normalization: Invalid dtype");
+    }
+}
+
+void Normalization::fit(const std::vector<tensor>& captures) {
+    if (kind == NormalizationKind::None) return;
+
+    // Welford's algorithm, so that the variance of data with a large offset doesn't cancel away to nothing
+    size_t count = 0;
+    double mean = 0, sum_of_squared_deviations = 0;
+    double min = std::numeric_limits<double>::max();
+    double max = std::numeric_limits<double>::lowest();
+
+    for (const auto& t : captures) {
+        for (size_t i=0; i<t.get_length(); ++i) {
+            double x = get_element(t, i);
+            if (kind == NormalizationKind::Log) {
+                if (x <= 0) {
+                    // This runs from Model::finalize, i.e. usually from a destructor, so throwing would terminate
+                    std::cerr << "PHASM: WARNING: Log normalization requires strictly positive values, but a capture "
+                              << "contains " << x << ". Disabling normalization for this variable." << std::endl;
+                    kind = NormalizationKind::None;
+                    center = 0.0;
+                    scale = 1.0;
+                    return;
+                }
+                x = std::log(x);
+            }
+            count += 1;
+            double delta = x - mean;
+            mean += delta / count;
+            sum_of_squared_deviations += delta * (x - mean);
+            if (x < min) min = x;
+            if (x > max) max = x;
+        }
+    }
+    center = 0.0;
+    scale = 1.0;
+    if (count == 0) return;
+
+    if (kind == NormalizationKind::MinMax) {
+        center = min;
+        double range = max - min;
+        if (range > 0) scale = 1.0 / range;
+    }
+    else {
+        // Standardize and Log
+        center = mean;
+        double variance = sum_of_squared_deviations / count;
+        double stddev = (variance > 0) ? std::sqrt(variance) : 0;
+        if (stddev > 0) scale = 1.0 / stddev;
+    }
+}
+
+void Normalization::normalize(const tensor& source, float* dest) const {
+    size_t length = source.get_length();
+    if (kind != NormalizationKind::Log) {
+        convert_centered(source.get_data<void>(), source.get_dtype(), dest, length, center, scale);
+        return;
+    }
+    // The log can't be folded into the conversion kernel, so we convert first and transform in place
+    convert(source.get_data<void>(), source.get_dtype(), dest, DType::F32, length);
+    for (size_t i=0; i<length; ++i) {
+        dest[i] = static_cast<float>((std::log(static_cast<double>(dest[i])) - center) * scale);
+    }
+}
+
+tensor Normalization::denormalize(const float* source, const std::vector<int64_t>& shape) const {
+    tensor result(DType::F32, shape);
+    denormalize(source, result.get_data<float>(), result.get_length());
+    return result;
+}
+
+void Normalization::denormalize(const float* source, float* dest, size_t length) const {
+    if (kind == NormalizationKind::None) {
+        convert(source, DType::F32, dest, DType::F32, length);
+        return;
+    }
+    // Inverting y = (x - center) * scale gives x = (y + center*scale) / scale, which is centered again
+    convert_centered(source, DType::F32, dest, length, -center * scale, 1.0 / scale);
+    if (kind == NormalizationKind::Log) {
+        for (size_t i=0; i<length; ++i) {
+            dest[i] = std::exp(dest[i]);
+        }
+    }
+}
+
+void Normalization::write(std::ostream& os) const {
+    switch (kind) {
+        case NormalizationKind::None: os << "none"; break;
+        case NormalizationKind::Standardize: os << "standardize"; break;
+        case NormalizationKind::MinMax: os << "minmax"; break;
+        case NormalizationKind::Log: os << "log"; break;
+    }
+    // The file format predates the center, and stores the offset of x*scale + offset instead
+    os << " " << std::setprecision(std::numeric_limits<double>::max_digits10) << scale << " " << -center * scale;
+}
+
+void Normalization::read(std::istream& is) {
+    std::string kind_name;
+    double offset;
+    is >> kind_name >> scale >> offset;
+    center = -offset / scale;
+    if (kind_name == "none") kind = NormalizationKind::None;
+    else if (kind_name == "standardize") kind = NormalizationKind::Standardize;
+    else if (kind_name == "minmax") kind = NormalizationKind::MinMax;
+    else if (kind_name == "log") kind = NormalizationKind::Log;
+    else throw std::runtime_error("Normalization: Invalid kind '" + kind_name + "'");
+}
+
+void flatten_and_join_into(const std::vector<const tensor*>& inputs,
+                           const std::vector<const Normalization*>& normalizations,
+                           float* dest, size_t capacity) {
+    size_t offset = 0;
+    for (size_t i=0; i<inputs.size(); ++i) {
+        const tensor* input = inputs[i];
+        if (offset + input->get_length() > capacity) {
+            throw std::runtime_error("flatten_and_join_into: Inputs are larger than the preallocated buffer");
+        }
+        if (i < normalizations.size() && normalizations[i] != nullptr && normalizations[i]->is_enabled()) {
+            normalizations[i]->normalize(*input, dest + offset);
+        }
+        else {
+            convert(input->get_data<void>(), input->get_dtype(), dest + offset, DType::F32, input->get_length());
+        }
+        offset += input->get_length();
+    }
+}
+
+void unpack_output_into(const float* source, const std::vector<int64_t>& shape,
+                        const Normalization& normalization, tensor& dest) {
+    size_t length = 1;
+    for (int64_t dim : shape) {
+        length *= dim;
+    }
+    if (dest.get_dtype() != DType::F32 || dest.get_length() != length || dest.is_borrowed()) {
+        // Only happens on the first call, or if someone else replaced the output tensor in the meantime
+        dest = tensor(DType::F32, shape);
+    }
+    normalization.denormalize(source, dest.get_data<float>(), length);
+}
+
+} // namespace phasm
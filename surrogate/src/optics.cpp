@@ -0,0 +1,27 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "optics.h"
+
+namespace phasm {
+
+// Explicit instantiation definitions for the extern declarations at the bottom of optics.h.
+// If you add a primitive type here, add it there as well.
+
+template class TensorIso<uint8_t>;
+template class TensorIso<int16_t>;
+template class TensorIso<int32_t>;
+template class TensorIso<int64_t>;
+template class TensorIso<float>;
+template class TensorIso<double>;
+
+template class ArrayTraversal<uint8_t>;
+template class ArrayTraversal<int16_t>;
+template class ArrayTraversal<int32_t>;
+template class ArrayTraversal<int64_t>;
+template class ArrayTraversal<float>;
+template class ArrayTraversal<double>;
+
+} // namespace phasm
+
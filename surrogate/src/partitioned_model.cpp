@@ -0,0 +1,343 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "partitioned_model.h"
+#include "normalization.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+namespace phasm {
+
+static const char s_magic[8] = {'P','H','A','S','M','P','R','T'};
+static const uint32_t s_version = 1;
+static const size_t s_max_depth = 16;
+
+struct PartitionHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t depth;
+    uint32_t input_dim;
+    uint32_t unused;
+};
+static_assert(sizeof(PartitionHeader) == 24, "PartitionHeader has to match the file format");
+static_assert(sizeof(PartitionSplit) == 8, "PartitionSplit has to match the file format");
+
+
+PartitionedModel::PartitionedModel(std::string filename, ExpertFactory make_expert, size_t depth, size_t min_captures)
+    : m_filename(std::move(filename)), m_make_expert(std::move(make_expert)), m_depth(depth),
+      m_min_captures(std::max<size_t>(min_captures, 1)), m_learn_splits(true) {
+    if (m_depth > s_max_depth) {
+        throw std::runtime_error("PartitionedModel: Depth " + std::to_string(m_depth) + " is too deep");
+    }
+    // Until we've learned something, everything goes to the leftmost leaf
+    m_splits.assign((size_t(1) << m_depth) - 1, {std::numeric_limits<float>::infinity(), 0});
+}
+
+
+PartitionedModel::PartitionedModel(std::string filename, ExpertFactory make_expert, std::vector<PartitionSplit> splits)
+    : m_filename(std::move(filename)), m_make_expert(std::move(make_expert)), m_depth(0), m_min_captures(1),
+      m_learn_splits(false), m_splits(std::move(splits)) {
+    while (((size_t(1) << m_depth) - 1) < m_splits.size() && m_depth < s_max_depth) m_depth++;
+    if (((size_t(1) << m_depth) - 1) != m_splits.size()) {
+        throw std::runtime_error("PartitionedModel: Got " + std::to_string(m_splits.size()) +
+                                 " splits, which isn't a complete tree (2^depth - 1)");
+    }
+}
+
+
+void PartitionedModel::initialize() {
+    if (!m_make_expert) {
+        throw std::runtime_error("PartitionedModel: No factory for the experts");
+    }
+    for (const auto& input : m_inputs) {
+        if (input->isRagged()) {
+            throw std::runtime_error("PartitionedModel: Ragged input '" + input->name + "' isn't supported");
+        }
+        int64_t length = 1;
+        for (int64_t dim : input->shape()) length *= dim;
+        m_input_dim += length;
+        m_input_tensors.push_back(&input->inference_input);
+    }
+    for (const auto& output : m_outputs) {
+        if (output->isRagged()) {
+            throw std::runtime_error("PartitionedModel: Ragged output '" + output->name + "' isn't supported");
+        }
+        int64_t length = 1;
+        for (int64_t dim : output->shape()) length *= dim;
+        m_output_dim += length;
+    }
+    if (std::ifstream(m_filename).good()) {
+        load_splits();
+        std::cerr << "PHASM: Loaded partitioning '" << m_filename << "' (" << (size_t(1) << m_depth) << " partitions)" << std::endl;
+    }
+    for (const auto& split : m_splits) {
+        if (split.input >= m_input_dim) {
+            throw std::runtime_error("PartitionedModel: Split on input element " + std::to_string(split.input) +
+                                     ", but there are only " + std::to_string(m_input_dim));
+        }
+    }
+
+    size_t leaves = size_t(1) << m_depth;
+    m_experts.clear();
+    m_expert_vars.clear();
+    for (size_t leaf=0; leaf<leaves; ++leaf) {
+        auto expert = m_make_expert(leaf);
+        if (expert == nullptr) {
+            throw std::runtime_error("PartitionedModel: Factory returned no expert for partition " + std::to_string(leaf));
+        }
+        // Each expert gets its own ModelVariables, so that they can hold different captures
+        std::vector<std::shared_ptr<ModelVariable>> vars;
+        for (const auto& mv : m_model_vars) {
+            auto copy = std::make_shared<ModelVariable>();
+            copy->name = mv->name;
+            copy->is_input = mv->is_input;
+            copy->is_output = mv->is_output;
+            copy->accessor = (mv->accessor == nullptr) ? nullptr : mv->accessor->clone();
+            copy->range = mv->range;
+            copy->normalization = mv->normalization;
+            vars.push_back(copy);
+        }
+        expert->enable_tensor_combining(m_combine_tensors);
+        expert->set_quantization(m_quantization);
+        expert->add_model_vars(vars);
+        expert->initialize();
+        m_experts.push_back(std::move(expert));
+        m_expert_vars.push_back(std::move(vars));
+    }
+}
+
+
+void PartitionedModel::learn_splits(const std::vector<float>& x, const std::vector<float>& y, size_t rows) {
+    // Standardize each output element, so that they all count the same towards the error
+    std::vector<double> mean(m_output_dim, 0), inv_std(m_output_dim, 0);
+    for (size_t r=0; r<rows; ++r) {
+        for (size_t m=0; m<m_output_dim; ++m) mean[m] += y[r * m_output_dim + m];
+    }
+    for (size_t m=0; m<m_output_dim; ++m) mean[m] /= double(rows);
+    for (size_t r=0; r<rows; ++r) {
+        for (size_t m=0; m<m_output_dim; ++m) {
+            double diff = y[r * m_output_dim + m] - mean[m];
+            inv_std[m] += diff * diff;
+        }
+    }
+    for (size_t m=0; m<m_output_dim; ++m) {
+        double stddev = std::sqrt(inv_std[m] / double(rows));
+        inv_std[m] = (stddev > 0) ? 1.0 / stddev : 0.0;
+    }
+    auto target = [&](size_t row, size_t m) { return (y[row * m_output_dim + m] - mean[m]) * inv_std[m]; };
+
+    std::vector<uint32_t> order(rows);
+    std::iota(order.begin(), order.end(), 0);
+    std::vector<double> total_sum(m_output_dim), total_sq(m_output_dim), left_sum(m_output_dim), left_sq(m_output_dim);
+
+    // Level order, so that every node knows which contiguous range of `order` holds its rows
+    std::vector<std::pair<size_t, size_t>> ranges(m_splits.size() * 2 + 1);
+    ranges[0] = {0, rows};
+    for (size_t node=0; node<m_splits.size(); ++node) {
+        size_t begin = ranges[node].first, end = ranges[node].second, n = end - begin;
+        PartitionSplit best {std::numeric_limits<float>::infinity(), 0};
+        std::fill(total_sum.begin(), total_sum.end(), 0.0);
+        std::fill(total_sq.begin(), total_sq.end(), 0.0);
+        for (size_t i=begin; i<end; ++i) {
+            for (size_t m=0; m<m_output_dim; ++m) {
+                double t = target(order[i], m);
+                total_sum[m] += t;
+                total_sq[m] += t * t;
+            }
+        }
+        double best_error = 0;
+        for (size_t m=0; m<m_output_dim && n > 0; ++m) best_error += total_sq[m] - total_sum[m] * total_sum[m] / double(n);
+        best_error *= 1 - 1e-9; // A split has to actually help
+
+        for (uint32_t d=0; d<m_input_dim && n >= 2 * m_min_captures; ++d) {
+            std::sort(order.begin() + begin, order.begin() + end, [&](uint32_t a, uint32_t b) {
+                return x[a * m_input_dim + d] < x[b * m_input_dim + d];
+            });
+            std::fill(left_sum.begin(), left_sum.end(), 0.0);
+            std::fill(left_sq.begin(), left_sq.end(), 0.0);
+            for (size_t k=1; k<n; ++k) {
+                uint32_t row = order[begin + k - 1];
+                for (size_t m=0; m<m_output_dim; ++m) {
+                    double t = target(row, m);
+                    left_sum[m] += t;
+                    left_sq[m] += t * t;
+                }
+                if (k < m_min_captures || n - k < m_min_captures) continue;
+                float below = x[row * m_input_dim + d];
+                float above = x[order[begin + k] * m_input_dim + d];
+                if (!(below < above)) continue; // Can't split in between equal values
+                double error = 0;
+                for (size_t m=0; m<m_output_dim; ++m) {
+                    double right_sum = total_sum[m] - left_sum[m];
+                    error += left_sq[m] - left_sum[m] * left_sum[m] / double(k);
+                    error += (total_sq[m] - left_sq[m]) - right_sum * right_sum / double(n - k);
+                }
+                if (error < best_error) {
+                    best_error = error;
+                    float midpoint = below + (above - below) / 2;
+                    best = {(midpoint > below) ? midpoint : above, d};
+                }
+            }
+        }
+        m_splits[node] = best;
+        auto mid = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t row) {
+            return x[row * m_input_dim + best.input] < best.threshold;
+        });
+        size_t split_at = mid - order.begin();
+        ranges[2*node + 1] = {begin, split_at};
+        ranges[2*node + 2] = {split_at, end};
+    }
+}
+
+
+void PartitionedModel::train_from_captures() {
+    size_t rows = get_capture_count();
+    if (rows == 0) {
+        std::cerr << "PHASM: No captures to train the partitioned model on" << std::endl;
+        return;
+    }
+    std::vector<float> x(rows * m_input_dim), y(rows * m_output_dim);
+    std::vector<const tensor*> row_inputs(m_inputs.size()), row_outputs(m_outputs.size());
+    for (size_t r=0; r<rows; ++r) {
+        for (size_t i=0; i<m_inputs.size(); ++i) row_inputs[i] = &m_inputs[i]->training_inputs[r];
+        for (size_t i=0; i<m_outputs.size(); ++i) row_outputs[i] = &m_outputs[i]->training_outputs[r];
+        flatten_and_join_into(row_inputs, {}, x.data() + r * m_input_dim, m_input_dim);
+        flatten_and_join_into(row_outputs, {}, y.data() + r * m_output_dim, m_output_dim);
+    }
+    if (m_learn_splits) {
+        auto start = std::chrono::steady_clock::now();
+        learn_splits(x, y, rows);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "PHASM: Learned " << m_experts.size() << "-way partitioning from " << rows << " captures in "
+                  << seconds << " s" << std::endl;
+    }
+
+    // Hand each expert the captures in its partition
+    for (auto& vars : m_expert_vars) {
+        for (auto& mv : vars) {
+            mv->training_inputs.clear();
+            mv->training_outputs.clear();
+        }
+    }
+    std::vector<size_t> counts(m_experts.size(), 0);
+    for (size_t r=0; r<rows; ++r) {
+        size_t leaf = route(x.data() + r * m_input_dim);
+        counts[leaf]++;
+        for (size_t i=0; i<m_model_vars.size(); ++i) {
+            const auto& mv = m_model_vars[i];
+            if (mv->is_input) m_expert_vars[leaf][i]->training_inputs.push_back(mv->training_inputs[r]);
+            if (mv->is_output) m_expert_vars[leaf][i]->training_outputs.push_back(mv->training_outputs[r]);
+        }
+    }
+    for (size_t leaf=0; leaf<m_experts.size(); ++leaf) {
+        m_experts[leaf]->m_captured_rows = counts[leaf];
+        std::cerr << "PHASM: Partition " << leaf << " has " << counts[leaf] << " captures" << std::endl;
+    }
+
+    // The experts are independent, so they train in parallel
+    std::atomic<size_t> next {0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+        for (size_t leaf = next++; leaf < m_experts.size(); leaf = next++) {
+            if (counts[leaf] == 0) continue;
+            try {
+                if (m_experts[leaf]->should_fit_normalizations()) m_experts[leaf]->fit_normalizations();
+                m_experts[leaf]->train_from_captures();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+        }
+    };
+    size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), m_experts.size());
+    std::vector<std::thread> threads;
+    for (size_t t=1; t<thread_count; ++t) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+
+    save_splits();
+    std::cerr << "PHASM: Saved partitioning to '" << m_filename << "'" << std::endl;
+}
+
+
+bool PartitionedModel::infer() {
+    float confidence;
+    return infer_with_confidence(confidence);
+}
+
+
+bool PartitionedModel::infer_with_confidence(float& confidence) {
+    confidence = 0;
+    if (m_experts.empty()) return false;
+    static thread_local std::vector<float> x;
+    x.resize(m_input_dim);
+    flatten_and_join_into(m_input_tensors, {}, x.data(), m_input_dim);
+    size_t leaf = route(x.data());
+
+    // Lend our tensors to the expert rather than copying them
+    auto& vars = m_expert_vars[leaf];
+    for (size_t i=0; i<m_model_vars.size(); ++i) {
+        if (m_model_vars[i]->is_input) std::swap(m_model_vars[i]->inference_input, vars[i]->inference_input);
+    }
+    bool success = m_experts[leaf]->infer_with_confidence(confidence);
+    for (size_t i=0; i<m_model_vars.size(); ++i) {
+        if (m_model_vars[i]->is_input) std::swap(m_model_vars[i]->inference_input, vars[i]->inference_input);
+        if (success && m_model_vars[i]->is_output) std::swap(m_model_vars[i]->inference_output, vars[i]->inference_output);
+    }
+    return success;
+}
+
+
+void PartitionedModel::load_splits() {
+    std::ifstream file(m_filename, std::ios::binary);
+    PartitionHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, s_magic, sizeof(s_magic)) != 0) {
+        throw std::runtime_error("PartitionedModel: '" + m_filename + "' isn't a partitioning");
+    }
+    if (header.version != s_version) {
+        throw std::runtime_error("PartitionedModel: '" + m_filename + "' has unsupported version " + std::to_string(header.version));
+    }
+    if (header.depth > s_max_depth || header.input_dim != m_input_dim) {
+        throw std::runtime_error("PartitionedModel: '" + m_filename + "' partitions " + std::to_string(header.input_dim) +
+                                 " inputs, but the model variables have " + std::to_string(m_input_dim));
+    }
+    std::vector<PartitionSplit> splits((size_t(1) << header.depth) - 1);
+    if (!file.read(reinterpret_cast<char*>(splits.data()), splits.size() * sizeof(PartitionSplit))) {
+        throw std::runtime_error("PartitionedModel: '" + m_filename + "' is truncated");
+    }
+    m_depth = header.depth;
+    m_splits = std::move(splits);
+}
+
+
+void PartitionedModel::save_splits() const {
+    std::ofstream file(m_filename, std::ios::binary | std::ios::trunc);
+    PartitionHeader header {};
+    std::memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.depth = uint32_t(m_depth);
+    header.input_dim = uint32_t(m_input_dim);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(m_splits.data()), m_splits.size() * sizeof(PartitionSplit));
+    if (!file) {
+        throw std::runtime_error("PartitionedModel: Unable to write '" + m_filename + "'");
+    }
+}
+
+} // namespace phasm
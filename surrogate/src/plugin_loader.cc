@@ -55,6 +55,7 @@ PluginLoader::~PluginLoader() {
     for (auto& p: m_loaded_plugins) {
         auto soname = p.first;
         auto handle = p.second->dl_handle;
+        if (handle == nullptr) continue; // Added via add_plugin, so there is nothing to close
         std::cout << "PHASM: Closing plugin '" << p.first << "'" << std::endl;
 
         // For now the Plugin is static, so DO NOT DELETE.
@@ -95,6 +96,8 @@ Plugin* PluginLoader::get_or_load_plugin(const std::string& plugin_name) {
     /// Otherwise it will load the plugin, cache it for future use, and then return it.
     /// Note that the PluginLoader retains ownership of all Plugin objects.
 
+    std::lock_guard<std::mutex> lock(m_plugins_mutex);
+
     // Search cached plugins
     auto it = m_loaded_plugins.find(plugin_name);
     if (it != m_loaded_plugins.end()) {
@@ -115,6 +118,53 @@ Plugin* PluginLoader::get_or_load_plugin(const std::string& plugin_name) {
     return plugin;
 }
 
+void PluginLoader::add_plugin(Plugin* plugin) {
+    std::lock_guard<std::mutex> lock(m_plugins_mutex);
+    m_loaded_plugins[plugin->get_name()] = plugin;
+}
+
+
+std::shared_ptr<Model> PluginLoader::get_or_make_model(const std::string& plugin_name, const std::string& model_name,
+                                                       const std::string& config,
+                                                       const std::function<std::shared_ptr<Model>(Plugin*)>& make_model) {
+
+    /// The registry only holds weak references. Once the last Surrogate using a model has been destroyed (and has
+    /// finalized it), the model goes away, and the next request makes a fresh one.
+    /// Each entry has its own mutex, so that different models can be made in parallel.
+
+    Plugin* plugin = get_or_load_plugin(plugin_name);
+    std::shared_ptr<SharedModel> entry;
+    {
+        std::lock_guard<std::mutex> lock(m_shared_models_mutex);
+        auto& slot = m_shared_models[SharedModelKey(plugin_name, model_name, config)];
+        if (slot == nullptr) {
+            slot = std::make_shared<SharedModel>();
+        }
+        entry = slot;
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    std::shared_ptr<Model> model = entry->model.lock();
+    if (model == nullptr) {
+        model = make_model(plugin);
+        entry->model = model;
+    }
+    else {
+        std::cout << "PHASM: Sharing model '" << model_name << "' from plugin '" << plugin_name << "'" << std::endl;
+    }
+    return model;
+}
+
+
+size_t PluginLoader::get_shared_model_count() {
+    std::lock_guard<std::mutex> lock(m_shared_models_mutex);
+    size_t count = 0;
+    for (auto& p : m_shared_models) {
+        if (!p.second->model.expired()) count += 1;
+    }
+    return count;
+}
+
+
 std::string PluginLoader::find_plugin(const std::string& short_plugin_name) {
 
     for (std::string path: m_plugin_paths) {
@@ -5,17 +5,207 @@
 #include "surrogate.h"
 
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cstdarg>  // For va_start, etc
 #include <cstring> // For strcmp
+#include <mutex>
+#include <thread>
 
 #include "model.h"
+#include "model_file_watcher.h"
+#include "memo_cache.h"
+#include "interpolation_table.h"
+#include "dtype_conversion.h"
 
 namespace phasm {
 
 
+/// Lives apart from the Surrogate, so that preload_all() can make the model without knowing where the Surrogate is
+struct Surrogate::DeferredModel {
+    std::once_flag once;
+    std::function<std::shared_ptr<Model>()> make_model;
+    std::shared_ptr<ModelHandle> handle;
+    std::exception_ptr error;
+
+    void load() {
+        std::call_once(once, [this]() {
+            try {
+                auto model = make_model();
+                // Only publish if nobody has swapped in a newer model in the meantime
+                if (handle->get_version_number() == 0) {
+                    publish_model(*handle, std::move(model));
+                }
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            make_model = nullptr;
+        });
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+
+struct Surrogate::PendingModels {
+    std::mutex mutex;
+    std::vector<std::weak_ptr<DeferredModel>> models;
+};
+
+
+Surrogate::PendingModels& Surrogate::get_pending_models() {
+    // Surrogates are often static globals, so this can't be a static global itself. See PluginLoader::get_singleton.
+    static PendingModels g_pending_models;
+    return g_pending_models;
+}
+
+
 Surrogate::~Surrogate() {
-    // TODO: If model is shared, maybe check reference count?
-    if (m_model != nullptr) m_model->finalize(m_callmode);
+    // Stop the watcher first, so that the model can't be swapped out from under finalize()
+    m_model_file_watcher.reset();
+    if (m_model == nullptr) return; // Moved-from
+    auto model = m_model->pin();
+    if (model && model->m_surrogate_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // We were the last Surrogate using this model
+        model->finalize(m_callmode);
+    }
+}
+
+
+Surrogate& Surrogate::set_model(const std::shared_ptr<Model>& model) {
+    publish_model(*m_model, model);
+    return *this;
+}
+
+
+Surrogate& Surrogate::defer_model(std::function<std::shared_ptr<Model>()> make_model) {
+    m_deferred_model = std::make_shared<DeferredModel>();
+    m_deferred_model->make_model = std::move(make_model);
+    m_deferred_model->handle = m_model;
+    auto& pending = get_pending_models();
+    std::lock_guard<std::mutex> lock(pending.mutex);
+    pending.models.push_back(m_deferred_model);
+    return *this;
+}
+
+
+void Surrogate::load_deferred_model() {
+    m_deferred_model->load();
+}
+
+
+void preload_all(size_t max_threads) {
+    std::vector<std::shared_ptr<Surrogate::DeferredModel>> models;
+    {
+        auto& pending = Surrogate::get_pending_models();
+        std::lock_guard<std::mutex> lock(pending.mutex);
+        for (const auto& weak : pending.models) {
+            if (auto model = weak.lock()) models.push_back(std::move(model));
+        }
+        pending.models.clear();
+    }
+    Surrogate::load_deferred_models(models, max_threads);
+}
+
+
+void preload(const std::vector<Surrogate*>& surrogates, size_t max_threads) {
+    std::vector<std::shared_ptr<Surrogate::DeferredModel>> models;
+    for (auto* surrogate : surrogates) {
+        if (surrogate->m_deferred_model != nullptr && surrogate->m_model->get_version_number() == 0) {
+            models.push_back(surrogate->m_deferred_model);
+        }
+    }
+    Surrogate::load_deferred_models(models, max_threads);
+}
+
+
+void Surrogate::load_deferred_models(const std::vector<std::shared_ptr<DeferredModel>>& models, size_t max_threads) {
+    if (models.empty()) return;
+    if (max_threads == 0) max_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t thread_count = std::min(max_threads, models.size());
+    std::cout << "PHASM: Preloading " << models.size() << " models on " << thread_count << " threads" << std::endl;
+
+    std::atomic<size_t> next {0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+        for (size_t i = next++; i < models.size(); i = next++) {
+            try {
+                models[i]->load();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t=1; t<thread_count; ++t) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+}
+
+
+void Surrogate::publish_model(ModelHandle& handle, std::shared_ptr<Model> model) {
+    if (model != nullptr) {
+        model->m_surrogate_count.fetch_add(1, std::memory_order_acq_rel);
+    }
+    auto previous = handle.publish(std::move(model));
+    if (previous != nullptr) {
+        // Models that have been swapped out don't get finalized, even if no other Surrogate is using them
+        previous->m_surrogate_count.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+
+void Surrogate::swap_model(std::shared_ptr<Model> model) {
+    // Making a deferred model may rebind our CallSiteVariables to a shared model's ModelVariables, so it has to come first
+    load_model();
+    install_model(*m_model, get_model_vars(), std::move(model));
+}
+
+
+void Surrogate::install_model(ModelHandle& handle, const std::vector<std::shared_ptr<ModelVariable>>& model_vars,
+                              std::shared_ptr<Model> model) {
+    // initialize() reallocates the outputs and loads normalizations, which mustn't happen to the ModelVariables the
+    // previous model is still serving calls from. So the new model gets copies, and borrows the tensors and captures
+    // of ours around every call (see Model::Loan).
+    std::vector<std::shared_ptr<ModelVariable>> copies;
+    for (const auto& mv : model_vars) {
+        copies.push_back(mv->clone_declaration());
+    }
+    model->add_model_vars(copies);
+    model->initialize();
+    model->m_lender_vars = model_vars;
+    // The captures themselves live in our ModelVariables, which both models borrow. Only the count lives in the model.
+    // Note that swapping while capturing on another thread can lose a count; swapping is really meant for UseModel.
+    auto previous = handle.get();
+    if (previous != nullptr) {
+        model->m_captured_rows = previous->m_captured_rows;
+    }
+    publish_model(handle, std::move(model));
+}
+
+
+void Surrogate::watch_model_file(std::string path, std::function<std::shared_ptr<Model>(const std::string&)> make_model,
+                                 std::chrono::milliseconds poll_interval) {
+    m_model_file_watcher.reset();
+    // The watcher thread may outlive a moved-from Surrogate, so it holds on to what it needs rather than to `this`
+    auto handle = m_model;
+    auto deferred_model = m_deferred_model;
+    auto callsite_vars = m_callsite_vars;
+    m_model_file_watcher = std::make_shared<ModelFileWatcher>(std::move(path),
+        [handle, deferred_model, callsite_vars, make_model=std::move(make_model)](const std::string& changed_path) {
+            // As in swap_model, the ModelVariables are only known once a deferred model has been made
+            if (deferred_model != nullptr) deferred_model->load();
+            std::vector<std::shared_ptr<ModelVariable>> model_vars;
+            for (const auto& csv : callsite_vars) {
+                model_vars.insert(model_vars.end(), csv->model_vars.begin(), csv->model_vars.end());
+            }
+            install_model(*handle, model_vars, make_model(changed_path));
+        },
+        poll_interval);
 }
 
 
@@ -54,7 +244,11 @@ std::shared_ptr<CallSiteVariable> Surrogate::get_callsite_var(std::string name)
 void Surrogate::call() {
     switch (m_callmode) {
         case CallMode::UseModel:
-            call_model();
+            // If the model declines (e.g. the input is outside what it was trained on, or no stage of a CascadeModel
+            // was confident enough), the original function has the last word
+            if (!call_model() && m_original_function) {
+                call_original();
+            }
             break;
         case CallMode::UseOriginal:
             call_original();
@@ -70,6 +264,9 @@ void Surrogate::call() {
             capture_input_range();
             call_original();
             break;
+        case CallMode::TrainOnline:
+            call_original_and_train_online();
+            break;
         case CallMode::NotSet:
         default:
             print_help_screen();
@@ -79,11 +276,47 @@ void Surrogate::call() {
 
 
 void Surrogate::call_original() {
+    if (m_original_cache != nullptr) {
+        call_original_memoized();
+        return;
+    }
     m_original_function();
 }
 
 
+/// Goes straight from the callsite bindings to the cache and back, without touching the ModelVariables, so that
+/// this is exactly as thread safe as the original function itself.
+void Surrogate::call_original_memoized() {
+    static thread_local std::string key;
+    static thread_local std::vector<tensor> outputs;
+    key.clear();
+    for (const auto& csv : m_callsite_vars) {
+        for (const auto& mv : csv->model_vars) {
+            if (mv->is_input) append_memo_key(key, mv->accessor->unsafe_to(csv->binding));
+        }
+    }
+    if (m_original_cache->lookup(key, outputs)) {
+        size_t i = 0;
+        for (const auto& csv : m_callsite_vars) {
+            for (const auto& mv : csv->model_vars) {
+                if (mv->is_output) mv->accessor->unsafe_from(outputs[i++], csv->binding);
+            }
+        }
+        return;
+    }
+    m_original_function();
+    outputs.clear();
+    for (const auto& csv : m_callsite_vars) {
+        for (const auto& mv : csv->model_vars) {
+            if (mv->is_output) outputs.push_back(mv->accessor->unsafe_to(csv->binding));
+        }
+    }
+    m_original_cache->insert(key, std::move(outputs));
+}
+
+
 void Surrogate::call_original_and_capture() {
+    load_model();
     for (auto &input: m_callsite_vars) {
         input->captureAllTrainingInputs();
     }
@@ -91,34 +324,87 @@ void Surrogate::call_original_and_capture() {
     for (auto &output: m_callsite_vars) {
         output->captureAllTrainingOutputs();
     }
-    m_model->m_captured_rows++;
+    m_model->pin()->m_captured_rows++;
 }
 
 void Surrogate::call_model_and_capture() {
+    load_model();
     for (auto &input: m_callsite_vars) {
         input->captureAllTrainingInputs();
         input->captureAllInferenceInputs();
     }
-    bool result = m_model->infer();
+    auto model = m_model->pin();
+    bool result = model->infer_on_loan();
     for (auto &output: m_callsite_vars) {
         output->publishAllInferenceOutputs();
         output->captureAllTrainingOutputs();
     }
-    m_model->m_captured_rows++;
+    model->m_captured_rows++;
     // TODO: Do something with result
 }
 
 
+void Surrogate::capture_grid(const std::vector<GridAxis>& axes) {
+    load_model();
+    size_t total = 1;
+    for (const auto& axis : axes) total *= axis.count;
+    std::vector<float> x(axes.size());
+    for (size_t p=0; p<total; ++p) {
+        size_t remaining = p;
+        for (size_t d=axes.size(); d>0; --d) {
+            x[d-1] = axes[d-1].get_point(remaining % axes[d-1].count);
+            remaining /= axes[d-1].count;
+        }
+        // Write the grid point through the optics, converting to whatever type each input actually is
+        size_t k = 0;
+        for (const auto& csv : m_callsite_vars) {
+            for (const auto& mv : csv->model_vars) {
+                if (!mv->is_input) continue;
+                tensor t = mv->accessor->unsafe_to(csv->binding);
+                if (k + t.get_length() > x.size()) {
+                    throw std::runtime_error("capture_grid: The inputs have more elements than there are axes");
+                }
+                convert(x.data() + k, DType::F32, t.get_data<void>(), t.get_dtype(), t.get_length());
+                mv->accessor->unsafe_from(t, csv->binding);
+                k += t.get_length();
+            }
+        }
+        if (k != x.size()) {
+            throw std::runtime_error("capture_grid: The inputs have fewer elements than there are axes");
+        }
+        call_original_and_capture();
+    }
+}
+
+
 void Surrogate::capture_input_range() {
+    load_model();
+}
+
 
+/// Calls the original function and hands the capture to the model, which trains on it in the background. Once the
+/// model reports that it is good enough, this Surrogate switches itself over to CallMode::UseModel. Models which don't
+/// support online training keep the capture around for train_from_captures() instead, just like TrainModel.
+void Surrogate::call_original_and_train_online() {
+    load_model();
+    call_original_and_capture();
+    auto model = m_model->pin();
+    model->train_online_on_loan();
+    if (model->is_online_training_converged()) {
+        std::cout << "PHASM: Online training converged; switching call mode to UseModel" << std::endl;
+        m_callmode = CallMode::UseModel;
+    }
 }
 
 
-void Surrogate::call_model() {
+bool Surrogate::call_model() {
+    load_model();
     for (const std::shared_ptr<CallSiteVariable>& v : m_callsite_vars) {
         v->captureAllInferenceInputs();
     }
-    bool result = m_model->infer();
+    // The pin keeps the model alive even if another thread swaps in a new one while we're inferring
+    auto model = m_model->pin();
+    bool result = model->infer_on_loan();
     if (result) {
         for (const std::shared_ptr<CallSiteVariable>& v : m_callsite_vars) {
             v->publishAllInferenceOutputs();
@@ -130,6 +416,7 @@ void Surrogate::call_model() {
         //       results, dump them, or use them for training? Unclear at the moment.
         //call_original_and_capture();
     }
+    return result;
 }
 
 
@@ -143,6 +430,7 @@ CallMode get_call_mode_from_envvar() {
     if (strcmp(callmode_str, "DumpTrainingData") == 0) return CallMode::DumpTrainingData;
     if (strcmp(callmode_str, "DumpValidationData") == 0) return CallMode::DumpValidationData;
     if (strcmp(callmode_str, "DumpInputSummary") == 0) return CallMode::DumpInputSummary;
+    if (strcmp(callmode_str, "TrainOnline") == 0) return CallMode::TrainOnline;
     return CallMode::NotSet;
 }
 
@@ -161,6 +449,8 @@ void print_help_screen() {
     std::cout << "    DumpValidationData         Call the surrogate model, capture all inputs and outputs, and dump them to CSV"
               << std::endl;
     std::cout << "    DumpInputSummary           Dump information about the ranges for each of the model inputs" << std::endl;
+    std::cout << "    TrainOnline                Call the original function and train the model in the background, switching to UseModel once it is accurate enough"
+              << std::endl;
     std::cout << std::endl;
 }
 
@@ -4,11 +4,21 @@
 
 #include "surrogate_builder.h"
 #include "plugin_loader.h"
+#include "memoizing_model.h"
 #include <iostream>
+#include <sstream>
 #include <string>
 
 namespace phasm {
 
+// Explicit instantiation definitions for the extern declarations in surrogate_builder.h
+template struct Cursor<uint8_t>;
+template struct Cursor<int16_t>;
+template struct Cursor<int32_t>;
+template struct Cursor<int64_t>;
+template struct Cursor<float>;
+template struct Cursor<double>;
+
 Surrogate SurrogateBuilder::finish() const {
     Surrogate s;
     if (m_callmode != CallMode::NotSet) {
@@ -24,23 +34,153 @@ Surrogate SurrogateBuilder::finish() const {
         s.set_callmode(CallMode::UseOriginal);
     }
     s.add_callsite_vars(m_csvs);
-    s.set_model(m_model);
-    m_model->add_model_vars(s.get_model_vars());
-    m_model->initialize();
+    if (m_lazy_init.value_or(!m_plugin_name.empty())) {
+        // The builder only holds on to shared_ptrs and settings, so a copy of it is a complete description of the model
+        SurrogateBuilder spec = *this;
+        s.defer_model([spec]() { return spec.make_model(); });
+    }
+    else {
+        s.set_model(make_model());
+    }
+    if (m_original_memoization_bytes > 0) {
+        s.set_original_memoization(std::make_shared<MemoCache>(m_original_memoization_bytes));
+    }
+    if (m_hot_reload_interval.count() > 0) {
+        if (m_plugin_name.empty() || m_model_name.empty()) {
+            throw std::runtime_error("enable_hot_reload: The model has to be loaded from a file via a plugin");
+        }
+        std::string plugin_name = m_plugin_name;
+        bool enable_tensor_combining = m_enable_tensor_combining;
+        Quantization quantization = m_quantization;
+        size_t memoization_bytes = m_model_memoization_bytes;
+        s.watch_model_file(m_model_name, [plugin_name, enable_tensor_combining, quantization, memoization_bytes](const std::string& path) {
+            Plugin* plugin = PluginLoader::get_singleton().get_or_load_plugin(plugin_name);
+            std::shared_ptr<Model> model = plugin->make_model(path);
+            if (memoization_bytes > 0) {
+                // A fresh cache, since the old one holds the previous model's outputs
+                model = std::make_shared<MemoizingModel>(model, memoization_bytes);
+            }
+            model->enable_tensor_combining(enable_tensor_combining);
+            model->set_quantization(quantization);
+            return model;
+        }, m_hot_reload_interval);
+    }
     return s;
 }
 
 SurrogateBuilder& SurrogateBuilder::set_model(std::string plugin_name, std::string model_name, bool enable_tensor_combining) {
-    m_model = PluginLoader::get_singleton().get_or_load_plugin(plugin_name)->make_model(model_name);
-    m_model->enable_tensor_combining(enable_tensor_combining);
+    // Neither the plugin nor the model is loaded until make_model(), once the rest of the configuration is known
+    m_plugin_name = plugin_name;
+    m_model_name = model_name;
+    m_enable_tensor_combining = enable_tensor_combining;
+    m_model = nullptr;
     return *this;
 }
 
 
+std::shared_ptr<Model> SurrogateBuilder::make_model() const {
+    // Only the first Surrogate of a shared model sets it up. The others capture into and infer from its ModelVariables.
+    bool made_model = false;
+    auto set_up_model = [&](std::shared_ptr<Model> model) {
+        if (m_model_memoization_bytes > 0) {
+            model = std::make_shared<MemoizingModel>(model, m_model_memoization_bytes);
+        }
+        model->set_quantization(m_quantization);
+        model->add_model_vars(get_model_vars());
+        model->initialize();
+        made_model = true;
+        return model;
+    };
+    std::shared_ptr<Model> model;
+    if (!m_plugin_name.empty() && !m_model_name.empty()) {
+        std::ostringstream config;
+        config << "combine=" << m_enable_tensor_combining << ";quantization=" << static_cast<int>(m_quantization)
+               << ";memoization=" << m_model_memoization_bytes;
+        // Call sites which feed the model different types or normalizations each need a model of their own. Names,
+        // directions and shapes are left out, so that mismatches there are reported by share_model_vars() instead.
+        for (const auto& mv : get_model_vars()) {
+            config << ";var=" << mv->accessor->consumes << "," << static_cast<int>(mv->accessor->dtype())
+                   << "," << static_cast<int>(mv->normalization.kind);
+        }
+        model = PluginLoader::get_singleton().get_or_make_model(m_plugin_name, m_model_name, config.str(),
+            [&](Plugin* plugin) {
+                auto plugin_model = plugin->make_model(m_model_name);
+                plugin_model->enable_tensor_combining(m_enable_tensor_combining);
+                return set_up_model(plugin_model);
+            });
+    }
+    else if (!m_plugin_name.empty()) {
+        // Without a model name, the plugin makes a fresh, untrained model, so there is nothing to share
+        auto plugin_model = PluginLoader::get_singleton().get_or_load_plugin(m_plugin_name)->make_model(m_model_name);
+        plugin_model->enable_tensor_combining(m_enable_tensor_combining);
+        model = set_up_model(plugin_model);
+    }
+    else if (m_model == nullptr) {
+        throw std::runtime_error("SurrogateBuilder: No model has been set");
+    }
+    else if (m_model->get_model_var_count() == 0) {
+        model = set_up_model(m_model);
+    }
+    else {
+        // The same model was handed to another builder, which has set it up already (including any memoization)
+        model = m_model;
+    }
+    if (!made_model) {
+        share_model_vars(*model);
+    }
+    return model;
+}
+
+
+void SurrogateBuilder::share_model_vars(Model& model) const {
+    if (model.get_model_var_count() != get_model_vars().size()) {
+        throw std::runtime_error("SurrogateBuilder: This call site has " + std::to_string(get_model_vars().size()) +
+                                 " model variables, but the model it shares has " +
+                                 std::to_string(model.get_model_var_count()));
+    }
+    for (const auto& csv : m_csvs) {
+        for (auto& mv : csv->model_vars) {
+            std::shared_ptr<ModelVariable> shared;
+            try {
+                shared = model.get_model_var(mv->name);
+            }
+            catch (std::runtime_error&) {
+                throw std::runtime_error("SurrogateBuilder: The model this call site shares has no model variable '" + mv->name + "'");
+            }
+            if (shared->is_input != mv->is_input || shared->is_output != mv->is_output || shared->shape() != mv->shape()) {
+                throw std::runtime_error("SurrogateBuilder: Model variable '" + mv->name +
+                                         "' is declared differently from the call site which set up the shared model");
+            }
+            // From here on, this call site reads and writes its variables through the shared accessor
+            if (shared->accessor->consumes != mv->accessor->consumes || shared->accessor->dtype() != mv->accessor->dtype()) {
+                throw std::runtime_error("SurrogateBuilder: Model variable '" + mv->name + "' has a different type or "
+                                         "dtype from the call site which set up the shared model");
+            }
+            // The shared model was set up with, and may have been trained on, the other call site's normalization
+            if (shared->normalization.kind != mv->normalization.kind) {
+                throw std::runtime_error("SurrogateBuilder: Model variable '" + mv->name + "' has a different "
+                                         "normalization from the call site which set up the shared model");
+            }
+            mv = shared;
+        }
+    }
+}
+
+
 std::vector<std::shared_ptr<CallSiteVariable>> SurrogateBuilder::get_callsite_vars() const {
     return m_csvs;
 }
 
+SurrogateBuilder& SurrogateBuilder::set_normalization(std::string model_var_name, NormalizationKind kind) {
+    for (const auto& mv : get_model_vars()) {
+        if (mv->name == model_var_name) {
+            mv->normalization.kind = kind;
+            return *this;
+        }
+    }
+    throw std::runtime_error("set_normalization: No model variable named '" + model_var_name + "'");
+}
+
 std::vector<std::shared_ptr<ModelVariable>> SurrogateBuilder::get_model_vars() const {
     std::vector<std::shared_ptr<ModelVariable>> results;
     for (const auto &csv: m_csvs) {
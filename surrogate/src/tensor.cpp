@@ -5,6 +5,7 @@
 
 #include "tensor.hpp"
 #include <cmath>
+#include <algorithm>
 #include <stdexcept>
 #include <cassert>
 #include <iostream>
@@ -25,6 +26,7 @@ tensor::tensor(const tensor& other) noexcept {
     m_dtype = other.m_dtype;
     m_length = other.m_length;
     m_shape = other.m_shape;
+    m_row_offsets = other.m_row_offsets;
     switch (m_dtype) {
         case DType::UI8: m_data = copy_typed<uint8_t>(other.m_data, other.m_length); break;
         case DType::I16: m_data = copy_typed<int16_t>(other.m_data, other.m_length); break;
@@ -38,30 +40,19 @@ tensor::tensor(const tensor& other) noexcept {
 
 tensor& tensor::operator=(const tensor& other) noexcept {
     if (this == &other) return *this;
+    free_data();
     m_dtype = other.m_dtype;
     m_length = other.m_length;
     m_shape = other.m_shape;
+    m_row_offsets = other.m_row_offsets;
     switch (m_dtype) {
-        case DType::UI8:
-            delete[] static_cast<uint8_t *>(m_data);
-            m_data = copy_typed<uint8_t>(other.m_data, other.m_length);
-            break;
-        case DType::I16:
-            delete[] static_cast<int16_t *>(m_data);
-            m_data = copy_typed<int16_t>(other.m_data, other.m_length); break;
-        case DType::I32:
-            delete[] static_cast<int32_t *>(m_data);
-            m_data = copy_typed<int32_t>(other.m_data, other.m_length); break;
-        case DType::I64:
-            delete[] static_cast<int64_t *>(m_data);
-            m_data = copy_typed<int64_t>(other.m_data, other.m_length); break;
-        case DType::F32:
-            delete[] static_cast<float *>(m_data);
-            m_data = copy_typed<float>(other.m_data, other.m_length); break;
-        case DType::F64:
-            delete[] static_cast<double *>(m_data);
-            m_data = copy_typed<double>(other.m_data, other.m_length); break;
-        default: break;
+        case DType::UI8: m_data = copy_typed<uint8_t>(other.m_data, other.m_length); break;
+        case DType::I16: m_data = copy_typed<int16_t>(other.m_data, other.m_length); break;
+        case DType::I32: m_data = copy_typed<int32_t>(other.m_data, other.m_length); break;
+        case DType::I64: m_data = copy_typed<int64_t>(other.m_data, other.m_length); break;
+        case DType::F32: m_data = copy_typed<float>(other.m_data, other.m_length); break;
+        case DType::F64: m_data = copy_typed<double>(other.m_data, other.m_length); break;
+        default: m_data = nullptr; break;
     }
     return *this;
 }
@@ -69,33 +60,73 @@ tensor::tensor(tensor &&other) noexcept {
     m_dtype = other.m_dtype;
     m_length = other.m_length;
     m_shape = other.m_shape;
+    m_row_offsets = std::move(other.m_row_offsets);
+    m_deleter = std::move(other.m_deleter);
     m_data = other.m_data;
     other.m_data = nullptr;
+    other.m_deleter = nullptr;
     other.m_dtype = DType::Undefined;
     other.m_length = 0;
     other.m_shape = {};
+    other.m_row_offsets = {};
 }
 
 tensor& tensor::operator=(tensor&& other) noexcept {
     if (this == &other) return *this;
+    free_data();
     m_dtype = other.m_dtype;
     m_length = other.m_length;
     m_shape = other.m_shape;
-    switch (m_dtype) {
-        case DType::UI8: delete[] static_cast<uint8_t *>(m_data); break;
-        case DType::I16: delete[] static_cast<int16_t *>(m_data); break;
-        case DType::I32: delete[] static_cast<int32_t *>(m_data); break;
-        case DType::I64: delete[] static_cast<int64_t *>(m_data); break;
-        case DType::F32: delete[] static_cast<float *>(m_data); break;
-        case DType::F64: delete[] static_cast<double *>(m_data); break;
-        default: break;
-    }
+    m_row_offsets = std::move(other.m_row_offsets);
+    m_deleter = std::move(other.m_deleter);
     m_data = other.m_data;
     other.m_data = nullptr;
+    other.m_deleter = nullptr;
+    other.m_dtype = DType::Undefined;
+    other.m_length = 0;
+    other.m_shape = {};
+    other.m_row_offsets = {};
     return *this;
 }
 
-tensor::~tensor() {
+tensor::tensor(void* data, DType dtype, const std::vector<int64_t>& shape, std::function<void(void*)> deleter) {
+    assert(deleter);
+    m_data = data;
+    m_dtype = dtype;
+    m_shape = shape;
+    m_length = 1;
+    for (int64_t l : shape) {
+        m_length *= l;
+    }
+    m_deleter = std::move(deleter);
+}
+
+tensor::tensor(DType dtype, const std::vector<int64_t>& shape) {
+    m_dtype = dtype;
+    m_shape = shape;
+    m_length = 1;
+    for (int64_t l : shape) {
+        m_length *= l;
+    }
+    switch (dtype) {
+        case DType::UI8: m_data = new uint8_t[m_length]; break;
+        case DType::I16: m_data = new int16_t[m_length]; break;
+        case DType::I32: m_data = new int32_t[m_length]; break;
+        case DType::I64: m_data = new int64_t[m_length]; break;
+        case DType::F32: m_data = new float[m_length]; break;
+        case DType::F64: m_data = new double[m_length]; break;
+        default: throw std::runtime_error("tensor: Invalid dtype");
+    }
+}
+
+/// Releases the buffer according to the dtype it currently holds. Must be called before m_dtype is overwritten.
+void tensor::free_data() {
+    if (m_deleter) {
+        m_deleter(m_data);
+        m_deleter = nullptr;
+        m_data = nullptr;
+        return;
+    }
     switch (m_dtype) {
         case DType::UI8: delete[] static_cast<uint8_t*>(m_data); break;
         case DType::I16: delete[] static_cast<int16_t*>(m_data); break;
@@ -110,7 +141,12 @@ tensor::~tensor() {
             }
             break;
     }
-};
+    m_data = nullptr;
+}
+
+tensor::~tensor() {
+    free_data();
+}
 
 template <typename T>
 inline bool equals_typed(const tensor& lhs, const tensor& rhs) {
@@ -140,6 +176,7 @@ bool tensor::operator==(const tensor& rhs) const {
     if (m_dtype != rhs.m_dtype) return false;
     if (m_length != rhs.m_length) return false;
     if (m_shape != rhs.m_shape) return false;
+    if (m_row_offsets != rhs.m_row_offsets) return false;
     switch (m_dtype) {
         case DType::UI8: return equals_typed<uint8_t>(*this, rhs);
         case DType::I16: return equals_typed<int16_t>(*this, rhs);
@@ -158,7 +195,7 @@ inline tensor stack_typed(const std::vector<tensor>& tensors) {
     size_t stacked_tensor_count = tensors.size();
     size_t stacked_length = original_length * stacked_tensor_count;
     std::vector<int64_t> stacked_shape;
-    stacked_shape.push_back(stacked_length);
+    stacked_shape.push_back(stacked_tensor_count);
     for (size_t dim_length : tensors[0].get_shape()) {
         stacked_shape.push_back(dim_length);
     }
@@ -204,9 +241,9 @@ std::vector<tensor> unstack_typed(const tensor& tensor) {
 
         T* split_buffer = new T[split_length];
         for (size_t i=0; i<split_length; ++i) {
-            split_buffer[i] = original_buffer[j*split_length] + i;
+            split_buffer[i] = original_buffer[j*split_length + i];
         }
-        results.push_back(phasm::tensor(split_buffer, split_shape));
+        results.push_back(phasm::tensor(std::unique_ptr<T[]>(split_buffer), split_shape));
     }
     return results;
 }
@@ -215,11 +252,119 @@ std::vector<tensor> unstack(const tensor& tensor) {
     auto unstacked_dtype = tensor.get_dtype();
     switch (unstacked_dtype) {
         case DType::UI8: return unstack_typed<uint8_t>(tensor);
-        case DType::I16: return unstack_typed<uint8_t>(tensor);
-        case DType::I32: return unstack_typed<uint8_t>(tensor);
-        case DType::I64: return unstack_typed<uint8_t>(tensor);
-        case DType::F32: return unstack_typed<uint8_t>(tensor);
-        case DType::F64: return unstack_typed<uint8_t>(tensor);
+        case DType::I16: return unstack_typed<int16_t>(tensor);
+        case DType::I32: return unstack_typed<int32_t>(tensor);
+        case DType::I64: return unstack_typed<int64_t>(tensor);
+        case DType::F32: return unstack_typed<float>(tensor);
+        case DType::F64: return unstack_typed<double>(tensor);
+        default:
+            throw std::runtime_error("Tensor has unknown dtype");
+    }
+}
+
+template <typename T>
+tensor stack_ragged_typed(const std::vector<tensor>& tensors, const std::vector<int64_t>& item_shape) {
+
+    size_t item_length = 1;
+    for (int64_t dim : item_shape) item_length *= dim;
+
+    std::vector<int64_t> row_offsets;
+    row_offsets.reserve(tensors.size() + 1);
+    row_offsets.push_back(0);
+    for (const auto& t : tensors) {
+        int64_t row_items = (t.get_dtype() == DType::Undefined) ? 0 : t.get_length() / item_length;
+        row_offsets.push_back(row_offsets.back() + row_items);
+    }
+    int64_t total_items = row_offsets.back();
+
+    std::vector<int64_t> stacked_shape {total_items};
+    stacked_shape.insert(stacked_shape.end(), item_shape.begin(), item_shape.end());
+
+    T* buffer = new T[total_items * item_length];
+    T* dest = buffer;
+    for (const auto& t : tensors) {
+        if (t.get_dtype() == DType::Undefined) continue;
+        const T* source = t.get_data<T>();
+        for (size_t i=0; i<t.get_length(); ++i) {
+            dest[i] = source[i];
+        }
+        dest += t.get_length();
+    }
+    return tensor(std::unique_ptr<T[]>(buffer), stacked_shape, std::move(row_offsets));
+}
+
+tensor stack_ragged(const std::vector<tensor>& tensors) {
+
+    // Find the dtype and the per-item shape from the first non-empty row
+    DType stacked_dtype = DType::Undefined;
+    std::vector<int64_t> item_shape;
+    for (const auto& t : tensors) {
+        if (t.get_dtype() == DType::Undefined) continue;
+        const auto& shape = t.get_shape();
+        auto item_shape_begin = shape.empty() ? shape.end() : shape.begin() + 1; // Scalars count as a single item
+        if (stacked_dtype == DType::Undefined) {
+            stacked_dtype = t.get_dtype();
+            item_shape.assign(item_shape_begin, shape.end());
+        }
+        else if (t.get_dtype() != stacked_dtype) {
+            throw std::runtime_error("stack_ragged: Tensors have inconsistent dtypes");
+        }
+        else if (!std::equal(item_shape.begin(), item_shape.end(), item_shape_begin, shape.end())) {
+            throw std::runtime_error("stack_ragged: Tensors differ in dimensions other than the first");
+        }
+    }
+    switch (stacked_dtype) {
+        case DType::UI8: return stack_ragged_typed<uint8_t>(tensors, item_shape);
+        case DType::I16: return stack_ragged_typed<int16_t>(tensors, item_shape);
+        case DType::I32: return stack_ragged_typed<int32_t>(tensors, item_shape);
+        case DType::I64: return stack_ragged_typed<int64_t>(tensors, item_shape);
+        case DType::F32: return stack_ragged_typed<float>(tensors, item_shape);
+        case DType::F64: return stack_ragged_typed<double>(tensors, item_shape);
+        default:
+            throw std::runtime_error("stack_ragged: All tensors are undefined");
+    }
+}
+
+template <typename T>
+std::vector<tensor> unstack_ragged_typed(const tensor& t) {
+
+    const auto& offsets = t.get_row_offsets();
+    std::vector<int64_t> row_shape = t.get_shape();
+    size_t item_length = 1;
+    for (size_t dim=1; dim<row_shape.size(); ++dim) item_length *= row_shape[dim];
+
+    std::vector<tensor> results;
+    results.reserve(t.get_row_count());
+    const T* source = t.get_data<T>();
+    for (size_t row=0; row<t.get_row_count(); ++row) {
+        int64_t row_items = offsets[row+1] - offsets[row];
+        if (row_items == 0) {
+            results.emplace_back();
+            continue;
+        }
+        row_shape[0] = row_items;
+        size_t row_length = row_items * item_length;
+        T* buffer = new T[row_length];
+        const T* row_start = source + offsets[row] * item_length;
+        for (size_t i=0; i<row_length; ++i) {
+            buffer[i] = row_start[i];
+        }
+        results.push_back(tensor(std::unique_ptr<T[]>(buffer), row_shape));
+    }
+    return results;
+}
+
+std::vector<tensor> unstack_ragged(const tensor& t) {
+    if (!t.is_ragged()) {
+        throw std::runtime_error("unstack_ragged: Tensor is not ragged");
+    }
+    switch (t.get_dtype()) {
+        case DType::UI8: return unstack_ragged_typed<uint8_t>(t);
+        case DType::I16: return unstack_ragged_typed<int16_t>(t);
+        case DType::I32: return unstack_ragged_typed<int32_t>(t);
+        case DType::I64: return unstack_ragged_typed<int64_t>(t);
+        case DType::F32: return unstack_ragged_typed<float>(t);
+        case DType::F64: return unstack_ragged_typed<double>(t);
         default:
             throw std::runtime_error("Tensor has unknown dtype");
     }
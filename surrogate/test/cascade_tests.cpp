@@ -0,0 +1,211 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include "surrogate_builder.h"
+#include "cascade_model.h"
+
+using namespace phasm;
+namespace phasm::test::cascade_tests {
+
+/// Answers y = `value` for inputs below `max_x`, with confidence 1 - x
+struct ScriptedModel : public Model {
+    double value;
+    double max_x;
+    size_t trained_on = 0;
+    ScriptedModel(double value, double max_x) : value(value), max_x(max_x) {}
+
+    void train_from_captures() override { trained_on = get_capture_count(); }
+    bool infer() override {
+        float confidence;
+        return infer_with_confidence(confidence);
+    }
+    bool infer_with_confidence(float& confidence) override {
+        double x = *m_inputs[0]->inference_input.get_data<double>();
+        confidence = float(1 - x);
+        if (x >= max_x) return false;
+        m_outputs[0]->inference_output = tensor(&value, 1);
+        return true;
+    }
+};
+
+/// Consumes every capture it is handed during online training
+struct OnlineStage : public ScriptedModel {
+    size_t seen_online = 0;
+    OnlineStage() : ScriptedModel(0, 1.0) {}
+    void train_online() override {
+        seen_online += get_capture_count();
+        discard_captures();
+    }
+};
+
+/// Computes y = x in normalized space, like a network that was trained on normalized data. The normalizations are
+/// loaded in initialize(), as the plugin models do from their .norm files. Fails for x >= max_x.
+struct NormalizedStage : public Model {
+    std::string norm_file;
+    double max_x;
+    NormalizedStage(std::string norm_file, double max_x) : norm_file(std::move(norm_file)), max_x(max_x) {}
+
+    void initialize() override {
+        std::istringstream is(norm_file);
+        load_normalizations(is);
+    }
+    bool infer() override {
+        if (*m_inputs[0]->inference_input.get_data<double>() >= max_x) return false;
+        float x;
+        m_inputs[0]->normalization.normalize(m_inputs[0]->inference_input, &x);
+        unpack_output_into(&x, {1}, m_outputs[0]->normalization, m_outputs[0]->inference_output);
+        return true;
+    }
+};
+
+TEST_CASE("LatencyHistogram buckets by powers of two") {
+    LatencyHistogram h;
+    REQUIRE(h.get_quantile(0.5).count() == 0);
+    for (int i=0; i<90; ++i) h.record(std::chrono::nanoseconds(100));   // Bucket [64, 128)
+    for (int i=0; i<10; ++i) h.record(std::chrono::nanoseconds(5000));  // Bucket [4096, 8192)
+    REQUIRE(h.get_count() == 100);
+    REQUIRE(h.get_bucket_count(6) == 90);
+    REQUIRE(h.get_bucket_count(12) == 10);
+    REQUIRE(h.get_mean().count() == 590);
+    REQUIRE(h.get_quantile(0.5).count() == 128);
+    REQUIRE(h.get_quantile(0.99).count() == 8192);
+    h.record(std::chrono::hours(1));
+    REQUIRE(h.get_bucket_count(LatencyHistogram::BUCKET_COUNT - 1) == 1);
+    h.clear();
+    REQUIRE(h.get_count() == 0);
+}
+
+TEST_CASE("CascadeModel escalates until a stage is confident enough") {
+    auto cheap = std::make_shared<ScriptedModel>(1, 1.0);     // Always answers, but is only confident for small x
+    auto expensive = std::make_shared<ScriptedModel>(2, 0.8); // Fails for large x
+    auto cascade = std::make_shared<CascadeModel>();
+    cascade->add_stage(cheap, 0.5f, "cheap").add_stage(expensive);
+
+    double x, y;
+    int original_calls = 0;
+    auto s = SurrogateBuilder()
+            .set_model(cascade)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_original_function([&]() { y = 3; original_calls++; });
+    s.bind_all_callsite_vars(&x, &y);
+
+    x = 0.2; s.call();
+    REQUIRE(y == 1);
+    x = 0.6; s.call();
+    REQUIRE(y == 2);
+    x = 0.9; s.call();
+    REQUIRE(y == 3);
+    REQUIRE(original_calls == 1);
+
+    auto cheap_stats = cascade->get_stats(0);
+    REQUIRE(cheap_stats.name == "cheap");
+    REQUIRE(cheap_stats.attempts == 3);
+    REQUIRE(cheap_stats.accepted == 1);
+    REQUIRE(cheap_stats.rejected == 2);
+    REQUIRE(cheap_stats.failed == 0);
+    REQUIRE(cheap_stats.latency->get_count() == 3);
+
+    auto expensive_stats = cascade->get_stats(1);
+    REQUIRE(expensive_stats.name == "stage1");
+    REQUIRE(expensive_stats.attempts == 2);
+    REQUIRE(expensive_stats.accepted == 1);
+    REQUIRE(expensive_stats.failed == 1);
+    REQUIRE(expensive_stats.latency->get_count() == 2);
+    REQUIRE(cascade->get_fallthrough_count() == 1);
+
+    std::ostringstream report;
+    cascade->print_stats(report);
+    REQUIRE(report.str().find("original function: 1 calls") != std::string::npos);
+
+    REQUIRE_THROWS(cascade->add_stage(std::make_shared<ScriptedModel>(4, 1.0)));
+}
+
+TEST_CASE("CascadeModel trains every stage on the same captures") {
+    auto first = std::make_shared<ScriptedModel>(1, 1.0);
+    auto second = std::make_shared<ScriptedModel>(2, 1.0);
+    auto cascade = std::make_shared<CascadeModel>();
+    cascade->add_stage(first).add_stage(second);
+    {
+        double x, y;
+        auto s = SurrogateBuilder()
+                .set_model(cascade)
+                .set_callmode(CallMode::TrainModel)
+                .local_primitive<double>("x", Direction::IN)
+                .local_primitive<double>("y", Direction::OUT)
+                .finish();
+        s.bind_original_function([&]() { y = x; });
+        s.bind_all_callsite_vars(&x, &y);
+        for (int i=0; i<7; ++i) {
+            x = i;
+            s.call();
+        }
+    }
+    REQUIRE(first->trained_on == 7);
+    REQUIRE(second->trained_on == 7);
+    REQUIRE(first->get_model_var_count() == 2);
+    REQUIRE_THROWS(CascadeModel().initialize());
+}
+
+TEST_CASE("CascadeModel stages keep their own normalizations") {
+    auto cascade = std::make_shared<CascadeModel>();
+    cascade->add_stage(std::make_shared<NormalizedStage>("x standardize 2 0\ny standardize 1 0\n", 1.0))  // y = 2x
+            .add_stage(std::make_shared<NormalizedStage>("x standardize 1 1\ny standardize 1 0\n", 1e9)); // y = x + 1
+    double x, y;
+    auto s = SurrogateBuilder()
+            .set_model(cascade)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x, &y);
+
+    x = 0.5; s.call();
+    REQUIRE(y == Approx(1.0));
+    x = 3; s.call();
+    REQUIRE(y == Approx(4.0));
+    REQUIRE_FALSE(cascade->get_model_var("x")->normalization.is_enabled());
+}
+
+TEST_CASE("Every CascadeModel stage sees every capture during online training") {
+    auto consumes_all = [](std::vector<std::shared_ptr<Model>> stages, size_t& cascade_captures) {
+        auto cascade = std::make_shared<CascadeModel>();
+        for (auto& stage : stages) cascade->add_stage(stage);
+        double x, y;
+        auto s = SurrogateBuilder()
+                .set_model(cascade)
+                .set_callmode(CallMode::TrainOnline)
+                .local_primitive<double>("x", Direction::IN)
+                .local_primitive<double>("y", Direction::OUT)
+                .finish();
+        s.bind_original_function([&]() { y = x; });
+        s.bind_all_callsite_vars(&x, &y);
+        for (int i=0; i<5; ++i) {
+            x = i;
+            s.call();
+        }
+        cascade_captures = cascade->get_capture_count();
+    };
+
+    // Once every stage has consumed a capture, the cascade doesn't need to keep it
+    auto first = std::make_shared<OnlineStage>();
+    auto second = std::make_shared<OnlineStage>();
+    size_t cascade_captures;
+    consumes_all({first, second}, cascade_captures);
+    REQUIRE(first->seen_online == 5);
+    REQUIRE(second->seen_online == 5);
+    REQUIRE(cascade_captures == 0);
+
+    // A stage that doesn't train online gets all of them when the program exits instead
+    auto online = std::make_shared<OnlineStage>();
+    auto offline = std::make_shared<ScriptedModel>(1, 1.0);
+    consumes_all({online, offline}, cascade_captures);
+    REQUIRE(online->seen_online == 5);
+    REQUIRE(cascade_captures == 5);
+    REQUIRE(offline->trained_on == 5);
+}
+
+} // namespace phasm::test::cascade_tests
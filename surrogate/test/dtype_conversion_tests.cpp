@@ -0,0 +1,145 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include "dtype_conversion.h"
+#include "optics.h"
+
+using namespace phasm;
+namespace phasm::test::dtype_conversion_tests {
+
+// Lengths chosen so that every kernel has to handle both full vectors and a scalar tail
+const size_t LENGTH = 37;
+
+std::vector<SimdLevel> supported_levels() {
+    std::vector<SimdLevel> levels;
+    for (auto level : {SimdLevel::Scalar, SimdLevel::SSE4, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (static_cast<int>(level) <= static_cast<int>(get_max_simd_level())) levels.push_back(level);
+    }
+    return levels;
+}
+
+TEST_CASE("SIMD level can be lowered but not raised beyond what the CPU supports") {
+    SimdLevel original = get_simd_level();
+    set_simd_level(SimdLevel::Scalar);
+    REQUIRE(get_simd_level() == SimdLevel::Scalar);
+    set_simd_level(SimdLevel::AVX512);
+    REQUIRE(get_simd_level() == get_max_simd_level());
+    set_simd_level(original);
+}
+
+TEST_CASE("Every SIMD level agrees with the scalar conversions") {
+    double f64[LENGTH];
+    float f32[LENGTH];
+    int32_t i32[LENGTH];
+    uint8_t ui8[LENGTH];
+    for (size_t i=0; i<LENGTH; ++i) {
+        f64[i] = (i * 1.75) - 20.3;
+        f32[i] = static_cast<float>(f64[i]);
+        i32[i] = static_cast<int32_t>(i) * 1000 - 7;
+        ui8[i] = static_cast<uint8_t>(i * 7);
+    }
+    SimdLevel original = get_simd_level();
+
+    for (auto level : supported_levels()) {
+        set_simd_level(level);
+
+        float f64_to_f32[LENGTH];
+        double f32_to_f64[LENGTH];
+        float i32_to_f32[LENGTH];
+        int32_t f32_to_i32[LENGTH];
+        float ui8_scaled[LENGTH];
+        convert(f64, DType::F64, f64_to_f32, DType::F32, LENGTH);
+        convert(f32, DType::F32, f32_to_f64, DType::F64, LENGTH);
+        convert(i32, DType::I32, i32_to_f32, DType::F32, LENGTH);
+        convert(f32, DType::F32, f32_to_i32, DType::I32, LENGTH);
+        convert_scaled(ui8, DType::UI8, ui8_scaled, LENGTH, 1.0f/255);
+
+        for (size_t i=0; i<LENGTH; ++i) {
+            REQUIRE(f64_to_f32[i] == static_cast<float>(f64[i]));
+            REQUIRE(f32_to_f64[i] == static_cast<double>(f32[i]));
+            REQUIRE(i32_to_f32[i] == static_cast<float>(i32[i]));
+            REQUIRE(f32_to_i32[i] == static_cast<int32_t>(f32[i]));
+            REQUIRE(ui8_scaled[i] == static_cast<float>(ui8[i]) * (1.0f/255));
+        }
+    }
+    set_simd_level(original);
+}
+
+TEST_CASE("Every SIMD level agrees with the scalar affine conversion") {
+    double f64[LENGTH];
+    uint8_t ui8[LENGTH];
+    for (size_t i=0; i<LENGTH; ++i) {
+        f64[i] = (i * 1.75) - 20.3;
+        ui8[i] = static_cast<uint8_t>(i * 7);
+    }
+    SimdLevel original = get_simd_level();
+    for (auto level : supported_levels()) {
+        set_simd_level(level);
+        float from_f64[LENGTH];
+        float from_ui8[LENGTH];
+        convert_affine(f64, DType::F64, from_f64, LENGTH, 0.5f, -3.0f);
+        convert_affine(ui8, DType::UI8, from_ui8, LENGTH, 0.25f, 1.0f);
+        for (size_t i=0; i<LENGTH; ++i) {
+            // FMA rounds once instead of twice, so we can't require bitwise equality here
+            REQUIRE(from_f64[i] == Approx(static_cast<float>(f64[i]) * 0.5f - 3.0f));
+            REQUIRE(from_ui8[i] == Approx(ui8[i] * 0.25f + 1.0f));
+        }
+    }
+    set_simd_level(original);
+}
+
+TEST_CASE("Every SIMD level agrees with the scalar centered conversion") {
+    double f64[LENGTH];
+    float f32[LENGTH];
+    int32_t i32[LENGTH];
+    for (size_t i=0; i<LENGTH; ++i) {
+        f64[i] = 1e9 + i * 0.25;
+        f32[i] = (i * 1.75f) - 20.3f;
+        i32[i] = static_cast<int32_t>(i * 1000) - 7;
+    }
+    SimdLevel original = get_simd_level();
+    for (auto level : supported_levels()) {
+        set_simd_level(level);
+        float from_f64[LENGTH];
+        float from_f32[LENGTH];
+        float from_i32[LENGTH];
+        convert_centered(f64, DType::F64, from_f64, LENGTH, 1e9, 4.0);
+        convert_centered(f32, DType::F32, from_f32, LENGTH, -3.0, 0.5);
+        convert_centered(i32, DType::I32, from_i32, LENGTH, 1.5, 0.001);
+        for (size_t i=0; i<LENGTH; ++i) {
+            // Everything happens in double, so every level rounds exactly once, like the scalar kernel
+            REQUIRE(from_f64[i] == static_cast<float>(i));
+            REQUIRE(from_f32[i] == static_cast<float>((static_cast<double>(f32[i]) + 3.0) * 0.5));
+            REQUIRE(from_i32[i] == static_cast<float>((static_cast<double>(i32[i]) - 1.5) * 0.001));
+        }
+    }
+    set_simd_level(original);
+}
+
+TEST_CASE("Conversions without a SIMD kernel fall back to scalar") {
+    int16_t i16[] = {-3, 0, 400};
+    int64_t i64[3];
+    convert(i16, DType::I16, i64, DType::I64, 3);
+    REQUIRE(i64[0] == -3);
+    REQUIRE(i64[2] == 400);
+    REQUIRE_THROWS(convert(i16, DType::Undefined, i64, DType::I64, 3));
+}
+
+TEST_CASE("TensorIso converts between dtypes using the conversion kernels") {
+    double x[LENGTH];
+    for (size_t i=0; i<LENGTH; ++i) x[i] = i * 0.5;
+
+    TensorIso<double> iso({LENGTH}, DType::F32);
+    auto t = iso.to(x);
+    REQUIRE(t.get_dtype() == DType::F32);
+    REQUIRE(t.get_shape() == std::vector<int64_t>{LENGTH});
+    REQUIRE(t.get_data<float>()[36] == 18.0f);
+
+    double y[LENGTH];
+    iso.from(t, y);
+    for (size_t i=0; i<LENGTH; ++i) REQUIRE(y[i] == x[i]);
+}
+
+} // namespace phasm::test::dtype_conversion_tests
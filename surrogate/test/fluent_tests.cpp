@@ -75,7 +75,87 @@ TEST_CASE("Field accessor") {
     builder.printModelVars();
 
 }
-} // namespace phasm::test::fluent_tests
 
+struct Hit {
+    float x = 0;
+    float y = 0;
+    float energy = 0;
+};
+
+TEST_CASE("Gathering fields from a vector of structs") {
+
+    std::vector<Hit> hits = {{1, 2, 3}, {4, 5, 6}};
+    float total_energy = 0;
+
+    auto s = SurrogateBuilder()
+        .set_model(std::make_shared<Model>())
+        .local<std::vector<Hit>>("hits")
+            .gather<float>("hit_positions", {&Hit::x, &Hit::y}, 2)
+            .end()
+        .local<float>("total_energy")
+            .primitive("total_energy", Direction::OUT)
+            .end()
+        .finish();
+
+    s.bind_original_function([&]() { total_energy = hits[0].energy + hits[1].energy; });
+    s.bind_all_callsite_vars(&hits, &total_energy);
+    s.call_original_and_capture();
+
+    auto& captured = s.get_model()->get_model_var("hit_positions")->training_inputs[0];
+    REQUIRE(captured.get_shape() == std::vector<int64_t>{2, 2});
+    REQUIRE(captured.get_data<float>()[2] == 4);
+    REQUIRE(captured.get_data<float>()[3] == 5);
+    REQUIRE(total_energy == 9);
+}
+
+struct Track {
+    Hit* first_hit = nullptr;
+};
+
+TEST_CASE("Dereferencing pointers in the builder") {
+
+    Hit hit {1, 2, 3};
+    Track track {&hit};
+    Track empty_track;
+    Track* track_ptr = &track;
+
+    auto s = SurrogateBuilder()
+        .set_model(std::make_shared<Model>())
+        .local<Track*>("track")
+            .deref<Track>()
+                .field<Hit*>(&Track::first_hit)
+                    .deref<Hit>()
+                        .field<float>(&Hit::energy)
+                            .primitive("first_hit_energy")
+                            .end()
+                        .end()
+                    .end()
+                .end()
+            .end()
+        .finish();
 
+    s.bind_original_function([]() {});
+    s.bind_all_callsite_vars(&track_ptr);
+    s.call_original_and_capture();
+    track_ptr = &empty_track;
+    s.call_original_and_capture();
 
+    auto mv = s.get_model()->get_model_var("first_hit_energy");
+    REQUIRE(*mv->training_inputs[0].get_data<float>() == 3);
+    REQUIRE(*mv->training_inputs[1].get_data<float>() == 0);
+}
+
+TEST_CASE("Quantization is passed from the builder to the model before initialize()") {
+    struct QuantizationRecordingModel : public Model {
+        Quantization quantization_at_init = Quantization::None;
+        void initialize() override { quantization_at_init = get_quantization(); }
+    };
+    auto model = std::make_shared<QuantizationRecordingModel>();
+    auto s = SurrogateBuilder()
+        .set_quantization(Quantization::DynamicInt8)
+        .set_model(model)
+        .local_primitive<double>("x", Direction::IN)
+        .finish();
+    REQUIRE(model->quantization_at_init == Quantization::DynamicInt8);
+}
+} // namespace phasm::test::fluent_tests
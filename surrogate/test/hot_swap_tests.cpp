@@ -0,0 +1,194 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <thread>
+#include <cstdio>
+#include "surrogate_builder.h"
+#include "model_file_watcher.h"
+
+using namespace phasm;
+namespace phasm::test::hot_swap_tests {
+
+/// Computes y = factor * x, and counts how many instances are still alive
+struct ScalingModel : public Model {
+    static inline std::atomic<int> s_alive {0};
+    double factor;
+    bool initialized = false;
+    explicit ScalingModel(double factor) : factor(factor) { s_alive++; }
+    ~ScalingModel() override { s_alive--; }
+
+    void initialize() override { initialized = true; }
+    bool infer() override {
+        double y = factor * *m_inputs[0]->inference_input.get_data<double>();
+        m_outputs[0]->inference_output = tensor(&y, 1);
+        return true;
+    }
+};
+
+/// Like the plugin models, initialize() sets up the output buffer and the normalizations, and infer() writes into
+/// that buffer in place
+struct BufferedScalingModel : public Model {
+    double factor;
+    explicit BufferedScalingModel(double factor) : factor(factor) {}
+
+    void initialize() override {
+        for (auto& output : m_outputs) {
+            output->inference_output = tensor(DType::F32, {1});
+            output->normalization = Normalization();
+        }
+    }
+    bool infer() override {
+        float y = float(factor * *m_inputs[0]->inference_input.get_data<double>());
+        unpack_output_into(&y, {1}, m_outputs[0]->normalization, m_outputs[0]->inference_output);
+        return true;
+    }
+};
+
+TEST_CASE("A pinned model outlives being swapped out") {
+    ModelHandle handle(std::make_shared<ScalingModel>(1));
+    REQUIRE(ScalingModel::s_alive == 1);
+    {
+        auto pin = handle.pin();
+        handle.publish(std::make_shared<ScalingModel>(2));
+        REQUIRE(ScalingModel::s_alive == 2);
+        REQUIRE(handle.get_retired_count() == 1);
+        REQUIRE(static_cast<ScalingModel*>(pin.get())->factor == 1);
+        REQUIRE(static_cast<ScalingModel*>(handle.pin().get())->factor == 2);
+    }
+    REQUIRE(handle.reclaim() == 0);
+    REQUIRE(ScalingModel::s_alive == 1);
+    REQUIRE(handle.get_version_number() == 1);
+}
+
+TEST_CASE("Readers never see a released model while a writer keeps swapping") {
+    auto first = std::make_shared<ScalingModel>(0);
+    first->initialize();
+    ModelHandle handle(std::move(first));
+    std::atomic<bool> done {false};
+    std::vector<std::thread> readers;
+    std::atomic<size_t> bad_reads {0};
+    for (int i=0; i<4; ++i) {
+        readers.emplace_back([&](){
+            while (!done) {
+                auto pin = handle.pin();
+                auto m = static_cast<ScalingModel*>(pin.get());
+                if (!m->initialized || m->factor < 0) bad_reads++;
+            }
+        });
+    }
+    for (int i=1; i<=200; ++i) {
+        auto m = std::make_shared<ScalingModel>(i);
+        m->initialize();
+        handle.publish(m);
+    }
+    done = true;
+    for (auto& t : readers) t.join();
+    handle.reclaim();
+    REQUIRE(bad_reads == 0);
+    REQUIRE(handle.get_retired_count() == 0);
+    REQUIRE(ScalingModel::s_alive == 1);
+}
+
+TEST_CASE("Surrogate::swap_model initializes the new model and uses it from the next call onwards") {
+    double x, y;
+    auto s = SurrogateBuilder()
+            .set_model(std::make_shared<ScalingModel>(2))
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_callsite_var("x", &x);
+    s.bind_callsite_var("y", &y);
+
+    x = 3;
+    s.call();
+    REQUIRE(y == 6);
+
+    auto replacement = std::make_shared<ScalingModel>(10);
+    s.swap_model(replacement);
+    REQUIRE(replacement->initialized);
+    REQUIRE(replacement->get_model_var_count() == 2);
+    REQUIRE(s.get_model() == replacement);
+    s.call();
+    REQUIRE(y == 30);
+}
+
+TEST_CASE("Surrogate reloads the model when its file changes") {
+    std::string path = "hot_swap_tests_model.txt";
+    std::ofstream(path) << "2";
+
+    auto load = [](const std::string& filename) {
+        double factor;
+        std::ifstream(filename) >> factor;
+        return std::make_shared<ScalingModel>(factor);
+    };
+
+    double x, y;
+    auto s = SurrogateBuilder()
+            .set_model(load(path))
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_callsite_var("x", &x);
+    s.bind_callsite_var("y", &y);
+    s.watch_model_file(path, load, std::chrono::milliseconds(10));
+
+    auto handle = s.get_model_handle();
+    // Make sure the new file has a different size, since modification times can be coarse
+    std::ofstream(path) << "100";
+    for (int i=0; i<500 && handle->get_version_number() < 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(handle->get_version_number() == 2);
+    x = 3;
+    s.call();
+    REQUIRE(y == 300);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Models can be swapped while another thread keeps calling the Surrogate") {
+    double x = 3, y = 0;
+    auto s = SurrogateBuilder()
+            .set_model(std::make_shared<BufferedScalingModel>(1))
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x, &y);
+    s.call();
+
+    // Initializing the new model mustn't touch the ModelVariables the current one is serving calls from
+    auto output_var = s.get_callsite_var("y")->model_vars[0];
+    const void* output_buffer = output_var->inference_output.get_data<void>();
+    s.swap_model(std::make_shared<BufferedScalingModel>(2));
+    REQUIRE(output_var->inference_output.get_data<void>() == output_buffer);
+    REQUIRE(s.get_model()->get_model_var("y") != output_var);
+
+    std::atomic<bool> done {false};
+    std::atomic<size_t> calls {0};
+    std::atomic<size_t> bad_calls {0};
+    std::thread caller([&]() {
+        while (!done) {
+            s.call();
+            double factor = y / x;
+            if (factor != std::floor(factor) || factor < 2 || factor > 201) bad_calls++;
+            calls++;
+        }
+    });
+    while (calls == 0) std::this_thread::yield();
+    for (int factor=3; factor<=201; ++factor) {
+        s.swap_model(std::make_shared<BufferedScalingModel>(factor));
+    }
+    done = true;
+    caller.join();
+    REQUIRE(bad_calls == 0);
+    s.call();
+    REQUIRE(y == 3 * 201);
+}
+
+} // namespace phasm::test::hot_swap_tests
@@ -0,0 +1,145 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include "surrogate_builder.h"
+#include "interpolation_model.h"
+#include "dtype_conversion.h"
+
+using namespace phasm;
+namespace phasm::test::interpolation_tests {
+
+TEST_CASE("Linear interpolation reproduces linear functions at every SIMD level") {
+    InterpolationTable table({{-1, 1, 5}, {0, 10, 11}, {2, 3, 4}}, 2);
+    table.fill([](const float* x, float* y) {
+        y[0] = 2*x[0] - 3*x[1] + x[2];
+        y[1] = 7;
+    });
+    REQUIRE(table.get_point_count() == 5*11*4);
+
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> u(0, 1);
+    size_t rows = 37; // Not a multiple of 8, to exercise the leftover rows
+    std::vector<float> x(rows * 3);
+    for (size_t r=0; r<rows; ++r) {
+        x[r*3] = -1 + 2*u(rng);
+        x[r*3 + 1] = 10*u(rng);
+        x[r*3 + 2] = 2 + u(rng);
+    }
+    SimdLevel original_level = get_simd_level();
+    for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::AVX2}) {
+        set_simd_level(level);
+        std::vector<float> y(rows * 2);
+        table.interpolate(x.data(), y.data(), rows);
+        for (size_t r=0; r<rows; ++r) {
+            REQUIRE(y[r*2] == Approx(2*x[r*3] - 3*x[r*3+1] + x[r*3+2]).margin(1e-4));
+            REQUIRE(y[r*2 + 1] == Approx(7));
+        }
+    }
+    set_simd_level(original_level);
+
+    // Outside the grid, queries are clamped to the boundary
+    float outside[3] = {5, 0, 2};
+    float y[2];
+    REQUIRE(!table.contains(outside));
+    table.interpolate(outside, y);
+    REQUIRE(y[0] == Approx(2*1 - 0 + 2));
+}
+
+TEST_CASE("Cubic interpolation reproduces quadratics away from the edges") {
+    InterpolationTable table({{0, 1, 11}, {0, 1, 11}}, 1, Interpolation::Cubic);
+    auto f = [](float a, float b) { return a*a - 2*a*b + 0.5f*b; };
+    table.fill([&](const float* x, float* y) { y[0] = f(x[0], x[1]); });
+
+    std::mt19937 rng(4);
+    std::uniform_real_distribution<float> u(0.1f, 0.9f);
+    size_t rows = 16;
+    std::vector<float> x(rows * 2), batch(rows), single(rows);
+    for (auto& v : x) v = u(rng);
+    table.interpolate(x.data(), batch.data(), rows); // Vectorized, if the CPU can
+    for (size_t r=0; r<rows; ++r) {
+        table.interpolate(x.data() + r*2, single.data() + r); // Always scalar
+        REQUIRE(single[r] == Approx(f(x[r*2], x[r*2+1])).margin(1e-5));
+        REQUIRE(batch[r] == Approx(single[r]).margin(1e-5));
+    }
+    REQUIRE_THROWS(InterpolationTable(std::vector<GridAxis>(7, GridAxis{0, 1, 2}), 1, Interpolation::Cubic));
+    REQUIRE_THROWS(InterpolationTable({{0, 1, 1}}, 1));
+}
+
+TEST_CASE("InterpolationTable round-trips through an mmapped file") {
+    InterpolationTable table({{0, 1, 3}, {-2, 2, 5}}, 3, Interpolation::Cubic);
+    table.fill([](const float* x, float* y) { y[0] = x[0]; y[1] = x[1]; y[2] = x[0] * x[1]; });
+    table.save("interpolation_tests_roundtrip.grid");
+
+    InterpolationTable loaded = InterpolationTable::load("interpolation_tests_roundtrip.grid");
+    REQUIRE(loaded.is_mapped());
+    REQUIRE(loaded.get_interpolation() == Interpolation::Cubic);
+    REQUIRE(loaded.get_axes()[1].count == 5);
+    for (size_t m=0; m<3; ++m) {
+        for (size_t i=0; i<loaded.get_point_count(); ++i) {
+            REQUIRE(loaded.get_value(m, i) == table.get_value(m, i));
+        }
+    }
+    REQUIRE_THROWS(loaded.set_value(0, 0, 1));
+    table.set_value(0, 0, 1);
+    REQUIRE(table.get_value(0, 0) == 1);
+    std::remove("interpolation_tests_roundtrip.grid");
+    REQUIRE_THROWS(InterpolationTable::load("does_not_exist.grid"));
+}
+
+TEST_CASE("InterpolationModel builds its table from a captured grid") {
+    std::remove("interpolation_tests_model.grid");
+    double x, y, z;
+    std::vector<GridAxis> axes = {{0, 3, 61}, {-1, 1, 41}};
+    {
+        auto s = SurrogateBuilder()
+                .set_model(std::make_shared<InterpolationModel>("interpolation_tests_model.grid", axes, Interpolation::Cubic))
+                .set_callmode(CallMode::TrainModel)
+                .local_primitive<double>("x", Direction::IN)
+                .local_primitive<double>("y", Direction::IN)
+                .local_primitive<double>("z", Direction::OUT)
+                .finish();
+        s.bind_original_function([&]() { z = std::sin(x) * y; });
+        s.bind_all_callsite_vars(&x, &y, &z);
+        s.capture_grid(axes);
+        REQUIRE(s.get_model()->get_capture_count() == 61*41);
+
+        // Some points in between the grid points, so that there is something to evaluate against
+        std::mt19937 rng(8);
+        std::uniform_real_distribution<double> u(0, 1);
+        for (int i=0; i<100; ++i) {
+            x = 3*u(rng);
+            y = 2*u(rng) - 1;
+            s.call();
+        }
+        s.get_model()->train_from_captures();
+        auto model = std::dynamic_pointer_cast<InterpolationModel>(s.get_model());
+        REQUIRE(model->get_report().samples == 10);
+        REQUIRE(model->get_report().max_abs_error[0] < 1e-3);
+        s.set_callmode(CallMode::UseOriginal); // Don't train again on the way out
+    }
+
+    auto s = SurrogateBuilder()
+            .set_model(std::make_shared<InterpolationModel>("interpolation_tests_model.grid"))
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::IN)
+            .local_primitive<double>("z", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x, &y, &z);
+    REQUIRE(std::dynamic_pointer_cast<InterpolationModel>(s.get_model())->get_table().is_mapped());
+
+    x = 1.234; y = 0.567;
+    s.call();
+    REQUIRE(z == Approx(std::sin(1.234) * 0.567).margin(1e-3));
+
+    x = 4; y = 0; z = -1; // Off the grid
+    s.call();
+    REQUIRE(z == -1);
+    std::remove("interpolation_tests_model.grid");
+}
+
+} // namespace phasm::test::interpolation_tests
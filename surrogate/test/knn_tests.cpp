@@ -0,0 +1,148 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include "surrogate_builder.h"
+#include "knn_model.h"
+
+using namespace phasm;
+namespace phasm::test::knn_tests {
+
+TEST_CASE("KnnIndex finds the same neighbors as brute force") {
+    std::mt19937 rng(5);
+    std::normal_distribution<float> dist;
+    for (size_t dims : {1, 2, 3, 7}) {
+        size_t count = 2000;
+        std::vector<float> inputs(count * dims), outputs(count);
+        for (auto& x : inputs) x = dist(rng);
+        for (size_t i=0; i<count; ++i) outputs[i] = i;
+        // Different units per dimension, which the index should standardize away
+        for (size_t i=0; i<count; ++i) inputs[i * dims] *= 1000;
+
+        KnnIndex index = KnnIndex::build(inputs.data(), outputs.data(), count, dims, 1, 8, 4);
+        REQUIRE(index.get_point_count() == count);
+
+        for (int q=0; q<50; ++q) {
+            std::vector<float> query(dims);
+            for (auto& x : query) x = dist(rng);
+            query[0] *= 1000;
+
+            // Brute force, using the same standardization
+            std::vector<float> mean(dims, 0), stddev(dims, 0);
+            for (size_t d=0; d<dims; ++d) {
+                for (size_t i=0; i<count; ++i) mean[d] += inputs[i*dims + d] / count;
+                for (size_t i=0; i<count; ++i) stddev[d] += (inputs[i*dims + d] - mean[d]) * (inputs[i*dims + d] - mean[d]) / count;
+                stddev[d] = std::sqrt(stddev[d]);
+            }
+            std::vector<std::pair<float, float>> expected; // (distance, output)
+            for (size_t i=0; i<count; ++i) {
+                float d2 = 0;
+                for (size_t d=0; d<dims; ++d) {
+                    float diff = (inputs[i*dims + d] - query[d]) / stddev[d];
+                    d2 += diff * diff;
+                }
+                expected.emplace_back(d2, outputs[i]);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            uint32_t neighbors[5];
+            float distances[5];
+            REQUIRE(index.query(query.data(), 5, neighbors, distances) == 5);
+            for (int n=0; n<5; ++n) {
+                REQUIRE(distances[n] == Approx(expected[n].first).epsilon(1e-3).margin(1e-5));
+                REQUIRE(*index.get_output(neighbors[n]) == expected[n].second);
+            }
+        }
+    }
+}
+
+TEST_CASE("KnnIndex round-trips through an mmapped file") {
+    std::mt19937 rng(9);
+    std::uniform_real_distribution<float> dist(-1, 1);
+    size_t count = 300;
+    std::vector<float> inputs(count * 2), outputs(count * 3);
+    for (auto& x : inputs) x = dist(rng);
+    for (auto& y : outputs) y = dist(rng);
+    KnnIndex built = KnnIndex::build(inputs.data(), outputs.data(), count, 2, 3);
+    built.save("knn_tests_roundtrip.knn");
+
+    KnnIndex loaded = KnnIndex::load("knn_tests_roundtrip.knn");
+    REQUIRE(loaded.is_mapped());
+    REQUIRE(!built.is_mapped());
+    REQUIRE(loaded.get_input_dim() == 2);
+    REQUIRE(loaded.get_output_dim() == 3);
+    for (int q=0; q<20; ++q) {
+        float query[2] = {dist(rng), dist(rng)};
+        uint32_t n1[3], n2[3];
+        float d1[3], d2[3];
+        built.query(query, 3, n1, d1);
+        loaded.query(query, 3, n2, d2);
+        for (int n=0; n<3; ++n) {
+            REQUIRE(d1[n] == d2[n]);
+            REQUIRE(std::equal(built.get_output(n1[n]), built.get_output(n1[n]) + 3, loaded.get_output(n2[n])));
+        }
+    }
+    std::remove("knn_tests_roundtrip.knn");
+
+    REQUIRE_THROWS(KnnIndex::load("does_not_exist.knn"));
+    std::ofstream("knn_tests_garbage.knn") << "definitely not an index, but long enough";
+    REQUIRE_THROWS(KnnIndex::load("knn_tests_garbage.knn"));
+    std::remove("knn_tests_garbage.knn");
+}
+
+TEST_CASE("KnnModel learns from captures and refuses to extrapolate") {
+    std::remove("knn_tests_model.knn");
+    double x0, x1, y;
+    auto train = [&]() { y = 3*x0 - x1; };
+    {
+        auto s = SurrogateBuilder()
+                .set_model(std::make_shared<KnnModel>("knn_tests_model.knn", 4, 0.5f))
+                .set_callmode(CallMode::TrainModel)
+                .local_primitive<double>("x0", Direction::IN)
+                .local_primitive<double>("x1", Direction::IN)
+                .local_primitive<double>("y", Direction::OUT)
+                .finish();
+        s.bind_original_function(train);
+        s.bind_all_callsite_vars(&x0, &x1, &y);
+        for (int i=0; i<=20; ++i) {
+            for (int j=0; j<=20; ++j) {
+                x0 = i / 20.0;
+                x1 = j / 20.0;
+                s.call();
+            }
+        }
+        // Destroying the Surrogate trains the model, which writes the index
+    }
+
+    auto s = SurrogateBuilder()
+            .set_model(std::make_shared<KnnModel>("knn_tests_model.knn", 4, 0.5f))
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x0", Direction::IN)
+            .local_primitive<double>("x1", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x0, &x1, &y);
+    auto model = std::dynamic_pointer_cast<KnnModel>(s.get_model());
+    REQUIRE(model->get_index().is_mapped());
+    REQUIRE(model->get_index().get_point_count() == 21*21);
+
+    x0 = 0.5; x1 = 0.25;  // Exactly on a capture
+    s.call();
+    REQUIRE(y == Approx(1.25));
+
+    x0 = 0.512; x1 = 0.263;  // In between captures
+    s.call();
+    REQUIRE(y == Approx(3*0.512 - 0.263).margin(0.05));
+
+    x0 = 10; x1 = 10;  // Far outside anything we've seen
+    y = -1;
+    s.call();
+    REQUIRE(y == -1);
+    std::remove("knn_tests_model.knn");
+}
+
+} // namespace phasm::test::knn_tests
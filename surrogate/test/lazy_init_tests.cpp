@@ -0,0 +1,189 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include "surrogate_builder.h"
+#include "plugin_loader.h"
+
+using namespace phasm;
+namespace phasm::test::lazy_init_tests {
+
+struct DoublingModel : public Model {
+    double output = 0;
+    bool infer() override {
+        output = 2 * *m_inputs[0]->inference_input.get_data<double>();
+        m_outputs[0]->inference_output = tensor(&output, 1);
+        return true;
+    }
+};
+
+/// Takes a while to make each model, and keeps track of how many it was making at once
+struct SlowPlugin : public Plugin {
+    std::mutex mutex;
+    std::vector<std::string> made;
+    std::atomic<int> in_progress {0};
+    std::atomic<int> max_in_progress {0};
+
+    std::string get_name() override { return "lazy_init_tests"; }
+    std::shared_ptr<Model> make_model(std::string model_name) override {
+        int now = ++in_progress;
+        int max = max_in_progress.load();
+        while (now > max && !max_in_progress.compare_exchange_weak(max, now)) {}
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        --in_progress;
+        if (model_name == "broken.pt") {
+            throw std::runtime_error("SlowPlugin: Can't load broken.pt");
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        made.push_back(model_name);
+        return std::make_shared<DoublingModel>();
+    }
+};
+
+SlowPlugin& get_plugin() {
+    static SlowPlugin plugin;
+    static bool added = false;
+    if (!added) {
+        PluginLoader::get_singleton().add_plugin(&plugin);
+        added = true;
+    }
+    plugin.made.clear();
+    plugin.max_in_progress = 0;
+    return plugin;
+}
+
+Surrogate make_surrogate(std::string model_name, CallMode callmode) {
+    return SurrogateBuilder()
+            .set_model("lazy_init_tests", model_name)
+            .set_callmode(callmode)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+}
+
+TEST_CASE("Plugin models are made on the first call that needs them") {
+    auto& plugin = get_plugin();
+    double x = 3, y = 0;
+    auto s = make_surrogate("first_call.pt", CallMode::UseOriginal);
+    s.bind_original_function([&]() { y = x + 1; }).bind_all_callsite_vars(&x, &y);
+    REQUIRE(plugin.made.empty());
+
+    // The original function doesn't need a model
+    s.call();
+    REQUIRE(y == 4);
+    REQUIRE(plugin.made.empty());
+
+    s.set_callmode(CallMode::UseModel);
+    s.call();
+    REQUIRE(y == 6);
+    REQUIRE(plugin.made.size() == 1);
+    s.call();
+    REQUIRE(plugin.made.size() == 1);
+
+    // Unless asked not to
+    auto not_lazy = SurrogateBuilder()
+            .set_model("lazy_init_tests", "not_lazy.pt")
+            .set_lazy_init(false)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    REQUIRE(plugin.made.size() == 2);
+}
+
+TEST_CASE("Concurrent first calls make the model once") {
+    auto& plugin = get_plugin();
+    auto s = make_surrogate("concurrent.pt", CallMode::UseModel);
+    std::vector<std::thread> threads;
+    std::atomic<int> correct {0};
+    for (int t=0; t<4; ++t) {
+        threads.emplace_back([&]() {
+            s.load_model();
+            auto model = s.get_model();
+            if (model != nullptr && model->get_model_var_count() == 2) correct++;
+        });
+    }
+    for (auto& t : threads) t.join();
+    REQUIRE(correct == 4);
+    REQUIRE(plugin.made.size() == 1);
+}
+
+// These use preload() rather than preload_all(), which would also make the models of other tests' static Surrogates
+
+TEST_CASE("preload makes the deferred models in parallel") {
+    auto& plugin = get_plugin();
+    auto a = make_surrogate("preload_a.pt", CallMode::UseModel);
+    auto b = make_surrogate("preload_b.pt", CallMode::UseModel);
+    auto c = make_surrogate("preload_c.pt", CallMode::UseModel);
+    auto d = make_surrogate("preload_d.pt", CallMode::UseModel);
+    REQUIRE(plugin.made.empty());
+
+    preload({&a, &b, &c, &d}, 4);
+    REQUIRE(plugin.made.size() == 4);
+    REQUIRE(plugin.max_in_progress > 1);
+
+    // Nothing is left to do, either for a second preload or for the first call
+    preload({&a, &b, &c, &d});
+    double x = 5, y = 0;
+    c.bind_all_callsite_vars(&x, &y);
+    c.call();
+    REQUIRE(y == 10);
+    REQUIRE(plugin.made.size() == 4);
+}
+
+TEST_CASE("Models that fail to load report it from preload and from every call") {
+    get_plugin();
+    auto good = make_surrogate("good.pt", CallMode::UseModel);
+    auto broken = make_surrogate("broken.pt", CallMode::UseModel);
+    REQUIRE_THROWS(preload({&good, &broken}));
+    REQUIRE(good.get_model() != nullptr);
+
+    double x = 1, y = 0;
+    broken.bind_original_function([&]() { y = x; }).bind_all_callsite_vars(&x, &y);
+    REQUIRE_THROWS(broken.call());
+    REQUIRE_THROWS(broken.call());
+    broken.set_callmode(CallMode::UseOriginal);
+    broken.call();
+    REQUIRE(y == 1);
+}
+
+TEST_CASE("Hot reloads of a shared, deferred model use the call site's shared ModelVariables") {
+    get_plugin();
+    std::string path = "lazy_init_tests_shared.pt";
+    std::ofstream(path) << "1";
+    auto first = make_surrogate(path, CallMode::UseModel);
+    auto second = SurrogateBuilder()
+            .set_model("lazy_init_tests", path)
+            .set_callmode(CallMode::UseModel)
+            .enable_hot_reload(std::chrono::milliseconds(10))
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    double x1 = 1, y1 = 0, x2 = 2, y2 = 0;
+    first.bind_all_callsite_vars(&x1, &y1);
+    second.bind_all_callsite_vars(&x2, &y2);
+    first.call();
+    second.call();
+    REQUIRE(second.get_callsite_var("x")->model_vars[0] == first.get_callsite_var("x")->model_vars[0]);
+
+    auto handle = second.get_model_handle();
+    std::ofstream(path) << "100";
+    for (int i=0; i<500 && handle->get_version_number() < 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(handle->get_version_number() == 2);
+    x1 = 5;
+    x2 = 7;
+    first.call();
+    second.call();
+    REQUIRE(y1 == 10);
+    REQUIRE(y2 == 14);
+    std::remove(path.c_str());
+}
+
+} // namespace phasm::test::lazy_init_tests
@@ -0,0 +1,208 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <atomic>
+#include <thread>
+#include "surrogate_builder.h"
+#include "memoizing_model.h"
+
+using namespace phasm;
+namespace phasm::test::memo_cache_tests {
+
+std::string key_of(double x) {
+    std::string key;
+    append_memo_key(key, tensor(&x, 1));
+    return key;
+}
+
+/// Computes y = 2*x, and counts how often it actually had to
+struct CountingModel : public Model {
+    int infer_count = 0;
+    bool infer() override {
+        infer_count++;
+        double y = 2 * *m_inputs[0]->inference_input.get_data<double>();
+        m_outputs[0]->inference_output = tensor(&y, 1);
+        return true;
+    }
+};
+
+TEST_CASE("MemoCache hits, misses, and evicts") {
+    double x = 22;
+    tensor value(&x, 1);
+    size_t entry_bytes = key_of(0).size() + sizeof(double) + MemoCache::ENTRY_OVERHEAD;
+    MemoCache cache(3*entry_bytes, 1); // Room for exactly three entries
+
+    std::vector<tensor> outputs;
+    REQUIRE(!cache.lookup(key_of(1), outputs));
+    cache.insert(key_of(1), {value});
+    REQUIRE(cache.lookup(key_of(1), outputs));
+    REQUIRE(outputs.size() == 1);
+    REQUIRE(*outputs[0].get_data<double>() == 22);
+    REQUIRE(cache.get_hit_count() == 1);
+    REQUIRE(cache.get_miss_count() == 1);
+
+    cache.insert(key_of(2), {value});
+    cache.insert(key_of(3), {value});
+    REQUIRE(cache.get_entry_count() == 3);
+    REQUIRE(cache.get_size_bytes() == 3*entry_bytes);
+    REQUIRE(cache.get_eviction_count() == 0);
+
+    // 1 was used since it was inserted, so CLOCK gives it a second chance and evicts 2 instead
+    cache.lookup(key_of(1), outputs);
+    cache.insert(key_of(4), {value});
+    REQUIRE(cache.get_eviction_count() == 1);
+    REQUIRE(cache.get_entry_count() == 3);
+    REQUIRE(cache.lookup(key_of(1), outputs));
+    REQUIRE(!cache.lookup(key_of(2), outputs));
+    REQUIRE(cache.lookup(key_of(4), outputs));
+
+    // Entries that can never fit aren't cached at all
+    std::vector<double> big(1000);
+    cache.insert(key_of(5), {tensor(big.data(), big.size())});
+    REQUIRE(!cache.lookup(key_of(5), outputs));
+
+    cache.clear();
+    REQUIRE(cache.get_entry_count() == 0);
+    REQUIRE(cache.get_size_bytes() == 0);
+}
+
+TEST_CASE("Memo keys distinguish dtypes and ragged row boundaries") {
+    double d = 1;
+    int64_t i = 1;
+    std::string dk, ik;
+    append_memo_key(dk, tensor(&d, 1));
+    append_memo_key(ik, tensor(&i, 1));
+    REQUIRE(dk != ik);
+
+    double a[] = {1, 2}, b[] = {3};
+    double c[] = {1}, e[] = {2, 3};
+    std::string k1, k2;
+    append_memo_key(k1, stack_ragged({tensor(a, 2), tensor(b, 1)}));
+    append_memo_key(k2, stack_ragged({tensor(c, 1), tensor(e, 2)}));
+    REQUIRE(k1 != k2);
+}
+
+TEST_CASE("MemoCache survives concurrent lookups and inserts") {
+    MemoCache cache(64*1024, 4);
+    std::atomic<int> wrong_values {0}; // Catch's assertions aren't thread safe
+    std::vector<std::thread> threads;
+    for (int t=0; t<4; ++t) {
+        threads.emplace_back([&cache, &wrong_values, t]() {
+            std::vector<tensor> outputs;
+            for (int i=0; i<5000; ++i) {
+                double x = (i * 7 + t) % 500;
+                std::string key = key_of(x);
+                if (cache.lookup(key, outputs)) {
+                    if (*outputs[0].get_data<double>() != x) wrong_values++;
+                }
+                else {
+                    cache.insert(key, {tensor(&x, 1)});
+                }
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    REQUIRE(wrong_values == 0);
+    REQUIRE(cache.get_hit_count() + cache.get_miss_count() == 20000);
+    REQUIRE(cache.get_size_bytes() <= 64*1024);
+}
+
+TEST_CASE("MemoizingModel only infers on a miss") {
+    auto inner = std::make_shared<CountingModel>();
+    double x, y;
+    auto s = SurrogateBuilder()
+            .set_model(inner)
+            .set_model_memoization(1024*1024)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x, &y);
+
+    auto memo = std::dynamic_pointer_cast<MemoizingModel>(s.get_model());
+    REQUIRE(memo != nullptr);
+    REQUIRE(memo->get_inner() == inner);
+    REQUIRE(inner->get_model_var_count() == 2);
+
+    for (double input : {1.0, 2.0, 1.0, 1.0, 2.0, 3.0}) {
+        x = input;
+        y = 0;
+        s.call();
+        REQUIRE(y == 2*input);
+    }
+    REQUIRE(inner->infer_count == 3);
+    REQUIRE(memo->get_cache().get_hit_count() == 3);
+    REQUIRE(memo->get_cache().get_miss_count() == 3);
+
+    // Retraining invalidates everything we remembered
+    memo->train_from_captures();
+    x = 1;
+    s.call();
+    REQUIRE(inner->infer_count == 4);
+}
+
+/// Like CountingModel, but computes y = factor*x, where the factor changes as if online training had published new weights
+struct ChangingModel : public CountingModel {
+    double factor = 2;
+    bool infer() override {
+        infer_count++;
+        double y = factor * *m_inputs[0]->inference_input.get_data<double>();
+        m_outputs[0]->inference_output = tensor(&y, 1);
+        return true;
+    }
+    void publish(double new_factor) {
+        factor = new_factor;
+        weights_changed();
+    }
+};
+
+TEST_CASE("MemoizingModel forgets its outputs when the wrapped model publishes new weights") {
+    auto inner = std::make_shared<ChangingModel>();
+    double x = 1, y;
+    auto s = SurrogateBuilder()
+            .set_model(inner)
+            .set_model_memoization(1024*1024)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x, &y);
+
+    s.call();
+    s.call();
+    REQUIRE(y == 2);
+    REQUIRE(inner->infer_count == 1);
+
+    inner->publish(3);
+    s.call();
+    REQUIRE(y == 3);
+    REQUIRE(inner->infer_count == 2);
+    s.call();
+    REQUIRE(inner->infer_count == 2);
+}
+
+TEST_CASE("Memoizing the original function skips repeated calls") {
+    int call_count = 0;
+    double x, y;
+    auto s = SurrogateBuilder()
+            .set_model(std::make_shared<CountingModel>())
+            .set_original_memoization(1024*1024)
+            .set_callmode(CallMode::UseOriginal)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_original_function([&]() { call_count++; y = x * x; });
+    s.bind_all_callsite_vars(&x, &y);
+
+    for (double input : {3.0, 4.0, 3.0, 3.0}) {
+        x = input;
+        y = 0;
+        s.call();
+        REQUIRE(y == input*input);
+    }
+    REQUIRE(call_count == 2);
+    REQUIRE(s.get_original_cache()->get_hit_count() == 2);
+}
+
+} // namespace phasm::test::memo_cache_tests
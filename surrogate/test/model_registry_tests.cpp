@@ -0,0 +1,203 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include "surrogate_builder.h"
+#include "plugin_loader.h"
+
+using namespace phasm;
+namespace phasm::test::model_registry_tests {
+
+/// Doubles its input, and counts what gets done to it
+struct CountingModel : public Model {
+    int initialize_count = 0;
+    int train_count = 0;
+    size_t trained_on = 0;
+    double output = 0;
+
+    void initialize() override { initialize_count += 1; }
+    void train_from_captures() override {
+        train_count += 1;
+        trained_on = get_capture_count();
+    }
+    bool infer() override {
+        output = 2 * *m_inputs[0]->inference_input.get_data<double>();
+        m_outputs[0]->inference_output = tensor(&output, 1);
+        return true;
+    }
+};
+
+struct CountingPlugin : public Plugin {
+    std::vector<std::shared_ptr<CountingModel>> made;
+
+    std::string get_name() override { return "model_registry_tests"; }
+    std::shared_ptr<Model> make_model(std::string) override {
+        auto model = std::make_shared<CountingModel>();
+        made.push_back(model);
+        return model;
+    }
+};
+
+CountingPlugin& get_plugin() {
+    static CountingPlugin plugin;
+    static bool added = false;
+    if (!added) {
+        PluginLoader::get_singleton().add_plugin(&plugin);
+        added = true;
+    }
+    plugin.made.clear();
+    return plugin;
+}
+
+Surrogate make_surrogate(std::string model_name, CallMode callmode, Quantization quantization = Quantization::None) {
+    return SurrogateBuilder()
+            .set_model("model_registry_tests", model_name)
+            .set_quantization(quantization)
+            .set_callmode(callmode)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+}
+
+TEST_CASE("Surrogates of the same model share one Model, which is finalized once") {
+    auto& plugin = get_plugin();
+    double x, y;
+    {
+        auto first = make_surrogate("shared.pt", CallMode::TrainModel);
+        auto second = make_surrogate("shared.pt", CallMode::TrainModel);
+        REQUIRE(first.get_model() == second.get_model());
+        REQUIRE(plugin.made.size() == 1);
+        REQUIRE(first.get_model()->get_surrogate_count() == 2);
+        REQUIRE(plugin.made[0]->initialize_count == 1);
+        REQUIRE(PluginLoader::get_singleton().get_shared_model_count() == 1);
+
+        // Both call sites capture into the same ModelVariables
+        REQUIRE(first.get_model_vars()[0] == second.get_model_vars()[0]);
+        first.bind_original_function([&]() { y = 2 * x; }).bind_all_callsite_vars(&x, &y);
+        second.bind_original_function([&]() { y = 2 * x; }).bind_all_callsite_vars(&x, &y);
+        for (int i=0; i<3; ++i) {
+            x = i;
+            first.call();
+            second.call();
+        }
+        second.call();
+        REQUIRE(first.get_model()->get_capture_count() == 7);
+    }
+    REQUIRE(plugin.made[0]->train_count == 1);
+    REQUIRE(plugin.made[0]->trained_on == 7);
+    REQUIRE(plugin.made[0]->get_surrogate_count() == 0);
+
+    // Once every Surrogate is gone, the registry lets go of the model, and the next Surrogate gets a fresh one
+    REQUIRE(plugin.made[0].use_count() == 1);
+    plugin.made.clear();
+    REQUIRE(PluginLoader::get_singleton().get_shared_model_count() == 0);
+    auto third = make_surrogate("shared.pt", CallMode::UseModel);
+    third.bind_all_callsite_vars(&x, &y);
+    x = 4;
+    third.call();
+    REQUIRE(y == 8);
+    REQUIRE(plugin.made.size() == 1);
+}
+
+TEST_CASE("Surrogates with different model names or configurations get different Models") {
+    auto& plugin = get_plugin();
+    auto a = make_surrogate("a.pt", CallMode::UseModel);
+    auto b = make_surrogate("b.pt", CallMode::UseModel);
+    auto a_int8 = make_surrogate("a.pt", CallMode::UseModel, Quantization::DynamicInt8);
+    REQUIRE(a.get_model() != b.get_model());
+    REQUIRE(a.get_model() != a_int8.get_model());
+    REQUIRE(plugin.made.size() == 3);
+    REQUIRE(a_int8.get_model()->get_quantization() == Quantization::DynamicInt8);
+
+    // Without a model name, every Surrogate gets its own untrained model
+    auto fresh = make_surrogate("", CallMode::UseModel);
+    auto other_fresh = make_surrogate("", CallMode::UseModel);
+    REQUIRE(fresh.get_model() != other_fresh.get_model());
+    REQUIRE(plugin.made.size() == 5);
+}
+
+TEST_CASE("Call sites sharing a model have to declare the same model variables") {
+    get_plugin();
+    auto s = make_surrogate("mismatched.pt", CallMode::UseModel);
+    s.load_model();
+    REQUIRE_THROWS(SurrogateBuilder()
+            .set_model("model_registry_tests", "mismatched.pt")
+            .set_lazy_init(false)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("z", Direction::OUT)
+            .finish());
+
+    // A lazily made model only finds out on first use
+    auto lazy = SurrogateBuilder()
+            .set_model("model_registry_tests", "mismatched.pt")
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN, {2})
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    REQUIRE_THROWS(lazy.load_model());
+    REQUIRE_THROWS(lazy.call_model());
+}
+
+TEST_CASE("Call sites with different dtypes or normalizations don't share a model") {
+    auto& plugin = get_plugin();
+    auto doubles = make_surrogate("typed.pt", CallMode::UseModel);
+    auto floats = SurrogateBuilder()
+            .set_model("model_registry_tests", "typed.pt")
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<float>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    auto normalized = SurrogateBuilder()
+            .set_model("model_registry_tests", "typed.pt")
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .set_normalization("x", NormalizationKind::Standardize)
+            .finish();
+    doubles.load_model();
+    floats.load_model();
+    normalized.load_model();
+    REQUIRE(plugin.made.size() == 3);
+
+    // A model handed to several builders can't be split up, so the mismatch is an error instead
+    auto model = std::make_shared<CountingModel>();
+    auto build = [&](bool use_floats, NormalizationKind kind) {
+        SurrogateBuilder builder;
+        builder.set_model(model).set_callmode(CallMode::UseModel);
+        if (use_floats) builder.local_primitive<float>("x", Direction::IN);
+        else builder.local_primitive<double>("x", Direction::IN);
+        builder.local_primitive<double>("y", Direction::OUT).set_normalization("x", kind);
+        return builder.finish();
+    };
+    auto first = build(false, NormalizationKind::None);
+    REQUIRE_THROWS(build(true, NormalizationKind::None));
+    REQUIRE_THROWS(build(false, NormalizationKind::MinMax));
+    REQUIRE_NOTHROW(build(false, NormalizationKind::None));
+}
+
+TEST_CASE("A model handed to several builders is also finalized once") {
+    auto model = std::make_shared<CountingModel>();
+    double x = 1, y = 0;
+    {
+        auto build = [&]() {
+            return SurrogateBuilder()
+                    .set_model(model)
+                    .set_callmode(CallMode::TrainModel)
+                    .local_primitive<double>("x", Direction::IN)
+                    .local_primitive<double>("y", Direction::OUT)
+                    .finish();
+        };
+        auto first = build();
+        auto second = build();
+        REQUIRE(model->initialize_count == 1);
+        REQUIRE(model->get_model_var_count() == 2);
+        first.bind_original_function([&]() { y = 2 * x; }).bind_all_callsite_vars(&x, &y);
+        second.bind_original_function([&]() { y = 2 * x; }).bind_all_callsite_vars(&x, &y);
+        first.call();
+        second.call();
+    }
+    REQUIRE(model->train_count == 1);
+    REQUIRE(model->trained_on == 2);
+}
+
+} // namespace phasm::test::model_registry_tests
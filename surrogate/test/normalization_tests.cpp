@@ -0,0 +1,176 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <sstream>
+#include "surrogate_builder.h"
+#include "normalization.h"
+
+using namespace phasm;
+namespace phasm::test::normalization_tests {
+
+TEST_CASE("Standardize normalization has zero mean and unit variance") {
+    double a[] = {1, 2, 3};
+    double b[] = {4, 5, 6};
+    Normalization n;
+    n.kind = NormalizationKind::Standardize;
+    n.fit({tensor(a, 3), tensor(b, 3)});
+
+    float normalized[3];
+    n.normalize(tensor(a, 3), normalized);
+    // mean = 3.5, stddev = sqrt(35/12)
+    REQUIRE(normalized[0] == Approx(-2.5 / std::sqrt(35.0/12)));
+    REQUIRE(normalized[2] == Approx(-0.5 / std::sqrt(35.0/12)));
+
+    auto denormalized = n.denormalize(normalized, {3});
+    REQUIRE(denormalized.get_dtype() == DType::F32);
+    REQUIRE(denormalized.get_data<float>()[0] == Approx(1));
+    REQUIRE(denormalized.get_data<float>()[2] == Approx(3));
+}
+
+TEST_CASE("MinMax normalization maps captures onto [0,1]") {
+    int32_t a[] = {-10, 0, 30};
+    Normalization n;
+    n.kind = NormalizationKind::MinMax;
+    n.fit({tensor(a, 3)});
+
+    float normalized[3];
+    n.normalize(tensor(a, 3), normalized);
+    REQUIRE(normalized[0] == Approx(0).margin(1e-6));
+    REQUIRE(normalized[1] == Approx(0.25));
+    REQUIRE(normalized[2] == Approx(1));
+}
+
+TEST_CASE("Log normalization round-trips values spanning many orders of magnitude") {
+    double a[] = {1e-3, 1, 1e3, 1e6};
+    Normalization n;
+    n.kind = NormalizationKind::Log;
+    n.fit({tensor(a, 4)});
+
+    float normalized[4];
+    n.normalize(tensor(a, 4), normalized);
+    REQUIRE(normalized[0] < normalized[1]);
+    REQUIRE(std::abs(normalized[3]) < 2);
+
+    auto denormalized = n.denormalize(normalized, {4});
+    REQUIRE(denormalized.get_data<float>()[0] == Approx(1e-3));
+    REQUIRE(denormalized.get_data<float>()[3] == Approx(1e6));
+
+    // Non-positive values disable the normalization instead of throwing, since fit() runs during shutdown
+    double bad[] = {-1};
+    REQUIRE_NOTHROW(n.fit({tensor(bad, 1)}));
+    REQUIRE(!n.is_enabled());
+}
+
+TEST_CASE("Standardize normalization stays accurate for data with a large offset") {
+    double a[] = {1e9 + 1, 1e9 + 2, 1e9 + 3};
+    Normalization n;
+    n.kind = NormalizationKind::Standardize;
+    n.fit({tensor(a, 3)});
+    // stddev = sqrt(2/3), which sum-of-squares minus mean-squared loses entirely at this offset
+    REQUIRE(n.scale == Approx(1.0 / std::sqrt(2.0/3)));
+
+    // An offset of -mean*scale applied in float would be off by up to 64 here, swamping every normalized value
+    float normalized[3];
+    n.normalize(tensor(a, 3), normalized);
+    REQUIRE(normalized[0] == Approx(-std::sqrt(1.5)));
+    REQUIRE(normalized[1] == Approx(0).margin(1e-6));
+    REQUIRE(normalized[2] == Approx(std::sqrt(1.5)));
+
+    // Neither may saving and loading it with the model
+    std::stringstream ss;
+    n.write(ss);
+    Normalization loaded;
+    loaded.read(ss);
+    loaded.normalize(tensor(a, 3), normalized);
+    REQUIRE(normalized[0] == Approx(-std::sqrt(1.5)));
+    REQUIRE(normalized[2] == Approx(std::sqrt(1.5)));
+}
+
+TEST_CASE("Constant captures don't produce infinite scales") {
+    float a[] = {7, 7, 7};
+    Normalization n;
+    n.kind = NormalizationKind::Standardize;
+    n.fit({tensor(a, 3)});
+    REQUIRE(n.scale == 1.0);
+    REQUIRE(n.center == 7.0);
+}
+
+TEST_CASE("Normalizations are fitted from captures and persisted with the model") {
+    double x, y;
+    auto model = std::make_shared<Model>();
+    auto builder = SurrogateBuilder()
+            .set_model(model)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .set_normalization("x", NormalizationKind::MinMax);
+    REQUIRE_THROWS(builder.set_normalization("z", NormalizationKind::MinMax));
+    auto s = builder.finish();
+
+    s.bind_original_function([&](){ y = x * 2; });
+    s.bind_callsite_var("x", &x);
+    s.bind_callsite_var("y", &y);
+    for (x = 0; x < 5; x += 1) {
+        s.call_original_and_capture();
+    }
+    model->fit_normalizations();
+    auto xvar = model->get_model_var("x");
+    REQUIRE(xvar->normalization.scale == Approx(0.25));
+    REQUIRE_FALSE(model->get_model_var("y")->normalization.is_enabled());
+
+    std::stringstream ss;
+    model->save_normalizations(ss);
+    REQUIRE(ss.str().rfind("x minmax ", 0) == 0);
+
+    xvar->normalization = Normalization();
+    model->load_normalizations(ss);
+    REQUIRE(xvar->normalization.kind == NormalizationKind::MinMax);
+    REQUIRE(xvar->normalization.scale == 0.25f);
+}
+
+/// Trains from scratch, optionally starting from normalizations saved by an earlier run
+struct ScratchModel : public Model {
+    std::string saved_normalizations;
+    explicit ScratchModel(std::string saved_normalizations = "") : saved_normalizations(std::move(saved_normalizations)) {
+        m_trains_from_scratch = true;
+    }
+    void initialize() override {
+        if (saved_normalizations.empty()) return;
+        std::istringstream is(saved_normalizations);
+        load_normalizations(is);
+    }
+};
+
+TEST_CASE("finalize() only fits normalizations for models which train from scratch without any") {
+    auto train = [](std::shared_ptr<Model> model) {
+        double x, y;
+        auto s = SurrogateBuilder()
+                .set_model(model)
+                .local_primitive<double>("x", Direction::IN)
+                .local_primitive<double>("y", Direction::OUT)
+                .set_normalization("x", NormalizationKind::MinMax)
+                .finish();
+        s.bind_original_function([&](){ y = x * 2; });
+        s.bind_all_callsite_vars(&x, &y);
+        for (x = 0; x < 5; x += 1) {
+            s.call_original_and_capture();
+        }
+        model->finalize(CallMode::TrainModel);
+        return model->get_model_var("x")->normalization.scale;
+    };
+    auto fresh = std::make_shared<ScratchModel>();
+    REQUIRE(train(fresh) == Approx(0.25));
+
+    // The weights were trained on these, so refitting them to this run's captures would break the network
+    auto loaded = std::make_shared<ScratchModel>("x minmax 0.5 0\n");
+    REQUIRE(train(loaded) == 0.5f);
+    REQUIRE(!loaded->should_fit_normalizations());
+
+    // Models which don't train their weights keep whatever they were initialized with
+    auto pretrained = std::make_shared<Model>();
+    REQUIRE(!pretrained->should_fit_normalizations());
+    REQUIRE(train(pretrained) == 1.0f);
+}
+
+} // namespace phasm::test::normalization_tests
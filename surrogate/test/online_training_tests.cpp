@@ -0,0 +1,96 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <thread>
+#include "surrogate_builder.h"
+#include "bounded_queue.h"
+
+using namespace phasm;
+namespace phasm::test::online_training_tests {
+
+TEST_CASE("BoundedQueue drops items instead of blocking when full") {
+    BoundedQueue<int> q(2);
+    REQUIRE(q.try_push(1));
+    REQUIRE(q.try_push(2));
+    REQUIRE_FALSE(q.try_push(3));
+    REQUIRE(q.get_dropped_count() == 1);
+    REQUIRE(q.size() == 2);
+
+    int item = 0;
+    REQUIRE(q.pop_for(item, std::chrono::milliseconds(1)));
+    REQUIRE(item == 1);
+    REQUIRE(q.try_push(4));
+}
+
+TEST_CASE("Closing a BoundedQueue lets the consumer drain it and then wakes it up") {
+    BoundedQueue<int> q(10);
+    q.try_push(1);
+    int item = 0;
+    std::vector<int> received;
+    std::thread consumer([&](){
+        int x;
+        while (q.pop_for(x, std::chrono::seconds(10))) {
+            received.push_back(x);
+        }
+    });
+    q.try_push(2);
+    q.close();
+    consumer.join();
+    REQUIRE(received == std::vector<int>{1, 2});
+    REQUIRE_FALSE(q.try_push(3));
+    REQUIRE_FALSE(q.pop_for(item, std::chrono::milliseconds(1)));
+}
+
+/// Pretends to learn y = 2x, and declares itself converged after a fixed number of samples
+struct CountingOnlineModel : public Model {
+    size_t samples_seen = 0;
+    size_t samples_needed;
+    explicit CountingOnlineModel(size_t samples_needed) : samples_needed(samples_needed) {}
+
+    void train_online() override {
+        samples_seen += get_capture_count();
+        discard_captures();
+    }
+    bool is_online_training_converged() override {
+        return samples_seen >= samples_needed;
+    }
+    bool infer() override {
+        double x = *m_inputs[0]->inference_input.get_data<double>();
+        double y = 2 * x;
+        m_outputs[0]->inference_output = tensor(&y, 1);
+        return true;
+    }
+};
+
+TEST_CASE("TrainOnline switches over to UseModel once the model converges") {
+    double x, y;
+    auto model = std::make_shared<CountingOnlineModel>(3);
+    auto s = SurrogateBuilder()
+            .set_model(model)
+            .set_callmode(CallMode::TrainOnline)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+
+    int original_calls = 0;
+    s.bind_original_function([&](){ y = x * 2; original_calls++; });
+    s.bind_callsite_var("x", &x);
+    s.bind_callsite_var("y", &y);
+
+    for (x = 0; x < 2; x += 1) {
+        s.call();
+        REQUIRE(s.get_callmode() == CallMode::TrainOnline);
+    }
+    REQUIRE(model->get_capture_count() == 0);
+    x = 2;
+    s.call();
+    REQUIRE(s.get_callmode() == CallMode::UseModel);
+
+    x = 10;
+    s.call();
+    REQUIRE(original_calls == 3);
+    REQUIRE(y == 20);
+}
+
+} // namespace phasm::test::online_training_tests
@@ -157,6 +157,88 @@ TEST_CASE("Iterate over std::vector") {
     REQUIRE(t.get_shape()[0] == 5);
 }
 
+TEST_CASE("Gather std::vector of structs into a single [n, fields] tensor") {
+    std::vector<MyStruct> aos = {{1,  2},
+                                 {5,  6},
+                                 {10, 11}};
+    auto iso = StructArrayIso<std::vector<MyStruct>, MyStruct, float>({&MyStruct::y, &MyStruct::x}, 3);
+
+    auto t = iso.to(&aos);
+    REQUIRE(t.get_shape() == std::vector<int64_t>{3, 2});
+    REQUIRE(t.get_dtype() == DType::F32);
+    float* data = t.get_data<float>();
+    REQUIRE(data[0] == 2);
+    REQUIRE(data[1] == 1);
+    REQUIRE(data[4] == 11);
+    REQUIRE(data[5] == 10);
+
+    data[2] = 7;  // aos[1].y
+    data[3] = 8;  // aos[1].x
+    iso.from(t, &aos);
+    REQUIRE(aos[1].y == 7);
+    REQUIRE(aos[1].x == 8);
+    REQUIRE(aos[2].x == 10);
+
+    std::vector<MyStruct> too_short = {{1, 2}};
+    REQUIRE_THROWS(iso.to(&too_short));
+}
+
+TEST_CASE("PointerLens follows raw and smart pointers") {
+    MyStruct ms {1, 2};
+    MyStruct* raw = &ms;
+    auto shared = std::make_shared<MyStruct>(MyStruct{3, 4});
+
+    auto iso = TensorIso<float>();
+    auto field = RefLens<MyStruct, float>(&iso, &MyStruct::y);
+    auto raw_lens = PointerLens<MyStruct*, MyStruct>(&field);
+    auto shared_lens = PointerLens<std::shared_ptr<MyStruct>, MyStruct>(&field);
+
+    REQUIRE(*raw_lens.to(&raw).get_data<float>() == 2);
+    REQUIRE(*shared_lens.to(&shared).get_data<float>() == 4);
+
+    float new_y = 9;
+    raw_lens.from(tensor(&new_y, 1), &raw);
+    REQUIRE(ms.y == 9);
+}
+
+TEST_CASE("PointerLens produces a masked default for nullptr") {
+    MyStruct* missing = nullptr;
+    auto iso = TensorIso<float>();
+    auto field = RefLens<MyStruct, float>(&iso, &MyStruct::y);
+    auto lens = PointerLens<MyStruct*, MyStruct>(&field);
+
+    auto t = lens.to(&missing);
+    REQUIRE(t.get_length() == 1);
+    REQUIRE(*t.get_data<float>() == 0);
+
+    float new_y = 9;
+    lens.from(tensor(&new_y, 1), &missing);  // Silently does nothing
+}
+
+TEST_CASE("PointerArrayTraversal follows an array of pointers") {
+    std::vector<MyStruct> storage = {{1, 2}, {5, 6}, {10, 11}, {15, 16}, {20, 21}, {25, 26}};
+    std::vector<MyStruct*> pointers;
+    for (auto& item : storage) pointers.push_back(&item);
+    pointers[2] = nullptr;
+
+    auto iso = TensorIso<float>();
+    auto field = RefLens<MyStruct, float>(&iso, &MyStruct::x);
+    auto traversal = PointerArrayTraversal<MyStruct*, MyStruct>(&field, 6, 2);
+
+    auto t = traversal.to(pointers.data());
+    REQUIRE(t.get_shape() == std::vector<int64_t>{6});
+    float* data = t.get_data<float>();
+    REQUIRE(data[0] == 1);
+    REQUIRE(data[1] == 5);
+    REQUIRE(data[2] == 0);
+    REQUIRE(data[5] == 25);
+
+    data[5] = 99;
+    traversal.from(t, pointers.data());
+    REQUIRE(storage[5].x == 99);
+    REQUIRE(storage[2].x == 10);
+}
+
 struct MyOrderableStruct {
     float x;
     float y;
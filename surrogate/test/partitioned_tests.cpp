@@ -0,0 +1,141 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <cstdio>
+#include <mutex>
+#include "surrogate_builder.h"
+#include "partitioned_model.h"
+#include "knn_model.h"
+
+using namespace phasm;
+namespace phasm::test::partitioned_tests {
+
+/// Predicts the mean of whatever captures it was trained on
+struct MeanModel : public Model {
+    double mean = 0;
+    size_t trained_on = 0;
+
+    void train_from_captures() override {
+        trained_on = get_capture_count();
+        mean = 0;
+        for (const auto& y : m_outputs[0]->training_outputs) mean += *y.get_data<double>() / trained_on;
+    }
+    bool infer() override {
+        m_outputs[0]->inference_output = tensor(&mean, 1);
+        return true;
+    }
+};
+
+/// A step in x0, and a second, smaller one in x1 where x0 is large
+double step(double x0, double x1) {
+    return (x0 < 0.3) ? 0 : (x1 < 0.6 ? 5 : 6);
+}
+
+TEST_CASE("PartitionedModel learns where the outputs change") {
+    std::vector<std::shared_ptr<MeanModel>> experts;
+    std::mutex experts_mutex;
+    auto partitioned = std::make_shared<PartitionedModel>("partitioned_tests_learned.tree", [&](size_t) {
+        auto expert = std::make_shared<MeanModel>();
+        std::lock_guard<std::mutex> lock(experts_mutex);
+        experts.push_back(expert);
+        return expert;
+    }, 2, 10);
+
+    double x0, x1, y;
+    auto s = SurrogateBuilder()
+            .set_model(partitioned)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x0", Direction::IN)
+            .local_primitive<double>("x1", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_original_function([&]() { y = step(x0, x1); });
+    s.bind_all_callsite_vars(&x0, &x1, &y);
+    REQUIRE(partitioned->get_expert_count() == 4);
+
+    for (int i=0; i<40; ++i) {
+        for (int j=0; j<40; ++j) {
+            x0 = (i + 0.5) / 40;
+            x1 = (j + 0.5) / 40;
+            s.call_original_and_capture();
+        }
+    }
+    partitioned->fit_normalizations();
+    partitioned->train_from_captures();
+
+    auto splits = partitioned->get_splits();
+    REQUIRE(splits[0].input == 0);
+    REQUIRE(splits[0].threshold == Approx(0.3).margin(0.0125));
+    REQUIRE(splits[2].input == 1);
+    REQUIRE(splits[2].threshold == Approx(0.6).margin(0.0125));
+
+    size_t total = 0;
+    for (const auto& expert : experts) total += expert->trained_on;
+    REQUIRE(total == 1600);
+
+    for (auto [q0, q1] : {std::pair{0.1, 0.9}, {0.29, 0.1}, {0.31, 0.1}, {0.9, 0.59}, {0.9, 0.61}}) {
+        x0 = q0; x1 = q1; y = -1;
+        s.call();
+        REQUIRE(y == Approx(step(q0, q1)));
+    }
+    float x[2] = {0.9f, 0.9f};
+    REQUIRE(partitioned->route(x) == 3);
+    s.set_callmode(CallMode::UseOriginal);
+    std::remove("partitioned_tests_learned.tree");
+}
+
+TEST_CASE("PartitionedModel with given splits trains KnnModel experts and reloads them") {
+    auto knn_file = [](size_t leaf) { return "partitioned_tests_" + std::to_string(leaf) + ".knn"; };
+    auto make_expert = [&](size_t leaf) { return std::make_shared<KnnModel>(knn_file(leaf)); };
+    std::remove("partitioned_tests_given.tree");
+    double x0, x1, y;
+    {
+        auto s = SurrogateBuilder()
+                .set_model(std::make_shared<PartitionedModel>("partitioned_tests_given.tree", make_expert,
+                                                              std::vector<PartitionSplit>{{0.3f, 0}}))
+                .set_callmode(CallMode::TrainModel)
+                .local_primitive<double>("x0", Direction::IN)
+                .local_primitive<double>("x1", Direction::IN)
+                .local_primitive<double>("y", Direction::OUT)
+                .finish();
+        s.bind_original_function([&]() { y = step(x0, x1); });
+        s.bind_all_callsite_vars(&x0, &x1, &y);
+        for (int i=0; i<=20; ++i) {
+            for (int j=0; j<=20; ++j) {
+                x0 = i / 20.0;
+                x1 = j / 20.0;
+                s.call();
+            }
+        }
+    }
+
+    // A fresh model picks up the splits from the file, and the experts from theirs
+    auto partitioned = std::make_shared<PartitionedModel>("partitioned_tests_given.tree", make_expert, 5);
+    auto s = SurrogateBuilder()
+            .set_model(partitioned)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x0", Direction::IN)
+            .local_primitive<double>("x1", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .finish();
+    s.bind_all_callsite_vars(&x0, &x1, &y);
+    REQUIRE(partitioned->get_depth() == 1);
+    REQUIRE(std::dynamic_pointer_cast<KnnModel>(partitioned->get_expert(0))->get_index().get_point_count() == 6*21);
+    REQUIRE(std::dynamic_pointer_cast<KnnModel>(partitioned->get_expert(1))->get_index().get_point_count() == 15*21);
+
+    // Right next to the step, a single k-NN model would average across it
+    x0 = 0.29; x1 = 0.2;
+    s.call();
+    REQUIRE(y == Approx(0));
+    x0 = 0.31;
+    s.call();
+    REQUIRE(y == Approx(5));
+
+    std::remove("partitioned_tests_given.tree");
+    std::remove(knn_file(0).c_str());
+    std::remove(knn_file(1).c_str());
+    REQUIRE_THROWS(PartitionedModel("unused.tree", make_expert, std::vector<PartitionSplit>(2)));
+}
+
+} // namespace phasm::test::partitioned_tests
@@ -0,0 +1,107 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include <sstream>
+#include "surrogate_builder.h"
+
+using namespace phasm;
+namespace phasm::test::ragged_tests {
+
+TEST_CASE("stack_ragged packs rows without padding") {
+    double a[] = {1, 2, 3};
+    double b[] = {4};
+    std::vector<tensor> rows = {tensor(a, 3), tensor(), tensor(b, 1)};
+
+    auto packed = stack_ragged(rows);
+    REQUIRE(packed.is_ragged());
+    REQUIRE(packed.get_row_count() == 3);
+    REQUIRE(packed.get_length() == 4);
+    REQUIRE(packed.get_shape() == std::vector<int64_t>{4});
+    REQUIRE(packed.get_row_offsets() == std::vector<int64_t>{0, 3, 3, 4});
+    REQUIRE(packed.get_data<double>()[3] == 4);
+
+    auto unpacked = unstack_ragged(packed);
+    REQUIRE(unpacked.size() == 3);
+    REQUIRE(unpacked[0] == rows[0]);
+    REQUIRE(unpacked[1].get_dtype() == DType::Undefined);
+    REQUIRE(unpacked[2] == rows[2]);
+}
+
+TEST_CASE("stack_ragged preserves inner dimensions") {
+    float a[] = {1, 2, 3, 4, 5, 6};
+    float b[] = {7, 8};
+    std::vector<tensor> rows = {tensor(a, {3, 2}), tensor(b, {1, 2})};
+
+    auto packed = stack_ragged(rows);
+    REQUIRE(packed.get_shape() == std::vector<int64_t>{4, 2});
+    REQUIRE(packed.get_row_offsets() == std::vector<int64_t>{0, 3, 4});
+
+    float c[] = {1, 2, 3};
+    rows.push_back(tensor(c, {1, 3}));
+    REQUIRE_THROWS(stack_ragged(rows));
+}
+
+TEST_CASE("Capturing a variable-length vector") {
+
+    std::vector<double> hit_energies;
+    double total_energy = 0;
+
+    auto s = SurrogateBuilder()
+        .set_model(std::make_shared<Model>())
+        .local<std::vector<double>>("hit_energies")
+            .ragged<double>()
+                .primitive("hit_energies", Direction::IN)
+                .end()
+            .end()
+        .local<double>("total_energy")
+            .primitive("total_energy", Direction::OUT)
+            .end()
+        .finish();
+
+    s.bind_original_function([&]() {
+        total_energy = 0;
+        for (double e : hit_energies) total_energy += e;
+    });
+    s.bind_all_callsite_vars(&hit_energies, &total_energy);
+
+    hit_energies = {1, 2, 3};
+    s.call_original_and_capture();
+    hit_energies = {};
+    s.call_original_and_capture();
+    hit_energies = {10};
+    s.call_original_and_capture();
+
+    auto mv = s.get_model()->get_model_var("hit_energies");
+    REQUIRE(mv->isRagged());
+    REQUIRE(mv->shape() == std::vector<int64_t>{-1});
+    REQUIRE(mv->training_inputs[0].get_shape() == std::vector<int64_t>{3});
+
+    auto packed = mv->getPackedTrainingInputs();
+    REQUIRE(packed.get_length() == 4);
+    REQUIRE(packed.get_row_offsets() == std::vector<int64_t>{0, 3, 3, 4});
+
+    std::ostringstream csv;
+    s.get_model()->dump_captures_to_csv(csv);
+    REQUIRE(csv.str() == "hit_energies[], total_energy\n1 2 3, 6\n, 0\n10, 10\n");
+}
+
+TEST_CASE("RaggedTraversal writes back by resizing the container") {
+    auto iso = TensorIso<int>();
+    auto traversal = RaggedTraversal<std::vector<int>, int>(&iso);
+
+    std::vector<int> source = {5, 6, 7};
+    auto t = traversal.to(&source);
+    REQUIRE(t.get_shape() == std::vector<int64_t>{3});
+
+    std::vector<int> dest;
+    traversal.from(t, &dest);
+    REQUIRE(dest == source);
+
+    std::vector<int> empty;
+    traversal.from(traversal.to(&empty), &dest);
+    REQUIRE(dest.empty());
+}
+
+} // namespace phasm::test::ragged_tests
@@ -0,0 +1,45 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include <catch.hpp>
+#include "tensor.hpp"
+
+using namespace phasm;
+namespace phasm::test::tensor_tests {
+
+TEST_CASE("Borrowed tensors call their deleter exactly once") {
+    float buffer[] = {1, 2, 3, 4};
+    int deleter_calls = 0;
+    {
+        tensor t(buffer, DType::F32, {2,2}, [&](void*) { deleter_calls++; });
+        REQUIRE(t.is_borrowed());
+        REQUIRE(t.get_length() == 4);
+        REQUIRE(t.get_data<float>() == buffer);
+
+        // Moving transfers the borrowed buffer
+        tensor moved = std::move(t);
+        REQUIRE(moved.get_data<float>() == buffer);
+        REQUIRE(deleter_calls == 0);
+
+        // Copying makes an owned copy
+        tensor copied = moved;
+        REQUIRE_FALSE(copied.is_borrowed());
+        REQUIRE(copied.get_data<float>() != buffer);
+        REQUIRE(copied == moved);
+    }
+    REQUIRE(deleter_calls == 1);
+}
+
+TEST_CASE("Assigning over a borrowed tensor releases it") {
+    double buffer[] = {1, 2};
+    int deleter_calls = 0;
+    tensor t(buffer, DType::F64, {2}, [&](void*) { deleter_calls++; });
+    int32_t x = 7;
+    t = tensor(&x, 1);
+    REQUIRE(deleter_calls == 1);
+    REQUIRE_FALSE(t.is_borrowed());
+    REQUIRE(t.get_data<int32_t>()[0] == 7);
+}
+
+} // namespace phasm::test::tensor_tests
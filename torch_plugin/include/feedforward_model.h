@@ -8,10 +8,55 @@
 
 #include "surrogate.h"
 #include "model.h"
+#include "bounded_queue.h"
+#include "quantized_mlp.h"
 #include <torch/torch.h>
+#include <atomic>
+#include <thread>
 
 namespace phasm {
 
+/// Controls how FeedForwardModel::train_from_captures() trains the network
+struct TrainingOptions {
+    enum class Optimizer { SGD, Adam };
+
+    Optimizer optimizer = Optimizer::SGD;
+    double learning_rate = 0.01;
+    size_t batch_size = 32;
+    size_t max_epochs = 10;
+    /// Fraction of the captures held out for validation. 0 disables validation and early stopping.
+    double validation_fraction = 0.1;
+    /// Stop once the validation loss hasn't improved for this many epochs. The best weights are restored.
+    size_t patience = 3;
+    /// Number of threads libtorch uses within each op. 0 leaves the libtorch default alone.
+    int threads = 0;
+    /// Seed for shuffling and the validation split. 0 leaves the libtorch default alone.
+    uint64_t seed = 0;
+    /// Where the best weights so far are saved. Empty disables checkpointing.
+    std::string checkpoint_path = "net.pt";
+
+    // The following only apply to online training (CallMode::TrainOnline)
+    /// Unless the normalizations were loaded, training waits for this many captures, fits the normalizations on
+    /// them, and keeps them frozen from then on, since the network's weights depend on them
+    size_t online_normalization_window = 256;
+    /// Captures waiting for the background trainer. Further captures are dropped while the queue is full.
+    size_t online_queue_capacity = 10000;
+    /// The serving network receives the shadow network's weights after this many mini-batches
+    size_t online_swap_interval = 100;
+    /// The first captures are held out for validation instead of being trained on
+    size_t online_validation_size = 256;
+    /// Once the validation loss (in normalized units) drops below this, the Surrogate switches to UseModel.
+    /// 0 means never switch.
+    double online_convergence_threshold = 0;
+
+    /// Reads PHASM_TRAIN_OPTIMIZER ("sgd" or "adam"), PHASM_TRAIN_LEARNING_RATE, PHASM_TRAIN_BATCH_SIZE,
+    /// PHASM_TRAIN_EPOCHS, PHASM_TRAIN_VALIDATION_FRACTION, PHASM_TRAIN_PATIENCE, PHASM_TRAIN_THREADS,
+    /// PHASM_TRAIN_SEED, PHASM_TRAIN_ONLINE_NORMALIZATION_WINDOW, PHASM_TRAIN_ONLINE_QUEUE_CAPACITY,
+    /// PHASM_TRAIN_ONLINE_SWAP_INTERVAL, PHASM_TRAIN_ONLINE_VALIDATION_SIZE, and PHASM_TRAIN_ONLINE_THRESHOLD,
+    /// falling back to the defaults above
+    static TrainingOptions from_env();
+};
+
 struct FeedForwardModel : public Model {
 private:
 
@@ -33,14 +78,49 @@ private:
 
         torch::Tensor forward(torch::Tensor x);
 
+        /// Same as forward(), but writes each layer's activations into preallocated buffers. Only valid without autograd.
+        void forward_into(const torch::Tensor& x, torch::Tensor& hidden1, torch::Tensor& hidden2, torch::Tensor& out);
+
     };
 
-    std::shared_ptr<FeedForwardNetwork> m_network = nullptr;
+    std::shared_ptr<FeedForwardNetwork> m_network = nullptr; // Always access via std::atomic_load/store, see train_online()
+    TrainingOptions m_training_options;
+
+    // Online training: The host thread packs each capture into a row of floats (inputs followed by outputs) and
+    // queues it. A background thread trains a shadow network on them, and periodically publishes a copy of it as
+    // the new m_network, so that infer() never sees a half-updated network and never waits on the trainer. Every
+    // published network is also checkpointed, since the captures it was trained on are gone by the time we exit.
+    std::unique_ptr<BoundedQueue<std::vector<float>>> m_online_queue;
+    std::thread m_online_thread;
+    std::atomic<bool> m_online_converged {false};
+
+    void run_online_training();
+    std::shared_ptr<FeedForwardNetwork> copy_network(FeedForwardNetwork& source);
+    void publish_online_network(FeedForwardNetwork& shadow);
+
+    // With Quantization::DynamicInt8, train_from_captures() finishes by building this from m_network, and infer()
+    // uses it instead. Online training only ever publishes float networks, so it doesn't apply there.
+    std::unique_ptr<QuantizedMLP> m_quantized_network;
+
+    /// Builds m_quantized_network, calibrates it on the training inputs, and reports its accuracy on the validation set
+    void quantize(const torch::Tensor& training_inputs, const torch::Tensor& validation_inputs,
+                  const torch::Tensor& validation_outputs);
     std::vector<std::vector<int64_t>> m_output_shapes;
     std::vector<int64_t> m_output_lengths;
+    std::vector<const Normalization*> m_input_normalizations;
+    std::vector<const Normalization*> m_output_normalizations;
+
+    // Buffers allocated once in initialize() and reused by every call to infer()
+    std::vector<const phasm::tensor*> m_input_tensors;
+    torch::Tensor m_input_buffer;
+    torch::Tensor m_hidden1_buffer;
+    torch::Tensor m_hidden2_buffer;
+    torch::Tensor m_output_buffer;
 
 public:
-    FeedForwardModel() = default;
+    FeedForwardModel() { m_trains_from_scratch = true; }
+
+    explicit FeedForwardModel(TrainingOptions options) : m_training_options(options) { m_trains_from_scratch = true; }
 
     ~FeedForwardModel();
 
@@ -48,6 +128,14 @@ public:
 
     void train_from_captures() override;
 
+    void train_online() override;
+
+    bool is_online_training_converged() override;
+
+    /// Packs every capture into a single contiguous [captures, features] tensor for the inputs and for the outputs,
+    /// normalizing them on the way. Rows are packed in parallel.
+    std::pair<torch::Tensor, torch::Tensor> stack_captures();
+
     bool infer() override;
 
 };
@@ -0,0 +1,91 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef TORCH_PLUGIN_QUANTIZED_MLP_H
+#define TORCH_PLUGIN_QUANTIZED_MLP_H
+
+#include <torch/torch.h>
+#include <iosfwd>
+#include <vector>
+
+namespace phasm {
+
+/// A Linear layer with int8 weights, for CPU inference where latency is dominated by streaming the weight matrix
+/// from memory. Weights are quantized symmetrically with one scale per output channel. Inputs are quantized
+/// symmetrically with a single scale, which is either computed from max|x| on every call ("dynamic"), or fixed
+/// ahead of time from calibration data. Dot products accumulate in int32, and are dequantized with the bias added
+/// in float.
+struct QuantizedLinear {
+    int64_t in_features = 0;
+    int64_t out_features = 0;
+    bool relu = false;              ///< Whether a ReLU follows this layer
+    std::vector<int8_t> weights;    ///< Row-major [out_features, in_features]
+    std::vector<float> weight_scales;
+    std::vector<float> bias;
+    float input_scale = 0;          ///< 0 means dynamic
+
+    // Kept for calibration and for measuring accuracy; never touched by forward()
+    torch::Tensor float_weight;
+    torch::Tensor float_bias;
+
+    QuantizedLinear(const torch::Tensor& weight, const torch::Tensor& bias, bool relu);
+
+    /// Computes one sample. `scratch` has to hold at least in_features int8s.
+    void forward(const float* x, float* y, int8_t* scratch) const;
+};
+
+
+/// How a quantized model compares to the float model it was built from, measured on captured data
+struct QuantizationReport {
+    size_t samples = 0;
+    double float_mse = 0;       ///< Float model vs. captured outputs
+    double quantized_mse = 0;   ///< Quantized model vs. captured outputs
+    double max_abs_deviation = 0; ///< Largest difference between the float and quantized models' outputs
+    size_t float_weight_bytes = 0;
+    size_t quantized_weight_bytes = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, const QuantizationReport& report);
+
+
+/// A chain of QuantizedLinear layers, which is how we run FeedForwardModels, and any TorchScript module that boils
+/// down to Linear and ReLU ops, in int8.
+class QuantizedMLP {
+    std::vector<QuantizedLinear> m_layers;
+    std::vector<float> m_activations[2]; // Ping-pong buffers between layers
+    std::vector<int8_t> m_scratch;
+
+public:
+    explicit QuantizedMLP(std::vector<QuantizedLinear> layers);
+
+    int64_t get_input_dim() const { return m_layers.front().in_features; }
+    int64_t get_output_dim() const { return m_layers.back().out_features; }
+    const std::vector<QuantizedLinear>& get_layers() const { return m_layers; }
+
+    /// Runs one sample through the network. Not thread safe, since it reuses the activation buffers.
+    void forward(const float* input, float* output);
+
+    /// Runs a batch of samples, [N, input_dim] -> [N, output_dim]
+    torch::Tensor forward(const torch::Tensor& inputs);
+
+    /// Same, but using the float weights, so that we can compare
+    torch::Tensor forward_float(const torch::Tensor& inputs) const;
+
+    /// Fixes each layer's input scale using representative inputs, [N, input_dim], so that forward() no longer needs
+    /// to scan for max|x|. `percentile` clips outliers: 1.0 uses the largest |x| seen, 0.999 ignores the top 0.1%.
+    void calibrate(const torch::Tensor& inputs, double percentile = 1.0);
+
+    /// Goes back to computing the input scales on every call
+    void clear_calibration();
+
+    QuantizationReport evaluate(const torch::Tensor& inputs, const torch::Tensor& expected_outputs);
+
+    /// Calibration is persisted as one input scale per line, so that it can live next to the .pt file
+    void save_calibration(std::ostream& os) const;
+    bool load_calibration(std::istream& is);
+};
+
+} // namespace phasm
+#endif //TORCH_PLUGIN_QUANTIZED_MLP_H
@@ -0,0 +1,59 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#ifndef TORCH_PLUGIN_STACKED_ENSEMBLE_H
+#define TORCH_PLUGIN_STACKED_ENSEMBLE_H
+
+#include <torch/torch.h>
+#include <vector>
+
+namespace phasm {
+
+/// The float weights of one Linear layer, as found in a TorchScript module or a FeedForwardModel
+struct LinearLayerWeights {
+    torch::Tensor weight; ///< [out_features, in_features]
+    torch::Tensor bias;   ///< [out_features], or undefined
+    bool relu = false;    ///< Whether a ReLU follows this layer
+};
+
+
+/// A deep ensemble of K MLPs with identical shapes, e.g. the same network trained from K different seeds, evaluated
+/// in a single pass. Each layer's weights are stacked into one [K, in, out] tensor, so that every layer is one batched
+/// matrix multiply (baddbmm) over all members, rather than K separate forward() calls. For the small networks we
+/// surrogate with, a forward pass is dominated by per-op overhead rather than by FLOPs, so evaluating the whole
+/// ensemble costs about as much as evaluating one member.
+class StackedEnsemble {
+    struct Layer {
+        torch::Tensor weight_t; // [K, in, out]
+        torch::Tensor bias;     // [K, 1, out]
+        torch::Tensor output;   // [K, 1, out], reused by every call
+        bool relu;
+    };
+    std::vector<Layer> m_layers;
+    int64_t m_members = 0;
+    int64_t m_input_dim = 0;
+    torch::Tensor m_input; // [K, 1, in], a broadcast view of the input buffer
+
+public:
+    /// `members[k]` holds member k's layers, in order. Throws if the members' shapes don't match, or the layers don't chain.
+    explicit StackedEnsemble(const std::vector<std::vector<LinearLayerWeights>>& members,
+                             torch::Device device = torch::kCPU);
+
+    int64_t get_member_count() const { return m_members; }
+    int64_t get_input_dim() const { return m_input_dim; }
+    int64_t get_output_dim() const { return m_layers.back().weight_t.size(2); }
+
+    /// Feeds the same input, [input_dim], to every member. Returns [K, output_dim], which stays valid until the next
+    /// call. Not thread safe, since it reuses the activation buffers.
+    torch::Tensor forward(const torch::Tensor& input);
+};
+
+
+/// Per-element mean and variance across the K rows of `members`, [K][n] -> [n] and [n]. The variance is the
+/// population variance, i.e. divided by K.
+void ensemble_mean_and_variance(const float* members, int64_t k, int64_t n, float* mean, float* variance);
+
+} // namespace phasm
+#endif //TORCH_PLUGIN_STACKED_ENSEMBLE_H
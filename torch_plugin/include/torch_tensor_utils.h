@@ -6,21 +6,40 @@
 
 #include <torch/torch.h>
 #include <tensor.hpp>
+#include <normalization.h>
 
 namespace phasm {
 
+/// Wraps the phasm::tensor's buffer without copying. The result is only valid for as long as t is, and in-place
+/// torch ops on it modify t.
+torch::Tensor to_torch_tensor(phasm::tensor& t);
+
+/// Copies the phasm::tensor's buffer, so that in-place torch ops can't modify t
 torch::Tensor to_torch_tensor(const phasm::tensor& t);
 
+/// Adopts the torch::Tensor's storage without copying, unless it lives on a GPU or is not contiguous.
+/// The result holds a reference to the storage, which is released when the phasm::tensor is destroyed.
 phasm::tensor to_phasm_tensor(const torch::Tensor& t);
 
 torch::Tensor flatten_and_join(std::vector<torch::Tensor> inputs);
 
+/// Packs the inputs into a single float tensor, applying each input's normalization (if provided) on the way.
+torch::Tensor flatten_and_join(const std::vector<const phasm::tensor*>& inputs,
+                               const std::vector<const Normalization*>& normalizations = {});
+
+// flatten_and_join_into() and unpack_output_into() don't need Torch, so they live in normalization.h
+
+/// Converts a (normalized) model output back into a phasm::tensor of the original scale
+phasm::tensor to_phasm_tensor(const torch::Tensor& t, const Normalization& normalization);
+
 std::vector<torch::Tensor> split_and_unflatten_outputs(torch::Tensor output,
                                                        const std::vector<int64_t>& lengths,
                                                        const std::vector<std::vector<int64_t>>& shapes);
 
 phasm::DType to_phasm_dtype(torch::Dtype t);
 
+torch::Dtype to_torch_dtype(phasm::DType t);
+
 }
 
 
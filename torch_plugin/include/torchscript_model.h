@@ -9,20 +9,84 @@
 #include "surrogate.h"
 #include "model.h"
 #include "torch_utils.h"
+#include "quantized_mlp.h"
+#include "stacked_ensemble.h"
 
 #include <torch/script.h>
+#include <limits>
 
 namespace phasm {
 
+/// Controls how a TorchscriptModel is prepared for inference. By default the module is used exactly as loaded.
+struct TorchscriptOptions {
+    /// Runs eval(), torch::jit::freeze and torch::jit::optimize_for_inference on the module in initialize()
+    bool optimize = false;
+    /// Disables autograd bookkeeping inside infer()
+    bool inference_mode = true;
+    /// Number of threads libtorch uses within and across ops. 0 leaves the libtorch default alone.
+    int intra_op_threads = 0;
+    int inter_op_threads = 0;
+    /// Number of forward() calls to run in initialize() using inputs shaped like the ModelVariables, so that
+    /// the profiling executor has specialized the graph before the first real call
+    size_t warmup_iterations = 0;
+    /// Number of forward() calls to time before and after optimization and warm-up. 0 disables the report.
+    size_t latency_samples = 0;
+    /// Directory where optimized modules are saved, so that later processes can load them instead of optimizing
+    /// again. Entries are keyed by the .pt file's contents, the input shapes, the thread settings, the device, and
+    /// the libtorch version. Empty disables the cache.
+    std::string cache_dir;
+
+    /// Further .pt files which, together with the main one, form a deep ensemble, e.g. the same network trained from
+    /// different seeds. All of them have to be chains of Linear and ReLU layers with identical shapes. Their weights
+    /// are stacked into a StackedEnsemble, so that infer() evaluates every member in one batched pass.
+    std::vector<std::string> ensemble_members;
+    /// For modules which are ensembles already: forward() returns the outputs of this many members, as
+    /// [ensemble_size, outputs]. 0 means the module isn't an ensemble. Ignored if ensemble_members is set.
+    int64_t ensemble_size = 0;
+    /// With an ensemble, infer() returns false if the members' variance of any output element exceeds this, in the
+    /// output's own units squared, so that the caller falls back to the original function. See also
+    /// TorchscriptModel::set_max_variance, which overrides this per output.
+    float max_variance = std::numeric_limits<float>::infinity();
+
+    /// Reads PHASM_TORCH_OPTIMIZE, PHASM_TORCH_INTRA_OP_THREADS, PHASM_TORCH_INTER_OP_THREADS,
+    /// PHASM_TORCH_WARMUP_ITERATIONS, PHASM_TORCH_LATENCY_SAMPLES, PHASM_TORCH_CACHE_DIR, PHASM_TORCH_ENSEMBLE_SIZE,
+    /// and PHASM_TORCH_MAX_VARIANCE, falling back to the defaults above
+    static TorchscriptOptions from_env();
+};
+
 struct TorchscriptModel : public Model {
 private:
     std::string m_filename;
     torch::jit::script::Module m_module;
     std::vector<std::vector<int64_t>> m_output_shapes;
     std::vector<int64_t> m_output_lengths;
+    std::vector<const Normalization*> m_input_normalizations;
+    int64_t m_all_outputs_dim = 0;
+
+    // Buffers allocated once in initialize() and reused by every call to infer()
+    std::vector<const phasm::tensor*> m_input_tensors;
+    torch::Tensor m_input_buffer;
+    torch::Tensor m_device_input_buffer; // Same as m_input_buffer when m_device is the CPU
+    std::vector<torch::jit::IValue> m_forward_inputs;
 
     // This should be included in Model.h but let's leave it here now.
     torch::Device m_device = torch::kCPU;
+    TorchscriptOptions m_options;
+
+    // With Quantization::DynamicInt8, infer() runs this instead of m_module, if the module could be converted
+    std::unique_ptr<QuantizedMLP> m_quantized_module;
+    std::vector<float> m_quantized_output;
+
+    // With an ensemble, infer() computes the mean and variance over the members' outputs. m_ensemble is only set if
+    // we stacked the members ourselves; otherwise the module returns all members' outputs at once.
+    std::unique_ptr<StackedEnsemble> m_ensemble;
+    int64_t m_ensemble_size = 0;
+    std::map<std::string, float> m_max_variance_by_output;
+    std::vector<float> m_max_variance;      // Per output element
+    std::vector<float> m_ensemble_outputs;  // [K, m_all_outputs_dim], denormalized
+    std::vector<float> m_ensemble_mean;
+    std::vector<float> m_ensemble_variance;
+    float m_last_confidence = 1;
 
     /// @brief The kernel part of loading *.pt module. Load to @param m_device manually.
     void LoadModule();
@@ -30,8 +94,40 @@ private:
     /// @brief Print the infomation of every layer.
     void PrintModuleLayers();
 
+    /// @brief Freeze and optimize the module for inference, as configured by @param m_options.
+    /// @return whether the optimization succeeded.
+    bool OptimizeModule();
+
+    /// @brief @return the path of this module's entry in the optimized module cache, or "" if the cache is disabled.
+    std::string GetCachePath();
+
+    /// @brief Replace the module with its optimized version from the cache. @return whether there was one.
+    bool LoadCachedModule(const std::string& cache_path);
+
+    /// @brief Save the (optimized) module to the cache, atomically so that concurrent processes never see half a file.
+    void SaveCachedModule(const std::string& cache_path);
+
+    /// @brief Build inputs shaped like the ModelVariables, for warm-up and latency measurements.
+    std::vector<torch::jit::IValue> MakeRepresentativeInputs();
+
+    /// @brief @return the mean latency over @param samples calls of whichever of the ensemble, the quantized module
+    /// and m_module infer() actually uses, in microseconds.
+    double MeasureLatency(std::vector<torch::jit::IValue>& inputs, size_t samples);
+
+    /// @brief Convert the module into an int8 QuantizedMLP. This only works if the frozen forward() graph is nothing
+    /// but a chain of aten::linear and aten::relu ops, e.g. an nn.Sequential of Linear and ReLU layers.
+    /// @return whether the conversion succeeded. If not, we keep running the module in float.
+    bool QuantizeModule();
+
+    /// @brief Stack the ensemble members' weights, or check that the module returns ensemble_size members' outputs.
+    void SetUpEnsemble();
+
+    /// @brief infer() for ensembles: unpack the mean, and @return whether the variance stayed within bounds.
+    bool InferEnsemble(const torch::Tensor& member_outputs);
+
 public:
-    TorchscriptModel(std::string filename, bool print_module_layers=false, torch::Device device=torch::kCPU);
+    TorchscriptModel(std::string filename, bool print_module_layers=false, torch::Device device=torch::kCPU,
+                     TorchscriptOptions options=TorchscriptOptions());
 
     ~TorchscriptModel();
 
@@ -41,6 +137,18 @@ public:
 
     bool infer() override;
 
+    /// For ensembles, the confidence is 1 - the largest ratio of an output element's variance to its maximum
+    bool infer_with_confidence(float& confidence) override;
+
+    /// Overrides TorchscriptOptions::max_variance for one output. Has to be called before initialize().
+    void set_max_variance(const std::string& output_name, float max_variance);
+
+    /// @return the number of ensemble members, or 0 if this isn't an ensemble.
+    int64_t get_ensemble_size() const { return m_ensemble_size; }
+
+    /// @return the per-element variance of the flattened outputs from the last call to infer(), for ensembles.
+    const std::vector<float>& get_variance() const { return m_ensemble_variance; }
+
     torch::jit::script::Module& get_module();
 
     /// @brief @return the shape of the input layer.
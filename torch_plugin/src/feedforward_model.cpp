@@ -4,8 +4,42 @@
 
 #include "feedforward_model.h"
 #include "torch_tensor_utils.h"
+#include <fstream>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <ATen/Parallel.h>
+
+phasm::TrainingOptions phasm::TrainingOptions::from_env() {
+    TrainingOptions options;
+    auto read = [](const char* name) { return std::getenv(name); };
+    if (const char* v = read("PHASM_TRAIN_OPTIMIZER")) {
+        std::string optimizer = v;
+        if (optimizer == "adam") options.optimizer = Optimizer::Adam;
+        else if (optimizer == "sgd") options.optimizer = Optimizer::SGD;
+        else throw std::runtime_error("PHASM_TRAIN_OPTIMIZER must be 'sgd' or 'adam'");
+    }
+    if (const char* v = read("PHASM_TRAIN_LEARNING_RATE")) options.learning_rate = std::atof(v);
+    if (const char* v = read("PHASM_TRAIN_BATCH_SIZE")) options.batch_size = std::max(1ll, std::atoll(v));
+    if (const char* v = read("PHASM_TRAIN_EPOCHS")) options.max_epochs = std::atoll(v);
+    if (const char* v = read("PHASM_TRAIN_VALIDATION_FRACTION")) options.validation_fraction = std::atof(v);
+    if (const char* v = read("PHASM_TRAIN_PATIENCE")) options.patience = std::atoll(v);
+    if (const char* v = read("PHASM_TRAIN_THREADS")) options.threads = std::atoi(v);
+    if (const char* v = read("PHASM_TRAIN_SEED")) options.seed = std::strtoull(v, nullptr, 10);
+    if (const char* v = read("PHASM_TRAIN_ONLINE_NORMALIZATION_WINDOW")) options.online_normalization_window = std::atoll(v);
+    if (const char* v = read("PHASM_TRAIN_ONLINE_QUEUE_CAPACITY")) options.online_queue_capacity = std::atoll(v);
+    if (const char* v = read("PHASM_TRAIN_ONLINE_SWAP_INTERVAL")) options.online_swap_interval = std::max(1ll, std::atoll(v));
+    if (const char* v = read("PHASM_TRAIN_ONLINE_VALIDATION_SIZE")) options.online_validation_size = std::atoll(v);
+    if (const char* v = read("PHASM_TRAIN_ONLINE_THRESHOLD")) options.online_convergence_threshold = std::atof(v);
+    return options;
+}
 
 phasm::FeedForwardModel::~FeedForwardModel() {
+    if (m_online_thread.joinable()) {
+        m_online_queue->close();
+        m_online_thread.join();
+    }
 }
 
 void phasm::FeedForwardModel::initialize() {
@@ -18,6 +52,8 @@ void phasm::FeedForwardModel::initialize() {
             n_elems *= len;
         }
         all_inputs_dim += n_elems;
+        m_input_tensors.push_back(&input->inference_input);
+        m_input_normalizations.push_back(&input->normalization);
     }
     for (auto output: this->m_outputs) {
         int64_t n_elems = 1;
@@ -28,90 +64,360 @@ void phasm::FeedForwardModel::initialize() {
         }
         all_outputs_dim += n_elems;
         m_output_lengths.push_back(n_elems);
+        m_output_normalizations.push_back(&output->normalization);
+        output->inference_output = phasm::tensor(phasm::DType::F32, shape);
     }
     // Now we can create the network
     m_network = std::make_shared<FeedForwardNetwork>(all_inputs_dim, all_inputs_dim, all_inputs_dim, all_outputs_dim);
+
+    m_input_buffer = torch::empty({all_inputs_dim}, torch::kFloat32);
+    m_hidden1_buffer = torch::empty({all_inputs_dim}, torch::kFloat32);
+    m_hidden2_buffer = torch::empty({all_inputs_dim}, torch::kFloat32);
+    m_output_buffer = torch::empty({all_outputs_dim}, torch::kFloat32);
 }
 
 
 bool phasm::FeedForwardModel::infer() {
 
-    std::vector<torch::Tensor> input_tensors;
+    // The out= variants used by forward_into() don't support autograd, and we don't need it here anyway
+    torch::NoGradGuard no_grad;
 
-    for (const auto& input_model_var : m_inputs) {
-        input_tensors.push_back(to_torch_tensor(input_model_var->inference_input));
+    flatten_and_join_into(m_input_tensors, m_input_normalizations, m_input_buffer.data_ptr<float>(), m_input_buffer.numel());
+    if (m_quantized_network != nullptr) {
+        m_quantized_network->forward(m_input_buffer.data_ptr<float>(), m_output_buffer.data_ptr<float>());
+    }
+    else {
+        // Online training may publish a new network at any time. Holding our own reference keeps this one alive until we're done.
+        std::shared_ptr<FeedForwardNetwork> network = std::atomic_load(&m_network);
+        network->forward_into(m_input_buffer, m_hidden1_buffer, m_hidden2_buffer, m_output_buffer);
     }
 
-    torch::Tensor input = flatten_and_join(input_tensors);
-    torch::Tensor output = m_network->forward(input);
-    std::vector<torch::Tensor> output_tensors = split_and_unflatten_outputs(output, m_output_lengths, m_output_shapes);
-
-    size_t i = 0;
-    for (const auto& output_model_var : m_outputs) {
-        output_model_var->inference_output = to_phasm_tensor(output_tensors[i++]);
+    const float* output = m_output_buffer.data_ptr<float>();
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        unpack_output_into(output, m_output_shapes[i], m_outputs[i]->normalization, m_outputs[i]->inference_output);
+        output += m_output_lengths[i];
     }
     return true;
 }
 
+std::pair<torch::Tensor, torch::Tensor> phasm::FeedForwardModel::stack_captures() {
+    int64_t rows = get_capture_count();
+    torch::Tensor inputs = torch::empty({rows, m_network->m_dim0}, torch::kFloat32);
+    torch::Tensor outputs = torch::empty({rows, m_network->m_dim3}, torch::kFloat32);
+    float* input_data = inputs.data_ptr<float>();
+    float* output_data = outputs.data_ptr<float>();
+
+    // Every row is independent, so we can pack them in parallel using libtorch's intra-op thread pool
+    at::parallel_for(0, rows, 1024, [&](int64_t begin, int64_t end) {
+        std::vector<const phasm::tensor*> sample_inputs(m_inputs.size());
+        std::vector<const phasm::tensor*> sample_outputs(m_outputs.size());
+        for (int64_t row=begin; row<end; ++row) {
+            for (size_t j=0; j<m_inputs.size(); ++j) {
+                sample_inputs[j] = &m_inputs[j]->training_inputs[row];
+            }
+            for (size_t j=0; j<m_outputs.size(); ++j) {
+                sample_outputs[j] = &m_outputs[j]->training_outputs[row];
+            }
+            flatten_and_join_into(sample_inputs, m_input_normalizations, input_data + row*m_network->m_dim0, m_network->m_dim0);
+            flatten_and_join_into(sample_outputs, m_output_normalizations, output_data + row*m_network->m_dim3, m_network->m_dim3);
+        }
+    });
+    return {inputs, outputs};
+}
+
 void phasm::FeedForwardModel::train_from_captures() {
 
-    // Instantiate an SGD optimization algorithm to update our Net's parameters.
-    torch::optim::SGD optimizer(m_network->parameters(), /*lr=*/0.01);
+    const TrainingOptions& options = m_training_options;
+    if (options.threads > 0) {
+        at::set_num_threads(options.threads);
+    }
+    if (options.seed != 0) {
+        torch::manual_seed(options.seed);
+    }
+
+    auto [all_inputs, all_outputs] = stack_captures();
+    int64_t rows = all_inputs.size(0);
+    if (rows == 0) {
+        std::cout << "PHASM: No captures to train on" << std::endl;
+        return;
+    }
 
-    std::vector<std::pair<torch::Tensor, torch::Tensor>> batches;
-    // For now each batch contains a single sample
+    // Hold out a random subset of the captures for validation
+    int64_t validation_rows = static_cast<int64_t>(rows * options.validation_fraction);
+    torch::Tensor permutation = torch::randperm(rows, torch::kLong);
+    torch::Tensor validation_indices = permutation.slice(0, 0, validation_rows);
+    torch::Tensor training_indices = permutation.slice(0, validation_rows, rows);
+    torch::Tensor training_inputs = all_inputs.index_select(0, training_indices);
+    torch::Tensor training_outputs = all_outputs.index_select(0, training_indices);
+    torch::Tensor validation_inputs = all_inputs.index_select(0, validation_indices);
+    torch::Tensor validation_outputs = all_outputs.index_select(0, validation_indices);
+    int64_t training_rows = training_inputs.size(0);
 
-    for (size_t i=0; i<get_capture_count(); ++i) {
-        std::vector<torch::Tensor> sample_inputs;
-        for (auto input : m_inputs) {
-            sample_inputs.push_back(to_torch_tensor(input->training_inputs[i]));
+    std::unique_ptr<torch::optim::Optimizer> optimizer;
+    if (options.optimizer == TrainingOptions::Optimizer::Adam) {
+        optimizer = std::make_unique<torch::optim::Adam>(m_network->parameters(), torch::optim::AdamOptions(options.learning_rate));
+    }
+    else {
+        optimizer = std::make_unique<torch::optim::SGD>(m_network->parameters(), torch::optim::SGDOptions(options.learning_rate));
+    }
+
+    std::cout << "PHASM: Training on " << training_rows << " captures, validating on " << validation_rows
+              << ", batch size " << options.batch_size << std::endl;
+
+    double best_validation_loss = std::numeric_limits<double>::max();
+    std::vector<torch::Tensor> best_parameters;
+    size_t epochs_without_improvement = 0;
+    int64_t batch_size = static_cast<int64_t>(options.batch_size);
+
+    for (size_t epoch = 1; epoch <= options.max_epochs; ++epoch) {
+        auto start = std::chrono::steady_clock::now();
+        m_network->train();
+        torch::Tensor shuffled = torch::randperm(training_rows, torch::kLong);
+        double training_loss = 0;
+
+        for (int64_t batch_start = 0; batch_start < training_rows; batch_start += batch_size) {
+            torch::Tensor batch_indices = shuffled.slice(0, batch_start, std::min(batch_start + batch_size, training_rows));
+            torch::Tensor batch_inputs = training_inputs.index_select(0, batch_indices);
+            torch::Tensor batch_outputs = training_outputs.index_select(0, batch_indices);
+
+            optimizer->zero_grad();
+            torch::Tensor prediction = m_network->forward(batch_inputs);
+            torch::Tensor loss = torch::mse_loss(prediction, batch_outputs);
+            loss.backward();
+            optimizer->step();
+            training_loss += loss.item<double>() * batch_indices.size(0);
         }
-        auto sample_input = flatten_and_join(std::move(sample_inputs));
+        training_loss /= training_rows;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "PHASM: Epoch " << epoch << " | Training loss: " << training_loss;
+        if (validation_rows > 0) {
+            torch::NoGradGuard no_grad;
+            m_network->eval();
+            double validation_loss = torch::mse_loss(m_network->forward(validation_inputs), validation_outputs).item<double>();
+            std::cout << " | Validation loss: " << validation_loss;
 
-        std::vector<torch::Tensor> sample_outputs;
-        for (auto output : m_outputs) {
-            sample_outputs.push_back(to_torch_tensor(output->training_outputs[i]));
+            if (validation_loss < best_validation_loss) {
+                best_validation_loss = validation_loss;
+                epochs_without_improvement = 0;
+                best_parameters.clear();
+                for (const auto& p : m_network->parameters()) {
+                    best_parameters.push_back(p.detach().clone());
+                }
+                if (!options.checkpoint_path.empty()) {
+                    torch::save(m_network, options.checkpoint_path);
+                }
+            }
+            else {
+                epochs_without_improvement += 1;
+            }
         }
-        auto sample_output = flatten_and_join(std::move(sample_outputs));
-
-        batches.push_back({sample_input, sample_output});
-    }
-
-
-    // Train on each batch
-    for (size_t epoch = 1; epoch <= 10; ++epoch) {
-        size_t batch_index = 0;
-        // Iterate the data loader to yield batches from the dataset.
-        for (const auto& batch: batches) {
-            // Reset gradients.
-            optimizer.zero_grad();
-            // Execute the model on the input data.
-            torch::Tensor prediction = m_network->forward(batch.first);
-            // Compute a loss value to judge the prediction of our model.
-            // std::cout << "prediction" << std::endl << prediction.dtype() << std::endl;
-            // std::cout << "actual" << std::endl << batch.second.dtype() << std::endl;
-            torch::Tensor loss = torch::mse_loss(prediction, batch.second);
-            // Compute gradients of the loss w.r.t. the parameters of our model.
-            loss.backward();
-            // Update the parameters based on the calculated gradients.
-            optimizer.step();
-            // Output the loss and checkpoint every 100 batches.
-            if (++batch_index % 100 == 0) {
-                std::cout << "Epoch: " << epoch << " | Batch: " << batch_index
-                          << " | Loss: " << loss.item<float>() << std::endl;
-                // Serialize your model periodically as a checkpoint.
-                torch::save(m_network, "net.pt");
+        else if (!options.checkpoint_path.empty()) {
+            torch::save(m_network, options.checkpoint_path);
+        }
+        std::cout << " | " << static_cast<int64_t>(training_rows / seconds) << " samples/sec" << std::endl;
+
+        if (validation_rows > 0 && epochs_without_improvement >= options.patience) {
+            std::cout << "PHASM: Stopping early; validation loss hasn't improved for " << options.patience << " epochs" << std::endl;
+            break;
+        }
+    }
+
+    // Roll back to the weights with the lowest validation loss
+    if (!best_parameters.empty()) {
+        torch::NoGradGuard no_grad;
+        auto parameters = m_network->parameters();
+        for (size_t i=0; i<parameters.size(); ++i) {
+            parameters[i].copy_(best_parameters[i]);
+        }
+    }
+    m_network->eval();
+
+    // The network only makes sense together with the normalizations it was trained on
+    if (!options.checkpoint_path.empty()) {
+        std::ofstream normalization_file(options.checkpoint_path + ".norm");
+        save_normalizations(normalization_file);
+    }
+
+    if (m_quantization == Quantization::DynamicInt8) {
+        // Without a validation set, the best we can do is report the accuracy on the training set
+        if (validation_rows > 0) {
+            quantize(training_inputs, validation_inputs, validation_outputs);
+        }
+        else {
+            quantize(training_inputs, training_inputs, training_outputs);
+        }
+    }
+}
+
+
+void phasm::FeedForwardModel::quantize(const torch::Tensor& training_inputs, const torch::Tensor& validation_inputs,
+                                       const torch::Tensor& validation_outputs) {
+    std::vector<QuantizedLinear> layers;
+    layers.emplace_back(m_network->m_input_layer->weight, m_network->m_input_layer->bias, true);
+    layers.emplace_back(m_network->m_middle_layer->weight, m_network->m_middle_layer->bias, true);
+    layers.emplace_back(m_network->m_output_layer->weight, m_network->m_output_layer->bias, false);
+    m_quantized_network = std::make_unique<QuantizedMLP>(std::move(layers));
+    m_quantized_network->calibrate(training_inputs);
+    std::cout << m_quantized_network->evaluate(validation_inputs, validation_outputs);
+}
+
+
+void phasm::FeedForwardModel::train_online() {
+    if (!m_online_thread.joinable()) {
+        if (should_fit_normalizations()) {
+            // Keep the captures until there are enough to fit the normalizations on. They are packed into the rows
+            // we train on, so they have to stay frozen once training starts, even at exit.
+            if (get_capture_count() < m_training_options.online_normalization_window) return;
+            fit_normalizations();
+            m_trains_from_scratch = false;
+        }
+        if (!m_training_options.checkpoint_path.empty()) {
+            std::ofstream normalization_file(m_training_options.checkpoint_path + ".norm");
+            save_normalizations(normalization_file);
+        }
+        m_online_queue = std::make_unique<BoundedQueue<std::vector<float>>>(m_training_options.online_queue_capacity);
+        m_online_thread = std::thread(&FeedForwardModel::run_online_training, this);
+    }
+    // The trainer may be replacing m_network concurrently, but the dimensions never change
+    std::shared_ptr<FeedForwardNetwork> network = std::atomic_load(&m_network);
+    int64_t input_dim = network->m_dim0;
+    int64_t output_dim = network->m_dim3;
+    std::vector<float> row(input_dim + output_dim);
+    std::vector<const phasm::tensor*> sample_inputs;
+    std::vector<const phasm::tensor*> sample_outputs;
+    for (size_t i=0; i<get_capture_count(); ++i) {
+        sample_inputs.clear();
+        sample_outputs.clear();
+        for (const auto& input : m_inputs) sample_inputs.push_back(&input->training_inputs[i]);
+        for (const auto& output : m_outputs) sample_outputs.push_back(&output->training_outputs[i]);
+        flatten_and_join_into(sample_inputs, m_input_normalizations, row.data(), input_dim);
+        flatten_and_join_into(sample_outputs, m_output_normalizations, row.data() + input_dim, output_dim);
+        m_online_queue->try_push(std::vector<float>(row));
+    }
+    // The trainer has its own copy now, so we don't let the captures pile up
+    discard_captures();
+}
+
+bool phasm::FeedForwardModel::is_online_training_converged() {
+    return m_online_converged.load(std::memory_order_relaxed);
+}
+
+std::shared_ptr<phasm::FeedForwardModel::FeedForwardNetwork> phasm::FeedForwardModel::copy_network(FeedForwardNetwork& source) {
+    auto copy = std::make_shared<FeedForwardNetwork>(source.m_dim0, source.m_dim1, source.m_dim2, source.m_dim3);
+    torch::NoGradGuard no_grad;
+    auto source_parameters = source.parameters();
+    auto copy_parameters = copy->parameters();
+    for (size_t i=0; i<source_parameters.size(); ++i) {
+        copy_parameters[i].copy_(source_parameters[i]);
+    }
+    copy->eval();
+    return copy;
+}
+
+void phasm::FeedForwardModel::run_online_training() {
+    const TrainingOptions& options = m_training_options;
+    int64_t input_dim = m_network->m_dim0;
+    int64_t output_dim = m_network->m_dim3;
+    int64_t row_length = input_dim + output_dim;
+
+    // The shadow network starts out as a copy of the serving network, and is only ever touched by this thread
+    auto shadow = copy_network(*std::atomic_load(&m_network));
+    shadow->train();
+    std::unique_ptr<torch::optim::Optimizer> optimizer;
+    if (options.optimizer == TrainingOptions::Optimizer::Adam) {
+        optimizer = std::make_unique<torch::optim::Adam>(shadow->parameters(), torch::optim::AdamOptions(options.learning_rate));
+    }
+    else {
+        optimizer = std::make_unique<torch::optim::SGD>(shadow->parameters(), torch::optim::SGDOptions(options.learning_rate));
+    }
+
+    std::vector<float> validation_rows;
+    std::vector<float> batch_rows;
+    size_t batches_since_swap = 0;
+    size_t total_samples = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<float> row;
+
+    while (true) {
+        bool got_row = m_online_queue->pop_for(row, std::chrono::milliseconds(100));
+        if (!got_row) {
+            // pop_for only returns false on a closed queue once it has been drained
+            if (m_online_queue->is_closed()) break;
+            continue;
+        }
+        if (validation_rows.size() < options.online_validation_size * row_length) {
+            validation_rows.insert(validation_rows.end(), row.begin(), row.end());
+            continue;
+        }
+        batch_rows.insert(batch_rows.end(), row.begin(), row.end());
+        if (batch_rows.size() < options.batch_size * row_length) continue;
+
+        // from_blob doesn't copy; batch_rows outlives the tensors below
+        int64_t batch_size = batch_rows.size() / row_length;
+        torch::Tensor batch = torch::from_blob(batch_rows.data(), {batch_size, row_length}, torch::kFloat32);
+        optimizer->zero_grad();
+        torch::Tensor loss = torch::mse_loss(shadow->forward(batch.slice(1, 0, input_dim)), batch.slice(1, input_dim, row_length));
+        loss.backward();
+        optimizer->step();
+        batch_rows.clear();
+        total_samples += batch_size;
+
+        if (++batches_since_swap < options.online_swap_interval) continue;
+        batches_since_swap = 0;
+
+        publish_online_network(*shadow);
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "PHASM: Online training | " << total_samples << " samples | " << static_cast<int64_t>(total_samples / seconds)
+                  << " samples/sec | " << m_online_queue->get_dropped_count() << " dropped";
+        if (!validation_rows.empty()) {
+            torch::NoGradGuard no_grad;
+            int64_t validation_size = validation_rows.size() / row_length;
+            torch::Tensor validation = torch::from_blob(validation_rows.data(), {validation_size, row_length}, torch::kFloat32);
+            shadow->eval();
+            double validation_loss = torch::mse_loss(shadow->forward(validation.slice(1, 0, input_dim)),
+                                                     validation.slice(1, input_dim, row_length)).item<double>();
+            shadow->train();
+            std::cout << " | Validation loss: " << validation_loss;
+            if (options.online_convergence_threshold > 0 && validation_loss < options.online_convergence_threshold) {
+                m_online_converged = true;
             }
         }
+        std::cout << std::endl;
+    }
+    // Don't lose whatever we learned since the last swap
+    if (total_samples > 0) {
+        publish_online_network(*shadow);
     }
 }
 
+void phasm::FeedForwardModel::publish_online_network(FeedForwardNetwork& shadow) {
+    // Callers of infer() pick up the new network on their next call
+    auto published = copy_network(shadow);
+    std::atomic_store(&m_network, published);
+    weights_changed();
+    // The normalizations were saved next to it when online training started
+    if (!m_training_options.checkpoint_path.empty()) {
+        torch::save(published, m_training_options.checkpoint_path);
+    }
+}
+
+
+void phasm::FeedForwardModel::FeedForwardNetwork::forward_into(const torch::Tensor& x, torch::Tensor& hidden1,
+                                                               torch::Tensor& hidden2, torch::Tensor& out) {
+    // Each layer computes bias + weight*x directly into its buffer, followed by an in-place relu for the hidden layers
+    torch::addmv_out(hidden1, m_input_layer->bias, m_input_layer->weight, x).relu_();
+    torch::addmv_out(hidden2, m_middle_layer->bias, m_middle_layer->weight, hidden1).relu_();
+    torch::addmv_out(out, m_output_layer->bias, m_output_layer->weight, hidden2);
+}
 
 torch::Tensor phasm::FeedForwardModel::FeedForwardNetwork::forward(torch::Tensor x) {
     x = torch::relu(m_input_layer->forward(x));
     // x = torch::dropout(x, /*p=*/0.5, /*train=*/is_training());
     x = torch::relu(m_middle_layer->forward(x));
-    x = torch::relu(m_output_layer->forward(x));
+    // No relu on the output: normalized targets are negative about half of the time
+    x = m_output_layer->forward(x);
     return x;
 }
 
@@ -0,0 +1,192 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "quantized_mlp.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace phasm {
+
+QuantizedLinear::QuantizedLinear(const torch::Tensor& weight, const torch::Tensor& bias_tensor, bool relu)
+    : relu(relu) {
+
+    float_weight = weight.detach().to(torch::kCPU, torch::kFloat32).contiguous().clone();
+    out_features = float_weight.size(0);
+    in_features = float_weight.size(1);
+    float_bias = bias_tensor.defined()
+                 ? bias_tensor.detach().to(torch::kCPU, torch::kFloat32).contiguous().clone()
+                 : torch::zeros({out_features}, torch::kFloat32);
+
+    weights.resize(out_features * in_features);
+    weight_scales.resize(out_features);
+    bias.assign(float_bias.data_ptr<float>(), float_bias.data_ptr<float>() + out_features);
+
+    const float* w = float_weight.data_ptr<float>();
+    for (int64_t o=0; o<out_features; ++o) {
+        const float* row = w + o*in_features;
+        float max_abs = 0;
+        for (int64_t i=0; i<in_features; ++i) {
+            max_abs = std::max(max_abs, std::abs(row[i]));
+        }
+        float scale = (max_abs == 0) ? 1.0f : max_abs / 127.0f;
+        weight_scales[o] = scale;
+        for (int64_t i=0; i<in_features; ++i) {
+            weights[o*in_features + i] = static_cast<int8_t>(std::lround(row[i] / scale));
+        }
+    }
+}
+
+
+void QuantizedLinear::forward(const float* x, float* y, int8_t* scratch) const {
+    float scale = input_scale;
+    if (scale == 0) {
+        float max_abs = 0;
+        for (int64_t i=0; i<in_features; ++i) {
+            max_abs = std::max(max_abs, std::abs(x[i]));
+        }
+        scale = (max_abs == 0) ? 1.0f : max_abs / 127.0f;
+    }
+    float inverse_scale = 1.0f / scale;
+    for (int64_t i=0; i<in_features; ++i) {
+        // Calibrated scales can be exceeded, so we saturate rather than wrap
+        float q = std::nearbyint(x[i] * inverse_scale);
+        scratch[i] = static_cast<int8_t>(std::min(127.0f, std::max(-127.0f, q)));
+    }
+
+    // The compiler vectorizes this inner loop (widening multiply-add into int32), which is the whole point:
+    // we read a quarter of the bytes a float GEMV would
+    for (int64_t o=0; o<out_features; ++o) {
+        const int8_t* row = weights.data() + o*in_features;
+        int32_t acc = 0;
+        for (int64_t i=0; i<in_features; ++i) {
+            acc += static_cast<int32_t>(row[i]) * static_cast<int32_t>(scratch[i]);
+        }
+        float result = static_cast<float>(acc) * scale * weight_scales[o] + bias[o];
+        y[o] = (relu && result < 0) ? 0 : result;
+    }
+}
+
+
+std::ostream& operator<<(std::ostream& os, const QuantizationReport& report) {
+    os << "PHASM: Quantization report over " << report.samples << " samples" << std::endl;
+    os << "  Weights:          " << report.float_weight_bytes << " bytes as float, "
+       << report.quantized_weight_bytes << " bytes as int8" << std::endl;
+    os << "  MSE (float):      " << report.float_mse << std::endl;
+    os << "  MSE (int8):       " << report.quantized_mse << std::endl;
+    os << "  Max |float-int8|: " << report.max_abs_deviation << std::endl;
+    return os;
+}
+
+
+QuantizedMLP::QuantizedMLP(std::vector<QuantizedLinear> layers) : m_layers(std::move(layers)) {
+    if (m_layers.empty()) {
+        throw std::runtime_error("QuantizedMLP needs at least one layer");
+    }
+    int64_t widest = 0;
+    for (size_t i=0; i<m_layers.size(); ++i) {
+        if (i > 0 && m_layers[i].in_features != m_layers[i-1].out_features) {
+            throw std::runtime_error("QuantizedMLP: Layer dimensions don't chain");
+        }
+        widest = std::max({widest, m_layers[i].in_features, m_layers[i].out_features});
+    }
+    m_activations[0].resize(widest);
+    m_activations[1].resize(widest);
+    m_scratch.resize(widest);
+}
+
+
+void QuantizedMLP::forward(const float* input, float* output) {
+    const float* x = input;
+    for (size_t i=0; i<m_layers.size(); ++i) {
+        float* y = (i+1 == m_layers.size()) ? output : m_activations[i % 2].data();
+        m_layers[i].forward(x, y, m_scratch.data());
+        x = y;
+    }
+}
+
+
+torch::Tensor QuantizedMLP::forward(const torch::Tensor& inputs) {
+    torch::Tensor x = inputs.to(torch::kFloat32).contiguous();
+    int64_t rows = x.size(0);
+    torch::Tensor outputs = torch::empty({rows, get_output_dim()}, torch::kFloat32);
+    for (int64_t r=0; r<rows; ++r) {
+        forward(x.data_ptr<float>() + r*get_input_dim(), outputs.data_ptr<float>() + r*get_output_dim());
+    }
+    return outputs;
+}
+
+
+torch::Tensor QuantizedMLP::forward_float(const torch::Tensor& inputs) const {
+    torch::NoGradGuard no_grad;
+    torch::Tensor x = inputs.to(torch::kFloat32);
+    for (const auto& layer : m_layers) {
+        x = torch::addmm(layer.float_bias, x, layer.float_weight.t());
+        if (layer.relu) x = x.relu();
+    }
+    return x;
+}
+
+
+void QuantizedMLP::calibrate(const torch::Tensor& inputs, double percentile) {
+    torch::NoGradGuard no_grad;
+    torch::Tensor x = inputs.to(torch::kFloat32);
+    for (auto& layer : m_layers) {
+        torch::Tensor magnitudes = x.abs().flatten();
+        int64_t k = std::max<int64_t>(1, static_cast<int64_t>(std::ceil(percentile * magnitudes.numel())));
+        float range = std::get<0>(magnitudes.kthvalue(std::min(k, magnitudes.numel()))).item<float>();
+        layer.input_scale = (range == 0) ? 1.0f : range / 127.0f;
+
+        x = torch::addmm(layer.float_bias, x, layer.float_weight.t());
+        if (layer.relu) x = x.relu();
+    }
+}
+
+
+void QuantizedMLP::clear_calibration() {
+    for (auto& layer : m_layers) {
+        layer.input_scale = 0;
+    }
+}
+
+
+QuantizationReport QuantizedMLP::evaluate(const torch::Tensor& inputs, const torch::Tensor& expected_outputs) {
+    QuantizationReport report;
+    report.samples = inputs.size(0);
+    for (const auto& layer : m_layers) {
+        report.float_weight_bytes += layer.float_weight.numel() * sizeof(float);
+        report.quantized_weight_bytes += layer.weights.size() + layer.weight_scales.size() * sizeof(float);
+    }
+    torch::Tensor expected = expected_outputs.to(torch::kFloat32).reshape({report.samples, get_output_dim()});
+    torch::Tensor float_outputs = forward_float(inputs);
+    torch::Tensor quantized_outputs = forward(inputs);
+    report.float_mse = torch::mse_loss(float_outputs, expected).item<double>();
+    report.quantized_mse = torch::mse_loss(quantized_outputs, expected).item<double>();
+    report.max_abs_deviation = (float_outputs - quantized_outputs).abs().max().item<double>();
+    return report;
+}
+
+
+void QuantizedMLP::save_calibration(std::ostream& os) const {
+    for (const auto& layer : m_layers) {
+        os << layer.input_scale << std::endl;
+    }
+}
+
+
+bool QuantizedMLP::load_calibration(std::istream& is) {
+    std::vector<float> scales;
+    float scale;
+    while (is >> scale) {
+        scales.push_back(scale);
+    }
+    if (scales.size() != m_layers.size()) return false;
+    for (size_t i=0; i<m_layers.size(); ++i) {
+        m_layers[i].input_scale = scales[i];
+    }
+    return true;
+}
+
+} // namespace phasm
@@ -0,0 +1,87 @@
+
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+#include "stacked_ensemble.h"
+
+#include <stdexcept>
+#include <string>
+
+namespace phasm {
+
+StackedEnsemble::StackedEnsemble(const std::vector<std::vector<LinearLayerWeights>>& members, torch::Device device) {
+    if (members.empty() || members[0].empty()) {
+        throw std::runtime_error("StackedEnsemble: Needs at least one member with at least one layer");
+    }
+    m_members = static_cast<int64_t>(members.size());
+    size_t layer_count = members[0].size();
+    for (const auto& member : members) {
+        if (member.size() != layer_count) {
+            throw std::runtime_error("StackedEnsemble: Members have different numbers of layers");
+        }
+    }
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(device);
+    int64_t previous_out = -1;
+    for (size_t l=0; l<layer_count; ++l) {
+        const LinearLayerWeights& first = members[0][l];
+        int64_t out_features = first.weight.size(0);
+        int64_t in_features = first.weight.size(1);
+        if (previous_out >= 0 && in_features != previous_out) {
+            throw std::runtime_error("StackedEnsemble: Layer " + std::to_string(l) + " takes " + std::to_string(in_features) +
+                                     " inputs, but the layer before it has " + std::to_string(previous_out) + " outputs");
+        }
+        std::vector<torch::Tensor> weights, biases;
+        for (const auto& member : members) {
+            const LinearLayerWeights& layer = member[l];
+            if (layer.weight.dim() != 2 || layer.weight.size(0) != out_features || layer.weight.size(1) != in_features ||
+                layer.relu != first.relu) {
+                throw std::runtime_error("StackedEnsemble: Members differ in the shape of layer " + std::to_string(l));
+            }
+            weights.push_back(layer.weight.detach().to(torch::kCPU, torch::kFloat32).t());
+            biases.push_back(layer.bias.defined()
+                             ? layer.bias.detach().to(torch::kCPU, torch::kFloat32).reshape({1, out_features})
+                             : torch::zeros({1, out_features}, torch::kFloat32));
+        }
+        Layer stacked;
+        stacked.weight_t = torch::stack(weights).contiguous().to(options);
+        stacked.bias = torch::stack(biases).contiguous().to(options);
+        stacked.output = torch::empty({m_members, 1, out_features}, options);
+        stacked.relu = first.relu;
+        m_layers.push_back(std::move(stacked));
+        previous_out = out_features;
+    }
+    m_input_dim = m_layers.front().weight_t.size(1);
+}
+
+
+torch::Tensor StackedEnsemble::forward(const torch::Tensor& input) {
+    // Every member sees the same input, so the batch dimension is a stride-0 view rather than K copies
+    torch::Tensor x = input.reshape({1, 1, m_input_dim}).expand({m_members, 1, m_input_dim});
+    for (auto& layer : m_layers) {
+        at::baddbmm_out(layer.output, layer.bias, x, layer.weight_t);
+        if (layer.relu) layer.output.relu_();
+        x = layer.output;
+    }
+    return x.view({m_members, x.size(2)});
+}
+
+
+void ensemble_mean_and_variance(const float* members, int64_t k, int64_t n, float* mean, float* variance) {
+    for (int64_t j=0; j<n; ++j) {
+        mean[j] = 0;
+        variance[j] = 0;
+    }
+    for (int64_t i=0; i<k; ++i) {
+        for (int64_t j=0; j<n; ++j) mean[j] += members[i*n + j];
+    }
+    for (int64_t j=0; j<n; ++j) mean[j] /= float(k);
+    for (int64_t i=0; i<k; ++i) {
+        for (int64_t j=0; j<n; ++j) {
+            float diff = members[i*n + j] - mean[j];
+            variance[j] += diff * diff;
+        }
+    }
+    for (int64_t j=0; j<n; ++j) variance[j] /= float(k);
+}
+
+} // namespace phasm
@@ -12,10 +12,10 @@ struct TorchPlugin : public phasm::Plugin {
 
     std::shared_ptr<phasm::Model> make_model(std::string file_name) override {
         if (file_name.empty()) {
-            return std::make_shared<phasm::FeedForwardModel>();
+            return std::make_shared<phasm::FeedForwardModel>(phasm::TrainingOptions::from_env());
         }
         else {
-            return std::make_shared<phasm::TorchscriptModel>(file_name);
+            return std::make_shared<phasm::TorchscriptModel>(file_name, false, torch::kCPU, phasm::TorchscriptOptions::from_env());
         }
     }
 };
@@ -2,56 +2,39 @@
 // Copyright 2022, Jefferson Science Associates, LLC.
 // Subject to the terms in the LICENSE file found in the top-level directory.
 #include "torch_tensor_utils.h"
+#include <dtype_conversion.h>
 
 namespace phasm {
 
-template <typename T>
-torch::Tensor to_torch_tensor_typed(const phasm::tensor& t) {
-    const T* data = t.get_data<T>();
-    int64_t length = t.get_length();
-    auto result = torch::tensor(at::ArrayRef<T>(data,length));
-    result = result.reshape(t.get_shape());
-    return result;
+torch::Tensor to_torch_tensor(phasm::tensor& t) {
+    torch::Dtype dtype = to_torch_dtype(t.get_dtype());
+    // from_blob doesn't copy and doesn't take ownership, so the phasm::tensor has to outlive the result.
+    // The phasm::tensor is always contiguous, so no strides are needed.
+    return torch::from_blob(t.get_data<void>(), t.get_shape(), torch::TensorOptions().dtype(dtype));
 }
 
 torch::Tensor to_torch_tensor(const phasm::tensor& t) {
-    switch(t.get_dtype()) {
-        case DType::UI8: return to_torch_tensor_typed<uint8_t>(t);
-        case DType::I16: return to_torch_tensor_typed<int16_t>(t);
-        case DType::I32: return to_torch_tensor_typed<int32_t>(t);
-        case DType::I64: return to_torch_tensor_typed<int64_t>(t);
-        case DType::F32: return to_torch_tensor_typed<float>(t);
-        case DType::F64: return to_torch_tensor_typed<double>(t);
-        default: throw std::runtime_error("Undefined tensor");
-    }
+    // Torch has no read-only tensors, so the only way to keep in-place ops (e.g. x.relu_()) off t is a copy
+    return to_torch_tensor(const_cast<phasm::tensor&>(t)).clone();
 }
 
-template <typename T>
-phasm::tensor to_phasm_tensor_typed(const torch::Tensor& t) {
-
-    T* torch_data = t.data_ptr<T>();
-    int64_t length = t.numel();
-    T* phasm_data = new T[length];
-    for (int64_t i=0; i<length; ++i) {
-        phasm_data[i] = torch_data[i];
+phasm::tensor to_phasm_tensor(const torch::Tensor& t) {
+    phasm::DType dtype = to_phasm_dtype(t.dtype().toScalarType());
+    if (dtype == phasm::DType::Undefined) {
+        throw std::runtime_error("Torch tensor has invalid or incompatible dtype!");
     }
-    size_t dims = t.dim();
-    std::vector<int64_t> phasm_dims;
-    for (size_t dim=0; dim<dims; ++dim) {
-        phasm_dims.push_back(t.size(dim));
+    // Only copy when we have to: to get the data onto the CPU, or to make a strided view contiguous.
+    // Otherwise the phasm::tensor adopts the torch storage directly, keeping it alive via the deleter.
+    torch::Tensor source = t;
+    if (!source.device().is_cpu()) {
+        source = source.to(torch::kCPU);
     }
-    return phasm::tensor(std::unique_ptr<T[]>(phasm_data), phasm_dims);
-}
-
-phasm::tensor to_phasm_tensor(const torch::Tensor& t) {
-    torch::Dtype dtype = t.dtype().toScalarType();
-    if (dtype == torch::kUInt8) return to_phasm_tensor_typed<uint8_t>(t);
-    if (dtype == torch::kInt16) return to_phasm_tensor_typed<int16_t>(t);
-    if (dtype == torch::kInt32) return to_phasm_tensor_typed<int32_t>(t);
-    if (dtype == torch::kInt64) return to_phasm_tensor_typed<int64_t>(t);
-    if (dtype == torch::kFloat32) return to_phasm_tensor_typed<float>(t);
-    if (dtype == torch::kFloat64) return to_phasm_tensor_typed<double>(t);
-    throw std::runtime_error("Torch tensor has invalid or incompatible dtype!");
+    if (!source.is_contiguous()) {
+        source = source.contiguous();
+    }
+    std::vector<int64_t> shape(source.sizes().begin(), source.sizes().end());
+    void* data = source.data_ptr();
+    return phasm::tensor(data, dtype, shape, [keep_alive = std::move(source)](void*) mutable { keep_alive.reset(); });
 }
 
 torch::Tensor flatten_and_join(std::vector<torch::Tensor> inputs) {
@@ -62,6 +45,29 @@ torch::Tensor flatten_and_join(std::vector<torch::Tensor> inputs) {
     return result;
 }
 
+torch::Tensor flatten_and_join(const std::vector<const phasm::tensor*>& inputs,
+                               const std::vector<const Normalization*>& normalizations) {
+    // Packs directly into a single float buffer using the SIMD conversion kernels, instead of creating
+    // one intermediate torch::Tensor per input and converting and concatenating them with torch ops.
+    // Normalization is folded into the same pass as a fused multiply-add.
+    int64_t total_length = 0;
+    for (const auto& input : inputs) {
+        total_length += input->get_length();
+    }
+    auto result = torch::empty({total_length}, torch::kFloat32);
+    flatten_and_join_into(inputs, normalizations, result.data_ptr<float>(), total_length);
+    return result;
+}
+
+phasm::tensor to_phasm_tensor(const torch::Tensor& t, const Normalization& normalization) {
+    if (!normalization.is_enabled()) {
+        return to_phasm_tensor(t);
+    }
+    torch::Tensor contiguous_floats = t.to(torch::kFloat32).contiguous();
+    std::vector<int64_t> shape(contiguous_floats.sizes().begin(), contiguous_floats.sizes().end());
+    return normalization.denormalize(contiguous_floats.data_ptr<float>(), shape);
+}
+
 std::vector<torch::Tensor> split_and_unflatten_outputs(torch::Tensor output,
                                                        const std::vector<int64_t>& output_lengths,
                                                        const std::vector<std::vector<int64_t>>& output_shapes) {
@@ -75,6 +81,18 @@ std::vector<torch::Tensor> split_and_unflatten_outputs(torch::Tensor output,
     return outputs;
 }
 
+torch::Dtype to_torch_dtype(phasm::DType t) {
+    switch (t) {
+        case DType::UI8: return torch::kUInt8;
+        case DType::I16: return torch::kInt16;
+        case DType::I32: return torch::kInt32;
+        case DType::I64: return torch::kInt64;
+        case DType::F32: return torch::kFloat32;
+        case DType::F64: return torch::kFloat64;
+        default: throw std::runtime_error("Undefined tensor");
+    }
+}
+
 phasm::DType to_phasm_dtype(torch::Dtype t) {
     if (t == torch::kUInt8) return phasm::DType::UI8;
     if (t == torch::kInt16) return phasm::DType::I16;
@@ -3,6 +3,16 @@
 
 #include "torchscript_model.h"
 #include "torch_tensor_utils.h"
+#include <torch/csrc/jit/ir/ir.h>
+#include <torch/csrc/jit/ir/constants.h>
+#include <algorithm>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
 
 namespace phasm {
 
@@ -20,9 +30,43 @@ void TorchscriptModel::LoadModule() {
     std::cerr << "PHASM: Loaded TorchScript model '" << m_filename << "'\n" << std::endl;
 }
 
-TorchscriptModel::TorchscriptModel(std::string filename, bool print_module_layers, torch::Device device) {
+TorchscriptOptions TorchscriptOptions::from_env() {
+    TorchscriptOptions options;
+    auto read_int = [](const char* name, long long default_value) {
+        const char* value = std::getenv(name);
+        return (value == nullptr) ? default_value : std::atoll(value);
+    };
+    options.optimize = read_int("PHASM_TORCH_OPTIMIZE", options.optimize) != 0;
+    options.intra_op_threads = static_cast<int>(read_int("PHASM_TORCH_INTRA_OP_THREADS", options.intra_op_threads));
+    options.inter_op_threads = static_cast<int>(read_int("PHASM_TORCH_INTER_OP_THREADS", options.inter_op_threads));
+    options.warmup_iterations = static_cast<size_t>(read_int("PHASM_TORCH_WARMUP_ITERATIONS", options.warmup_iterations));
+    options.latency_samples = static_cast<size_t>(read_int("PHASM_TORCH_LATENCY_SAMPLES", options.latency_samples));
+    const char* cache_dir = std::getenv("PHASM_TORCH_CACHE_DIR");
+    if (cache_dir != nullptr) options.cache_dir = cache_dir;
+    options.ensemble_size = static_cast<int64_t>(read_int("PHASM_TORCH_ENSEMBLE_SIZE", options.ensemble_size));
+    const char* max_variance = std::getenv("PHASM_TORCH_MAX_VARIANCE");
+    if (max_variance != nullptr) options.max_variance = std::strtof(max_variance, nullptr);
+    return options;
+}
+
+TorchscriptModel::TorchscriptModel(std::string filename, bool print_module_layers, torch::Device device,
+                                   TorchscriptOptions options) {
     m_filename = filename;
     m_device = device;
+    m_options = options;
+
+    // These are process-wide settings. The inter-op pool can only be sized before it is first used.
+    if (m_options.intra_op_threads > 0) {
+        at::set_num_threads(m_options.intra_op_threads);
+    }
+    if (m_options.inter_op_threads > 0) {
+        try {
+            at::set_num_interop_threads(m_options.inter_op_threads);
+        }
+        catch (const c10::Error &e) {
+            std::cerr << "PHASM: WARNING: Unable to set inter-op thread count; libtorch has already started its thread pool" << std::endl;
+        }
+    }
     TorchscriptModel::LoadModule();
 
     if (print_module_layers) {
@@ -30,16 +74,294 @@ TorchscriptModel::TorchscriptModel(std::string filename, bool print_module_layer
     }
 }
 
+bool TorchscriptModel::OptimizeModule() {
+    m_module.eval();
+    try {
+        m_module = torch::jit::freeze(m_module);
+        m_module = torch::jit::optimize_for_inference(m_module);
+    }
+    catch (const c10::Error &e) {
+        // Some modules (e.g. ones with training-only attributes or unsupported ops) can't be frozen.
+        // They still work fine unoptimized, so we don't treat this as fatal.
+        std::cerr << "PHASM: WARNING: Unable to optimize TorchScript model '" << m_filename << "' for inference" << std::endl;
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    std::cerr << "PHASM: Optimized TorchScript model '" << m_filename << "' for inference" << std::endl;
+    return true;
+}
+
+/// Freezes a copy of `module` and reads the weights out of its forward() graph, which has to be nothing but a chain
+/// of aten::linear and aten::relu ops, e.g. an nn.Sequential of Linear and ReLU layers. We skip the numerical
+/// optimizations, since they may rewrite aten::linear into something we don't recognize.
+/// @return an empty string on success, otherwise the reason why the module isn't such a chain.
+static std::string ExtractLinearChain(const torch::jit::Module& module, std::vector<LinearLayerWeights>& layers) {
+    layers.clear();
+    // Freezing inlines everything and turns the weights into constants, so that the graph is just a list of ops.
+    torch::jit::Module frozen;
+    try {
+        frozen = module.clone();
+        frozen.eval();
+        frozen = torch::jit::freeze(frozen, c10::nullopt, false);
+    }
+    catch (const c10::Error &e) {
+        return std::string("freezing failed: ") + e.what();
+    }
+    auto graph = frozen.get_method("forward").graph();
+    if (graph->inputs().size() != 2 || graph->outputs().size() != 1) {
+        return "forward() has to take a single tensor and return a single tensor";
+    }
+
+    // Follow the data flow from the input through each op, making sure that it really is a chain
+    torch::jit::Value* current = graph->inputs()[1];
+    for (torch::jit::Node* node : graph->nodes()) {
+        auto kind = node->kind();
+        if (kind == c10::prim::Constant) continue;
+        if (node->inputs().empty() || node->input(0) != current) {
+            return std::string("unsupported data flow at ") + kind.toQualString();
+        }
+        if (kind == c10::aten::linear) {
+            auto weight = torch::jit::toIValue(node->input(1));
+            auto bias = torch::jit::toIValue(node->input(2));
+            if (!weight || !weight->isTensor()) return "linear layer with non-constant weight";
+            layers.push_back({weight->toTensor(), (bias && bias->isTensor()) ? bias->toTensor() : torch::Tensor(), false});
+        }
+        else if ((kind == c10::aten::relu || kind == c10::aten::relu_) && !layers.empty() && !layers.back().relu) {
+            layers.back().relu = true;
+        }
+        else {
+            return std::string("unsupported op ") + kind.toQualString();
+        }
+        current = node->output();
+    }
+    if (layers.empty() || graph->outputs()[0] != current) {
+        return "forward() doesn't return the output of its last layer";
+    }
+    return "";
+}
+
+bool TorchscriptModel::QuantizeModule() {
+    auto fail = [&](const std::string& reason) {
+        std::cerr << "PHASM: WARNING: Unable to quantize TorchScript model '" << m_filename << "': " << reason << std::endl;
+        std::cerr << "  Falling back to float inference" << std::endl;
+        return false;
+    };
+    if (!m_combine_tensors) return fail("quantization requires tensor combining");
+    if (!m_device.is_cpu()) return fail("quantization is only supported on the CPU");
+
+    std::vector<LinearLayerWeights> chain;
+    std::string reason = ExtractLinearChain(m_module, chain);
+    if (!reason.empty()) return fail(reason);
+    std::vector<QuantizedLinear> layers;
+    for (const auto& layer : chain) {
+        layers.emplace_back(layer.weight, layer.bias, layer.relu);
+    }
+    try {
+        m_quantized_module = std::make_unique<QuantizedMLP>(std::move(layers));
+    }
+    catch (std::exception& e) {
+        return fail(e.what());
+    }
+    // forward() reads get_input_dim() floats straight out of m_input_buffer, so this has to match exactly
+    if (m_quantized_module->get_input_dim() != m_input_buffer.numel()) {
+        m_quantized_module = nullptr;
+        return fail("input dimension doesn't match the model variables");
+    }
+    if (m_quantized_module->get_output_dim() != m_all_outputs_dim) {
+        m_quantized_module = nullptr;
+        return fail("output dimension doesn't match the model variables");
+    }
+    m_quantized_output.resize(m_all_outputs_dim);
+
+    std::ifstream calibration_file(m_filename + ".int8");
+    if (calibration_file.good() && m_quantized_module->load_calibration(calibration_file)) {
+        std::cerr << "PHASM: Loaded int8 calibration from '" << m_filename << ".int8'" << std::endl;
+    }
+    std::cerr << "PHASM: Quantized TorchScript model '" << m_filename << "' to int8 ("
+              << m_quantized_module->get_layers().size() << " layers)" << std::endl;
+    return true;
+}
+
+void TorchscriptModel::SetUpEnsemble() {
+    if (m_options.ensemble_members.empty() && m_options.ensemble_size <= 0) return;
+    if (!m_combine_tensors) {
+        std::cerr << "PHASM: FATAL ERROR: TorchScript ensembles require tensor combining" << std::endl;
+        exit(1);
+    }
+    if (!m_options.ensemble_members.empty()) {
+        std::vector<std::vector<LinearLayerWeights>> members(1 + m_options.ensemble_members.size());
+        std::string reason = ExtractLinearChain(m_module, members[0]);
+        for (size_t i=0; i<m_options.ensemble_members.size() && reason.empty(); ++i) {
+            const std::string& member_filename = m_options.ensemble_members[i];
+            try {
+                reason = ExtractLinearChain(torch::jit::load(member_filename, torch::kCPU), members[i+1]);
+            }
+            catch (const c10::Error &e) {
+                reason = "unable to load '" + member_filename + "': " + e.what();
+            }
+        }
+        try {
+            if (reason.empty()) m_ensemble = std::make_unique<StackedEnsemble>(members, m_device);
+        }
+        catch (std::exception& e) {
+            reason = e.what();
+        }
+        if (!reason.empty()) {
+            std::cerr << "PHASM: FATAL ERROR: Unable to stack the ensemble members of '" << m_filename << "'" << std::endl;
+            std::cerr << "  " << reason << std::endl;
+            exit(1);
+        }
+        if (m_ensemble->get_input_dim() != m_input_buffer.numel() || m_ensemble->get_output_dim() != m_all_outputs_dim) {
+            std::cerr << "PHASM: FATAL ERROR: Ensemble maps " << m_ensemble->get_input_dim() << " inputs to "
+                      << m_ensemble->get_output_dim() << " outputs, but the model variables have "
+                      << m_input_buffer.numel() << " inputs and " << m_all_outputs_dim << " outputs" << std::endl;
+            exit(1);
+        }
+        m_ensemble_size = m_ensemble->get_member_count();
+        std::cerr << "PHASM: Stacked " << m_ensemble_size << " ensemble members of '" << m_filename << "'" << std::endl;
+    }
+    else {
+        m_ensemble_size = m_options.ensemble_size;
+    }
+
+    m_max_variance.clear();
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        auto it = m_max_variance_by_output.find(m_outputs[i]->name);
+        float max_variance = (it == m_max_variance_by_output.end()) ? m_options.max_variance : it->second;
+        m_max_variance.insert(m_max_variance.end(), m_output_lengths[i], max_variance);
+    }
+    m_ensemble_outputs.resize(m_ensemble_size * m_all_outputs_dim);
+    m_ensemble_mean.resize(m_all_outputs_dim);
+    m_ensemble_variance.resize(m_all_outputs_dim);
+}
+
+void TorchscriptModel::set_max_variance(const std::string& output_name, float max_variance) {
+    m_max_variance_by_output[output_name] = max_variance;
+}
+
+/// 64-bit FNV-1a. We only need to tell apart different versions of the same model file, not resist attacks.
+static uint64_t fnv1a_update(uint64_t hash, const char* data, size_t length) {
+    for (size_t i=0; i<length; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string TorchscriptModel::GetCachePath() {
+    if (m_options.cache_dir.empty()) return "";
+
+    uint64_t hash = 14695981039346656037ull;
+    std::ifstream file(m_filename, std::ios::binary);
+    char buffer[1 << 16];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        hash = fnv1a_update(hash, buffer, file.gcount());
+    }
+    // Everything else that affects the optimized graph goes into the key as well
+    std::ostringstream key;
+    key << "torch=" << TORCH_VERSION_MAJOR << "." << TORCH_VERSION_MINOR << "." << TORCH_VERSION_PATCH
+        << ";device=" << m_device.str()
+        << ";intra=" << m_options.intra_op_threads << ";inter=" << m_options.inter_op_threads
+        << ";combined=" << m_combine_tensors << ";shapes=";
+    for (const auto& input : m_inputs) {
+        for (int64_t dim : input->shape()) key << dim << ",";
+        key << ";";
+    }
+    std::string key_str = key.str();
+    hash = fnv1a_update(hash, key_str.data(), key_str.size());
+
+    std::ostringstream path;
+    path << m_options.cache_dir << "/" << std::filesystem::path(m_filename).stem().string() << "-"
+         << std::hex << std::setw(16) << std::setfill('0') << hash << ".pt";
+    return path.str();
+}
+
+bool TorchscriptModel::LoadCachedModule(const std::string& cache_path) {
+    if (cache_path.empty() || !std::filesystem::exists(cache_path)) return false;
+    try {
+        m_module = torch::jit::load(cache_path, m_device);
+    }
+    catch (const c10::Error &e) {
+        std::cerr << "PHASM: WARNING: Ignoring unreadable cached TorchScript model '" << cache_path << "'" << std::endl;
+        return false;
+    }
+    std::cerr << "PHASM: Loaded optimized TorchScript model from cache '" << cache_path << "'" << std::endl;
+    return true;
+}
+
+void TorchscriptModel::SaveCachedModule(const std::string& cache_path) {
+    if (cache_path.empty()) return;
+    // Write to a process-specific temporary file and rename it, so that concurrent processes never see half a file
+    std::string temp_path = cache_path + ".tmp" + std::to_string(getpid());
+    try {
+        std::filesystem::create_directories(m_options.cache_dir);
+        m_module.save(temp_path);
+        std::filesystem::rename(temp_path, cache_path);
+    }
+    catch (const std::exception &e) {
+        // c10::Error derives from std::exception. Some optimized graphs contain ops that can't be serialized.
+        std::cerr << "PHASM: WARNING: Unable to cache optimized TorchScript model to '" << cache_path << "'" << std::endl;
+        std::cerr << e.what() << std::endl;
+        std::error_code ignored;
+        std::filesystem::remove(temp_path, ignored);
+        return;
+    }
+    std::cerr << "PHASM: Cached optimized TorchScript model to '" << cache_path << "'" << std::endl;
+}
+
+std::vector<torch::jit::IValue> TorchscriptModel::MakeRepresentativeInputs() {
+    std::vector<torch::jit::IValue> inputs;
+    auto options = torch::TensorOptions().dtype(torch::kFloat32).device(m_device);
+    if (m_combine_tensors) {
+        inputs.push_back(torch::zeros({m_input_buffer.numel()}, options));
+    }
+    else {
+        for (const auto& input : m_inputs) {
+            std::vector<int64_t> shape = input->shape();
+            for (auto& dim : shape) {
+                if (dim < 0) dim = 1; // Ragged dimensions get a single row
+            }
+            inputs.push_back(torch::zeros(shape, options));
+        }
+    }
+    return inputs;
+}
+
+double TorchscriptModel::MeasureLatency(std::vector<torch::jit::IValue>& inputs, size_t samples) {
+    c10::InferenceMode guard(m_options.inference_mode);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<samples; ++i) {
+        if (m_ensemble != nullptr) {
+            m_ensemble->forward(inputs[0].toTensor());
+        }
+        else if (m_quantized_module != nullptr) {
+            m_quantized_module->forward(inputs[0].toTensor().data_ptr<float>(), m_quantized_output.data());
+        }
+        else {
+            m_module.forward(inputs);
+        }
+    }
+    if (m_device.is_cuda()) {
+        torch::cuda::synchronize();
+    }
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(finish - start).count() / samples;
+}
+
 TorchscriptModel::~TorchscriptModel() {
 }
 
 void TorchscriptModel::initialize() {
     // Compute flattened input and output dimensions from shapes
+    int64_t all_inputs_dim = 0;
     for (auto input: this->m_inputs) {
         int64_t n_elems = 1;
         for (int64_t len : input->shape()) {
             n_elems *= len;
         }
+        all_inputs_dim += n_elems;
+        m_input_tensors.push_back(&input->inference_input);
+        m_input_normalizations.push_back(&input->normalization);
     }
     for (auto output: this->m_outputs) {
         int64_t n_elems = 1;
@@ -49,6 +371,60 @@ void TorchscriptModel::initialize() {
             n_elems *= len;
         }
         m_output_lengths.push_back(n_elems);
+        m_all_outputs_dim += n_elems;
+        if (m_combine_tensors) {
+            output->inference_output = phasm::tensor(DType::F32, shape);
+        }
+    }
+    if (m_combine_tensors) {
+        // Allocate the input buffers once, so that infer() only ever writes into them. The IValue we pass to
+        // forward() shares the underlying storage, so it never needs to be rebuilt either.
+        m_input_buffer = torch::empty({all_inputs_dim}, torch::kFloat32);
+        m_device_input_buffer = m_device.is_cpu() ? m_input_buffer : torch::empty({all_inputs_dim}, torch::TensorOptions().dtype(torch::kFloat32).device(m_device));
+        m_forward_inputs.clear();
+        m_forward_inputs.push_back(m_device_input_buffer);
+    }
+    // If the model was trained with normalized inputs and outputs, the normalizations live next to the .pt file
+    std::ifstream normalization_file(m_filename + ".norm");
+    if (normalization_file.good()) {
+        load_normalizations(normalization_file);
+        std::cerr << "PHASM: Loaded normalizations from '" << m_filename << ".norm'" << std::endl;
+    }
+
+    SetUpEnsemble();
+    if (m_quantization == Quantization::DynamicInt8) {
+        if (m_ensemble_size > 0) {
+            std::cerr << "PHASM: WARNING: Ensembles aren't quantized; falling back to float inference" << std::endl;
+        }
+        else {
+            QuantizeModule();
+        }
+    }
+
+    // Now that we know the input shapes, we can optimize, warm up, and measure the module. A stacked ensemble or a
+    // quantized module replaces m_module in infer(), so there is no point in optimizing m_module then.
+    bool optimize = m_options.optimize && m_ensemble == nullptr && m_quantized_module == nullptr;
+    if (optimize || m_options.warmup_iterations > 0 || m_options.latency_samples > 0) {
+        auto inputs = MakeRepresentativeInputs();
+        double latency_before = 0;
+        if (m_options.latency_samples > 0) {
+            latency_before = MeasureLatency(inputs, m_options.latency_samples);
+        }
+        if (optimize) {
+            std::string cache_path = GetCachePath();
+            if (!LoadCachedModule(cache_path) && OptimizeModule()) {
+                SaveCachedModule(cache_path);
+            }
+        }
+        if (m_options.warmup_iterations > 0) {
+            MeasureLatency(inputs, m_options.warmup_iterations);
+        }
+        if (m_options.latency_samples > 0) {
+            double latency_after = MeasureLatency(inputs, m_options.latency_samples);
+            std::cerr << "PHASM: TorchScript model latency over " << m_options.latency_samples << " calls: "
+                      << latency_before << " us/call as loaded, " << latency_after << " us/call after"
+                      << (optimize ? " optimization and " : " ") << "warm-up" << std::endl;
+        }
     }
 }
 
@@ -58,38 +434,74 @@ torch::jit::script::Module& TorchscriptModel::get_module() {
 
 bool TorchscriptModel::infer() {
 
-    if (m_combine_tensors) {
-        std::vector<torch::Tensor> input_tensors;
-
-        for (const auto &input_model_var: m_inputs) {
-            input_tensors.push_back(to_torch_tensor(input_model_var->inference_input));
-        }
+    c10::InferenceMode guard(m_options.inference_mode);
 
+    if (m_combine_tensors) {
         // This all assumes a single Tensor of floats as input and output
-        torch::Tensor input = flatten_and_join(input_tensors).to(m_device); // located on m_device
-        std::vector<torch::jit::IValue> inputs;
-        inputs.push_back(input);
-        auto output = m_module.forward(inputs).toTensor().to(torch::kCPU);  // on CPU
-
-        std::vector<torch::Tensor> output_tensors = split_and_unflatten_outputs(output, m_output_lengths, m_output_shapes);
+        flatten_and_join_into(m_input_tensors, m_input_normalizations, m_input_buffer.data_ptr<float>(), m_input_buffer.numel());
+        if (m_quantized_module != nullptr) {
+            m_quantized_module->forward(m_input_buffer.data_ptr<float>(), m_quantized_output.data());
+            const float* output_data = m_quantized_output.data();
+            for (size_t i=0; i<m_outputs.size(); ++i) {
+                unpack_output_into(output_data, m_output_shapes[i], m_outputs[i]->normalization, m_outputs[i]->inference_output);
+                output_data += m_output_lengths[i];
+            }
+            return true;
+        }
+        if (!m_device.is_cpu()) {
+            m_device_input_buffer.copy_(m_input_buffer);
+        }
+        if (m_ensemble != nullptr) {
+            return InferEnsemble(m_ensemble->forward(m_device_input_buffer));
+        }
+        auto output = m_module.forward(m_forward_inputs).toTensor();
+        if (m_ensemble_size > 0) {
+            return InferEnsemble(output);
+        }
+        // These only copy if the module hands back something we can't read directly
+        if (!output.device().is_cpu()) output = output.to(torch::kCPU);
+        if (output.scalar_type() != torch::kFloat32) output = output.to(torch::kFloat32);
+        if (!output.is_contiguous()) output = output.contiguous();
 
-        assert(output_tensors.size() == m_outputs.size());
-        size_t i = 0;
-        for (const auto &output_model_var: m_outputs) {
-            output_model_var->inference_output = to_phasm_tensor(output_tensors[i++]);
+        if (output.numel() != m_all_outputs_dim) {
+            std::cerr << "PHASM: FATAL ERROR: Torchscript model output has wrong size" << std::endl;
+            std::cerr << "  Surrogate expects " << m_all_outputs_dim << std::endl;
+            std::cerr << "  PT file provides " << output.numel() << std::endl;
+            std::cerr << "  Filename is '" << m_filename << "'" << std::endl;
+            exit(1);
+        }
+        const float* output_data = output.data_ptr<float>();
+        for (size_t i=0; i<m_outputs.size(); ++i) {
+            unpack_output_into(output_data, m_output_shapes[i], m_outputs[i]->normalization, m_outputs[i]->inference_output);
+            output_data += m_output_lengths[i];
         }
     }
     else {
-        std::vector<torch::jit::IValue> inputs;
+        // clear() keeps the capacity, so this only allocates on the first call
+        m_forward_inputs.clear();
         for (const auto &input_model_var: m_inputs) {
-            inputs.push_back(to_torch_tensor(input_model_var->inference_input).to(m_device));
+            if (input_model_var->normalization.is_enabled()) {
+                // Normalizing has to produce a new float buffer anyway, so this doesn't cost an extra copy
+                torch::Tensor normalized = flatten_and_join({&input_model_var->inference_input}, {&input_model_var->normalization});
+                m_forward_inputs.push_back(normalized.reshape(input_model_var->inference_input.get_shape()).to(m_device));
+            }
+            else if (m_device.is_cpu()) {
+                // The module may modify its inputs in place, and the inference input may be read again afterwards,
+                // e.g. by the next stage of a CascadeModel
+                const tensor& input = input_model_var->inference_input;
+                m_forward_inputs.push_back(to_torch_tensor(input));
+            }
+            else {
+                // Moving to the device copies anyway
+                m_forward_inputs.push_back(to_torch_tensor(input_model_var->inference_input).to(m_device));
+            }
         }
 
-        auto output = m_module.forward(inputs);
+        auto output = m_module.forward(m_forward_inputs);
         if (output.isTensor()) {
 
             if (m_outputs.size() == 1) {
-                m_outputs[0]->inference_output = to_phasm_tensor(output.toTensor().to(torch::kCPU));
+                m_outputs[0]->inference_output = to_phasm_tensor(output.toTensor().to(torch::kCPU), m_outputs[0]->normalization);
             }
             else {
                 std::cerr << "PHASM: FATAL ERROR: Torchscript model outputs a single tensor when multiple expected" << std::endl;
@@ -109,7 +521,7 @@ bool TorchscriptModel::infer() {
             }
             size_t i = 0;
             for (const auto &output_model_var: m_outputs) {
-                output_model_var->inference_output = to_phasm_tensor(tuple->elements()[i++].toTensor().to(m_device));
+                output_model_var->inference_output = to_phasm_tensor(tuple->elements()[i++].toTensor().to(torch::kCPU), output_model_var->normalization);
             }
         }
         else {
@@ -121,7 +533,57 @@ bool TorchscriptModel::infer() {
         }
     }
 
-    // TODO: Figure out how to extract UQ info from model so that we can return false when appropriate
+    // Single models don't tell us how uncertain they are. Ensembles do; see InferEnsemble.
+    return true;
+}
+
+bool TorchscriptModel::infer_with_confidence(float& confidence) {
+    m_last_confidence = 1;
+    bool result = infer();
+    confidence = result ? m_last_confidence : 0;
+    return result;
+}
+
+bool TorchscriptModel::InferEnsemble(const torch::Tensor& member_outputs) {
+    torch::Tensor output = member_outputs;
+    if (!output.device().is_cpu()) output = output.to(torch::kCPU);
+    if (output.scalar_type() != torch::kFloat32) output = output.to(torch::kFloat32);
+    if (!output.is_contiguous()) output = output.contiguous();
+    if (output.numel() != m_ensemble_size * m_all_outputs_dim) {
+        std::cerr << "PHASM: FATAL ERROR: Torchscript ensemble output has wrong size" << std::endl;
+        std::cerr << "  Surrogate expects " << m_ensemble_size << " members x " << m_all_outputs_dim << std::endl;
+        std::cerr << "  PT file provides " << output.numel() << std::endl;
+        std::cerr << "  Filename is '" << m_filename << "'" << std::endl;
+        exit(1);
+    }
+
+    // Denormalize every member first, so that the variance is in the outputs' own units even for log normalizations
+    const float* source = output.data_ptr<float>();
+    float* dest = m_ensemble_outputs.data();
+    for (int64_t k=0; k<m_ensemble_size; ++k) {
+        for (size_t i=0; i<m_outputs.size(); ++i) {
+            m_outputs[i]->normalization.denormalize(source, dest, m_output_lengths[i]);
+            source += m_output_lengths[i];
+            dest += m_output_lengths[i];
+        }
+    }
+    ensemble_mean_and_variance(m_ensemble_outputs.data(), m_ensemble_size, m_all_outputs_dim,
+                               m_ensemble_mean.data(), m_ensemble_variance.data());
+
+    float worst = 0;
+    for (int64_t j=0; j<m_all_outputs_dim; ++j) {
+        // Written so that a NaN variance counts as too uncertain
+        if (!(m_ensemble_variance[j] <= m_max_variance[j])) return false;
+        if (m_max_variance[j] > 0) worst = std::max(worst, m_ensemble_variance[j] / m_max_variance[j]);
+    }
+    m_last_confidence = 1 - worst;
+
+    static const Normalization identity;
+    const float* mean = m_ensemble_mean.data();
+    for (size_t i=0; i<m_outputs.size(); ++i) {
+        unpack_output_into(mean, m_output_shapes[i], identity, m_outputs[i]->inference_output);
+        mean += m_output_lengths[i];
+    }
     return true;
 }
 
@@ -159,6 +621,34 @@ void TorchscriptModel::PrintModuleLayers() {
 
 void TorchscriptModel::train_from_captures() {
 
+    // For a quantized module, "training" means calibrating the int8 input scales against the captures
+    if (m_quantized_module != nullptr) {
+        int64_t rows = get_capture_count();
+        if (rows == 0) {
+            std::cout << "PHASM: No captures to calibrate on" << std::endl;
+            return;
+        }
+        std::vector<const Normalization*> output_normalizations;
+        for (const auto& output : m_outputs) output_normalizations.push_back(&output->normalization);
+
+        torch::Tensor inputs = torch::empty({rows, m_quantized_module->get_input_dim()}, torch::kFloat32);
+        torch::Tensor outputs = torch::empty({rows, m_all_outputs_dim}, torch::kFloat32);
+        std::vector<const phasm::tensor*> sample_inputs(m_inputs.size());
+        std::vector<const phasm::tensor*> sample_outputs(m_outputs.size());
+        for (int64_t row=0; row<rows; ++row) {
+            for (size_t j=0; j<m_inputs.size(); ++j) sample_inputs[j] = &m_inputs[j]->training_inputs[row];
+            for (size_t j=0; j<m_outputs.size(); ++j) sample_outputs[j] = &m_outputs[j]->training_outputs[row];
+            flatten_and_join_into(sample_inputs, m_input_normalizations, inputs.data_ptr<float>() + row*inputs.size(1), inputs.size(1));
+            flatten_and_join_into(sample_outputs, output_normalizations, outputs.data_ptr<float>() + row*m_all_outputs_dim, m_all_outputs_dim);
+        }
+        m_quantized_module->calibrate(inputs);
+        std::cout << m_quantized_module->evaluate(inputs, outputs);
+        std::ofstream calibration_file(m_filename + ".int8");
+        m_quantized_module->save_calibration(calibration_file);
+        std::cout << "PHASM: Saved int8 calibration to '" << m_filename << ".int8'" << std::endl;
+        return;
+    }
+
     std::cerr << "PHASM: FATAL ERROR: Training a TorchScript model from C++ is temporarily disabled. Please train from Python for now" << std::endl;
     exit(1);
     // Temporarily disable training the torchscript module
@@ -0,0 +1,61 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#include <catch.hpp>
+#include "feedforward_model.h"
+#include "surrogate_builder.h"
+
+using namespace phasm;
+namespace phasm::tests::feedforward_model_tests {
+
+/// Trains y = x on x in [0, 1) with standardized inputs and outputs, so that every target below 0.5 is negative
+/// once normalized, and returns the model's predictions at x = 0.05 and x = 0.95
+std::pair<double, double> fit_identity(Quantization quantization) {
+    TrainingOptions options;
+    options.optimizer = TrainingOptions::Optimizer::Adam;
+    options.learning_rate = 0.01;
+    options.batch_size = 16;
+    options.max_epochs = 300;
+    options.validation_fraction = 0;
+    options.seed = 42;
+    options.checkpoint_path = "";
+    auto model = std::make_shared<FeedForwardModel>(options);
+    model->set_quantization(quantization);
+
+    double x, y;
+    auto s = SurrogateBuilder()
+            .set_model(model)
+            .set_callmode(CallMode::UseModel)
+            .local_primitive<double>("x", Direction::IN)
+            .local_primitive<double>("y", Direction::OUT)
+            .set_normalization("x", NormalizationKind::Standardize)
+            .set_normalization("y", NormalizationKind::Standardize)
+            .finish();
+    s.bind_original_function([&]() { y = x; });
+    s.bind_all_callsite_vars(&x, &y);
+    for (int i=0; i<100; ++i) {
+        x = i / 100.0;
+        s.call_original_and_capture();
+    }
+    model->fit_normalizations();
+    model->train_from_captures();
+
+    x = 0.05; s.call_model();
+    double low = y;
+    x = 0.95; s.call_model();
+    return {low, y};
+}
+
+TEST_CASE("FeedForwardModel fits targets whose normalized values are negative") {
+    // With a relu on the output layer, nothing below the mean of y, i.e. 0.495, could be predicted
+    auto [low, high] = fit_identity(Quantization::None);
+    REQUIRE(low < 0.25);
+    REQUIRE(high > 0.75);
+
+    auto [quantized_low, quantized_high] = fit_identity(Quantization::DynamicInt8);
+    REQUIRE(quantized_low < 0.25);
+    REQUIRE(quantized_high > 0.75);
+}
+
+} // namespace phasm::tests::feedforward_model_tests
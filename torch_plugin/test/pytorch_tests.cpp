@@ -6,6 +6,7 @@
 #include <catch.hpp>
 #include <optics.h>
 #include <torch/torch.h>
+#include "torch_tensor_utils.h"
 
 using namespace phasm;
 namespace phasm::tests::pytorch_tests {
@@ -79,4 +80,42 @@ TEST_CASE("Getting a multidimensional array out of a Torch tensor with arbitrary
     std::cout << mat[1][0] << " " << mat[1][1] << " " << mat[1][2] << std::endl;
 }
 
+TEST_CASE("Converting a phasm tensor to a Torch tensor doesn't copy") {
+    double mat[2][3] = {{1,2,3},{4,5,6}};
+    phasm::tensor pt(mat[0], std::vector<int64_t>{2,3});
+    auto tt = to_torch_tensor(pt);
+    REQUIRE(tt.data_ptr<double>() == pt.get_data<double>());
+    REQUIRE(tt.sizes() == torch::IntArrayRef({2,3}));
+    REQUIRE(tt[1][2].item<double>() == 6);
+}
+
+TEST_CASE("Converting a const phasm tensor to a Torch tensor copies, so in-place ops can't modify it") {
+    double mat[2][3] = {{-1,2,-3},{4,-5,6}};
+    const phasm::tensor pt(mat[0], std::vector<int64_t>{2,3});
+    auto tt = to_torch_tensor(pt);
+    REQUIRE(tt.data_ptr<double>() != pt.get_data<double>());
+    tt.relu_();
+    REQUIRE(tt[0][0].item<double>() == 0);
+    REQUIRE(pt.get_data<double>()[0] == -1);
+}
+
+TEST_CASE("Converting a Torch tensor to a phasm tensor adopts its storage") {
+    auto tt = torch::arange(6, torch::dtype<float>()).reshape({2,3});
+    phasm::tensor pt = to_phasm_tensor(tt);
+    REQUIRE(pt.is_borrowed());
+    REQUIRE(pt.get_data<float>() == tt.data_ptr<float>());
+    REQUIRE(pt.get_shape() == std::vector<int64_t>{2,3});
+
+    // The phasm tensor keeps the storage alive after the torch tensor goes away
+    float* data = pt.get_data<float>();
+    tt = torch::Tensor();
+    REQUIRE(data[5] == 5);
+
+    // Non-contiguous views get copied into contiguous storage first
+    auto transposed = torch::arange(6, torch::dtype<float>()).reshape({2,3}).t();
+    phasm::tensor pt2 = to_phasm_tensor(transposed);
+    REQUIRE(pt2.get_shape() == std::vector<int64_t>{3,2});
+    REQUIRE(pt2.get_data<float>()[1] == 3);
+}
+
 }
@@ -0,0 +1,66 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#include <catch.hpp>
+#include <sstream>
+#include "quantized_mlp.h"
+
+using namespace phasm;
+namespace phasm::tests::quantized_mlp_tests {
+
+QuantizedMLP make_mlp() {
+    torch::manual_seed(42);
+    std::vector<QuantizedLinear> layers;
+    layers.emplace_back(torch::randn({16, 8}), torch::randn({16}), true);
+    layers.emplace_back(torch::randn({4, 16}), torch::randn({4}), false);
+    return QuantizedMLP(std::move(layers));
+}
+
+TEST_CASE("Int8 MLP stays close to the float MLP") {
+    auto mlp = make_mlp();
+    torch::Tensor inputs = torch::randn({100, 8});
+    torch::Tensor expected = mlp.forward_float(inputs);
+    torch::Tensor actual = mlp.forward(inputs);
+    double relative_error = ((actual - expected).abs().max() / expected.abs().max()).item<double>();
+    REQUIRE(relative_error < 0.05);
+
+    // Same thing, one sample at a time through the raw-pointer interface
+    float output[4];
+    torch::Tensor first = inputs[0].contiguous();
+    mlp.forward(first.data_ptr<float>(), output);
+    REQUIRE(output[0] == Approx(actual[0][0].item<float>()));
+}
+
+TEST_CASE("Weights shrink fourfold and calibration is reported and persisted") {
+    auto mlp = make_mlp();
+    torch::Tensor inputs = torch::randn({200, 8});
+    torch::Tensor outputs = mlp.forward_float(inputs);
+
+    mlp.calibrate(inputs);
+    for (const auto& layer : mlp.get_layers()) {
+        REQUIRE(layer.input_scale > 0);
+    }
+    auto report = mlp.evaluate(inputs, outputs);
+    REQUIRE(report.samples == 200);
+    REQUIRE(report.float_mse == Approx(0).margin(1e-10));
+    REQUIRE(report.quantized_mse > 0);
+    REQUIRE(report.quantized_weight_bytes < report.float_weight_bytes / 3);
+
+    std::stringstream ss;
+    mlp.save_calibration(ss);
+    float first_scale = mlp.get_layers()[0].input_scale;
+    mlp.clear_calibration();
+    REQUIRE(mlp.get_layers()[0].input_scale == 0);
+    REQUIRE(mlp.load_calibration(ss));
+    REQUIRE(mlp.get_layers()[0].input_scale == Approx(first_scale));
+}
+
+TEST_CASE("Layers that don't chain are rejected") {
+    std::vector<QuantizedLinear> layers;
+    layers.emplace_back(torch::randn({16, 8}), torch::randn({16}), true);
+    layers.emplace_back(torch::randn({4, 10}), torch::randn({4}), false);
+    REQUIRE_THROWS(QuantizedMLP(std::move(layers)));
+}
+
+} // namespace phasm::tests::quantized_mlp_tests
@@ -0,0 +1,77 @@
+// Copyright 2022, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+
+
+#include <catch.hpp>
+#include "stacked_ensemble.h"
+
+using namespace phasm;
+namespace phasm::tests::stacked_ensemble_tests {
+
+std::vector<LinearLayerWeights> make_member() {
+    std::vector<LinearLayerWeights> layers;
+    layers.push_back({torch::randn({16, 3}), torch::randn({16}), true});
+    layers.push_back({torch::randn({2, 16}), torch::randn({2}), false});
+    return layers;
+}
+
+torch::Tensor forward_member(const std::vector<LinearLayerWeights>& layers, torch::Tensor x) {
+    for (const auto& layer : layers) {
+        x = torch::linear(x, layer.weight, layer.bias);
+        if (layer.relu) x = torch::relu(x);
+    }
+    return x;
+}
+
+TEST_CASE("Stacked ensemble matches its members evaluated one at a time") {
+    torch::manual_seed(7);
+    std::vector<std::vector<LinearLayerWeights>> members;
+    for (int k=0; k<5; ++k) members.push_back(make_member());
+    StackedEnsemble ensemble(members);
+    REQUIRE(ensemble.get_member_count() == 5);
+    REQUIRE(ensemble.get_input_dim() == 3);
+    REQUIRE(ensemble.get_output_dim() == 2);
+
+    for (int trial=0; trial<3; ++trial) {
+        torch::Tensor input = torch::randn({3});
+        torch::Tensor outputs = ensemble.forward(input);
+        REQUIRE(outputs.size(0) == 5);
+        REQUIRE(outputs.size(1) == 2);
+        for (int k=0; k<5; ++k) {
+            torch::Tensor expected = forward_member(members[k], input);
+            REQUIRE(torch::allclose(outputs[k], expected, 1e-4, 1e-5));
+        }
+
+        float mean[2], variance[2];
+        ensemble_mean_and_variance(outputs.data_ptr<float>(), 5, 2, mean, variance);
+        torch::Tensor expected_mean = outputs.mean(0);
+        torch::Tensor expected_variance = (outputs - expected_mean).pow(2).mean(0);
+        for (int j=0; j<2; ++j) {
+            REQUIRE(mean[j] == Approx(expected_mean[j].item<float>()).margin(1e-5));
+            REQUIRE(variance[j] == Approx(expected_variance[j].item<float>()).margin(1e-5));
+        }
+    }
+}
+
+TEST_CASE("Identical members agree perfectly") {
+    auto member = make_member();
+    std::vector<std::vector<LinearLayerWeights>> members = {member, member, member};
+    StackedEnsemble ensemble(members);
+    torch::Tensor outputs = ensemble.forward(torch::randn({3}));
+    float mean[2], variance[2];
+    ensemble_mean_and_variance(outputs.data_ptr<float>(), 3, 2, mean, variance);
+    REQUIRE(variance[0] == Approx(0).margin(1e-10));
+    REQUIRE(variance[1] == Approx(0).margin(1e-10));
+}
+
+TEST_CASE("Members with different shapes are rejected") {
+    auto other = make_member();
+    other[0] = {torch::randn({8, 3}), torch::randn({8}), true};
+    other[1] = {torch::randn({2, 8}), torch::randn({2}), false};
+    std::vector<std::vector<LinearLayerWeights>> members = {make_member(), other};
+    REQUIRE_THROWS(StackedEnsemble(members));
+    members.clear();
+    REQUIRE_THROWS(StackedEnsemble(members));
+}
+
+} // namespace phasm::tests::stacked_ensemble_tests
@@ -11,6 +11,7 @@ Authors: Nathan Brei (nbrei@jlab.org), Xinxin Mei (xmei@jlab.org)
 #define CATCH_CONFIG_RUNNER  // this is necessary because of own-defined main function
 #include <catch.hpp>
 #include <string>
+#include <filesystem>
 
 #include <surrogate_builder.h>
 #include "torchscript_model.h"
@@ -115,6 +116,79 @@ TEST_CASE("Load the module to assigned device (GPU prefered) and do inference")
     REQUIRE(Bz != -3.0);
 }
 
+TEST_CASE("Optimize and warm up the module before inference") {
+    TorchscriptOptions options;
+    options.optimize = true;
+    options.warmup_iterations = 5;
+    options.latency_samples = 10;
+
+    auto s = SurrogateBuilder()
+        .set_model(std::make_shared<TorchscriptModel>(ptPath, false, torch::kCPU, options), true)
+        .local_primitive<double>("x", phasm::IN)
+        .local_primitive<double>("y", phasm::IN)
+        .local_primitive<double>("z", phasm::IN)
+        .local_primitive<double>("Bx", Direction::OUT)
+        .local_primitive<double>("By", Direction::OUT)
+        .local_primitive<double>("Bz", Direction::OUT)
+        .finish();
+
+    double x = 1.0, y = 2.0, z = 3.0, Bx, By, Bz;
+    s.bind_original_function([&]() { Bx = -x, By = -y; Bz = -z; });
+    s.bind_all_callsite_vars(&x, &y, &z, &Bx, &By, &Bz);
+
+    s.call_model_and_capture();
+    double optimized_Bx = Bx;
+
+    // The optimized module has to agree with the module as loaded
+    auto s2 = SurrogateBuilder()
+        .set_model(std::make_shared<TorchscriptModel>(ptPath), true)
+        .local_primitive<double>("x", phasm::IN)
+        .local_primitive<double>("y", phasm::IN)
+        .local_primitive<double>("z", phasm::IN)
+        .local_primitive<double>("Bx", Direction::OUT)
+        .local_primitive<double>("By", Direction::OUT)
+        .local_primitive<double>("Bz", Direction::OUT)
+        .finish();
+    s2.bind_original_function([&]() { Bx = -x, By = -y; Bz = -z; });
+    s2.bind_all_callsite_vars(&x, &y, &z, &Bx, &By, &Bz);
+    s2.call_model_and_capture();
+    REQUIRE(Bx == Approx(optimized_Bx));
+}
+
+TEST_CASE("Optimized modules are cached on disk and reused") {
+    TorchscriptOptions options;
+    options.optimize = true;
+    options.cache_dir = "phasm_torchscript_cache_test";
+    std::filesystem::remove_all(options.cache_dir);
+
+    auto make_surrogate = [&]() {
+        return SurrogateBuilder()
+            .set_model(std::make_shared<TorchscriptModel>(ptPath, false, torch::kCPU, options), true)
+            .local_primitive<double>("x", phasm::IN)
+            .local_primitive<double>("y", phasm::IN)
+            .local_primitive<double>("z", phasm::IN)
+            .local_primitive<double>("Bx", Direction::OUT)
+            .local_primitive<double>("By", Direction::OUT)
+            .local_primitive<double>("Bz", Direction::OUT)
+            .finish();
+    };
+    double x = 1.0, y = 2.0, z = 3.0, Bx, By, Bz;
+
+    auto first = make_surrogate();
+    REQUIRE(std::distance(std::filesystem::directory_iterator(options.cache_dir), std::filesystem::directory_iterator()) == 1);
+    first.bind_all_callsite_vars(&x, &y, &z, &Bx, &By, &Bz);
+    first.call_model_and_capture();
+    double first_Bx = Bx;
+
+    auto second = make_surrogate(); // Loads from the cache
+    REQUIRE(std::distance(std::filesystem::directory_iterator(options.cache_dir), std::filesystem::directory_iterator()) == 1);
+    second.bind_all_callsite_vars(&x, &y, &z, &Bx, &By, &Bz);
+    second.call_model_and_capture();
+    REQUIRE(Bx == Approx(first_Bx));
+
+    std::filesystem::remove_all(options.cache_dir);
+}
+
 // TEST_CASE("Get the module from url") {
 
 // }